@@ -1,30 +1,311 @@
 #include "src/server.h"
 
+#include <unistd.h>
+
+namespace
+{
+
+void
+usage (const char *prog)
+{
+  std::fprintf (stderr,
+		"Usage: %s [--port <1-65535>] [--appendonly yes|no]\n"
+		"       [--appendfilename <path>]"
+		" [--appendfsync always|everysec|no]\n"
+		"       [--bgsave fork|sliced]"
+		" [--bgsave-slice <microseconds>]\n"
+		"       [--dir <path>] [--dbfilename <name>]"
+		" [--save \"<seconds> <changes> ...\"]\n"
+		"       [--repl-backlog-size <bytes>]"
+		" [--repl-diskless-sync yes|no]\n"
+		"       [--repl-diskless-sync-delay <milliseconds>]\n"
+		"       [--cluster-enabled yes|no]"
+		" [--cluster-announce-ip <address>]\n"
+		"       [--notify-keyspace-events <flags>]\n"
+		"       [--client-output-buffer-limit-pubsub <bytes>]\n"
+		"       [--busy-reply-threshold <milliseconds>]\n",
+		prog);
+}
+
+// Parses "<seconds> <changes>" pairs into points; "" clears them.
+bool
+parse_save_points (const std::string &value,
+		   std::vector<mini_redis::save_point> &points)
+{
+  std::vector<std::string> words;
+  auto trimmed = boost::trim_copy (value);
+  if (trimmed.empty ())
+    {
+      points.clear ();
+      return true;
+    }
+  boost::split (words, trimmed, boost::is_space (), boost::token_compress_on);
+  if (words.size () % 2 != 0)
+    return false;
+
+  for (std::size_t i = 0; i < words.size (); i += 2)
+    {
+      std::int64_t secs, changes;
+      if (!mini_redis::try_lexical_convert (words[i], secs) || secs <= 0
+	  || !mini_redis::try_lexical_convert (words[i + 1], changes)
+	  || changes < 0)
+	return false;
+      points.push_back (
+	  { mini_redis::seconds{ secs },
+	    static_cast<std::uint64_t> (changes) });
+    }
+  return true;
+}
+
+// Parses notify-keyspace-events letters, as Redis has them. The classes
+// of data types this server lacks are accepted, and never fire.
+bool
+parse_notify_keyspace_events (const std::string &value, unsigned &flags)
+{
+  flags = 0;
+  for (auto c : value)
+    switch (c)
+      {
+      case 'K':
+	flags |= mini_redis::notify_keyspace;
+	break;
+      case 'E':
+	flags |= mini_redis::notify_keyevent;
+	break;
+      case 'g':
+	flags |= mini_redis::notify_generic;
+	break;
+      case '$':
+	flags |= mini_redis::notify_string;
+	break;
+      case 'l':
+	flags |= mini_redis::notify_list;
+	break;
+      case 'z':
+	flags |= mini_redis::notify_zset;
+	break;
+      case 'x':
+	flags |= mini_redis::notify_expired;
+	break;
+      case 't':
+	flags |= mini_redis::notify_stream;
+	break;
+      case 'A':
+	flags |= mini_redis::notify_all;
+	break;
+      case 's':
+      case 'h':
+      case 'e':
+      case 'd':
+      case 'm':
+      case 'n':
+	break;
+      default:
+	return false;
+      }
+  if ((flags & (mini_redis::notify_keyspace | mini_redis::notify_keyevent))
+      == 0)
+    flags = 0;
+  return true;
+}
+
+} // namespace
+
 int
 main (int argc, char **argv)
 {
   std::uint16_t port = 6379;
+  mini_redis::config cfg;
 
-  if (argc != 1)
+  for (int i = 1; i < argc; i += 2)
     {
-      if (argc != 3 || std::string{ argv[1] } != "--port")
+      if (i + 1 >= argc)
 	{
-	  std::fprintf (stderr, "Usage: %s [--port <1-65535>]\n", argv[0]);
+	  usage (argv[0]);
 	  return 1;
 	}
 
-      std::int64_t n;
-      if (!mini_redis::try_lexical_convert (argv[2], n) || n <= 0
-	  || n > std::numeric_limits<std::uint16_t>::max ())
+      std::string opt{ argv[i] };
+      std::string value{ argv[i + 1] };
+      if (opt == "--port")
+	{
+	  std::int64_t n;
+	  if (!mini_redis::try_lexical_convert (value, n) || n <= 0
+	      || n > std::numeric_limits<std::uint16_t>::max ())
+	    {
+	      std::fprintf (stderr, "Invalid port: %s\n", value.c_str ());
+	      return 1;
+	    }
+	  port = static_cast<std::uint16_t> (n);
+	}
+      else if (opt == "--appendonly")
+	{
+	  if (value != "yes" && value != "no")
+	    {
+	      std::fprintf (stderr, "Invalid appendonly: %s\n",
+			    value.c_str ());
+	      return 1;
+	    }
+	  cfg.appendonly = value == "yes";
+	}
+      else if (opt == "--appendfilename")
+	cfg.appendfilename = value;
+      else if (opt == "--appendfsync")
+	{
+	  if (value == "always")
+	    cfg.appendfsync = mini_redis::appendfsync_always;
+	  else if (value == "everysec")
+	    cfg.appendfsync = mini_redis::appendfsync_everysec;
+	  else if (value == "no")
+	    cfg.appendfsync = mini_redis::appendfsync_no;
+	  else
+	    {
+	      std::fprintf (stderr, "Invalid appendfsync: %s\n",
+			    value.c_str ());
+	      return 1;
+	    }
+	}
+      else if (opt == "--bgsave")
+	{
+	  if (value == "fork")
+	    cfg.bgsave = mini_redis::bgsave_fork;
+	  else if (value == "sliced")
+	    cfg.bgsave = mini_redis::bgsave_sliced;
+	  else
+	    {
+	      std::fprintf (stderr, "Invalid bgsave: %s\n", value.c_str ());
+	      return 1;
+	    }
+	}
+      else if (opt == "--bgsave-slice")
 	{
-	  std::fprintf (stderr, "Invalid port: %s\n", argv[2]);
+	  std::int64_t n;
+	  if (!mini_redis::try_lexical_convert (value, n) || n <= 0)
+	    {
+	      std::fprintf (stderr, "Invalid bgsave-slice: %s\n",
+			    value.c_str ());
+	      return 1;
+	    }
+	  cfg.bgsave_slice = mini_redis::microseconds{ n };
+	}
+      else if (opt == "--repl-backlog-size")
+	{
+	  std::int64_t n;
+	  if (!mini_redis::try_lexical_convert (value, n) || n <= 0)
+	    {
+	      std::fprintf (stderr, "Invalid repl-backlog-size: %s\n",
+			    value.c_str ());
+	      return 1;
+	    }
+	  cfg.repl_backlog_size = static_cast<std::size_t> (n);
+	}
+      else if (opt == "--repl-diskless-sync")
+	{
+	  if (value != "yes" && value != "no")
+	    {
+	      std::fprintf (stderr, "Invalid repl-diskless-sync: %s\n",
+			    value.c_str ());
+	      return 1;
+	    }
+	  cfg.repl_diskless_sync = value == "yes";
+	}
+      else if (opt == "--repl-diskless-sync-delay")
+	{
+	  std::int64_t n;
+	  if (!mini_redis::try_lexical_convert (value, n) || n < 0)
+	    {
+	      std::fprintf (stderr, "Invalid repl-diskless-sync-delay: %s\n",
+			    value.c_str ());
+	      return 1;
+	    }
+	  cfg.repl_diskless_sync_delay = mini_redis::milliseconds{ n };
+	}
+      else if (opt == "--cluster-enabled")
+	{
+	  if (value != "yes" && value != "no")
+	    {
+	      std::fprintf (stderr, "Invalid cluster-enabled: %s\n",
+			    value.c_str ());
+	      return 1;
+	    }
+	  cfg.cluster_enabled = value == "yes";
+	}
+      else if (opt == "--cluster-announce-ip")
+	cfg.cluster_announce_ip = value;
+      else if (opt == "--notify-keyspace-events")
+	{
+	  if (!parse_notify_keyspace_events (value,
+					     cfg.notify_keyspace_events))
+	    {
+	      std::fprintf (stderr, "Invalid notify-keyspace-events: %s\n",
+			    value.c_str ());
+	      return 1;
+	    }
+	}
+      else if (opt == "--client-output-buffer-limit-pubsub")
+	{
+	  std::int64_t n;
+	  if (!mini_redis::try_lexical_convert (value, n) || n < 0)
+	    {
+	      std::fprintf (stderr,
+			    "Invalid client-output-buffer-limit-pubsub: %s\n",
+			    value.c_str ());
+	      return 1;
+	    }
+	  cfg.client_output_buffer_limit_pubsub = static_cast<std::size_t> (n);
+	}
+      else if (opt == "--busy-reply-threshold")
+	{
+	  std::int64_t n;
+	  if (!mini_redis::try_lexical_convert (value, n) || n <= 0)
+	    {
+	      std::fprintf (stderr, "Invalid busy-reply-threshold: %s\n",
+			    value.c_str ());
+	      return 1;
+	    }
+	  cfg.busy_reply_threshold = mini_redis::milliseconds{ n };
+	}
+      else if (opt == "--dir")
+	{
+	  if (::chdir (value.c_str ()) != 0)
+	    {
+	      std::fprintf (stderr, "Cannot change to directory %s: %s\n",
+			    value.c_str (), std::strerror (errno));
+	      return 1;
+	    }
+	}
+      else if (opt == "--dbfilename")
+	{
+	  if (value.empty ())
+	    {
+	      std::fprintf (stderr, "Invalid dbfilename: %s\n",
+			    value.c_str ());
+	      return 1;
+	    }
+	  cfg.dbfilename = value;
+	}
+      else if (opt == "--save")
+	{
+	  if (!parse_save_points (value, cfg.save_points))
+	    {
+	      std::fprintf (stderr, "Invalid save: %s\n", value.c_str ());
+	      return 1;
+	    }
+	}
+      else
+	{
+	  usage (argv[0]);
 	  return 1;
 	}
-
-      port = static_cast<std::uint16_t> (n);
     }
 
-  mini_redis::server srv{ port };
-  srv.start ();
+  cfg.cluster_announce_port = port;
+  mini_redis::server srv{ port, std::move (cfg) };
+  auto ret = srv.start ();
+  if (!ret.has_value ())
+    {
+      std::fprintf (stderr, "%s\n", ret.error ().c_str ());
+      return 1;
+    }
   srv.run ();
 }
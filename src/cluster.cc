@@ -0,0 +1,130 @@
+#include "cluster.h"
+
+namespace mini_redis
+{
+
+cluster_table::cluster_table (std::string myid, std::string host,
+			      std::uint16_t port)
+    : myself_{ nullptr }, owners_ (db::slot_count, nullptr), assigned_{ 0 }
+{
+  add_node (myid, std::move (host), port);
+  myself_ = find_node (myid);
+}
+
+const cluster_table::node &
+cluster_table::myself () const noexcept
+{
+  return *myself_;
+}
+
+const std::map<std::string, cluster_table::node> &
+cluster_table::nodes () const noexcept
+{
+  return nodes_;
+}
+
+const cluster_table::node *
+cluster_table::find_node (string_view id) const
+{
+  auto it = nodes_.find (id.to_string ());
+  return it == nodes_.end () ? nullptr : &it->second;
+}
+
+void
+cluster_table::add_node (const std::string &id, std::string host,
+			 std::uint16_t port)
+{
+  auto &n = nodes_[id];
+  n.id = id;
+  n.host = std::move (host);
+  n.port = port;
+}
+
+const cluster_table::node *
+cluster_table::owner (std::size_t slot) const noexcept
+{
+  return owners_[slot];
+}
+
+void
+cluster_table::assign (std::size_t slot, string_view id)
+{
+  auto n = find_node (id);
+  BOOST_ASSERT (n != nullptr);
+  if (owners_[slot] == nullptr)
+    assigned_++;
+  owners_[slot] = n;
+}
+
+void
+cluster_table::unassign (std::size_t slot)
+{
+  if (owners_[slot] != nullptr)
+    assigned_--;
+  owners_[slot] = nullptr;
+}
+
+std::size_t
+cluster_table::slots_assigned () const noexcept
+{
+  return assigned_;
+}
+
+std::vector<cluster_table::slot_range>
+cluster_table::ranges () const
+{
+  std::vector<slot_range> out;
+  for (std::size_t slot = 0; slot < owners_.size (); slot++)
+    {
+      auto n = owners_[slot];
+      if (n == nullptr)
+	continue;
+      if (!out.empty () && out.back ().owner == n
+	  && out.back ().last + 1 == slot)
+	out.back ().last = slot;
+      else
+	out.push_back ({ slot, slot, n });
+    }
+  return out;
+}
+
+const cluster_table::node *
+cluster_table::migrating (std::size_t slot) const
+{
+  auto it = migrating_.find (slot);
+  return it == migrating_.end () ? nullptr : it->second;
+}
+
+const cluster_table::node *
+cluster_table::importing (std::size_t slot) const
+{
+  auto it = importing_.find (slot);
+  return it == importing_.end () ? nullptr : it->second;
+}
+
+void
+cluster_table::set_migrating (std::size_t slot, string_view id)
+{
+  auto n = find_node (id);
+  BOOST_ASSERT (n != nullptr);
+  importing_.erase (slot);
+  migrating_[slot] = n;
+}
+
+void
+cluster_table::set_importing (std::size_t slot, string_view id)
+{
+  auto n = find_node (id);
+  BOOST_ASSERT (n != nullptr);
+  migrating_.erase (slot);
+  importing_[slot] = n;
+}
+
+void
+cluster_table::set_stable (std::size_t slot)
+{
+  migrating_.erase (slot);
+  importing_.erase (slot);
+}
+
+} // namespace mini_redis
@@ -0,0 +1,76 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "pch.h"
+
+#include "db_slots.h"
+
+namespace mini_redis
+{
+
+// What a node of a cluster knows of it: the nodes, and which of them
+// serves every hash slot. There is no cluster bus: every node is told
+// about the others, and about who owns which slots, with CLUSTER commands,
+// as a slot migration goes the same way: the target is marked importing
+// the slot, the source migrating it, the keys are moved with MIGRATE, then
+// every node is told about the new owner.
+class cluster_table
+{
+public:
+  struct node
+  {
+    std::string id;
+    std::string host;
+    std::uint16_t port;
+  };
+
+  // A run of consecutive slots with the same owner.
+  struct slot_range
+  {
+    std::size_t first;
+    std::size_t last;
+    const node *owner;
+  };
+
+public:
+  cluster_table (std::string myid, std::string host, std::uint16_t port);
+
+  cluster_table (const cluster_table &) = delete;
+  cluster_table &operator= (const cluster_table &) = delete;
+
+  const node &myself () const noexcept;
+  const std::map<std::string, node> &nodes () const noexcept;
+  const node *find_node (string_view id) const;
+  // Adds a node, or updates the address of a known one.
+  void add_node (const std::string &id, std::string host,
+		 std::uint16_t port);
+
+  // Null when nobody serves the slot.
+  const node *owner (std::size_t slot) const noexcept;
+  // id must name a known node.
+  void assign (std::size_t slot, string_view id);
+  void unassign (std::size_t slot);
+  std::size_t slots_assigned () const noexcept;
+  std::vector<slot_range> ranges () const;
+
+  // The node a slot is moved to, or moved from, while it migrates; null
+  // otherwise.
+  const node *migrating (std::size_t slot) const;
+  const node *importing (std::size_t slot) const;
+  void set_migrating (std::size_t slot, string_view id);
+  void set_importing (std::size_t slot, string_view id);
+  void set_stable (std::size_t slot);
+
+private:
+  // Ordered by id; the nodes never move, so pointers to them stay valid.
+  std::map<std::string, node> nodes_;
+  const node *myself_;
+  std::vector<const node *> owners_;
+  std::size_t assigned_;
+  unordered_flat_map<std::size_t, const node *> migrating_;
+  unordered_flat_map<std::size_t, const node *> importing_;
+}; // class cluster_table
+
+} // namespace mini_redis
+
+#endif // CLUSTER_H
@@ -6,6 +6,49 @@
 namespace mini_redis
 {
 
+enum appendfsync_policy
+{
+  // fsync before replying to the writes.
+  appendfsync_always,
+  // fsync about once a second.
+  appendfsync_everysec,
+  // Leave it to the operating system.
+  appendfsync_no,
+};
+
+enum bgsave_mode
+{
+  // Save in a forked child process.
+  bgsave_fork,
+  // Save in slices between the requests, without forking.
+  bgsave_sliced,
+};
+
+// The keyspace events that are published, as notify-keyspace-events
+// letters: to __keyspace@0__:<key> with the event as the message (K),
+// and to __keyevent@0__:<event> with the key as the message (E), for
+// the classes of events enabled.
+enum notify_flags : unsigned
+{
+  notify_keyspace = 1 << 0, // K
+  notify_keyevent = 1 << 1, // E
+  notify_generic = 1 << 2,  // g: DEL, EXPIRE, RESTORE...
+  notify_string = 1 << 3,   // $
+  notify_list = 1 << 4,     // l
+  notify_zset = 1 << 5,     // z
+  notify_expired = 1 << 6,  // x
+  notify_stream = 1 << 7,   // t
+  // A
+  notify_all = notify_generic | notify_string | notify_list | notify_zset
+	       | notify_expired | notify_stream,
+};
+
+struct save_point
+{
+  seconds interval;
+  std::uint64_t changes;
+}; // struct save_point
+
 struct config
 {
   // 0 means no limit
@@ -15,6 +58,48 @@ struct config
   std::size_t proto_max_inline_len = 64 * 1024;
   // 0 means no timeout
   std::size_t conn_idle_timeout_ms = 60000;
+
+  // The snapshot loaded on startup and saved by SAVE and BGSAVE, relative
+  // to the working directory.
+  std::string dbfilename = "dump.mrdb";
+  // A BGSAVE starts once, for any of them, the interval has passed since
+  // the last save and as many writes were made. When any is set, the
+  // dataset is also saved on shutdown.
+  std::vector<save_point> save_points;
+
+  // Log the write commands to an append-only file, replayed on startup.
+  bool appendonly = false;
+  std::string appendfilename = "appendonly.aof";
+  appendfsync_policy appendfsync = appendfsync_everysec;
+
+  // Bytes of the replication stream kept for replicas that reconnect.
+  std::size_t repl_backlog_size = 1024 * 1024;
+  // Stream the snapshot of a full sync to the replicas from memory instead
+  // of saving it to disk first. The replicas that ask for one within the
+  // delay share the same pass over the dataset.
+  bool repl_diskless_sync = false;
+  milliseconds repl_diskless_sync_delay{ 0 };
+
+  // Serve only the hash slots this node owns, and redirect the clients to
+  // the other nodes for the rest. The address is the one given to them.
+  bool cluster_enabled = false;
+  std::string cluster_announce_ip = "127.0.0.1";
+  std::uint16_t cluster_announce_port = 6379;
+
+  // Which keyspace events are published; see notify_flags. None when
+  // neither K nor E is set.
+  unsigned notify_keyspace_events = 0;
+  // Bytes of messages a subscriber has not been written yet past which it
+  // is disconnected, rather than having them all held; 0 for no limit.
+  std::size_t client_output_buffer_limit_pubsub = 32 * 1024 * 1024;
+
+  bgsave_mode bgsave = bgsave_fork;
+  // The longest a slice of a sliced BGSAVE holds up the requests.
+  microseconds bgsave_slice{ 1000 };
+
+  // How long a script runs before the other clients are answered BUSY
+  // while it goes on, and may stop it with SCRIPT KILL.
+  milliseconds busy_reply_threshold{ 5000 };
 }; // struct config
 
 } // namespace mini_redis
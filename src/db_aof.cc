@@ -0,0 +1,419 @@
+#include "db_aof.h"
+#include "db_disk.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mini_redis
+{
+namespace db
+{
+
+namespace
+{
+
+typedef result<void, std::string> result_type;
+
+// The length of the base is only known once it is written; it is written
+// in a fixed number of digits, over a placeholder.
+const int base_length_digits = 20;
+
+std::string
+format_errno (string_view prefix)
+{
+  int code = errno;
+  std::string msg = prefix.to_string ();
+  msg += ": ";
+  msg += std::strerror (code);
+  return msg;
+}
+
+// Writes [data, data + size) from done on, and keeps track of how much is
+// done, so that a failed write can be resumed.
+bool
+write_fd (int fd, const char *data, std::size_t size, std::size_t &done)
+{
+  while (done < size)
+    {
+      auto n = ::write (fd, data + done, size - done);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return false;
+	}
+      done += static_cast<std::size_t> (n);
+    }
+  return true;
+}
+
+int
+sync_fd (int fd)
+{
+#if defined(__linux__)
+  return ::fdatasync (fd);
+#else
+  return ::fsync (fd);
+#endif
+}
+
+void
+put_header (std::string &out, char prefix, std::size_t n)
+{
+  out.push_back (prefix);
+  out.append (std::to_string (n));
+  out.append ("\r\n");
+}
+
+enum parse_status
+{
+  parse_ok,
+  parse_incomplete,
+  parse_bad,
+};
+
+// Parses "<prefix><decimal>\r\n" at pos.
+parse_status
+parse_header (string_view buf, std::size_t &pos, char prefix,
+	      std::uint64_t &n)
+{
+  if (pos == buf.size ())
+    return parse_incomplete;
+  if (buf[pos] != prefix)
+    return parse_bad;
+
+  auto i = pos + 1;
+  n = 0;
+  for (; i < buf.size () && buf[i] >= '0' && buf[i] <= '9'; i++)
+    {
+      // No sane length gets anywhere close.
+      if (n >= std::numeric_limits<std::uint64_t>::max () / 100)
+	return parse_bad;
+      n = n * 10 + static_cast<std::uint64_t> (buf[i] - '0');
+    }
+
+  if (i == buf.size ())
+    return parse_incomplete;
+  if (i == pos + 1 || buf[i] != '\r')
+    return parse_bad;
+  if (i + 1 == buf.size ())
+    return parse_incomplete;
+  if (buf[i + 1] != '\n')
+    return parse_bad;
+  pos = i + 2;
+  return parse_ok;
+}
+
+// Parses the command at pos. pos is only moved past a complete command.
+parse_status
+parse_command (string_view buf, std::size_t &pos,
+	       std::vector<resp::data> &argv)
+{
+  auto p = pos;
+  std::uint64_t argc;
+  auto st = parse_header (buf, p, '*', argc);
+  if (st != parse_ok)
+    return st;
+  if (argc == 0)
+    return parse_bad;
+
+  argv.clear ();
+  argv.reserve (std::min<std::uint64_t> (argc, 1024));
+  for (std::uint64_t i = 0; i < argc; i++)
+    {
+      std::uint64_t len;
+      st = parse_header (buf, p, '$', len);
+      if (st != parse_ok)
+	return st;
+      if (buf.size () - p < len + 2)
+	return parse_incomplete;
+      if (buf[p + len] != '\r' || buf[p + len + 1] != '\n')
+	return parse_bad;
+
+      std::string arg{ buf.data () + p, static_cast<std::size_t> (len) };
+      argv.push_back (resp::data{ resp::bulk_string{ std::move (arg) } });
+      p += len + 2;
+    }
+
+  pos = p;
+  return parse_ok;
+}
+
+} // namespace
+
+append_only_file::append_only_file () noexcept
+    : fd_{ -1 }, written_{ 0 }, unsynced_{ false }, rewriting_{ false }
+{
+}
+
+append_only_file::~append_only_file ()
+{
+  if (fd_ < 0)
+    return;
+  flush (true);
+  ::close (fd_);
+}
+
+result_type
+append_only_file::open (string_view path)
+{
+  BOOST_ASSERT (fd_ < 0);
+
+  auto path_str = path.to_string ();
+  int fd = ::open (path_str.c_str (),
+		   O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return format_errno ("cannot open the append-only file");
+
+  struct stat sb;
+  if (::fstat (fd, &sb) != 0)
+    {
+      auto msg = format_errno ("cannot stat the append-only file");
+      ::close (fd);
+      return msg;
+    }
+
+  fd_ = fd;
+  path_ = std::move (path_str);
+  written_ = static_cast<std::uint64_t> (sb.st_size);
+  return {};
+}
+
+bool
+append_only_file::is_open () const noexcept
+{
+  return fd_ >= 0;
+}
+
+void
+append_only_file::append (span<const std::string> argv)
+{
+  auto start = buf_.size ();
+  put_header (buf_, '*', argv.size ());
+  for (const auto &arg : argv)
+    {
+      put_header (buf_, '$', arg.size ());
+      buf_.append (arg);
+      buf_.append ("\r\n");
+    }
+  if (rewriting_)
+    rewrite_buf_.append (buf_, start, std::string::npos);
+}
+
+bool
+append_only_file::has_buffered () const noexcept
+{
+  return !buf_.empty ();
+}
+
+result_type
+append_only_file::flush (bool sync)
+{
+  std::size_t done = 0;
+  bool ok = write_fd (fd_, buf_.data (), buf_.size (), done);
+  written_ += done;
+  unsynced_ = unsynced_ || done != 0;
+  if (!ok)
+    {
+      auto msg = format_errno ("cannot write the append-only file");
+      buf_.erase (0, done);
+      return msg;
+    }
+  buf_.clear ();
+
+  if (sync)
+    return this->sync ();
+  return {};
+}
+
+result_type
+append_only_file::sync ()
+{
+  if (!unsynced_)
+    return {};
+
+  if (sync_fd (fd_) != 0)
+    return format_errno ("cannot fsync the append-only file");
+
+  unsynced_ = false;
+  return {};
+}
+
+std::uint64_t
+append_only_file::size () const noexcept
+{
+  return written_ + buf_.size ();
+}
+
+void
+append_only_file::start_rewrite ()
+{
+  rewriting_ = true;
+  rewrite_buf_.clear ();
+}
+
+result_type
+append_only_file::finish_rewrite (string_view temp_path)
+{
+  BOOST_ASSERT (rewriting_);
+
+  // Whatever is still buffered is set aside too; it must not reach the
+  // rewritten file twice.
+  auto res = flush (false);
+  if (!res.has_value ())
+    {
+      abort_rewrite ();
+      return res;
+    }
+
+  auto temp_str = temp_path.to_string ();
+  int fd = ::open (temp_str.c_str (), O_WRONLY | O_APPEND | O_CLOEXEC);
+  if (fd < 0)
+    {
+      abort_rewrite ();
+      return format_errno ("cannot open the rewritten append-only file");
+    }
+
+  std::size_t done = 0;
+  const char *what = nullptr;
+  if (!write_fd (fd, rewrite_buf_.data (), rewrite_buf_.size (), done))
+    what = "cannot write the rewritten append-only file";
+  else if (sync_fd (fd) != 0)
+    what = "cannot fsync the rewritten append-only file";
+  else if (::rename (temp_str.c_str (), path_.c_str ()) != 0)
+    what = "cannot replace the append-only file";
+  if (what != nullptr)
+    {
+      auto msg = format_errno (what);
+      ::close (fd);
+      abort_rewrite ();
+      return msg;
+    }
+
+  // The descriptor follows the file to its new name.
+  struct stat sb;
+  ::fstat (fd, &sb);
+  ::close (fd_);
+  fd_ = fd;
+  written_ = static_cast<std::uint64_t> (sb.st_size);
+  unsynced_ = false;
+  abort_rewrite ();
+  return {};
+}
+
+void
+append_only_file::abort_rewrite ()
+{
+  rewriting_ = false;
+  rewrite_buf_.clear ();
+  rewrite_buf_.shrink_to_fit ();
+}
+
+result<std::size_t, std::string>
+replay_append_only_file (string_view path, storage &st,
+			 const std::function<void (resp::data)> &fn)
+{
+  auto path_str = path.to_string ();
+  struct stat sb;
+  if (::stat (path_str.c_str (), &sb) != 0 && errno == ENOENT)
+    return std::size_t{ 0 };
+
+  mapped_file file;
+  auto res = file.open (path_str);
+  if (!res.has_value ())
+    return res.error ();
+
+  auto bytes = file.bytes ();
+  std::size_t pos = 0;
+  if (!bytes.empty () && bytes[0] == '$')
+    {
+      // The base is written in full before the file replaces the old one;
+      // it is never cut short.
+      std::uint64_t len;
+      if (parse_header (bytes, pos, '$', len) != parse_ok
+	  || bytes.size () - pos < len + 2
+	  || bytes.substr (pos + len, 2) != "\r\n")
+	return std::string{ "bad base in the append-only file" };
+
+      // Keys that expired since are deleted by the commands that follow.
+      auto base = bytes.substr (pos, static_cast<std::size_t> (len));
+      res = load_snapshot (base, st, true);
+      if (!res.has_value ())
+	return res.error ();
+      pos += len + 2;
+    }
+
+  std::size_t count = 0;
+  std::vector<resp::data> argv;
+  while (pos < bytes.size ())
+    {
+      auto status = parse_command (bytes, pos, argv);
+      if (status == parse_incomplete)
+	break;
+      if (status == parse_bad)
+	return "bad command in the append-only file at offset "
+	       + std::to_string (pos);
+      fn (resp::data{ resp::array{ std::move (argv) } });
+      argv.clear ();
+      count++;
+    }
+
+  if (pos != bytes.size ())
+    {
+      if (::truncate (path_str.c_str (), static_cast<off_t> (pos)) != 0)
+	return format_errno ("cannot truncate the append-only file");
+      std::fprintf (stderr,
+		    "Dropped an incomplete command at the end of the "
+		    "append-only file, truncated it to %llu bytes\n",
+		    static_cast<unsigned long long> (pos));
+    }
+
+  return count;
+}
+
+result<void, std::string>
+write_append_only_base (string_view path, const storage &st)
+{
+  auto path_str = path.to_string ();
+  auto *fp = std::fopen (path_str.c_str (), "wb");
+  if (fp == nullptr)
+    return format_errno ("rewrite failed: cannot open file");
+
+  auto fail = [fp] (result_type res) -> result_type
+    {
+      std::fclose (fp);
+      return res;
+    };
+
+  char header[base_length_digits + 4];
+  std::snprintf (header, sizeof (header), "$%0*d\r\n", base_length_digits,
+		 0);
+  auto header_len = std::strlen (header);
+  if (std::fwrite (header, 1, header_len, fp) != header_len)
+    return fail (format_errno ("rewrite failed: cannot write file"));
+
+  auto res = write_snapshot (fp, st, compression_none);
+  if (!res.has_value ())
+    return fail (res);
+
+  auto end = std::ftell (fp);
+  if (end < 0 || std::fwrite ("\r\n", 1, 2, fp) != 2)
+    return fail (format_errno ("rewrite failed: cannot write file"));
+
+  auto len = static_cast<unsigned long long> (end) - header_len;
+  std::snprintf (header, sizeof (header), "$%0*llu\r\n", base_length_digits,
+		 len);
+  if (std::fseek (fp, 0, SEEK_SET) != 0
+      || std::fwrite (header, 1, header_len, fp) != header_len
+      || std::fflush (fp) != 0)
+    return fail (format_errno ("rewrite failed: cannot write file"));
+  if (sync_fd (::fileno (fp)) != 0)
+    return fail (format_errno ("rewrite failed: cannot fsync file"));
+  if (std::fclose (fp) != 0)
+    return format_errno ("rewrite failed: cannot close file");
+  return {};
+}
+
+} // namespace db
+} // namespace mini_redis
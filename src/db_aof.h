@@ -0,0 +1,80 @@
+#ifndef DB_AOF_H
+#define DB_AOF_H
+
+#include "pch.h"
+
+#include "db_storage.h"
+#include "resp_data.h"
+
+namespace mini_redis
+{
+namespace db
+{
+
+// An append-only file of write commands, each stored as a RESP array of
+// bulk strings. Commands are buffered in memory by append and only reach the
+// file on flush, so that a whole batch of them costs a single write and a
+// single fsync.
+//
+// A rewritten file starts with a base instead: a snapshot of the dataset,
+// framed as a RESP bulk string, which the commands logged since then follow.
+class append_only_file
+{
+public:
+  append_only_file () noexcept;
+  ~append_only_file ();
+
+  append_only_file (const append_only_file &) = delete;
+  append_only_file &operator= (const append_only_file &) = delete;
+
+  // Opens path for appending, creating it if needed.
+  result<void, std::string> open (string_view path);
+  bool is_open () const noexcept;
+
+  void append (span<const std::string> argv);
+  bool has_buffered () const noexcept;
+
+  // Writes the buffered commands, then fsyncs the file when sync is set.
+  // On failure whatever was not written stays buffered.
+  result<void, std::string> flush (bool sync);
+  // fsyncs the data written since the last fsync, if any.
+  result<void, std::string> sync ();
+
+  // Size of the file, including the buffered commands.
+  std::uint64_t size () const noexcept;
+
+  // From start_rewrite on, the commands appended are also set aside, for
+  // the file being rewritten in the background. finish_rewrite appends them
+  // to the rewritten file at temp_path, which then atomically replaces the
+  // file; the commands are logged there from then on.
+  void start_rewrite ();
+  result<void, std::string> finish_rewrite (string_view temp_path);
+  void abort_rewrite ();
+
+private:
+  int fd_;
+  std::string path_;
+  std::string buf_;
+  std::uint64_t written_;
+  bool unsynced_;
+  bool rewriting_;
+  std::string rewrite_buf_;
+}; // class append_only_file
+
+// Loads the base of the file at path into st, which should be empty, then
+// passes each command logged at path to fn. A missing file holds nothing. A
+// command cut short at the end of the file, as a crash in the middle of a
+// write leaves it, is dropped and truncated away. Returns the number of
+// commands read.
+result<std::size_t, std::string>
+replay_append_only_file (string_view path, storage &st,
+			 const std::function<void (resp::data)> &fn);
+
+// Writes a file made of a base holding st only to path, and fsyncs it.
+result<void, std::string> write_append_only_base (string_view path,
+						  const storage &st);
+
+} // namespace db
+} // namespace mini_redis
+
+#endif // DB_AOF_H
@@ -0,0 +1,267 @@
+#include "db_bitops.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace mini_redis
+{
+namespace db
+{
+
+namespace
+{
+
+std::uint64_t
+load64 (const unsigned char *p)
+{
+  std::uint64_t w;
+  std::memcpy (&w, p, sizeof (w));
+  return w;
+}
+
+int
+popcount64 (std::uint64_t x)
+{
+#if defined(__GNUC__)
+  return __builtin_popcountll (x);
+#else
+  x = x - ((x >> 1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+  x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+  return static_cast<int> ((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// Byte-wise popcount of a 64-bit word summed into the 8 byte lanes.
+std::uint64_t
+popcount_bytes (std::uint64_t x)
+{
+  x = x - ((x >> 1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+  return (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+}
+
+// SWAR: accumulate per-byte counts of up to 31 words (31 * 8 < 256) before
+// folding the byte lanes, which avoids a multiply per word. Returns the
+// bytes counted, a multiple of 8.
+std::size_t
+popcount_swar (const unsigned char *p, std::size_t n, std::uint64_t &total)
+{
+  std::size_t i = 0;
+  while (i + 8 <= n)
+    {
+      std::uint64_t acc = 0;
+      auto block_end = std::min (n - n % 8, i + 31 * 8);
+      for (; i < block_end; i += 8)
+	acc += popcount_bytes (load64 (p + i));
+      const std::uint64_t lanes = 0x00ff00ff00ff00ffULL;
+      acc = (acc & lanes) + ((acc >> 8) & lanes);
+      total += (acc * 0x0001000100010001ULL) >> 48;
+    }
+  return i;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+// Built for popcnt whatever the target the rest is built for, and only
+// called once the CPU is known to have it. Four independent chains keep
+// the popcnt unit busy. Returns the bytes counted, a multiple of 32.
+__attribute__ ((target ("popcnt"))) std::size_t
+popcount_popcnt (const unsigned char *p, std::size_t n, std::uint64_t &total)
+{
+  std::size_t i = 0;
+  std::uint64_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+  for (; i + 32 <= n; i += 32)
+    {
+      c0 += __builtin_popcountll (load64 (p + i));
+      c1 += __builtin_popcountll (load64 (p + i + 8));
+      c2 += __builtin_popcountll (load64 (p + i + 16));
+      c3 += __builtin_popcountll (load64 (p + i + 24));
+    }
+  total += c0 + c1 + c2 + c3;
+  return i;
+}
+#endif
+
+} // namespace
+
+std::uint64_t
+popcount (const unsigned char *p, std::size_t n)
+{
+  std::uint64_t total = 0;
+  std::size_t i;
+
+#if defined(__GNUC__) && defined(__x86_64__)
+  static const bool has_popcnt = __builtin_cpu_supports ("popcnt");
+  if (has_popcnt)
+    i = popcount_popcnt (p, n, total);
+  else
+    i = popcount_swar (p, n, total);
+#else
+  i = popcount_swar (p, n, total);
+#endif
+
+  for (; i + 8 <= n; i += 8)
+    total += popcount64 (load64 (p + i));
+  for (; i < n; i++)
+    total += popcount64 (p[i]);
+  return total;
+}
+
+void
+bitop_apply (bitop_kind op, unsigned char *dst, const unsigned char *src,
+	     std::size_t n)
+{
+  std::size_t i = 0;
+
+#if defined(__SSE2__)
+  switch (op)
+    {
+    case bitop_and:
+      for (; i + 16 <= n; i += 16)
+	{
+	  auto d = reinterpret_cast<__m128i *> (dst + i);
+	  auto s = reinterpret_cast<const __m128i *> (src + i);
+	  _mm_storeu_si128 (
+	      d, _mm_and_si128 (_mm_loadu_si128 (d), _mm_loadu_si128 (s)));
+	}
+      break;
+
+    case bitop_or:
+      for (; i + 16 <= n; i += 16)
+	{
+	  auto d = reinterpret_cast<__m128i *> (dst + i);
+	  auto s = reinterpret_cast<const __m128i *> (src + i);
+	  _mm_storeu_si128 (
+	      d, _mm_or_si128 (_mm_loadu_si128 (d), _mm_loadu_si128 (s)));
+	}
+      break;
+
+    case bitop_xor:
+      for (; i + 16 <= n; i += 16)
+	{
+	  auto d = reinterpret_cast<__m128i *> (dst + i);
+	  auto s = reinterpret_cast<const __m128i *> (src + i);
+	  _mm_storeu_si128 (
+	      d, _mm_xor_si128 (_mm_loadu_si128 (d), _mm_loadu_si128 (s)));
+	}
+      break;
+    }
+#endif
+
+  for (; i + 8 <= n; i += 8)
+    {
+      auto a = load64 (dst + i);
+      auto b = load64 (src + i);
+      auto c = op == bitop_and ? a & b : op == bitop_or ? a | b : a ^ b;
+      std::memcpy (dst + i, &c, sizeof (c));
+    }
+  for (; i < n; i++)
+    {
+      auto a = dst[i];
+      auto b = src[i];
+      dst[i] = static_cast<unsigned char> (op == bitop_and  ? a & b
+					   : op == bitop_or ? a | b
+							    : a ^ b);
+    }
+}
+
+void
+bitop_not (unsigned char *dst, std::size_t n)
+{
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    {
+      auto w = ~load64 (dst + i);
+      std::memcpy (dst + i, &w, sizeof (w));
+    }
+  for (; i < n; i++)
+    dst[i] = static_cast<unsigned char> (~dst[i]);
+}
+
+void
+bitop (bitop_kind op, std::string &dst, const std::vector<string_view> &srcs)
+{
+  std::size_t len = 0;
+  for (const auto &s : srcs)
+    len = std::max (len, s.size ());
+  dst.assign (len, '\0');
+  if (srcs.empty ())
+    return;
+
+  // Work on cache-sized blocks of the destination so that it stays hot while
+  // every source streams through it once.
+  const std::size_t block = 64 * 1024;
+  auto out = reinterpret_cast<unsigned char *> (&dst[0]);
+  for (std::size_t off = 0; off < len; off += block)
+    {
+      auto n = std::min (block, len - off);
+      const auto &first = srcs[0];
+      if (off < first.size ())
+	std::memcpy (out + off, first.data () + off,
+		     std::min (n, first.size () - off));
+
+      for (std::size_t k = 1; k < srcs.size (); k++)
+	{
+	  const auto &s = srcs[k];
+	  auto avail = off < s.size () ? std::min (n, s.size () - off) : 0;
+	  auto src = reinterpret_cast<const unsigned char *> (s.data ());
+	  bitop_apply (op, out + off, src + off, avail);
+	  // Missing bytes are zeros: only AND is affected by them.
+	  if (op == bitop_and && avail < n)
+	    std::memset (out + off + avail, 0, n - avail);
+	}
+    }
+}
+
+optional<std::uint64_t>
+find_bit (const unsigned char *p, std::size_t n, bool bit)
+{
+  // Skip whole words that cannot contain the bit.
+  const std::uint64_t skip = bit ? 0 : ~std::uint64_t{ 0 };
+  std::size_t i = 0;
+  while (i + 8 <= n && load64 (p + i) == skip)
+    i += 8;
+
+  const unsigned char skip_byte = bit ? 0 : 0xff;
+  for (; i < n; i++)
+    {
+      if (p[i] == skip_byte)
+	continue;
+
+      for (int j = 0; j < 8; j++)
+	if (((p[i] >> (7 - j)) & 1) == (bit ? 1 : 0))
+	  return std::uint64_t{ i } * 8 + static_cast<std::uint64_t> (j);
+    }
+
+  return boost::none;
+}
+
+std::uint64_t
+get_bits (const unsigned char *p, std::uint64_t offset, int bits)
+{
+  std::uint64_t value = 0;
+  for (int i = 0; i < bits; i++, offset++)
+    {
+      auto byte = p[offset >> 3];
+      auto bit = (byte >> (7 - (offset & 7))) & 1;
+      value = (value << 1) | bit;
+    }
+  return value;
+}
+
+void
+set_bits (unsigned char *p, std::uint64_t offset, int bits,
+	  std::uint64_t value)
+{
+  for (int i = bits - 1; i >= 0; i--, offset++)
+    {
+      auto bit = static_cast<unsigned char> ((value >> i) & 1);
+      auto &byte = p[offset >> 3];
+      auto mask = static_cast<unsigned char> (1 << (7 - (offset & 7)));
+      byte = static_cast<unsigned char> (bit ? byte | mask : byte & ~mask);
+    }
+}
+
+} // namespace db
+} // namespace mini_redis
@@ -0,0 +1,49 @@
+#ifndef DB_BITOPS_H
+#define DB_BITOPS_H
+
+#include "pch.h"
+
+namespace mini_redis
+{
+namespace db
+{
+
+// Bit-level kernels over string values. Bit 0 is the most significant bit
+// of the first byte, as in Redis.
+
+enum bitop_kind
+{
+  bitop_and,
+  bitop_or,
+  bitop_xor,
+};
+
+// Number of set bits in [p, p + n).
+std::uint64_t popcount (const unsigned char *p, std::size_t n);
+
+// dst[i] = dst[i] <op> src[i] for i in [0, n).
+void bitop_apply (bitop_kind op, unsigned char *dst, const unsigned char *src,
+		  std::size_t n);
+
+// dst[i] = ~dst[i] for i in [0, n).
+void bitop_not (unsigned char *dst, std::size_t n);
+
+// dst = srcs[0] <op> srcs[1] <op> ...; shorter sources are zero-padded.
+void bitop (bitop_kind op, std::string &dst,
+	    const std::vector<string_view> &srcs);
+
+// Position of the first bit equal to `bit` in [p, p + n), in bits from p.
+optional<std::uint64_t> find_bit (const unsigned char *p, std::size_t n,
+				  bool bit);
+
+// Reads / writes a big-endian unsigned integer of `bits` (1..64) bits
+// starting at bit `offset`. The buffer must cover the whole field.
+std::uint64_t get_bits (const unsigned char *p, std::uint64_t offset,
+			int bits);
+void set_bits (unsigned char *p, std::uint64_t offset, int bits,
+	       std::uint64_t value);
+
+} // namespace db
+} // namespace mini_redis
+
+#endif // DB_BITOPS_H
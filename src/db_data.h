@@ -3,6 +3,9 @@
 
 #include "pch.h"
 
+#include "db_hll.h"
+#include "db_stream.h"
+#include "db_zset.h"
 #include "resp_data.h"
 #include "value_wrapper.h"
 #include "variant_wrapper.h"
@@ -18,8 +21,13 @@ typedef value_wrapper<std::deque<std::string>, 2> list;
 typedef value_wrapper<unordered_flat_set<std::string>, 3> set;
 typedef value_wrapper<unordered_flat_map<std::string, std::string>, 4>
     hashtable;
+typedef value_wrapper<db::zset, 5> sorted_set;
+typedef value_wrapper<db::hyperloglog, 6> hll;
+typedef value_wrapper<db::stream, 7> stream_type;
 
-typedef variant_wrapper<string, integer, list, set, hashtable> data_base;
+typedef variant_wrapper<string, integer, list, set, hashtable, sorted_set,
+			hll, stream_type>
+    data_base;
 
 struct data : data_base
 {
@@ -1,7 +1,15 @@
 #include "db_disk.h"
 
+#include "db_lz.h"
 #include "resp_parser.h"
 
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 namespace mini_redis
 {
 namespace db
@@ -17,170 +25,463 @@ enum : std::int64_t
   type_list = data::index_of<list> (),
   type_set = data::index_of<set> (),
   type_hash = data::index_of<hashtable> (),
+  type_zset = data::index_of<sorted_set> (),
+  type_hll = data::index_of<hll> (),
+  type_stream = data::index_of<stream_type> (),
 };
 
 typedef result<void, std::string> result_type;
 
 static const char format_magic[4]{ 'M', 'R', 'D', 'B' };
-static const char format_version = 1;
+static const char delta_magic[4]{ 'M', 'R', 'D', 'D' };
+static const char format_version = 4;
+static const char format_version_uncompressed = 3;
+static const char format_version_unindexed = 2;
+static const char format_version_resp = 1;
+
+static const std::size_t header_size = 5;
+// Entries are grouped into blocks of about this size for the block index.
+static const std::uint64_t index_block_bytes = 1 << 20;
+
+std::string
+format_errno (string_view prefix)
+{
+  int code = errno;
+  std::string msg = prefix.to_string ();
+  msg += ": ";
+  msg += std::strerror (code);
+  return msg;
+}
+
+bool
+write_all (std::FILE *fp, string_view bytes)
+{
+  auto buf = bytes.data ();
+  auto len = bytes.size ();
+
+  while (len != 0)
+    {
+      auto n = std::fwrite (buf, 1, len, fp);
+      if (n == 0)
+	return false;
+
+      buf += n;
+      len -= n;
+    }
+
+  return true;
+}
+
+// Serializes into a fixed-size buffer that is written out whenever it
+// fills up, so that saving needs a bounded amount of memory however big the
+// dataset is. Pieces larger than the buffer are written straight through.
+class output_buffer
+{
+public:
+  static constexpr std::size_t capacity = 1 << 20;
+
+  output_buffer (std::FILE *fp, std::uint64_t offset)
+      : fp_{ fp }, ok_{ true }, offset_{ offset }
+  {
+    buf_.reserve (capacity);
+  }
+
+  // Offset in the file of the next byte appended.
+  std::uint64_t
+  offset () const noexcept
+  {
+    return offset_;
+  }
+
+  void
+  append (string_view bytes)
+  {
+    offset_ += bytes.size ();
+    if (buf_.size () + bytes.size () > capacity)
+      {
+	flush ();
+	if (bytes.size () >= capacity)
+	  {
+	    ok_ = ok_ && write_all (fp_, bytes);
+	    return;
+	  }
+      }
+    buf_.append (bytes.data (), bytes.size ());
+  }
+
+  void
+  push_back (char c)
+  {
+    offset_++;
+    if (buf_.size () == capacity)
+      flush ();
+    buf_.push_back (c);
+  }
+
+  // Returns false if any write so far has failed.
+  bool
+  flush ()
+  {
+    if (!buf_.empty ())
+      {
+	ok_ = ok_ && write_all (fp_, buf_);
+	buf_.clear ();
+      }
+    return ok_;
+  }
+
+private:
+  std::FILE *fp_;
+  bool ok_;
+  std::uint64_t offset_;
+  std::string buf_;
+}; // class output_buffer
+
+// Version 2 is a binary format. The body is a varint entry count followed
+// by the entries. Version 3 stores the same entries, without the count, in
+// blocks of about index_block_bytes, and ends with a block index: a varint
+// block count, then the offset, length and entry count of every block as
+// varints, then the 8-byte little-endian offset of the index itself. The
+// index lets the loader decode the blocks in parallel. Version 4 adds to
+// every index record the codec of the block and, for compressed blocks,
+// its decompressed length.
+//
+// An entry is a tag byte holding the value type, with
+// flag_expire set when a varint expiration time in milliseconds follows,
+// then the key and the value. Strings are a varint length and the bytes,
+// integers are zigzag varints, scores are 8-byte little-endian doubles,
+// and containers are a varint element count followed by their elements.
+// Varints are little-endian base 128.
+//
+// A delta file is a chain of segments, one per incremental save, each of
+// them an 8-byte little-endian length and an image in the version 4 format
+// with the "MRDD" magic, whose offsets are relative to the image. Its
+// entries are the keys changed since the previous save; a deleted key is
+// the tag_deleted byte followed by the key, and reads as an entry that has
+// expired.
+
+enum : unsigned char
+{
+  flag_expire = 0x80,
+  tag_deleted = 0x7f,
+};
+
+template <class Out>
+void
+put_varint (Out &out, std::uint64_t v)
+{
+  char buf[10];
+  std::size_t n = 0;
+  while (v >= 0x80)
+    {
+      buf[n++] = static_cast<char> ((v & 0x7f) | 0x80);
+      v >>= 7;
+    }
+  buf[n++] = static_cast<char> (v);
+  out.append ({ buf, n });
+}
 
+template <class Out>
 void
-append_array_header (std::string &out, std::size_t n)
+put_string (Out &out, string_view s)
 {
-  out.push_back (resp::array_first);
-  out += std::to_string (n);
-  out.append ("\r\n", 2);
+  put_varint (out, s.size ());
+  out.append (s);
 }
 
+template <class Out>
 void
-append_bulk_string (std::string &out, string_view s)
+put_integer (Out &out, std::int64_t i)
 {
-  out.push_back (resp::bulk_string_first);
-  out += std::to_string (s.size ());
-  out.append ("\r\n", 2);
-  out.append (s.data (), s.size ());
-  out.append ("\r\n", 2);
+  auto u = static_cast<std::uint64_t> (i);
+  put_varint (out, (u << 1) ^ (i < 0 ? ~std::uint64_t{ 0 } : 0));
 }
 
+template <class Out>
 void
-append_integer (std::string &out, std::int64_t i)
+put_fixed64 (Out &out, std::uint64_t u)
 {
-  out.push_back (resp::integer_first);
-  out += std::to_string (i);
-  out.append ("\r\n", 2);
+  char buf[8];
+  for (int i = 0; i < 8; i++)
+    buf[i] = static_cast<char> ((u >> (i * 8)) & 0xff);
+  out.append ({ buf, sizeof (buf) });
 }
 
+template <class Out>
 void
-append_entry (std::string &out, const snapshot::entry &entry)
+put_double (Out &out, double d)
 {
-  append_array_header (out, 5);
+  std::uint64_t u;
+  std::memcpy (&u, &d, sizeof (u));
+  put_fixed64 (out, u);
+}
 
-  append_bulk_string (out, entry.key);
-  const auto &value = entry.value;
+template <class Out>
+void
+put_value (Out &out, const data &value)
+{
   switch (value.index ())
     {
     case type_string:
-      {
-	append_integer (out, type_string);
-	append_bulk_string (out, value.get<string> ());
-      }
+      put_string (out, value.get<string> ());
       break;
 
     case type_integer:
-      {
-	append_integer (out, type_integer);
-	append_integer (out, value.get<integer> ());
-      }
+      put_integer (out, value.get<integer> ());
       break;
 
     case type_list:
       {
-	append_integer (out, type_list);
 	const auto &ls = value.get<list> ();
-	append_array_header (out, ls.size ());
+	put_varint (out, ls.size ());
 	for (const auto &i : ls)
-	  append_bulk_string (out, i);
+	  put_string (out, i);
       }
       break;
 
     case type_set:
       {
-	append_integer (out, type_set);
 	const auto &st = value.get<set> ();
-	append_array_header (out, st.size ());
+	put_varint (out, st.size ());
 	for (const auto &i : st)
-	  append_bulk_string (out, i);
+	  put_string (out, i);
       }
       break;
 
     case type_hash:
       {
-	append_integer (out, type_hash);
 	const auto &ht = value.get<hashtable> ();
-	append_array_header (out, ht.size () * 2);
+	put_varint (out, ht.size ());
 	for (const auto &p : ht)
 	  {
-	    append_bulk_string (out, p.first);
-	    append_bulk_string (out, p.second);
+	    put_string (out, p.first);
+	    put_string (out, p.second);
 	  }
       }
       break;
 
+    case type_zset:
+      {
+	const auto &zs = value.get<sorted_set> ();
+	put_varint (out, zs.size ());
+	zs.for_each (
+	    [&out] (const std::string &member, double score)
+	      {
+		put_string (out, member);
+		put_double (out, score);
+	      });
+      }
+      break;
+
+    case type_hll:
+      put_string (out, value.get<hll> ().dump ());
+      break;
+
+    case type_stream:
+      put_string (out, value.get<stream_type> ().dump ());
+      break;
+
     default:
       BOOST_THROW_EXCEPTION (std::logic_error ("bad data type"));
     }
+}
+
+template <class Out>
+void
+put_entry (Out &out, const std::string &key, const data &value,
+	   const optional<time_point> &expire_at)
+{
+  auto tag = static_cast<unsigned char> (value.index ());
+  if (expire_at.has_value ())
+    tag |= flag_expire;
+  out.push_back (static_cast<char> (tag));
 
-  std::int64_t has_expire = 0;
-  std::int64_t expire_at_ms = 0;
-  if (entry.expire_at.has_value ())
+  if (expire_at.has_value ())
     {
-      has_expire = 1;
-      expire_at_ms = duration_cast<milliseconds> (
-			 entry.expire_at.value ().time_since_epoch ())
-			 .count ();
+      auto ms = duration_cast<milliseconds> (
+		    expire_at.value ().time_since_epoch ())
+		    .count ();
+      put_varint (out, static_cast<std::uint64_t> (std::max<std::int64_t> (
+			   ms, 0)));
     }
 
-  append_integer (out, has_expire);
-  append_integer (out, expire_at_ms);
+  put_string (out, key);
+  put_value (out, value);
 }
 
-std::string
-format_errno (string_view prefix)
+template <class Out>
+void
+put_deleted (Out &out, const std::string &key)
 {
-  int code = errno;
-  std::string msg = prefix.to_string ();
-  msg += ": ";
-  msg += std::strerror (code);
-  return msg;
+  out.push_back (static_cast<char> (tag_deleted));
+  put_string (out, key);
 }
 
-bool
-write_all (std::FILE *fp, string_view bytes)
+struct block_info
 {
-  auto buf = bytes.data ();
-  auto len = bytes.size ();
+  std::uint64_t offset;
+  // Length of the block in the file, and once decompressed.
+  std::uint64_t length;
+  std::uint64_t raw_length;
+  std::uint64_t entries;
+  compression codec;
+};
 
-  while (len != 0)
-    {
-      auto n = std::fwrite (buf, 1, len, fp);
-      if (n == 0)
-	return false;
+// Groups the entries written through it into blocks and keeps the block
+// index. Without compression the entries go straight to the file; with it
+// every block is staged in memory and compressed as a whole, and is kept
+// uncompressed when that does not make it smaller.
+class block_writer
+{
+public:
+  block_writer (output_buffer &out, compression codec)
+      : out_{ out }, codec_{ codec },
+	block_{ out.offset (), 0, 0, 0, compression_none }
+  {
+  }
+
+  void
+  append (string_view bytes)
+  {
+    if (codec_ == compression_none)
+      out_.append (bytes);
+    else
+      stage_.append (bytes.data (), bytes.size ());
+  }
+
+  void
+  push_back (char c)
+  {
+    if (codec_ == compression_none)
+      out_.push_back (c);
+    else
+      stage_.push_back (c);
+  }
+
+  // Called after every entry.
+  void
+  end_entry ()
+  {
+    block_.entries++;
+    auto size = codec_ == compression_none ? out_.offset () - block_.offset
+					   : stage_.size ();
+    if (size >= index_block_bytes)
+      end_block ();
+  }
+
+  // Ends the last block and writes the index.
+  void
+  finish ()
+  {
+    if (block_.entries != 0)
+      end_block ();
+
+    auto index_offset = out_.offset ();
+    put_varint (out_, index_.size ());
+    for (const auto &b : index_)
+      {
+	put_varint (out_, b.offset);
+	put_varint (out_, b.length);
+	put_varint (out_, b.entries);
+	put_varint (out_, b.codec);
+	if (b.codec != compression_none)
+	  put_varint (out_, b.raw_length);
+      }
+    put_fixed64 (out_, index_offset);
+  }
+
+private:
+  void
+  end_block ()
+  {
+    if (codec_ != compression_none)
+      {
+	packed_.clear ();
+	lz_compress (stage_, packed_);
+	if (packed_.size () < stage_.size ())
+	  {
+	    block_.codec = codec_;
+	    block_.raw_length = stage_.size ();
+	    out_.append (packed_);
+	  }
+	else
+	  out_.append (stage_);
+	stage_.clear ();
+      }
 
-      buf += n;
-      len -= n;
-    }
+    block_.length = out_.offset () - block_.offset;
+    if (block_.codec == compression_none)
+      block_.raw_length = block_.length;
+    index_.push_back (block_);
+    block_ = block_info{ out_.offset (), 0, 0, 0, compression_none };
+  }
+
+private:
+  output_buffer &out_;
+  compression codec_;
+  block_info block_;
+  std::vector<block_info> index_;
+  std::string stage_;
+  std::string packed_;
+}; // class block_writer
 
-  return true;
+result_type
+write_header (std::FILE *fp, const char (&magic)[4])
+{
+  const char header[header_size]{ magic[0], magic[1], magic[2], magic[3],
+				  static_cast<char> (format_version) };
+  if (!write_all (fp, { header, sizeof (header) }))
+    return format_errno ("save failed: cannot write header");
+  return {};
 }
 
+// Writes a header with the given magic, then the entries that put_entries
+// passes to the block_writer, then the block index.
+template <class Fn>
 result_type
-save_file (std::string path, string_view body)
+write_image (std::FILE *fp, const char (&magic)[4], compression codec,
+	     Fn put_entries)
+{
+  auto res = write_header (fp, magic);
+  if (!res.has_value ())
+    return res;
+
+  output_buffer out{ fp, header_size };
+  block_writer blocks{ out, codec };
+  put_entries (blocks);
+  blocks.finish ();
+  if (!out.flush ())
+    return format_errno ("save failed: cannot write body");
+  return {};
+}
+
+std::string
+delta_path (string_view path)
+{
+  return path.to_string () + ".delta";
+}
+
+int
+sync_fd (int fd)
+{
+#if defined(__linux__)
+  return ::fdatasync (fd);
+#else
+  return ::fsync (fd);
+#endif
+}
+
+// Flushes and closes fp, open on temp_path, then moves the file over
+// path. The temporary file is removed on failure.
+result_type
+commit_file (std::FILE *fp, const std::string &temp_path,
+	     const std::string &path)
 {
-  auto temp_path = path + ".tmp";
   auto backup_path = path + ".bak";
   const char *path_cstr = path.c_str ();
   const char *temp_path_cstr = temp_path.c_str ();
   const char *backup_path_cstr = backup_path.c_str ();
 
-  std::remove (temp_path_cstr);
-
-  auto *fp = std::fopen (temp_path_cstr, "wb");
-  const char header[5]{ format_magic[0], format_magic[1], format_magic[2],
-			format_magic[3], static_cast<char> (format_version) };
-  if (fp == nullptr)
-    return format_errno ("save failed: cannot open temporary file");
-  if (!write_all (fp, { header, sizeof (header) }))
-    {
-      std::fclose (fp);
-      std::remove (temp_path_cstr);
-      return format_errno ("save failed: cannot write header");
-    }
-  if (!body.empty () && !write_all (fp, body))
-    {
-      std::fclose (fp);
-      std::remove (temp_path_cstr);
-      return format_errno ("save failed: cannot write body");
-    }
   if (std::fflush (fp) != 0)
     {
       std::fclose (fp);
@@ -218,37 +519,32 @@ save_file (std::string path, string_view body)
   return {};
 }
 
+// Writes whatever write_file puts into a temporary file, then moves it
+// over path.
+template <class Fn>
 result_type
-load_file (std::string path, std::string &out)
+save_file (std::string path, Fn write_file)
 {
-  auto *fp = std::fopen (path.c_str (), "rb");
+  auto temp_path = path + ".tmp";
+  std::remove (temp_path.c_str ());
+
+  auto *fp = std::fopen (temp_path.c_str (), "wb");
   if (fp == nullptr)
-    return format_errno ("load failed: cannot open file");
+    return format_errno ("save failed: cannot open temporary file");
 
-  std::array<char, 4096> buffer;
-  while (true)
+  auto res = write_file (fp);
+  if (!res.has_value ())
     {
-      auto n = std::fread (buffer.data (), 1, buffer.size (), fp);
-      if (n != 0)
-	out.append (buffer.data (), n);
-
-      if (n == buffer.size ())
-	continue;
-
-      if (std::ferror (fp) != 0)
-	{
-	  std::fclose (fp);
-	  return format_errno ("load failed: cannot read file");
-	}
-      break;
+      std::fclose (fp);
+      std::remove (temp_path.c_str ());
+      return res;
     }
-
-  if (std::fclose (fp) != 0)
-    return format_errno ("load failed: cannot close file");
-
-  return {};
+  return commit_file (fp, temp_path, path);
 }
 
+// Version 1 stores the body as a RESP array of entries, each of them an
+// array of key, type, value, expiration flag and expiration time.
+
 result_type
 parse_value (std::int64_t type, resp::data &input, data &out)
 {
@@ -331,6 +627,51 @@ parse_value (std::int64_t type, resp::data &input, data &out)
 	return {};
       }
 
+    case type_zset:
+      {
+	auto p = input.get_if<resp::array> ();
+	if (p == nullptr || !p->has_value ())
+	  return "load failed: invalid container value";
+	sorted_set zs;
+	auto &arr = p->value ();
+	if (arr.size () % 2 != 0)
+	  return "load failed: invalid sorted set length";
+	for (std::size_t i = 0; i < arr.size (); i += 2)
+	  {
+	    auto pm = arr[i].get_if<resp::bulk_string> ();
+	    auto ps = arr[i + 1].get_if<resp::bulk_string> ();
+	    double score;
+	    if (pm == nullptr || ps == nullptr || !pm->has_value ()
+		|| !ps->has_value () || !parse_score (ps->value (), score))
+	      return "load failed: invalid sorted set entry";
+	    zs->insert (std::move (pm->value ()), score);
+	  }
+	out = data{ std::move (zs) };
+	return {};
+      }
+
+    case type_hll:
+      {
+	auto p = input.get_if<resp::bulk_string> ();
+	hll h;
+	if (p == nullptr || !p->has_value ()
+	    || !hyperloglog::restore (p->value (), *h))
+	  return "load failed: invalid hyperloglog value";
+	out = data{ std::move (h) };
+	return {};
+      }
+
+    case type_stream:
+      {
+	auto p = input.get_if<resp::bulk_string> ();
+	stream_type st;
+	if (p == nullptr || !p->has_value ()
+	    || !stream::restore (p->value (), *st))
+	  return "load failed: invalid stream value";
+	out = data{ std::move (st) };
+	return {};
+      }
+
     default:
       return "load failed: unknown value type";
     }
@@ -397,11 +738,19 @@ parse_entry (resp::data &in, std::int64_t now, snapshot::entry &out,
 }
 
 result_type
-parse_body (string_view body, snapshot &out)
+parse_body (string_view body, snapshot &out, time_point now)
 {
+  // The parser drops consumed bytes from the front of its buffer, so it is
+  // fed in chunks to keep that cheap.
   resp::parser parser{ {} };
-  parser.append (body);
-  parser.parse ();
+  const std::size_t chunk = 4096;
+  for (std::size_t off = 0; off < body.size (); off += chunk)
+    {
+      parser.append (body.substr (off, chunk));
+      parser.parse ();
+      if (parser.has_error ())
+	break;
+    }
 
   if (parser.has_error ())
     {
@@ -419,16 +768,14 @@ parse_body (string_view body, snapshot &out)
     return "load failed: snapshot root is not an array";
   auto &arr = p->value ();
 
-  auto now
-      = duration_cast<milliseconds> (clock_type::now ().time_since_epoch ())
-	    .count ();
+  auto now_ms = duration_cast<milliseconds> (now.time_since_epoch ()).count ();
   out.entries.clear ();
   out.entries.reserve (arr.size ());
   for (auto &i : arr)
     {
       bool dropped = false;
       snapshot::entry entry;
-      auto entry_res = parse_entry (i, now, entry, dropped);
+      auto entry_res = parse_entry (i, now_ms, entry, dropped);
       if (!entry_res.has_value ())
 	return entry_res;
       if (!dropped)
@@ -438,39 +785,1205 @@ parse_body (string_view body, snapshot &out)
   return {};
 }
 
-} // namespace
+std::uint64_t
+load_fixed64 (const char *p)
+{
+  std::uint64_t u = 0;
+  for (int i = 0; i < 8; i++)
+    u |= static_cast<std::uint64_t> (static_cast<unsigned char> (p[i]))
+	 << (i * 8);
+  return u;
+}
 
-result<void, std::string>
-save_to (string_view path, snapshot snap)
+// Sequential decoder of version 2 and 3 bodies.
+class input_buffer
+{
+public:
+  explicit input_buffer (string_view in) : rest_{ in } {}
+
+  bool
+  empty () const noexcept
+  {
+    return rest_.empty ();
+  }
+
+  bool
+  get_byte (unsigned char &b)
+  {
+    if (rest_.empty ())
+      return false;
+    b = static_cast<unsigned char> (rest_[0]);
+    rest_.remove_prefix (1);
+    return true;
+  }
+
+  bool
+  get_varint (std::uint64_t &v)
+  {
+    v = 0;
+    for (int shift = 0; shift < 64 && !rest_.empty (); shift += 7)
+      {
+	auto b = static_cast<unsigned char> (rest_[0]);
+	rest_.remove_prefix (1);
+	v |= static_cast<std::uint64_t> (b & 0x7f) << shift;
+	if ((b & 0x80) == 0)
+	  return true;
+      }
+    return false;
+  }
+
+  // An element count. Every element takes at least one byte, which bounds
+  // what a corrupted count can make the caller reserve.
+  bool
+  get_count (std::size_t &n)
+  {
+    std::uint64_t v;
+    if (!get_varint (v) || v > rest_.size ())
+      return false;
+    n = static_cast<std::size_t> (v);
+    return true;
+  }
+
+  bool
+  get_string (string_view &s)
+  {
+    std::uint64_t n;
+    if (!get_varint (n) || n > rest_.size ())
+      return false;
+    s = rest_.substr (0, static_cast<std::size_t> (n));
+    rest_.remove_prefix (static_cast<std::size_t> (n));
+    return true;
+  }
+
+  bool
+  get_string (std::string &s)
+  {
+    string_view sv;
+    if (!get_string (sv))
+      return false;
+    s.assign (sv.data (), sv.size ());
+    return true;
+  }
+
+  bool
+  get_integer (std::int64_t &i)
+  {
+    std::uint64_t u;
+    if (!get_varint (u))
+      return false;
+    i = static_cast<std::int64_t> ((u >> 1) ^ (~(u & 1) + 1));
+    return true;
+  }
+
+  bool
+  get_fixed64 (std::uint64_t &u)
+  {
+    if (rest_.size () < 8)
+      return false;
+    u = load_fixed64 (rest_.data ());
+    rest_.remove_prefix (8);
+    return true;
+  }
+
+  bool
+  get_double (double &d)
+  {
+    std::uint64_t u;
+    if (!get_fixed64 (u))
+      return false;
+    std::memcpy (&d, &u, sizeof (d));
+    return true;
+  }
+
+private:
+  string_view rest_;
+}; // class input_buffer
+
+result_type
+read_value (unsigned type, input_buffer &in, data &out)
 {
-  std::string body;
-  append_array_header (body, snap.entries.size ());
-  for (const auto &entry : snap.entries)
-    append_entry (body, entry);
+  switch (type)
+    {
+    case type_string:
+      {
+	string str;
+	if (!in.get_string (*str))
+	  return "load failed: invalid string value";
+	out = data{ std::move (str) };
+	return {};
+      }
+
+    case type_integer:
+      {
+	std::int64_t i;
+	if (!in.get_integer (i))
+	  return "load failed: invalid integer value";
+	out = data{ integer{ i } };
+	return {};
+      }
+
+    case type_list:
+      {
+	std::size_t n;
+	if (!in.get_count (n))
+	  return "load failed: invalid container value";
+	list ls;
+	for (std::size_t i = 0; i < n; i++)
+	  {
+	    std::string item;
+	    if (!in.get_string (item))
+	      return "load failed: invalid list element";
+	    ls->push_back (std::move (item));
+	  }
+	out = data{ std::move (ls) };
+	return {};
+      }
+
+    case type_set:
+      {
+	std::size_t n;
+	if (!in.get_count (n))
+	  return "load failed: invalid container value";
+	set st;
+	st->reserve (n);
+	for (std::size_t i = 0; i < n; i++)
+	  {
+	    std::string item;
+	    if (!in.get_string (item))
+	      return "load failed: invalid set element";
+	    st->insert (std::move (item));
+	  }
+	out = data{ std::move (st) };
+	return {};
+      }
+
+    case type_hash:
+      {
+	std::size_t n;
+	if (!in.get_count (n))
+	  return "load failed: invalid container value";
+	hashtable hs;
+	hs->reserve (n);
+	for (std::size_t i = 0; i < n; i++)
+	  {
+	    std::string field, value;
+	    if (!in.get_string (field) || !in.get_string (value))
+	      return "load failed: invalid hash entry";
+	    hs->insert_or_assign (std::move (field), std::move (value));
+	  }
+	out = data{ std::move (hs) };
+	return {};
+      }
 
-  return save_file (path.to_string (), body);
+    case type_zset:
+      {
+	std::size_t n;
+	if (!in.get_count (n))
+	  return "load failed: invalid container value";
+	sorted_set zs;
+	for (std::size_t i = 0; i < n; i++)
+	  {
+	    std::string member;
+	    double score;
+	    if (!in.get_string (member) || !in.get_double (score)
+		|| std::isnan (score))
+	      return "load failed: invalid sorted set entry";
+	    zs->insert (std::move (member), score);
+	  }
+	out = data{ std::move (zs) };
+	return {};
+      }
+
+    case type_hll:
+      {
+	string_view raw;
+	hll h;
+	if (!in.get_string (raw) || !hyperloglog::restore (raw, *h))
+	  return "load failed: invalid hyperloglog value";
+	out = data{ std::move (h) };
+	return {};
+      }
+
+    case type_stream:
+      {
+	string_view raw;
+	stream_type st;
+	if (!in.get_string (raw) || !stream::restore (raw, *st))
+	  return "load failed: invalid stream value";
+	out = data{ std::move (st) };
+	return {};
+      }
+
+    default:
+      return "load failed: unknown value type";
+    }
 }
 
-result<void, std::string>
-load_from (string_view path, snapshot &out)
+result_type
+read_entry (input_buffer &in, snapshot::entry &out, bool delta)
 {
-  out.entries.clear ();
+  unsigned char tag;
+  if (!in.get_byte (tag))
+    return "load failed: invalid type tag";
 
-  std::string raw;
-  auto res = load_file (path.to_string (), raw);
+  if (tag == tag_deleted && delta)
+    {
+      if (!in.get_string (out.key))
+	return "load failed: invalid snapshot key";
+      out.expire_at = time_point::min ();
+      return {};
+    }
+
+  std::uint64_t expire_at_ms = 0;
+  if ((tag & flag_expire) != 0 && !in.get_varint (expire_at_ms))
+    return "load failed: invalid expiration timestamp";
+
+  if (!in.get_string (out.key))
+    return "load failed: invalid snapshot key";
+
+  auto res = read_value (tag & ~flag_expire, in, out.value);
   if (!res.has_value ())
     return res;
 
-  if (raw.size () < 5)
-    return "load failed: file is too short";
+  if ((tag & flag_expire) != 0)
+    out.expire_at = time_point{ milliseconds{
+	static_cast<std::int64_t> (expire_at_ms) } };
+  else
+    out.expire_at = boost::none;
+  return {};
+}
+
+// Decodes n entries into [out, out + n), which must use up all of in.
+// Deleted keys are only allowed in a delta.
+result_type
+read_entries (input_buffer &in, std::size_t n, snapshot::entry *out,
+	      bool delta = false)
+{
+  for (std::size_t i = 0; i < n; i++)
+    {
+      auto res = read_entry (in, out[i], delta);
+      if (!res.has_value ())
+	return res;
+    }
+
+  if (!in.empty ())
+    return "load failed: trailing data after snapshot";
+  return {};
+}
+
+void
+drop_expired (snapshot &snap, time_point now)
+{
+  auto &entries = snap.entries;
+  auto end = std::remove_if (entries.begin (), entries.end (),
+			     [now] (const snapshot::entry &e)
+			       {
+				 return e.expire_at.has_value ()
+					&& e.expire_at.value () <= now;
+			       });
+  entries.erase (end, entries.end ());
+}
+
+result_type
+read_body_unindexed (string_view body, snapshot &out, time_point now)
+{
+  input_buffer in{ body };
+  std::size_t n;
+  if (!in.get_count (n))
+    return "load failed: invalid entry count";
+
+  out.entries.clear ();
+  out.entries.resize (n);
+  auto res = read_entries (in, n, out.entries.data ());
+  if (!res.has_value ())
+    return res;
+
+  drop_expired (out, now);
+  return {};
+}
+
+result_type
+read_block_index (string_view file, char version, std::vector<block_info> &out)
+{
+  if (file.size () < header_size + 8)
+    return "load failed: file is too short";
+
+  auto index_offset = load_fixed64 (file.data () + file.size () - 8);
+  if (index_offset < header_size || index_offset > file.size () - 8)
+    return "load failed: invalid block index offset";
+
+  input_buffer in{ file.substr (index_offset, file.size () - 8
+						  - index_offset) };
+  std::size_t n;
+  if (!in.get_count (n))
+    return "load failed: invalid block index";
+
+  // The blocks must tile the body exactly.
+  std::uint64_t next = header_size;
+  out.resize (n);
+  for (auto &block : out)
+    {
+      if (!in.get_varint (block.offset) || !in.get_varint (block.length)
+	  || !in.get_varint (block.entries) || block.offset != next
+	  || block.length > index_offset - next)
+	return "load failed: invalid block index";
+      next += block.length;
+
+      std::uint64_t codec = compression_none;
+      if (version != format_version_uncompressed && !in.get_varint (codec))
+	return "load failed: invalid block index";
+      block.raw_length = block.length;
+      if (codec == compression_lz)
+	{
+	  // lz expands by at most 255 times, plus the last token.
+	  if (!in.get_varint (block.raw_length)
+	      || block.raw_length / 255 > block.length)
+	    return "load failed: invalid block index";
+	}
+      else if (codec != compression_none)
+	return "load failed: unknown block compression";
+      block.codec = static_cast<compression> (codec);
+
+      // Every entry takes at least three bytes.
+      if (block.entries > block.raw_length / 3)
+	return "load failed: invalid block index";
+    }
+  if (next != index_offset || !in.empty ())
+    return "load failed: invalid block index";
+  return {};
+}
+
+struct decoded_block
+{
+  std::vector<snapshot::entry> entries;
+  result_type result;
+  bool done = false;
+};
+
+void
+decode_block (string_view file, const block_info &block, bool delta,
+	      decoded_block &out)
+{
+  auto bytes = file.substr (block.offset, block.length);
+  std::string raw;
+  if (block.codec == compression_lz)
+    {
+      raw.resize (block.raw_length);
+      if (!lz_decompress (bytes, &raw[0], raw.size ()))
+	{
+	  out.result = "load failed: invalid compressed block";
+	  return;
+	}
+      bytes = raw;
+    }
+
+  input_buffer in{ bytes };
+  out.entries.resize (block.entries);
+  out.result
+      = read_entries (in, out.entries.size (), out.entries.data (), delta);
+}
+
+// Decodes the blocks of a version 3 or 4 image on a thread pool while this
+// thread passes the decoded entries, block by block and in file order, to
+// consume. At most a few blocks per thread are in flight, so the decoded
+// entries never hold more than a few megabytes at once. Deleted keys are
+// only allowed in a delta.
+template <class Fn>
+result_type
+for_each_block (string_view file, const std::vector<block_info> &index,
+		bool delta, Fn consume)
+{
+  // This thread consumes, the others decode.
+  std::size_t threads = std::thread::hardware_concurrency ();
+  threads = std::min<std::size_t> (threads > 1 ? threads - 1 : 0,
+				   index.size ());
+  if (threads == 0)
+    {
+      for (const auto &info : index)
+	{
+	  decoded_block block;
+	  decode_block (file, info, delta, block);
+	  if (!block.result.has_value ())
+	    return block.result;
+	  consume (block.entries);
+	}
+      return {};
+    }
+
+  std::vector<decoded_block> blocks (index.size ());
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::atomic<bool> failed{ false };
+  std::size_t posted = 0;
+
+  asio::thread_pool pool{ threads };
+  auto post_next = [&] ()
+    {
+      if (posted == index.size ())
+	return;
+      auto i = posted++;
+      asio::post (pool,
+		  [&, i] ()
+		    {
+		      decoded_block block;
+		      if (!failed)
+			decode_block (file, index[i], delta, block);
+		      std::lock_guard<std::mutex> lock{ mutex };
+		      blocks[i] = std::move (block);
+		      blocks[i].done = true;
+		      cond.notify_one ();
+		    });
+    };
+
+  for (std::size_t i = 0; i < threads * 4; i++)
+    post_next ();
+
+  result_type ret;
+  for (std::size_t i = 0; i < index.size (); i++)
+    {
+      decoded_block block;
+      {
+	std::unique_lock<std::mutex> lock{ mutex };
+	cond.wait (lock, [&] () { return blocks[i].done; });
+	block = std::move (blocks[i]);
+      }
+      if (!block.result.has_value ())
+	{
+	  failed = true;
+	  ret = block.result;
+	  break;
+	}
+      post_next ();
+      consume (block.entries);
+    }
+
+  pool.join ();
+  return ret;
+}
+
+// Moves the entries of a version 3 or 4 file into the storage, which is
+// sized for all of them up front.
+result_type
+read_body_indexed (string_view file, storage &out, time_point now)
+{
+  std::vector<block_info> index;
+  auto res = read_block_index (file, file[4], index);
+  if (!res.has_value ())
+    return res;
+
+  std::uint64_t total = 0;
+  for (const auto &block : index)
+    total += block.entries;
+  out.reserve (static_cast<std::size_t> (total));
+
+  return for_each_block (
+      file, index, false,
+      [&out, now] (std::vector<snapshot::entry> &entries)
+	{
+	  for (auto &e : entries)
+	    {
+	      if (e.expire_at.has_value () && e.expire_at.value () <= now)
+		continue;
+	      auto it = out.insert (std::move (e.key), std::move (e.value));
+	      if (e.expire_at.has_value ())
+		out.expire_at (it, e.expire_at.value ());
+	    }
+	});
+}
 
+// Passes every entry of a snapshot to fn, keys past their expiration time
+// included.
+template <class Fn>
+result_type
+for_each_snapshot_entry (string_view raw, Fn fn)
+{
+  if (raw.size () < header_size)
+    return "load failed: file is too short";
   if (std::memcmp (raw.data (), format_magic, sizeof (format_magic)) != 0)
     return "load failed: bad format header";
 
-  if (raw[4] != format_version)
+  if (raw[4] == format_version || raw[4] == format_version_uncompressed)
+    {
+      std::vector<block_info> index;
+      auto res = read_block_index (raw, raw[4], index);
+      if (!res.has_value ())
+	return res;
+      return for_each_block (raw, index, false,
+			     [&fn] (std::vector<snapshot::entry> &entries)
+			       {
+				 for (auto &e : entries)
+				   fn (e);
+			       });
+    }
+
+  result_type res;
+  snapshot snap;
+  auto body = raw.substr (header_size);
+  if (raw[4] == format_version_unindexed)
+    res = read_body_unindexed (body, snap, time_point::min ());
+  else if (raw[4] == format_version_resp)
+    res = parse_body (body, snap, time_point::min ());
+  else
     return "load failed: unsupported format version";
 
-  return parse_body (string_view{ raw.data () + 5, raw.size () - 5 }, out);
+  if (!res.has_value ())
+    return res;
+  for (auto &e : snap.entries)
+    fn (e);
+  return {};
+}
+
+// Passes every entry of the delta file held in raw to fn, segment by
+// segment. A segment that a crash cut short ends the chain. Returns the
+// length of the segments read.
+template <class Fn>
+result<std::uint64_t, std::string>
+for_each_delta_entry (string_view raw, Fn fn)
+{
+  std::uint64_t pos = 0;
+  while (raw.size () - pos >= 8)
+    {
+      // The length is written last, so a complete length means a complete
+      // segment.
+      auto length = load_fixed64 (raw.data () + pos);
+      if (length == 0 || length > raw.size () - pos - 8)
+	break;
+
+      auto image = raw.substr (pos + 8, length);
+      if (image.size () < header_size
+	  || std::memcmp (image.data (), delta_magic, sizeof (delta_magic))
+		 != 0
+	  || image[4] != format_version)
+	return std::string{ "load failed: bad delta header" };
+
+      std::vector<block_info> index;
+      auto res = read_block_index (image, image[4], index);
+      if (!res.has_value ())
+	return res.error ();
+      res = for_each_block (image, index, true,
+			    [&fn] (std::vector<snapshot::entry> &entries)
+			      {
+				for (auto &e : entries)
+				  fn (e);
+			      });
+      if (!res.has_value ())
+	return res.error ();
+      pos += 8 + length;
+    }
+  return pos;
+}
+
+// Maps the delta file of path into file. Returns false if there is none.
+result<bool, std::string>
+open_delta (string_view path, mapped_file &file)
+{
+  auto delta = delta_path (path);
+  struct stat sb;
+  if (::stat (delta.c_str (), &sb) != 0)
+    {
+      if (errno == ENOENT)
+	return false;
+      return format_errno ("load failed: cannot stat delta file");
+    }
+
+  auto res = file.open (delta);
+  if (!res.has_value ())
+    return res.error ();
+  return true;
+}
+
+} // namespace
+
+mapped_file::mapped_file () noexcept : data_{ nullptr }, size_{ 0 } {}
+
+mapped_file::~mapped_file ()
+{
+  if (data_ != nullptr)
+    ::munmap (data_, size_);
+}
+
+result<void, std::string>
+mapped_file::open (const std::string &path)
+{
+  BOOST_ASSERT (data_ == nullptr);
+
+  int fd = ::open (path.c_str (), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return format_errno ("load failed: cannot open file");
+
+  struct stat sb;
+  if (::fstat (fd, &sb) != 0)
+    {
+      auto msg = format_errno ("load failed: cannot stat file");
+      ::close (fd);
+      return msg;
+    }
+
+  size_ = static_cast<std::size_t> (sb.st_size);
+  if (size_ != 0)
+    {
+      auto p = ::mmap (nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED)
+	{
+	  auto msg = format_errno ("load failed: cannot map file");
+	  ::close (fd);
+	  size_ = 0;
+	  return msg;
+	}
+      data_ = p;
+      // Snapshot blocks are read all at once by the decoding threads.
+      ::madvise (data_, size_, MADV_WILLNEED);
+    }
+
+  ::close (fd);
+  return {};
+}
+
+string_view
+mapped_file::bytes () const noexcept
+{
+  return { static_cast<const char *> (data_), size_ };
+}
+
+result<void, std::string>
+write_snapshot (std::FILE *fp, const storage &st, compression codec)
+{
+  // Expired keys that are still around are written as well; they are
+  // dropped when the snapshot is loaded.
+  auto put_entries = [&st] (block_writer &blocks)
+    {
+      st.for_each (
+	  [&blocks] (const std::string &key, const data &value,
+		     const optional<time_point> &expire_at)
+	    {
+	      put_entry (blocks, key, value, expire_at);
+	      blocks.end_entry ();
+	    });
+    };
+  return write_image (fp, format_magic, codec, put_entries);
+}
+
+result<void, std::string>
+save_to (string_view path, const storage &st, compression codec)
+{
+  return save_file (path.to_string (), [&st, codec] (std::FILE *fp)
+		      { return write_snapshot (fp, st, codec); });
+}
+
+result<void, std::string>
+load_from (string_view path, storage &out)
+{
+  mapped_file file;
+  auto res = file.open (path.to_string ());
+  if (!res.has_value ())
+    return res;
+  return load_snapshot (file.bytes (), out);
+}
+
+bool
+file_exists (string_view path)
+{
+  struct stat sb;
+  return ::stat (path.to_string ().c_str (), &sb) == 0;
+}
+
+result<void, std::string>
+load_snapshot (string_view raw, storage &out, bool keep_expired)
+{
+  auto now = keep_expired ? time_point::min () : clock_type::now ();
+  if (raw.size () < header_size)
+    return "load failed: file is too short";
+
+  if (std::memcmp (raw.data (), format_magic, sizeof (format_magic)) != 0)
+    return "load failed: bad format header";
+
+  if (raw[4] == format_version || raw[4] == format_version_uncompressed)
+    return read_body_indexed (raw, out, now);
+
+  result_type res;
+  snapshot snap;
+  auto body = raw.substr (header_size);
+  if (raw[4] == format_version_unindexed)
+    res = read_body_unindexed (body, snap, now);
+  else if (raw[4] == format_version_resp)
+    res = parse_body (body, snap, now);
+  else
+    return "load failed: unsupported format version";
+
+  if (!res.has_value ())
+    return res;
+  out.replace_with_snapshot (std::move (snap));
+  return {};
+}
+
+result<std::uint64_t, std::string>
+save_delta (string_view path, std::uint64_t valid_size, const storage &st,
+	    compression codec)
+{
+  auto delta = delta_path (path);
+  int fd = ::open (delta.c_str (), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return format_errno ("save failed: cannot open delta file");
+
+  // Drop whatever a failed save left after the chain.
+  auto *fp = ::fdopen (fd, "wb");
+  if (fp == nullptr || ::ftruncate (fd, static_cast<off_t> (valid_size)) != 0
+      || ::fseeko (fp, static_cast<off_t> (valid_size), SEEK_SET) != 0)
+    {
+      auto msg = format_errno ("save failed: cannot open delta file");
+      if (fp != nullptr)
+	std::fclose (fp);
+      else
+	::close (fd);
+      return msg;
+    }
+
+  // The length of the segment is written once the rest of it is on disk,
+  // so that a crash cannot leave a complete length over a partial image.
+  auto put_entries = [&st] (block_writer &blocks)
+    {
+      st.for_each_change (
+	  [&blocks] (const std::string &key, const data *value,
+		     const optional<time_point> &expire_at)
+	    {
+	      if (value == nullptr)
+		put_deleted (blocks, key);
+	      else
+		put_entry (blocks, key, *value, expire_at);
+	      blocks.end_entry ();
+	    });
+    };
+
+  char length[8]{};
+  result_type res;
+  if (!write_all (fp, { length, sizeof (length) }))
+    res = format_errno ("save failed: cannot write delta file");
+  else
+    res = write_image (fp, delta_magic, codec, put_entries);
+
+  auto end = ::ftello (fp);
+  if (res.has_value ()
+      && (std::fflush (fp) != 0 || sync_fd (fd) != 0 || end < 0))
+    res = format_errno ("save failed: cannot write delta file");
+  if (res.has_value ())
+    {
+      auto n = static_cast<std::uint64_t> (end) - valid_size - 8;
+      for (int i = 0; i < 8; i++)
+	length[i] = static_cast<char> ((n >> (i * 8)) & 0xff);
+      if (::fseeko (fp, static_cast<off_t> (valid_size), SEEK_SET) != 0
+	  || !write_all (fp, { length, sizeof (length) })
+	  || std::fflush (fp) != 0 || sync_fd (fd) != 0)
+	res = format_errno ("save failed: cannot write delta file");
+    }
+
+  if (std::fclose (fp) != 0 && res.has_value ())
+    res = format_errno ("save failed: cannot close delta file");
+  if (!res.has_value ())
+    return res.error ();
+  return static_cast<std::uint64_t> (end);
+}
+
+result<std::uint64_t, std::string>
+load_deltas (string_view path, storage &out)
+{
+  mapped_file file;
+  auto found = open_delta (path, file);
+  if (!found.has_value ())
+    return found.error ();
+  if (!found.value ())
+    return std::uint64_t{ 0 };
+
+  // Each entry is the latest version of its key; one that has expired
+  // stands for a key that is gone.
+  auto now = clock_type::now ();
+  auto apply = [&out, now] (snapshot::entry &e)
+    {
+      if (e.expire_at.has_value () && e.expire_at.value () <= now)
+	{
+	  auto it = out.find (e.key);
+	  if (it.has_value ())
+	    out.erase (it.value ());
+	  return;
+	}
+
+      auto it = out.insert (std::move (e.key), std::move (e.value));
+      if (e.expire_at.has_value ())
+	out.expire_at (it, e.expire_at.value ());
+      else
+	out.clear_expires (it);
+    };
+  return for_each_delta_entry (file.bytes (), apply);
+}
+
+result<void, std::string>
+remove_deltas (string_view path)
+{
+  auto delta = delta_path (path);
+  if (std::remove (delta.c_str ()) != 0 && errno != ENOENT)
+    return format_errno ("save failed: cannot remove delta file");
+  return {};
+}
+
+result<void, std::string>
+compact (string_view path, compression codec)
+{
+  mapped_file delta_file;
+  auto found = open_delta (path, delta_file);
+  if (!found.has_value ())
+    return found.error ();
+  if (!found.value ())
+    return {};
+
+  // Only the latest version of the keys in the deltas is held in memory;
+  // the snapshot is streamed through block by block.
+  unordered_flat_map<std::string, snapshot::entry> changes;
+  auto collect = [&changes] (snapshot::entry &e)
+    {
+      auto &slot = changes[e.key];
+      slot = std::move (e);
+    };
+  auto ret = for_each_delta_entry (delta_file.bytes (), collect);
+  if (!ret.has_value ())
+    return ret.error ();
+
+  mapped_file base_file;
+  auto res = base_file.open (path.to_string ());
+  if (!res.has_value ())
+    return res;
+
+  auto now = clock_type::now ();
+  auto put = [now] (block_writer &blocks, const snapshot::entry &e)
+    {
+      if (e.expire_at.has_value () && e.expire_at.value () <= now)
+	return;
+      put_entry (blocks, e.key, e.value, e.expire_at);
+      blocks.end_entry ();
+    };
+
+  result_type read_res;
+  auto put_entries = [&] (block_writer &blocks)
+    {
+      read_res = for_each_snapshot_entry (
+	  base_file.bytes (),
+	  [&] (snapshot::entry &e)
+	    {
+	      if (changes.count (e.key) == 0)
+		put (blocks, e);
+	    });
+      if (!read_res.has_value ())
+	return;
+      for (const auto &p : changes)
+	put (blocks, p.second);
+    };
+  auto write_file = [&] (std::FILE *fp)
+    {
+      auto written = write_image (fp, format_magic, codec, put_entries);
+      if (!read_res.has_value ())
+	return read_res;
+      return written;
+    };
+  res = save_file (path.to_string (), write_file);
+  if (!res.has_value ())
+    return res;
+
+  // Applying the deltas again to the merged snapshot changes nothing, so
+  // a crash before they are removed is harmless.
+  return remove_deltas (path);
+}
+
+result<int, std::string>
+run_in_background (const std::function<result<void, std::string> ()> &job)
+{
+  std::fflush (nullptr);
+  auto pid = ::fork ();
+  if (pid < 0)
+    return format_errno ("cannot fork");
+
+  if (pid == 0)
+    {
+      // The child shares the parent's signal handlers; a termination signal
+      // must not be forwarded to the server through them.
+      ::signal (SIGINT, SIG_DFL);
+      ::signal (SIGTERM, SIG_DFL);
+
+      auto res = job ();
+      if (!res.has_value ())
+	std::fprintf (stderr, "%s\n", res.error ().c_str ());
+      ::_exit (res.has_value () ? 0 : 1);
+    }
+
+  return static_cast<int> (pid);
+}
+
+result<int, std::string>
+save_in_background (string_view path, const storage &st,
+		    compression codec)
+{
+  auto ret = run_in_background ([path, &st, codec] ()
+				  { return save_to (path, st, codec); });
+  if (!ret.has_value ())
+    return "background save failed: " + ret.error ();
+  return ret;
+}
+
+optional<bool>
+poll_background_save (int pid)
+{
+  int status = 0;
+  auto ret = ::waitpid (pid, &status, WNOHANG);
+  if (ret == 0)
+    return boost::none;
+  if (ret < 0)
+    return false;
+  return WIFEXITED (status) && WEXITSTATUS (status) == 0;
+}
+
+void
+stop_background_save (int pid)
+{
+  ::kill (pid, SIGKILL);
+  int status = 0;
+  while (::waitpid (pid, &status, 0) < 0 && errno == EINTR)
+    ;
+}
+
+struct sliced_save::state
+{
+  state (std::string path, std::string temp_path, std::FILE *fp,
+	 compression codec)
+      : path{ std::move (path) }, temp_path{ std::move (temp_path) },
+	fp{ fp }, out{ fp, header_size }, blocks{ out, codec }
+  {
+  }
+
+  std::string path;
+  std::string temp_path;
+  std::FILE *fp;
+  output_buffer out;
+  block_writer blocks;
+}; // struct sliced_save::state
+
+sliced_save::sliced_save () noexcept {}
+
+sliced_save::~sliced_save ()
+{
+  if (state_ != nullptr)
+    {
+      std::fclose (state_->fp);
+      std::remove (state_->temp_path.c_str ());
+    }
+}
+
+bool
+sliced_save::active () const noexcept
+{
+  return state_ != nullptr;
+}
+
+result<void, std::string>
+sliced_save::start (string_view path, storage &st, compression codec)
+{
+  BOOST_ASSERT (!active ());
+
+  auto temp_path = path.to_string () + ".tmp";
+  std::remove (temp_path.c_str ());
+  auto *fp = std::fopen (temp_path.c_str (), "wb");
+  if (fp == nullptr)
+    return format_errno ("save failed: cannot open temporary file");
+
+  auto res = write_header (fp, format_magic);
+  if (!res.has_value ())
+    {
+      std::fclose (fp);
+      std::remove (temp_path.c_str ());
+      return res;
+    }
+
+  state_ = make_unique<state> (path.to_string (), std::move (temp_path),
+			      fp, codec);
+  auto *s = state_.get ();
+  st.begin_snapshot (
+      [s] (const std::string &key, const data &value,
+	   const optional<time_point> &expire_at)
+	{
+	  put_entry (s->blocks, key, value, expire_at);
+	  s->blocks.end_entry ();
+	});
+  return {};
+}
+
+bool
+sliced_save::step (storage &st, steady_clock::time_point deadline)
+{
+  BOOST_ASSERT (active ());
+  return st.snapshot_step (deadline);
+}
+
+result<void, std::string>
+sliced_save::finish ()
+{
+  BOOST_ASSERT (active ());
+
+  auto s = std::move (state_);
+  s->blocks.finish ();
+  if (!s->out.flush ())
+    {
+      auto msg = format_errno ("save failed: cannot write body");
+      std::fclose (s->fp);
+      std::remove (s->temp_path.c_str ());
+      return msg;
+    }
+  return commit_file (s->fp, s->temp_path, s->path);
+}
+
+struct streamed_snapshot::state
+{
+  // Called after every entry, so that chunks only hold whole ones.
+  void
+  end_entry ()
+  {
+    if (buf.size () >= index_block_bytes)
+      flush ();
+  }
+
+  void
+  flush ()
+  {
+    if (buf.empty ())
+      return;
+    auto chunk = std::move (buf);
+    buf = std::string{};
+    sink (std::move (chunk));
+  }
+
+  // The output interface of put_entry.
+  void
+  append (string_view bytes)
+  {
+    buf.append (bytes.data (), bytes.size ());
+  }
+
+  void
+  push_back (char c)
+  {
+    buf.push_back (c);
+  }
+
+  chunk_sink sink;
+  std::string buf;
+}; // struct streamed_snapshot::state
+
+streamed_snapshot::streamed_snapshot () noexcept {}
+
+streamed_snapshot::~streamed_snapshot () {}
+
+bool
+streamed_snapshot::active () const noexcept
+{
+  return state_ != nullptr;
+}
+
+void
+streamed_snapshot::start (storage &st, chunk_sink sink)
+{
+  BOOST_ASSERT (!active ());
+
+  state_ = make_unique<state> ();
+  state_->sink = std::move (sink);
+  auto *s = state_.get ();
+  st.begin_snapshot (
+      [s] (const std::string &key, const data &value,
+	   const optional<time_point> &expire_at)
+	{
+	  put_entry (*s, key, value, expire_at);
+	  s->end_entry ();
+	});
+}
+
+bool
+streamed_snapshot::step (storage &st, steady_clock::time_point deadline)
+{
+  BOOST_ASSERT (active ());
+  if (!st.snapshot_step (deadline))
+    return false;
+
+  auto s = std::move (state_);
+  s->flush ();
+  return true;
+}
+
+result<void, std::string>
+load_snapshot_chunk (string_view chunk, storage &out)
+{
+  auto now = clock_type::now ();
+  input_buffer in{ chunk };
+  snapshot::entry e;
+  while (!in.empty ())
+    {
+      auto res = read_entry (in, e, false);
+      if (!res.has_value ())
+	return res;
+      if (e.expire_at.has_value () && e.expire_at.value () <= now)
+	continue;
+      auto it = out.insert (std::move (e.key), std::move (e.value));
+      if (e.expire_at.has_value ())
+	out.expire_at (it, e.expire_at.value ());
+    }
+  return {};
+}
+
+// The payload of DUMP is the tag and encoding of the value, as in an
+// entry, then the format version and the CRC16 of all that, little-endian.
+std::string
+dump_value (const data &value)
+{
+  struct string_output
+  {
+    void
+    append (string_view bytes)
+    {
+      out.append (bytes.data (), bytes.size ());
+    }
+
+    void
+    push_back (char c)
+    {
+      out.push_back (c);
+    }
+
+    std::string out;
+  } payload;
+
+  payload.push_back (static_cast<char> (value.index ()));
+  put_value (payload, value);
+  payload.push_back (format_version);
+  auto crc = crc16 (payload.out);
+  payload.push_back (static_cast<char> (crc & 0xff));
+  payload.push_back (static_cast<char> (crc >> 8));
+  return std::move (payload.out);
+}
+
+result<data, std::string>
+restore_value (string_view payload)
+{
+  if (payload.size () < 4)
+    return std::string{ "payload is too short" };
+  auto body = payload.substr (0, payload.size () - 2);
+  auto crc = static_cast<std::uint16_t> (
+      static_cast<unsigned char> (payload[payload.size () - 2])
+      | static_cast<unsigned char> (payload[payload.size () - 1]) << 8);
+  if (body.back () != format_version || crc16 (body) != crc)
+    return std::string{ "DUMP payload version or checksum are wrong" };
+
+  input_buffer in{ body.substr (0, body.size () - 1) };
+  unsigned char tag;
+  data value;
+  if (!in.get_byte (tag) || tag >= flag_expire)
+    return std::string{ "Bad data format" };
+  auto res = read_value (tag, in, value);
+  if (!res.has_value () || !in.empty ())
+    return std::string{ "Bad data format" };
+  return value;
 }
 
 } // namespace db
@@ -10,8 +10,156 @@ namespace mini_redis
 namespace db
 {
 
-result<void, std::string> save_to (string_view path, snapshot snap);
-result<void, std::string> load_from (string_view path, snapshot &out);
+enum compression
+{
+  compression_none,
+  compression_lz,
+};
+
+// A read-only memory mapping of a whole file.
+class mapped_file
+{
+public:
+  mapped_file () noexcept;
+  ~mapped_file ();
+
+  mapped_file (const mapped_file &) = delete;
+  mapped_file &operator= (const mapped_file &) = delete;
+
+  result<void, std::string> open (const std::string &path);
+  string_view bytes () const noexcept;
+
+private:
+  void *data_;
+  std::size_t size_;
+}; // class mapped_file
+
+// Writes a snapshot of the storage to fp, at its current position.
+result<void, std::string> write_snapshot (std::FILE *fp, const storage &st,
+					  compression codec);
+// Streams the storage to path through a fixed-size buffer, so that saving
+// does not copy the dataset. With compression every block of about 1 MiB
+// is compressed on its own.
+result<void, std::string> save_to (string_view path, const storage &st,
+				   compression codec = compression_none);
+// Loads the snapshot at path into out, which should be empty. Snapshots
+// written by save_to are decoded on several threads.
+result<void, std::string> load_from (string_view path, storage &out);
+bool file_exists (string_view path);
+// Loads the snapshot held in raw into out. Keys past their expiration time
+// are kept when keep_expired is set.
+result<void, std::string> load_snapshot (string_view raw, storage &out,
+					 bool keep_expired = false);
+
+// Incremental saves. The snapshot at path is extended by its delta file,
+// path + ".delta", a chain of segments that each hold the keys changed
+// since the save before, with a tombstone for those deleted.
+
+// Appends the keys of st marked as changed to the delta file of path,
+// dropping first whatever follows its first valid_size bytes, and fsyncs
+// it. Returns the new length of the file.
+result<std::uint64_t, std::string>
+save_delta (string_view path, std::uint64_t valid_size, const storage &st,
+	    compression codec = compression_none);
+// Applies the delta file of path, if any, to out, which holds the snapshot.
+// A segment cut short by a crash ends the chain. Returns the length of the
+// segments applied.
+result<std::uint64_t, std::string> load_deltas (string_view path,
+						storage &out);
+// Removes the delta file of path, so that the snapshot stands alone.
+result<void, std::string> remove_deltas (string_view path);
+// Merges the delta file of path into the snapshot, then removes it. The
+// snapshot is streamed block by block, and only the latest version of the
+// keys in the deltas is held in memory.
+result<void, std::string> compact (string_view path,
+				   compression codec = compression_none);
+
+// Forks a child process that runs job, which sees the memory of the server
+// as it is at the time of the call, while the parent keeps running. Returns
+// the child pid.
+result<int, std::string>
+run_in_background (const std::function<result<void, std::string> ()> &job);
+// Forks a child process that saves the storage to path, as it is at the
+// time of the call, while the parent keeps running. Returns the child pid.
+result<int, std::string>
+save_in_background (string_view path, const storage &st,
+		    compression codec = compression_none);
+// Returns boost::none while the child is running, then whether the save,
+// or the job, succeeded. The child is reaped once it has exited.
+optional<bool> poll_background_save (int pid);
+// Kills the child and reaps it. Its temporary file is left behind, to be
+// replaced by the next save.
+void stop_background_save (int pid);
+
+// A save that runs in slices on the thread serving requests, between them,
+// instead of in a forked child, so that it takes no extra memory for pages
+// copied on write. The dataset is saved as it is when the save starts; see
+// storage::begin_snapshot.
+class sliced_save
+{
+public:
+  sliced_save () noexcept;
+  ~sliced_save ();
+
+  sliced_save (const sliced_save &) = delete;
+  sliced_save &operator= (const sliced_save &) = delete;
+
+  bool active () const noexcept;
+  // Opens a temporary file next to path and begins a snapshot of st.
+  result<void, std::string> start (string_view path, storage &st,
+				   compression codec = compression_none);
+  // Writes keys until the deadline. Returns true once all are written.
+  bool step (storage &st, steady_clock::time_point deadline);
+  // Once step has returned true, completes the file and moves it over
+  // path.
+  result<void, std::string> finish ();
+
+private:
+  struct state;
+  std::unique_ptr<state> state_;
+}; // class sliced_save
+
+// Diskless full syncs: a snapshot is streamed to replicas as a series of
+// chunks, each holding whole entries in the format of the snapshot blocks,
+// without header, compression or block index, so that a replica can load
+// every chunk as soon as it arrives.
+
+// Serializes the storage in slices, like sliced_save, into chunks of
+// about 1 MiB passed to a sink instead of a file.
+class streamed_snapshot
+{
+public:
+  typedef std::function<void (std::string chunk)> chunk_sink;
+
+  streamed_snapshot () noexcept;
+  ~streamed_snapshot ();
+
+  streamed_snapshot (const streamed_snapshot &) = delete;
+  streamed_snapshot &operator= (const streamed_snapshot &) = delete;
+
+  bool active () const noexcept;
+  // Begins a snapshot of st. The sink may also be called while requests
+  // run, when they touch keys not serialized yet.
+  void start (storage &st, chunk_sink sink);
+  // Serializes keys until the deadline. Returns true once all are, and
+  // the last chunk was passed to the sink.
+  bool step (storage &st, steady_clock::time_point deadline);
+
+private:
+  struct state;
+  std::unique_ptr<state> state_;
+}; // class streamed_snapshot
+
+// Loads a chunk of a streamed snapshot into out. Keys past their
+// expiration time are dropped.
+result<void, std::string> load_snapshot_chunk (string_view chunk,
+					       storage &out);
+
+// The serialized form of a single value, used by DUMP, RESTORE and
+// MIGRATE. It carries the format version and a checksum, which
+// restore_value checks.
+std::string dump_value (const data &value);
+result<data, std::string> restore_value (string_view payload);
 
 } // namespace db
 } // namespace mini_redis
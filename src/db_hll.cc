@@ -0,0 +1,407 @@
+#include "db_hll.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace mini_redis
+{
+namespace db
+{
+
+namespace
+{
+
+// MurmurHash64A, the hash used by the Redis HyperLogLog implementation.
+std::uint64_t
+murmur64a (const void *key, std::size_t len, std::uint64_t seed)
+{
+  const std::uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  std::uint64_t h = seed ^ (len * m);
+
+  auto data = static_cast<const unsigned char *> (key);
+  auto end = data + (len - len % 8);
+  for (; data != end; data += 8)
+    {
+      std::uint64_t k;
+      std::memcpy (&k, data, 8);
+
+      k *= m;
+      k ^= k >> r;
+      k *= m;
+
+      h ^= k;
+      h *= m;
+    }
+
+  switch (len & 7)
+    {
+    case 7:
+      h ^= static_cast<std::uint64_t> (data[6]) << 48;
+      BOOST_FALLTHROUGH;
+    case 6:
+      h ^= static_cast<std::uint64_t> (data[5]) << 40;
+      BOOST_FALLTHROUGH;
+    case 5:
+      h ^= static_cast<std::uint64_t> (data[4]) << 32;
+      BOOST_FALLTHROUGH;
+    case 4:
+      h ^= static_cast<std::uint64_t> (data[3]) << 24;
+      BOOST_FALLTHROUGH;
+    case 3:
+      h ^= static_cast<std::uint64_t> (data[2]) << 16;
+      BOOST_FALLTHROUGH;
+    case 2:
+      h ^= static_cast<std::uint64_t> (data[1]) << 8;
+      BOOST_FALLTHROUGH;
+    case 1:
+      h ^= static_cast<std::uint64_t> (data[0]);
+      h *= m;
+    }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+std::uint32_t
+sparse_index (std::uint32_t e)
+{
+  return e >> 8;
+}
+
+std::uint8_t
+sparse_value (std::uint32_t e)
+{
+  return static_cast<std::uint8_t> (e & 0xff);
+}
+
+std::uint32_t
+make_sparse (std::size_t index, std::uint8_t value)
+{
+  return static_cast<std::uint32_t> (index << 8 | value);
+}
+
+// dst[i] = max (dst[i], src[i])
+void
+max_merge (std::uint8_t *dst, const std::uint8_t *src, std::size_t n)
+{
+  std::size_t i = 0;
+#if defined(__SSE2__)
+  for (; i + 64 <= n; i += 64)
+    {
+      auto d = reinterpret_cast<__m128i *> (dst + i);
+      auto s = reinterpret_cast<const __m128i *> (src + i);
+      auto a0 = _mm_max_epu8 (_mm_loadu_si128 (d), _mm_loadu_si128 (s));
+      auto a1
+	  = _mm_max_epu8 (_mm_loadu_si128 (d + 1), _mm_loadu_si128 (s + 1));
+      auto a2
+	  = _mm_max_epu8 (_mm_loadu_si128 (d + 2), _mm_loadu_si128 (s + 2));
+      auto a3
+	  = _mm_max_epu8 (_mm_loadu_si128 (d + 3), _mm_loadu_si128 (s + 3));
+      _mm_storeu_si128 (d, a0);
+      _mm_storeu_si128 (d + 1, a1);
+      _mm_storeu_si128 (d + 2, a2);
+      _mm_storeu_si128 (d + 3, a3);
+    }
+#endif
+  for (; i < n; i++)
+    if (src[i] > dst[i])
+      dst[i] = src[i];
+}
+
+int
+popcount16 (unsigned int x)
+{
+  x = x - ((x >> 1) & 0x5555);
+  x = (x & 0x3333) + ((x >> 2) & 0x3333);
+  x = (x + (x >> 4)) & 0x0f0f;
+  return static_cast<int> ((x + (x >> 8)) & 0x1f);
+}
+
+// Computes sum (2^-regs[i]) and the number of zero registers.
+void
+harmonic_sum (const std::uint8_t *regs, std::size_t n, double &sum,
+	      std::size_t &zeros)
+{
+  sum = 0;
+  zeros = 0;
+
+  std::size_t i = 0;
+#if defined(__SSE2__)
+  // 2^-v is built directly as the float with biased exponent (127 - v).
+  const auto zero = _mm_setzero_si128 ();
+  const auto bias = _mm_set1_epi32 (127);
+  while (i + 16 <= n)
+    {
+      // Flush the float accumulator every 1024 registers to keep precision.
+      auto acc = _mm_setzero_ps ();
+      auto block_end = std::min (n - n % 16, i + 1024);
+      for (; i < block_end; i += 16)
+	{
+	  auto v = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (regs + i));
+	  auto mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, zero));
+	  zeros += popcount16 (static_cast<unsigned int> (mask));
+
+	  auto lo = _mm_unpacklo_epi8 (v, zero);
+	  auto hi = _mm_unpackhi_epi8 (v, zero);
+	  __m128i w[4] = {
+	    _mm_unpacklo_epi16 (lo, zero), _mm_unpackhi_epi16 (lo, zero),
+	    _mm_unpacklo_epi16 (hi, zero), _mm_unpackhi_epi16 (hi, zero)
+	  };
+	  for (auto &x : w)
+	    {
+	      auto bits = _mm_slli_epi32 (_mm_sub_epi32 (bias, x), 23);
+	      acc = _mm_add_ps (acc, _mm_castsi128_ps (bits));
+	    }
+	}
+
+      float lanes[4];
+      _mm_storeu_ps (lanes, acc);
+      sum += static_cast<double> (lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+    }
+#endif
+  for (; i < n; i++)
+    {
+      if (regs[i] == 0)
+	zeros++;
+      sum += std::ldexp (1.0, -static_cast<int> (regs[i]));
+    }
+}
+
+} // namespace
+
+constexpr int hyperloglog::precision;
+constexpr std::size_t hyperloglog::registers;
+constexpr std::size_t hyperloglog::sparse_max_entries;
+
+hyperloglog::hyperloglog () noexcept {}
+
+bool
+hyperloglog::is_sparse () const noexcept
+{
+  return dense_.empty ();
+}
+
+bool
+hyperloglog::add (string_view element)
+{
+  auto hash = murmur64a (element.data (), element.size (), 0xadc83b19ULL);
+  auto index = static_cast<std::size_t> (hash & (registers - 1));
+
+  // The position of the first set bit in the remaining bits; the sentinel
+  // bit bounds the count to 64 - precision + 1.
+  hash >>= precision;
+  hash |= std::uint64_t{ 1 } << (64 - precision);
+  std::uint8_t count = 1;
+  while ((hash & 1) == 0)
+    {
+      count++;
+      hash >>= 1;
+    }
+
+  return set_register (index, count);
+}
+
+std::uint64_t
+hyperloglog::count () const
+{
+  if (cached_.has_value ())
+    return cached_.value ();
+
+  std::uint64_t n;
+  if (is_sparse ())
+    {
+      std::array<std::uint8_t, registers> regs{};
+      merge_dense (regs.data (), *this);
+      n = estimate (regs.data ());
+    }
+  else
+    n = estimate (dense_.data ());
+
+  cached_ = n;
+  return n;
+}
+
+void
+hyperloglog::merge (const hyperloglog &other)
+{
+  if (this == &other)
+    return;
+
+  if (!other.is_sparse () && is_sparse ())
+    promote ();
+
+  if (!is_sparse ())
+    {
+      merge_dense (dense_.data (), other);
+      cached_ = boost::none;
+      return;
+    }
+
+  for (auto e : other.sparse_)
+    set_register (sparse_index (e), sparse_value (e));
+}
+
+std::string
+hyperloglog::dump () const
+{
+  std::string out;
+  if (is_sparse ())
+    {
+      out.reserve (1 + sparse_.size () * 4);
+      out.push_back ('S');
+      for (auto e : sparse_)
+	for (int shift = 0; shift < 32; shift += 8)
+	  out.push_back (static_cast<char> ((e >> shift) & 0xff));
+    }
+  else
+    {
+      out.reserve (1 + registers);
+      out.push_back ('D');
+      out.append (reinterpret_cast<const char *> (dense_.data ()),
+		  dense_.size ());
+    }
+  return out;
+}
+
+bool
+hyperloglog::restore (string_view raw, hyperloglog &out)
+{
+  out = hyperloglog{};
+  if (raw.empty ())
+    return false;
+
+  auto max_value = static_cast<std::uint8_t> (64 - precision + 1);
+  auto body = raw.substr (1);
+  switch (raw[0])
+    {
+    case 'S':
+      {
+	if (body.size () % 4 != 0 || body.size () / 4 > sparse_max_entries)
+	  return false;
+
+	out.sparse_.reserve (body.size () / 4);
+	for (std::size_t i = 0; i < body.size (); i += 4)
+	  {
+	    std::uint32_t e = 0;
+	    for (int j = 0; j < 4; j++)
+	      e |= static_cast<std::uint32_t> (
+		       static_cast<unsigned char> (body[i + j]))
+		   << (j * 8);
+
+	    auto value = sparse_value (e);
+	    if (sparse_index (e) >= registers || value == 0 || value > max_value
+		|| (!out.sparse_.empty ()
+		    && sparse_index (out.sparse_.back ()) >= sparse_index (e)))
+	      return false;
+	    out.sparse_.push_back (e);
+	  }
+	return true;
+      }
+
+    case 'D':
+      {
+	if (body.size () != registers)
+	  return false;
+
+	out.dense_.assign (body.begin (), body.end ());
+	for (auto v : out.dense_)
+	  if (v > max_value)
+	    return false;
+	return true;
+      }
+
+    default:
+      return false;
+    }
+}
+
+void
+hyperloglog::merge_dense (std::uint8_t *regs, const hyperloglog &hll)
+{
+  if (!hll.is_sparse ())
+    {
+      max_merge (regs, hll.dense_.data (), registers);
+      return;
+    }
+
+  for (auto e : hll.sparse_)
+    {
+      auto &r = regs[sparse_index (e)];
+      if (sparse_value (e) > r)
+	r = sparse_value (e);
+    }
+}
+
+std::uint64_t
+hyperloglog::estimate (const std::uint8_t *regs)
+{
+  double sum;
+  std::size_t zeros;
+  harmonic_sum (regs, registers, sum, zeros);
+
+  const double m = static_cast<double> (registers);
+  const double alpha = 0.7213 / (1 + 1.079 / m);
+  double e = alpha * m * m / sum;
+
+  // Linear counting is more accurate while many registers are still empty.
+  if (zeros != 0 && e <= 5 * m / 2)
+    e = m * std::log (m / static_cast<double> (zeros));
+
+  return static_cast<std::uint64_t> (std::llround (e));
+}
+
+bool
+hyperloglog::set_register (std::size_t index, std::uint8_t value)
+{
+  if (!is_sparse ())
+    {
+      auto &r = dense_[index];
+      if (value <= r)
+	return false;
+      r = value;
+      cached_ = boost::none;
+      return true;
+    }
+
+  auto it = std::lower_bound (sparse_.begin (), sparse_.end (),
+			      make_sparse (index, 0));
+  if (it != sparse_.end () && sparse_index (*it) == index)
+    {
+      if (value <= sparse_value (*it))
+	return false;
+      *it = make_sparse (index, value);
+      cached_ = boost::none;
+      return true;
+    }
+
+  cached_ = boost::none;
+  if (sparse_.size () >= sparse_max_entries)
+    {
+      promote ();
+      dense_[index] = value;
+      return true;
+    }
+
+  sparse_.insert (it, make_sparse (index, value));
+  return true;
+}
+
+void
+hyperloglog::promote ()
+{
+  BOOST_ASSERT (is_sparse ());
+
+  dense_.assign (registers, 0);
+  for (auto e : sparse_)
+    dense_[sparse_index (e)] = sparse_value (e);
+
+  sparse_.clear ();
+  sparse_.shrink_to_fit ();
+}
+
+} // namespace db
+} // namespace mini_redis
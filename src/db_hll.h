@@ -0,0 +1,56 @@
+#ifndef DB_HLL_H
+#define DB_HLL_H
+
+#include "pch.h"
+
+namespace mini_redis
+{
+namespace db
+{
+
+// A HyperLogLog cardinality estimator with 2^14 registers.
+//
+// A new estimator starts with the sparse encoding: a sorted vector of the
+// non-zero registers, each packed as (index << 8 | value). Once it grows
+// past sparse_max_entries it is promoted to the dense encoding, one byte per
+// register, so that merges and the estimator can work on whole vectors of
+// registers at a time.
+class hyperloglog
+{
+public:
+  static constexpr int precision = 14;
+  static constexpr std::size_t registers = std::size_t{ 1 } << precision;
+  static constexpr std::size_t sparse_max_entries = 768;
+
+public:
+  hyperloglog () noexcept;
+
+  bool is_sparse () const noexcept;
+
+  // Returns true if a register was changed.
+  bool add (string_view element);
+  std::uint64_t count () const;
+  void merge (const hyperloglog &other);
+
+  // Raw form used by snapshots.
+  std::string dump () const;
+  static bool restore (string_view raw, hyperloglog &out);
+
+  // Max-merges the registers of hll into a dense register array.
+  static void merge_dense (std::uint8_t *regs, const hyperloglog &hll);
+  static std::uint64_t estimate (const std::uint8_t *regs);
+
+private:
+  bool set_register (std::size_t index, std::uint8_t value);
+  void promote ();
+
+private:
+  std::vector<std::uint32_t> sparse_;
+  std::vector<std::uint8_t> dense_;
+  mutable optional<std::uint64_t> cached_;
+}; // class hyperloglog
+
+} // namespace db
+} // namespace mini_redis
+
+#endif // DB_HLL_H
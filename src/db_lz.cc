@@ -0,0 +1,212 @@
+#include "db_lz.h"
+
+namespace mini_redis
+{
+namespace db
+{
+
+namespace
+{
+
+const std::size_t min_match = 4;
+const std::size_t max_offset = 65535;
+const int hash_bits = 14;
+
+std::uint32_t
+load32 (const char *p)
+{
+  std::uint32_t v;
+  std::memcpy (&v, p, sizeof (v));
+  return v;
+}
+
+std::uint64_t
+load64 (const char *p)
+{
+  std::uint64_t v;
+  std::memcpy (&v, p, sizeof (v));
+  return v;
+}
+
+// Number of equal leading bytes of a and b, which differ.
+std::size_t
+common_bytes (std::uint64_t a, std::uint64_t b)
+{
+  auto x = a ^ b;
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return static_cast<std::size_t> (__builtin_ctzll (x)) / 8;
+#else
+  std::size_t n = 0;
+  while (((a >> (n * 8)) & 0xff) == ((b >> (n * 8)) & 0xff))
+    n++;
+  return n;
+#endif
+}
+
+// Length of the match between the bytes at cand and at i, which share
+// their first min_match bytes, a word at a time while 8 bytes remain.
+std::size_t
+match_length (const char *base, std::size_t cand, std::size_t i,
+	      std::size_t n)
+{
+  std::size_t len = min_match;
+  while (i + len + 8 <= n)
+    {
+      auto a = load64 (base + cand + len);
+      auto b = load64 (base + i + len);
+      if (a != b)
+	return len + common_bytes (a, b);
+      len += 8;
+    }
+  while (i + len < n && base[cand + len] == base[i + len])
+    len++;
+  return len;
+}
+
+std::uint32_t
+hash32 (std::uint32_t v)
+{
+  return (v * 2654435761u) >> (32 - hash_bits);
+}
+
+void
+put_length (std::string &out, std::size_t n)
+{
+  for (; n >= 255; n -= 255)
+    out.push_back (static_cast<char> (255));
+  out.push_back (static_cast<char> (n));
+}
+
+void
+put_sequence (std::string &out, const char *lit, std::size_t nlit,
+	      std::size_t offset, std::size_t nmatch)
+{
+  auto lit_nibble = std::min<std::size_t> (nlit, 15);
+  auto match_nibble
+      = nmatch == 0 ? 0 : std::min<std::size_t> (nmatch - min_match, 15);
+  out.push_back (static_cast<char> ((lit_nibble << 4) | match_nibble));
+  if (lit_nibble == 15)
+    put_length (out, nlit - 15);
+  out.append (lit, nlit);
+
+  if (nmatch == 0)
+    return;
+  out.push_back (static_cast<char> (offset & 0xff));
+  out.push_back (static_cast<char> (offset >> 8));
+  if (match_nibble == 15)
+    put_length (out, nmatch - min_match - 15);
+}
+
+bool
+get_length (const unsigned char *&ip, const unsigned char *end,
+	    std::size_t &n)
+{
+  while (true)
+    {
+      if (ip == end)
+	return false;
+      auto b = *ip++;
+      n += b;
+      if (b != 255)
+	return true;
+    }
+}
+
+} // namespace
+
+void
+lz_compress (string_view src, std::string &out)
+{
+  const char *base = src.data ();
+  const std::size_t n = src.size ();
+
+  // Positions of recent 4-byte sequences by hash. Stale or colliding
+  // entries are harmless: every candidate is verified.
+  std::vector<std::uint32_t> table (std::size_t{ 1 } << hash_bits, 0);
+  out.reserve (out.size () + n + n / 255 + 16);
+
+  std::size_t anchor = 0;
+  std::size_t i = 0;
+  // Matches never reach into the last bytes, which keeps the reads in
+  // bounds without checks in the inner loop.
+  const std::size_t limit = n > 8 ? n - 8 : 0;
+  while (i < limit)
+    {
+      auto v = load32 (base + i);
+      auto h = hash32 (v);
+      std::size_t cand = table[h];
+      table[h] = static_cast<std::uint32_t> (i);
+
+      if (cand >= i || i - cand > max_offset || load32 (base + cand) != v)
+	{
+	  // Step faster through data that does not compress.
+	  i += 1 + ((i - anchor) >> 6);
+	  continue;
+	}
+
+      auto len = match_length (base, cand, i, n);
+      put_sequence (out, base + anchor, i - anchor, i - cand, len);
+      i += len;
+      anchor = i;
+    }
+
+  put_sequence (out, base + anchor, n - anchor, 0, 0);
+}
+
+bool
+lz_decompress (string_view src, char *dst, std::size_t size)
+{
+  auto ip = reinterpret_cast<const unsigned char *> (src.data ());
+  auto end = ip + src.size ();
+  std::size_t op = 0;
+
+  while (ip != end)
+    {
+      auto token = *ip++;
+
+      std::size_t nlit = token >> 4;
+      if (nlit == 15 && !get_length (ip, end, nlit))
+	return false;
+      if (nlit > static_cast<std::size_t> (end - ip) || nlit > size - op)
+	return false;
+      // Short literals and matches are copied with a fixed-size copy, which
+      // may write past them into bytes that are produced later anyway.
+      if (nlit <= 16 && end - ip >= 16 && size - op >= 16)
+	std::memcpy (dst + op, ip, 16);
+      else
+	std::memcpy (dst + op, ip, nlit);
+      ip += nlit;
+      op += nlit;
+
+      if (ip == end)
+	break;
+
+      if (end - ip < 2)
+	return false;
+      std::size_t offset = ip[0] | (static_cast<std::size_t> (ip[1]) << 8);
+      ip += 2;
+      std::size_t nmatch = token & 15;
+      if (nmatch == 15 && !get_length (ip, end, nmatch))
+	return false;
+      nmatch += min_match;
+      if (offset == 0 || offset > op || nmatch > size - op)
+	return false;
+
+      // The source and the destination overlap when offset < nmatch, and
+      // the copy must then see the bytes it has just written.
+      const char *from = dst + op - offset;
+      if (offset >= 16 && nmatch <= 16 && size - op >= 16)
+	std::memcpy (dst + op, from, 16);
+      else if (offset >= nmatch)
+	std::memcpy (dst + op, from, nmatch);
+      else
+	for (std::size_t k = 0; k < nmatch; k++)
+	  dst[op + k] = from[k];
+      op += nmatch;
+    }
+
+  return op == size;
+}
+
+} // namespace db
+} // namespace mini_redis
@@ -0,0 +1,28 @@
+#ifndef DB_LZ_H
+#define DB_LZ_H
+
+#include "pch.h"
+
+namespace mini_redis
+{
+namespace db
+{
+
+// A small LZ77 codec in the spirit of LZ4, used to compress snapshot
+// blocks. The output is a sequence of (literals, match) pairs: a token byte
+// holding the literal length in its high nibble and the match length minus
+// 4 in its low nibble, either of them extended with 255-valued bytes when
+// it reaches 15, then the literals and a 2-byte little-endian match offset.
+// The last pair has literals only.
+
+// Appends the compressed form of src to out.
+void lz_compress (string_view src, std::string &out);
+
+// Decompresses src into [dst, dst + size). Fails unless src is well formed
+// and expands to exactly size bytes.
+bool lz_decompress (string_view src, char *dst, std::size_t size);
+
+} // namespace db
+} // namespace mini_redis
+
+#endif // DB_LZ_H
@@ -0,0 +1,375 @@
+#ifndef DB_RADIX_H
+#define DB_RADIX_H
+
+#include "pch.h"
+
+namespace mini_redis
+{
+namespace db
+{
+
+// A radix tree over byte-string keys with path compression.
+//
+// Every node stores the bytes of its incoming edge, so a chain of single-
+// child nodes collapses into one node. Children are kept sorted by their
+// first byte, which keeps the keys in lexicographic order: besides exact
+// lookups the tree answers floor / ceiling queries, which is what ordered
+// scans over big-endian encoded keys need.
+template <class T> class radix_tree
+{
+public:
+  struct item
+  {
+    std::string key;
+    T *value;
+  };
+
+public:
+  radix_tree () : root_{ new node{} }, size_{ 0 } {}
+
+  radix_tree (const radix_tree &) = delete;
+  radix_tree &operator= (const radix_tree &) = delete;
+
+  radix_tree (radix_tree &&other) noexcept
+      : root_{ std::move (other.root_) }, size_{ other.size_ }
+  {
+    other.root_.reset (new node{});
+    other.size_ = 0;
+  }
+
+  radix_tree &
+  operator= (radix_tree &&other) noexcept
+  {
+    root_.swap (other.root_);
+    std::swap (size_, other.size_);
+    return *this;
+  }
+
+  std::size_t
+  size () const noexcept
+  {
+    return size_;
+  }
+
+  bool
+  empty () const noexcept
+  {
+    return size_ == 0;
+  }
+
+  T *
+  find (string_view key) const
+  {
+    const node *x = root_.get ();
+    std::size_t depth = 0;
+    while (true)
+      {
+	auto edge = string_view{ x->edge };
+	if (key.substr (depth, edge.size ()) != edge)
+	  return nullptr;
+	depth += edge.size ();
+	if (depth == key.size ())
+	  return x->value ? x->value.get () : nullptr;
+
+	auto child = x->child (static_cast<unsigned char> (key[depth]));
+	if (child == nullptr)
+	  return nullptr;
+	x = child;
+      }
+  }
+
+  // Returns false, leaving the tree unchanged, if the key already exists.
+  bool
+  insert (string_view key, T value)
+  {
+    node *x = root_.get ();
+    std::size_t depth = 0;
+    while (true)
+      {
+	auto edge = string_view{ x->edge };
+	auto rest = key.substr (depth);
+	std::size_t common = 0;
+	while (common < edge.size () && common < rest.size ()
+	       && edge[common] == rest[common])
+	  common++;
+
+	if (common < edge.size ())
+	  {
+	    // Split x so that its edge ends where the new key diverges.
+	    std::unique_ptr<node> tail{ new node{} };
+	    tail->edge = x->edge.substr (common);
+	    tail->value = std::move (x->value);
+	    tail->labels.swap (x->labels);
+	    tail->children.swap (x->children);
+
+	    x->edge.resize (common);
+	    x->labels.push_back (static_cast<unsigned char> (tail->edge[0]));
+	    x->children.push_back (std::move (tail));
+	  }
+
+	depth += common;
+	if (depth == key.size ())
+	  {
+	    if (x->value)
+	      return false;
+	    x->value.reset (new T (std::move (value)));
+	    size_++;
+	    return true;
+	  }
+
+	auto label = static_cast<unsigned char> (key[depth]);
+	auto child = x->child (label);
+	if (child == nullptr)
+	  {
+	    std::unique_ptr<node> leaf{ new node{} };
+	    leaf->edge.assign (key.data () + depth, key.size () - depth);
+	    leaf->value.reset (new T (std::move (value)));
+	    x->add_child (label, std::move (leaf));
+	    size_++;
+	    return true;
+	  }
+	x = child;
+      }
+  }
+
+  bool
+  erase (string_view key)
+  {
+    if (!erase_at (root_.get (), key, 0))
+      return false;
+    size_--;
+    return true;
+  }
+
+  void
+  clear ()
+  {
+    root_.reset (new node{});
+    size_ = 0;
+  }
+
+  // The greatest key <= key / the smallest key >= key.
+  optional<item>
+  floor (string_view key) const
+  {
+    std::string path;
+    auto x = floor_at (root_.get (), key, 0, path);
+    if (x == nullptr)
+      return boost::none;
+    return item{ std::move (path), x->value.get () };
+  }
+
+  optional<item>
+  ceil (string_view key) const
+  {
+    std::string path;
+    auto x = ceil_at (root_.get (), key, 0, path);
+    if (x == nullptr)
+      return boost::none;
+    return item{ std::move (path), x->value.get () };
+  }
+
+  optional<item>
+  first () const
+  {
+    if (empty ())
+      return boost::none;
+    std::string path;
+    auto x = min_at (root_.get (), path);
+    return item{ std::move (path), x->value.get () };
+  }
+
+  optional<item>
+  last () const
+  {
+    if (empty ())
+      return boost::none;
+    std::string path;
+    auto x = max_at (root_.get (), path);
+    return item{ std::move (path), x->value.get () };
+  }
+
+private:
+  struct node
+  {
+    std::string edge;
+    std::unique_ptr<T> value;
+    std::vector<unsigned char> labels;
+    std::vector<std::unique_ptr<node>> children;
+
+    node *
+    child (unsigned char label) const
+    {
+      auto it = std::lower_bound (labels.begin (), labels.end (), label);
+      if (it == labels.end () || *it != label)
+	return nullptr;
+      return children[static_cast<std::size_t> (it - labels.begin ())]
+	  .get ();
+    }
+
+    void
+    add_child (unsigned char label, std::unique_ptr<node> x)
+    {
+      auto it = std::lower_bound (labels.begin (), labels.end (), label);
+      auto i = it - labels.begin ();
+      labels.insert (it, label);
+      children.insert (children.begin () + i, std::move (x));
+    }
+  };
+
+  static bool
+  erase_at (node *x, string_view key, std::size_t depth)
+  {
+    auto edge = string_view{ x->edge };
+    if (key.substr (depth, edge.size ()) != edge)
+      return false;
+    depth += edge.size ();
+    if (depth == key.size ())
+      {
+	if (!x->value)
+	  return false;
+	x->value.reset ();
+	return true;
+      }
+
+    auto it = std::lower_bound (x->labels.begin (), x->labels.end (),
+				static_cast<unsigned char> (key[depth]));
+    if (it == x->labels.end ()
+	|| *it != static_cast<unsigned char> (key[depth]))
+      return false;
+    auto i = static_cast<std::size_t> (it - x->labels.begin ());
+    auto child = x->children[i].get ();
+    if (!erase_at (child, key, depth))
+      return false;
+
+    // Drop empty children and merge pass-through ones into their child.
+    if (!child->value && child->children.empty ())
+      {
+	x->labels.erase (it);
+	x->children.erase (x->children.begin () + i);
+      }
+    else if (!child->value && child->children.size () == 1)
+      {
+	auto grandchild = std::move (child->children[0]);
+	grandchild->edge.insert (0, child->edge);
+	x->children[i] = std::move (grandchild);
+      }
+    return true;
+  }
+
+  static const node *
+  min_at (const node *x, std::string &path)
+  {
+    path += x->edge;
+    while (!x->value)
+      {
+	x = x->children.front ().get ();
+	path += x->edge;
+      }
+    return x;
+  }
+
+  static const node *
+  max_at (const node *x, std::string &path)
+  {
+    path += x->edge;
+    while (!x->children.empty ())
+      {
+	x = x->children.back ().get ();
+	path += x->edge;
+      }
+    return x;
+  }
+
+  static const node *
+  floor_at (const node *x, string_view key, std::size_t depth,
+	    std::string &path)
+  {
+    auto edge = string_view{ x->edge };
+    auto rest = key.substr (depth, edge.size ());
+    int cmp = edge.compare (rest);
+    if (cmp < 0)
+      return max_at (x, path);
+    if (cmp != 0)
+      return nullptr;
+
+    auto saved = path.size ();
+    path += x->edge;
+    depth += edge.size ();
+    if (depth == key.size ())
+      {
+	if (x->value)
+	  return x;
+	path.resize (saved);
+	return nullptr;
+      }
+
+    auto label = static_cast<unsigned char> (key[depth]);
+    auto it = std::lower_bound (x->labels.begin (), x->labels.end (), label);
+    auto i = static_cast<std::size_t> (it - x->labels.begin ());
+    if (it != x->labels.end () && *it == label)
+      {
+	auto found = floor_at (x->children[i].get (), key, depth, path);
+	if (found != nullptr)
+	  return found;
+      }
+    if (i != 0)
+      return max_at (x->children[i - 1].get (), path);
+    if (x->value)
+      return x;
+
+    path.resize (saved);
+    return nullptr;
+  }
+
+  static const node *
+  ceil_at (const node *x, string_view key, std::size_t depth,
+	   std::string &path)
+  {
+    auto edge = string_view{ x->edge };
+    auto rest = key.substr (depth, edge.size ());
+    int cmp = edge.compare (rest);
+    if (cmp > 0)
+      return min_at (x, path);
+    if (cmp != 0)
+      return nullptr;
+
+    auto saved = path.size ();
+    path += x->edge;
+    depth += edge.size ();
+    if (depth == key.size ())
+      {
+	if (x->value)
+	  return x;
+	if (!x->children.empty ())
+	  return min_at (x->children.front ().get (), path);
+	path.resize (saved);
+	return nullptr;
+      }
+
+    auto label = static_cast<unsigned char> (key[depth]);
+    auto it = std::lower_bound (x->labels.begin (), x->labels.end (), label);
+    auto i = static_cast<std::size_t> (it - x->labels.begin ());
+    if (it != x->labels.end () && *it == label)
+      {
+	auto found = ceil_at (x->children[i].get (), key, depth, path);
+	if (found != nullptr)
+	  return found;
+	i++;
+      }
+    if (i < x->children.size ())
+      return min_at (x->children[i].get (), path);
+
+    path.resize (saved);
+    return nullptr;
+  }
+
+private:
+  std::unique_ptr<node> root_;
+  std::size_t size_;
+}; // class radix_tree
+
+} // namespace db
+} // namespace mini_redis
+
+#endif // DB_RADIX_H
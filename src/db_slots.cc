@@ -0,0 +1,57 @@
+#include "db_slots.h"
+
+namespace mini_redis
+{
+namespace db
+{
+
+namespace
+{
+
+struct crc16_table
+{
+  crc16_table ()
+  {
+    for (unsigned i = 0; i < 256; i++)
+      {
+	std::uint16_t crc = static_cast<std::uint16_t> (i << 8);
+	for (int bit = 0; bit < 8; bit++)
+	  crc = static_cast<std::uint16_t> ((crc & 0x8000) != 0
+					    ? (crc << 1) ^ 0x1021
+					    : crc << 1);
+	entries[i] = crc;
+      }
+  }
+
+  std::uint16_t entries[256];
+}; // struct crc16_table
+
+} // namespace
+
+std::uint16_t
+crc16 (string_view bytes)
+{
+  static const crc16_table table;
+  std::uint16_t crc = 0;
+  for (auto c : bytes)
+    crc = static_cast<std::uint16_t> (
+	(crc << 8)
+	^ table.entries[((crc >> 8) ^ static_cast<unsigned char> (c)) & 0xff]);
+  return crc;
+}
+
+std::size_t
+key_slot (string_view key)
+{
+  auto open = key.find ('{');
+  if (open != string_view::npos)
+    {
+      auto close = key.find ('}', open + 1);
+      if (close != string_view::npos && close != open + 1)
+	key = key.substr (open + 1, close - open - 1);
+    }
+  return crc16 (key) & (slot_count - 1);
+}
+
+} // namespace db
+} // namespace mini_redis
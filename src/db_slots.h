@@ -0,0 +1,24 @@
+#ifndef DB_SLOTS_H
+#define DB_SLOTS_H
+
+#include "pch.h"
+
+namespace mini_redis
+{
+namespace db
+{
+
+// Cluster mode splits the keyspace into slot_count hash slots. A key maps
+// to the CRC16 of its hash tag, the part between its first '{' and the
+// next '}' when that is not empty, or else of the whole key, so that keys
+// sharing a tag share a slot.
+const std::size_t slot_count = 16384;
+
+// CRC16-CCITT (XMODEM): polynomial 0x1021, initial value 0.
+std::uint16_t crc16 (string_view bytes);
+std::size_t key_slot (string_view key);
+
+} // namespace db
+} // namespace mini_redis
+
+#endif // DB_SLOTS_H
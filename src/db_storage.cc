@@ -5,40 +5,158 @@ namespace mini_redis
 namespace db
 {
 
+namespace
+{
+
+void
+prefetch (const void *p)
+{
+#if defined(__GNUC__)
+  __builtin_prefetch (p);
+#else
+  (void) p;
+#endif
+}
+
+} // namespace
+
 optional<storage::iterator>
 storage::find (const std::string &key)
 {
   auto it = db_.find (key);
   if (it == db_.end ())
-    return boost::none;
+    {
+      if (frozen_.empty ())
+	return boost::none;
+      it = frozen_.find (key);
+      if (it == frozen_.end ())
+	return boost::none;
+      it = release_frozen (it, true);
+    }
 
+  mark (key);
+  if (writing_)
+    touch (key);
   auto ttl_it = ttl_.find (key);
   if (ttl_it == ttl_.end ())
     return it;
 
   auto expires = ttl_it->second;
   auto now = clock_type::now ();
-  if (now < expires)
+  if (now < expires || expiration_paused_)
     return it;
+  if (keeping_expired_)
+    return boost::none;
 
+  if (expire_hook_)
+    expire_hook_ (key);
+  touch (key);
+  unindex_key (key);
   ttl_.erase (ttl_it);
   db_.erase (it);
   return boost::none;
 }
 
+std::vector<optional<storage::iterator>>
+storage::find (span<const std::string> keys)
+{
+  std::vector<optional<iterator>> out (keys.size ());
+
+  // Thawing a key can rehash db_, which would invalidate the iterators
+  // already in out, so the frozen keys are all moved back beforehand.
+  if (!frozen_.empty ())
+    for (const auto &key : keys)
+      thaw (key);
+
+  // Probe all the keys first; the probes do not depend on each other, so
+  // their misses are serviced in parallel. Long string values live out of
+  // line, so their buffers are prefetched as well.
+  for (std::size_t i = 0; i < keys.size (); i++)
+    {
+      auto it = db_.find (keys[i]);
+      if (it == db_.end ())
+	continue;
+
+      out[i] = it;
+      mark (keys[i]);
+      if (writing_)
+	touch (keys[i]);
+      const auto &value = it->second;
+      if (value.is<string> ())
+	prefetch (value.get<string> ().data ());
+    }
+
+  if (ttl_.empty () || expiration_paused_)
+    return out;
+
+  auto now = clock_type::now ();
+  for (std::size_t i = 0; i < keys.size (); i++)
+    {
+      if (!out[i].has_value ())
+	continue;
+
+      auto ttl_it = ttl_.find (keys[i]);
+      if (ttl_it == ttl_.end () || now < ttl_it->second)
+	continue;
+      if (keeping_expired_)
+	{
+	  out[i] = boost::none;
+	  continue;
+	}
+
+      // Expired: drop the key and every later duplicate of it.
+      for (std::size_t j = i + 1; j < keys.size (); j++)
+	if (keys[j] == keys[i])
+	  out[j] = boost::none;
+      if (expire_hook_)
+	expire_hook_ (keys[i]);
+      touch (keys[i]);
+      unindex_key (keys[i]);
+      ttl_.erase (ttl_it);
+      db_.erase (out[i].value ());
+      out[i] = boost::none;
+    }
+
+  return out;
+}
+
 storage::iterator
 storage::insert (std::string key, data value)
 {
+  if (!frozen_.empty ())
+    {
+      auto it = frozen_.find (key);
+      if (it != frozen_.end ())
+	release_frozen (it, false);
+    }
+
   auto pair = db_.insert_or_assign (std::move (key), std::move (value));
+  mark (pair.first->first);
+  touch (pair.first->first);
+  if (pair.second)
+    index_key (pair.first->first);
   return pair.first;
 }
 
+void
+storage::thaw (const std::string &key)
+{
+  if (frozen_.empty ())
+    return;
+  auto it = frozen_.find (key);
+  if (it != frozen_.end ())
+    release_frozen (it, true);
+}
+
 void
 storage::erase (iterator it)
 {
   BOOST_ASSERT (it != db_.end ());
 
   const auto &key = it->first;
+  mark (key);
+  touch (key);
+  unindex_key (key);
   ttl_.erase (key);
   db_.erase (it);
 }
@@ -56,6 +174,8 @@ storage::expire_at (iterator it, time_point at)
   BOOST_ASSERT (it != db_.end ());
 
   const auto &key = it->first;
+  mark (key);
+  touch (key);
   ttl_.insert_or_assign (key, at);
 }
 
@@ -80,51 +200,26 @@ storage::clear_expires (iterator it)
   BOOST_ASSERT (it != db_.end ());
 
   const auto &key = it->first;
+  mark (key);
+  touch (key);
   ttl_.erase (key);
 }
 
-snapshot
-storage::create_snapshot ()
-{
-  auto now = clock_type::now ();
-
-  std::vector<std::string> expired_keys;
-  expired_keys.reserve (ttl_.size ());
-  snapshot out;
-  out.entries.reserve (db_.size ());
-  for (const auto &p : db_)
-    {
-      const auto &key = p.first;
-      auto ttl_it = ttl_.find (key);
-      if (ttl_it == ttl_.end ())
-	{
-	  out.entries.push_back ({ key, p.second, boost::none });
-	  continue;
-	}
-
-      auto expires = ttl_it->second;
-      if (now >= expires)
-	expired_keys.push_back (key);
-      else
-	out.entries.push_back ({ key, p.second, expires });
-    }
-
-  for (const auto &key : expired_keys)
-    {
-      ttl_.erase (key);
-      db_.erase (key);
-    }
-
-  return out;
-}
-
 void
 storage::replace_with_snapshot (snapshot snap)
 {
+  BOOST_ASSERT (!snapshot_active ());
+
+  std::size_t expires = 0;
+  for (const auto &e : snap.entries)
+    if (e.expire_at.has_value ())
+      expires++;
+
+  // Both tables are sized up front, so they never rehash while loading.
   db_type new_db;
   new_db.reserve (snap.entries.size ());
   ttl_type new_ttl;
-  new_ttl.reserve (snap.entries.size ());
+  new_ttl.reserve (expires);
   for (auto &e : snap.entries)
     {
       auto pair
@@ -132,12 +227,190 @@ storage::replace_with_snapshot (snapshot snap)
       const auto &key = pair.first->first;
       if (e.expire_at.has_value ())
 	new_ttl.insert_or_assign (key, e.expire_at.value ());
-      else
+      else if (!pair.second)
 	new_ttl.erase (key);
     }
 
   db_.swap (new_db);
   ttl_.swap (new_ttl);
+  for (auto &w : watched_)
+    w.second.version++;
+  if (!slots_.empty ())
+    {
+      slots_.clear ();
+      index_slots ();
+    }
+}
+
+void
+storage::begin_snapshot (snapshot_sink sink)
+{
+  BOOST_ASSERT (!snapshot_active ());
+
+  // The keys move back one by one as they reach the sink, or as they are
+  // looked up. db_ is sized for all of them up front, but the keys inserted
+  // meanwhile take room too, so moving one back can still rehash db_: the
+  // iterators into it are not kept across a thaw (see thaw).
+  frozen_.swap (db_);
+  db_.reserve (frozen_.size ());
+  cursor_ = frozen_.begin ();
+  sink_ = std::move (sink);
+}
+
+bool
+storage::snapshot_step (steady_clock::time_point deadline)
+{
+  BOOST_ASSERT (snapshot_active ());
+
+  // Reading the clock costs more than passing a small key on.
+  const std::size_t keys_per_clock_check = 64;
+  std::size_t n = 0;
+  while (cursor_ != frozen_.end ())
+    {
+      release_frozen (cursor_, true);
+      if (++n % keys_per_clock_check == 0 && steady_clock::now () >= deadline)
+	return false;
+    }
+
+  frozen_ = db_type{};
+  sink_ = nullptr;
+  return true;
+}
+
+storage::iterator
+storage::release_frozen (iterator it, bool thaw)
+{
+  auto ttl_it = ttl_.find (it->first);
+  if (ttl_it == ttl_.end ())
+    sink_ (it->first, it->second, optional<time_point>{});
+  else
+    sink_ (it->first, it->second, optional<time_point>{ ttl_it->second });
+
+  iterator out = db_.end ();
+  if (thaw)
+    out = db_.emplace (it->first, std::move (it->second)).first;
+  if (it == cursor_)
+    cursor_++;
+  frozen_.erase (it);
+  return out;
+}
+
+void
+storage::set_expire_hook (std::function<void (const std::string &)> hook)
+{
+  expire_hook_ = std::move (hook);
+}
+
+void
+storage::pause_expiration (bool paused) noexcept
+{
+  expiration_paused_ = paused;
+}
+
+void
+storage::keep_expired (bool keep) noexcept
+{
+  keeping_expired_ = keep;
+}
+
+void
+storage::mark_changes (bool on) noexcept
+{
+  marking_ = on;
+}
+
+std::size_t
+storage::changes () const noexcept
+{
+  return changed_.size ();
+}
+
+void
+storage::clear_changes ()
+{
+  changed_.clear ();
+}
+
+std::uint64_t
+storage::watch (const std::string &key)
+{
+  auto &w = watched_.emplace (key, watch_entry{ 0, 0 }).first->second;
+  w.watchers++;
+  return w.version;
+}
+
+void
+storage::unwatch (const std::string &key)
+{
+  auto it = watched_.find (key);
+  BOOST_ASSERT (it != watched_.end ());
+  if (--it->second.watchers == 0)
+    watched_.erase (it);
+}
+
+std::uint64_t
+storage::version (const std::string &key) const
+{
+  auto it = watched_.find (key);
+  BOOST_ASSERT (it != watched_.end ());
+  return it->second.version;
+}
+
+void
+storage::set_writing (bool on) noexcept
+{
+  writing_ = on;
+}
+
+void
+storage::take_watches (storage &old)
+{
+  watched_.swap (old.watched_);
+  for (auto &w : watched_)
+    w.second.version++;
+}
+
+void
+storage::bump_version (const std::string &key)
+{
+  auto it = watched_.find (key);
+  if (it != watched_.end ())
+    it->second.version++;
+}
+
+void
+storage::index_slots ()
+{
+  if (!slots_.empty ())
+    return;
+
+  slots_.resize (slot_count);
+  for (const auto *table : { &db_, &frozen_ })
+    for (const auto &p : *table)
+      index_key (p.first);
+}
+
+std::size_t
+storage::count_keys_in_slot (std::size_t slot) const
+{
+  if (slots_.empty ())
+    return 0;
+  return slots_[slot].size ();
+}
+
+std::vector<std::string>
+storage::keys_in_slot (std::size_t slot, std::size_t count) const
+{
+  std::vector<std::string> out;
+  if (slots_.empty ())
+    return out;
+
+  const auto &keys = slots_[slot];
+  out.reserve (std::min (count, keys.size ()));
+  for (auto it = keys.begin (); it != keys.end () && out.size () < count;
+       ++it)
+    out.push_back (*it);
+  return out;
 }
 
 } // namespace db
@@ -4,6 +4,7 @@
 #include "pch.h"
 
 #include "db_data.h"
+#include "db_slots.h"
 
 namespace mini_redis
 {
@@ -31,23 +32,207 @@ public:
   typedef unordered_flat_map<std::string, data> db_type;
   typedef unordered_flat_map<std::string, clock_type::time_point> ttl_type;
   typedef db_type::iterator iterator;
+  typedef std::function<void (const std::string &, const data &,
+			      const optional<time_point> &)>
+      snapshot_sink;
 
 public:
   optional<iterator> find (const std::string &key);
+  // Looks up several keys at once. Every probe is issued before any result
+  // is used and the values found are prefetched, so that the cache misses
+  // of independent keys overlap instead of adding up.
+  std::vector<optional<iterator>> find (span<const std::string> keys);
   iterator insert (std::string key, data value);
   void erase (iterator it);
+  // Moves the key back into the table if a snapshot still holds it frozen.
+  // That can rehash the table, as find does when it meets a frozen key, so
+  // a command that holds on to several keys has them all thawed first.
+  void thaw (const std::string &key);
 
   void expire_after (iterator it, duration dur);
   void expire_at (iterator it, time_point at);
   optional<duration> ttl (iterator it);
   void clear_expires (iterator it);
 
-  snapshot create_snapshot ();
+  std::size_t
+  size () const noexcept
+  {
+    return db_.size () + frozen_.size ();
+  }
+
+  void
+  reserve (std::size_t n)
+  {
+    db_.reserve (n);
+  }
+
+  // Visits every key with its value and expiration time, without copying
+  // anything. Keys that have expired but were not removed yet are visited
+  // too.
+  template <class Fn>
+  void
+  for_each (Fn fn) const
+  {
+    for (const auto *table : { &db_, &frozen_ })
+      for (const auto &p : *table)
+	{
+	  auto ttl_it = ttl_.find (p.first);
+	  if (ttl_it == ttl_.end ())
+	    fn (p.first, p.second, optional<time_point>{});
+	  else
+	    fn (p.first, p.second, optional<time_point>{ ttl_it->second });
+	}
+  }
+
   void replace_with_snapshot (snapshot snap);
 
+  // Cooperative snapshots, taken while the storage keeps serving requests.
+  // begin_snapshot freezes every key as it is: from then on, find and
+  // insert pass a frozen key to the sink, with its value and expiration
+  // time, before they hand it out or replace it, and snapshot_step passes
+  // the others in slices. Each key reaches the sink once, as it was when
+  // the snapshot began, and no value is copied.
+  void begin_snapshot (snapshot_sink sink);
+  // Passes frozen keys to the sink until the deadline, which is checked
+  // every few keys. Returns true, ending the snapshot, once none are left.
+  bool snapshot_step (steady_clock::time_point deadline);
+
+  bool
+  snapshot_active () const noexcept
+  {
+    return static_cast<bool> (sink_);
+  }
+
+  // Keys that find drops because they have expired are passed to the
+  // expire hook first, so that their removal can be logged.
+  void set_expire_hook (std::function<void (const std::string &)> hook);
+  // While expiration is paused, find keeps the keys past their expiration
+  // time, as replaying a log must see them as they were when the commands
+  // were logged.
+  void pause_expiration (bool paused) noexcept;
+  // While expired keys are kept, find reports a key past its expiration
+  // time as missing but leaves it, unless expiration is paused: a replica
+  // removes it when the DEL its primary logs for it arrives.
+  void keep_expired (bool keep) noexcept;
+
+  // While marking is on, every key that find returns, or that is inserted,
+  // erased, or given or stripped of an expiration, is recorded as changed.
+  // Values are modified in place through iterators, so a write command
+  // runs with marking on; the keys it only reads are recorded as well,
+  // which is harmless.
+  void mark_changes (bool on) noexcept;
+  std::size_t changes () const noexcept;
+  void clear_changes ();
+
+  // Watched keys have a version, bumped whenever the key is inserted,
+  // erased, given or stripped of an expiration, or found expired, when
+  // the dataset is replaced, and when find returns it while a write runs
+  // (see set_writing), as for mark_changes. Keys nobody watches have no
+  // version, and cost nothing. watch returns the version of the key, and
+  // every watch must be undone by an unwatch.
+  std::uint64_t watch (const std::string &key);
+  void unwatch (const std::string &key);
+  std::uint64_t version (const std::string &key) const;
+  void set_writing (bool on) noexcept;
+  // Takes over the watches of a storage this one replaces, all bumped.
+  void take_watches (storage &old);
+
+  // Cluster mode keeps the keys indexed by hash slot. Turning the index on
+  // indexes the keys already there; it then follows every insertion and
+  // removal.
+  void index_slots ();
+  std::size_t count_keys_in_slot (std::size_t slot) const;
+  // At most count keys of the slot, in no particular order.
+  std::vector<std::string> keys_in_slot (std::size_t slot,
+					 std::size_t count) const;
+
+  // Visits every changed key with its value and expiration time, or with
+  // a null value if the key no longer exists.
+  template <class Fn>
+  void
+  for_each_change (Fn fn) const
+  {
+    for (const auto &key : changed_)
+      {
+	auto it = db_.find (key);
+	bool found = it != db_.end ();
+	if (!found)
+	  {
+	    it = frozen_.find (key);
+	    found = it != frozen_.end ();
+	  }
+	if (!found)
+	  {
+	    fn (key, static_cast<const data *> (nullptr),
+		optional<time_point>{});
+	    continue;
+	  }
+
+	auto ttl_it = ttl_.find (key);
+	if (ttl_it == ttl_.end ())
+	  fn (key, &it->second, optional<time_point>{});
+	else
+	  fn (key, &it->second, optional<time_point>{ ttl_it->second });
+      }
+  }
+
+private:
+  // Passes the frozen key at it to the sink, and moves it out of frozen_:
+  // into db_ when thaw is set, where the returned iterator points to it.
+  iterator release_frozen (iterator it, bool thaw);
+
+  void
+  mark (const std::string &key)
+  {
+    if (marking_)
+      changed_.insert (key);
+  }
+
+  void
+  touch (const std::string &key)
+  {
+    if (!watched_.empty ())
+      bump_version (key);
+  }
+
+  void bump_version (const std::string &key);
+
+  void
+  index_key (const std::string &key)
+  {
+    if (!slots_.empty ())
+      slots_[key_slot (key)].insert (key);
+  }
+
+  void
+  unindex_key (const std::string &key)
+  {
+    if (!slots_.empty ())
+      slots_[key_slot (key)].erase (key);
+  }
+
 private:
   db_type db_;
   ttl_type ttl_;
+  std::function<void (const std::string &)> expire_hook_;
+  bool expiration_paused_ = false;
+  bool keeping_expired_ = false;
+  unordered_flat_set<std::string> changed_;
+  bool marking_ = false;
+  struct watch_entry
+  {
+    std::uint64_t version;
+    std::size_t watchers;
+  };
+  unordered_flat_map<std::string, watch_entry> watched_;
+  bool writing_ = false;
+  // The keys by hash slot, when indexed.
+  std::vector<unordered_flat_set<std::string>> slots_;
+  // While a snapshot is taken, the keys not passed to the sink yet. Keys
+  // are only ever removed from it, so cursor_ stays valid.
+  db_type frozen_;
+  iterator cursor_;
+  snapshot_sink sink_;
 }; // class storage
 
 } // namespace db
@@ -0,0 +1,736 @@
+#include "db_stream.h"
+
+namespace mini_redis
+{
+namespace db
+{
+
+namespace
+{
+
+enum : unsigned char
+{
+  flag_deleted = 1,
+  flag_same_fields = 2,
+};
+
+void
+put_varint (std::string &out, std::uint64_t v)
+{
+  while (v >= 0x80)
+    {
+      out.push_back (static_cast<char> ((v & 0x7f) | 0x80));
+      v >>= 7;
+    }
+  out.push_back (static_cast<char> (v));
+}
+
+bool
+get_varint (string_view &in, std::uint64_t &v)
+{
+  v = 0;
+  for (int shift = 0; shift < 64 && !in.empty (); shift += 7)
+    {
+      auto b = static_cast<unsigned char> (in[0]);
+      in.remove_prefix (1);
+      v |= static_cast<std::uint64_t> (b & 0x7f) << shift;
+      if ((b & 0x80) == 0)
+	return true;
+    }
+  return false;
+}
+
+void
+put_string (std::string &out, string_view s)
+{
+  put_varint (out, s.size ());
+  out.append (s.data (), s.size ());
+}
+
+bool
+get_string (string_view &in, string_view &s)
+{
+  std::uint64_t n;
+  if (!get_varint (in, n) || n > in.size ())
+    return false;
+  s = in.substr (0, static_cast<std::size_t> (n));
+  in.remove_prefix (static_cast<std::size_t> (n));
+  return true;
+}
+
+struct decoded_entry
+{
+  std::size_t pos; // offset of the flags byte in the block
+  bool deleted;
+  stream_id id;
+  // field, value, field, value, ...
+  std::vector<string_view> fields;
+};
+
+// Sequential decoder of the entries of a block.
+class block_reader
+{
+public:
+  block_reader (string_view data, const stream_id &master)
+      : data_{ data }, rest_{ data }, master_{ master }, ok_{ true }
+  {
+    std::uint64_t n;
+    if (!get_varint (rest_, n) || n > rest_.size ())
+      {
+	ok_ = false;
+	return;
+      }
+
+    master_fields_.resize (static_cast<std::size_t> (n));
+    for (auto &f : master_fields_)
+      if (!get_string (rest_, f))
+	{
+	  ok_ = false;
+	  return;
+	}
+  }
+
+  bool
+  ok () const noexcept
+  {
+    return ok_;
+  }
+
+  const std::vector<string_view> &
+  master_fields () const noexcept
+  {
+    return master_fields_;
+  }
+
+  // Returns false at the end of the block or on malformed data.
+  bool
+  next (decoded_entry &e)
+  {
+    if (!ok_ || rest_.empty ())
+      return false;
+
+    e.pos = data_.size () - rest_.size ();
+    auto flags = static_cast<unsigned char> (rest_[0]);
+    rest_.remove_prefix (1);
+    e.deleted = (flags & flag_deleted) != 0;
+
+    std::uint64_t ms_delta, seq;
+    if (!get_varint (rest_, ms_delta) || !get_varint (rest_, seq))
+      return fail ();
+    e.id.ms = master_.ms + ms_delta;
+    e.id.seq = ms_delta == 0 ? master_.seq + seq : seq;
+
+    e.fields.clear ();
+    if ((flags & flag_same_fields) != 0)
+      {
+	e.fields.resize (master_fields_.size () * 2);
+	for (std::size_t i = 0; i < master_fields_.size (); i++)
+	  {
+	    e.fields[i * 2] = master_fields_[i];
+	    if (!get_string (rest_, e.fields[i * 2 + 1]))
+	      return fail ();
+	  }
+	return true;
+      }
+
+    std::uint64_t n;
+    if (!get_varint (rest_, n) || n > rest_.size ())
+      return fail ();
+    e.fields.resize (static_cast<std::size_t> (n) * 2);
+    for (std::size_t i = 0; i < n; i++)
+      if (!get_string (rest_, e.fields[i * 2]))
+	return fail ();
+    for (std::size_t i = 0; i < n; i++)
+      if (!get_string (rest_, e.fields[i * 2 + 1]))
+	return fail ();
+    return true;
+  }
+
+private:
+  bool
+  fail ()
+  {
+    ok_ = false;
+    return false;
+  }
+
+private:
+  string_view data_;
+  string_view rest_;
+  stream_id master_;
+  std::vector<string_view> master_fields_;
+  bool ok_;
+};
+
+void
+encode_entry (std::string &out, const stream_id &master,
+	      const std::vector<string_view> &master_fields,
+	      const stream_id &id, span<const std::string> fields)
+{
+  auto n = fields.size () / 2;
+  bool same = n == master_fields.size ();
+  for (std::size_t i = 0; same && i < n; i++)
+    same = master_fields[i] == fields[i * 2];
+
+  out.push_back (static_cast<char> (same ? flag_same_fields : 0));
+  auto ms_delta = id.ms - master.ms;
+  put_varint (out, ms_delta);
+  put_varint (out, ms_delta == 0 ? id.seq - master.seq : id.seq);
+
+  if (!same)
+    {
+      put_varint (out, n);
+      for (std::size_t i = 0; i < n; i++)
+	put_string (out, fields[i * 2]);
+    }
+  for (std::size_t i = 0; i < n; i++)
+    put_string (out, fields[i * 2 + 1]);
+}
+
+stream::entry
+to_entry (const decoded_entry &e)
+{
+  stream::entry out;
+  out.id = e.id;
+  out.fields.reserve (e.fields.size ());
+  for (auto f : e.fields)
+    out.fields.emplace_back (f.data (), f.size ());
+  return out;
+}
+
+} // namespace
+
+stream_id
+stream_id::min () noexcept
+{
+  return { 0, 0 };
+}
+
+stream_id
+stream_id::max () noexcept
+{
+  const auto m = std::numeric_limits<std::uint64_t>::max ();
+  return { m, m };
+}
+
+bool
+stream_id::incr () noexcept
+{
+  const auto m = std::numeric_limits<std::uint64_t>::max ();
+  if (seq != m)
+    {
+      seq++;
+      return true;
+    }
+  if (ms == m)
+    return false;
+  ms++;
+  seq = 0;
+  return true;
+}
+
+bool
+stream_id::decr () noexcept
+{
+  if (seq != 0)
+    {
+      seq--;
+      return true;
+    }
+  if (ms == 0)
+    return false;
+  ms--;
+  seq = std::numeric_limits<std::uint64_t>::max ();
+  return true;
+}
+
+std::string
+stream_id::to_string () const
+{
+  std::string out = std::to_string (ms);
+  out.push_back ('-');
+  out += std::to_string (seq);
+  return out;
+}
+
+std::string
+stream_id::to_key () const
+{
+  std::string out (16, '\0');
+  for (int i = 0; i < 8; i++)
+    {
+      out[i] = static_cast<char> ((ms >> (56 - i * 8)) & 0xff);
+      out[8 + i] = static_cast<char> ((seq >> (56 - i * 8)) & 0xff);
+    }
+  return out;
+}
+
+stream_id
+stream_id::from_key (string_view key)
+{
+  BOOST_ASSERT (key.size () == 16);
+
+  stream_id id{ 0, 0 };
+  for (int i = 0; i < 8; i++)
+    {
+      id.ms = id.ms << 8 | static_cast<unsigned char> (key[i]);
+      id.seq = id.seq << 8 | static_cast<unsigned char> (key[8 + i]);
+    }
+  return id;
+}
+
+bool
+operator== (const stream_id &a, const stream_id &b) noexcept
+{
+  return a.ms == b.ms && a.seq == b.seq;
+}
+
+bool
+operator!= (const stream_id &a, const stream_id &b) noexcept
+{
+  return !(a == b);
+}
+
+bool
+operator< (const stream_id &a, const stream_id &b) noexcept
+{
+  return a.ms < b.ms || (a.ms == b.ms && a.seq < b.seq);
+}
+
+bool
+operator<= (const stream_id &a, const stream_id &b) noexcept
+{
+  return !(b < a);
+}
+
+bool
+operator> (const stream_id &a, const stream_id &b) noexcept
+{
+  return b < a;
+}
+
+bool
+operator>= (const stream_id &a, const stream_id &b) noexcept
+{
+  return !(a < b);
+}
+
+bool
+parse_stream_id (string_view str, std::uint64_t default_seq, stream_id &out,
+		 bool *seq_given)
+{
+  auto dash = str.find ('-');
+  auto ms_part = str.substr (0, dash);
+  if (ms_part.empty () || ms_part[0] == '+'
+      || !try_lexical_convert (ms_part, out.ms))
+    return false;
+
+  if (seq_given != nullptr)
+    *seq_given = dash != string_view::npos;
+  if (dash == string_view::npos)
+    {
+      out.seq = default_seq;
+      return true;
+    }
+
+  auto seq_part = str.substr (dash + 1);
+  return !seq_part.empty () && seq_part[0] != '+'
+	 && try_lexical_convert (seq_part, out.seq);
+}
+
+constexpr std::size_t stream::block_max_bytes;
+constexpr std::size_t stream::block_max_entries;
+
+stream::stream () noexcept
+    : length_{ 0 }, entries_added_{ 0 }, last_id_{ 0, 0 },
+      max_deleted_id_{ 0, 0 }
+{
+}
+
+stream::stream (const stream &other)
+    : length_{ other.length_ }, entries_added_{ other.entries_added_ },
+      last_id_{ other.last_id_ }, max_deleted_id_{ other.max_deleted_id_ }
+{
+  for (auto it = other.blocks_.first (); it.has_value ();
+       it = other.next_block (stream_id::from_key (it->key)))
+    blocks_.insert (it->key, *it->value);
+}
+
+stream &
+stream::operator= (const stream &other)
+{
+  if (this != &other)
+    {
+      stream tmp{ other };
+      *this = std::move (tmp);
+    }
+  return *this;
+}
+
+std::size_t
+stream::size () const noexcept
+{
+  return length_;
+}
+
+stream_id
+stream::last_id () const noexcept
+{
+  return last_id_;
+}
+
+stream_id
+stream::max_deleted_id () const noexcept
+{
+  return max_deleted_id_;
+}
+
+std::uint64_t
+stream::entries_added () const noexcept
+{
+  return entries_added_;
+}
+
+optional<stream_id>
+stream::first_id () const
+{
+  auto it = blocks_.first ();
+  if (!it.has_value ())
+    return boost::none;
+
+  block_reader reader{ it->value->data, stream_id::from_key (it->key) };
+  decoded_entry e;
+  while (reader.next (e))
+    if (!e.deleted)
+      return e.id;
+  return boost::none;
+}
+
+void
+stream::append (const stream_id &id, span<const std::string> fields)
+{
+  BOOST_ASSERT (length_ == 0 || id > last_id_);
+  BOOST_ASSERT (fields.size () % 2 == 0);
+
+  auto last = blocks_.last ();
+  if (last.has_value () && last->value->data.size () < block_max_bytes
+      && last->value->total < block_max_entries)
+    {
+      auto b = last->value;
+      block_reader reader{ b->data, stream_id::from_key (last->key) };
+      encode_entry (b->data, stream_id::from_key (last->key),
+		    reader.master_fields (), id, fields);
+      b->live++;
+      b->total++;
+    }
+  else
+    {
+      // A new block takes the field names of its first entry as the
+      // master fields.
+      block b{ {}, 1, 1 };
+      std::vector<string_view> names;
+      put_varint (b.data, fields.size () / 2);
+      for (std::size_t i = 0; i < fields.size (); i += 2)
+	{
+	  put_string (b.data, fields[i]);
+	  names.push_back (fields[i]);
+	}
+      encode_entry (b.data, id, names, id, fields);
+      blocks_.insert (id.to_key (), std::move (b));
+    }
+
+  length_++;
+  entries_added_++;
+  last_id_ = id;
+}
+
+bool
+stream::erase (const stream_id &id)
+{
+  auto it = blocks_.floor (id.to_key ());
+  if (!it.has_value ())
+    return false;
+
+  auto b = it->value;
+  block_reader reader{ b->data, stream_id::from_key (it->key) };
+  decoded_entry e;
+  while (reader.next (e))
+    {
+      if (e.id < id)
+	continue;
+      if (e.id != id || e.deleted)
+	return false;
+
+      b->data[e.pos] = static_cast<char> (b->data[e.pos] | flag_deleted);
+      b->live--;
+      length_--;
+      if (max_deleted_id_ < id)
+	max_deleted_id_ = id;
+      if (b->live == 0)
+	erase_block (it.value ());
+      return true;
+    }
+  return false;
+}
+
+std::size_t
+stream::trim_maxlen (std::uint64_t maxlen, bool approx, std::size_t limit)
+{
+  std::size_t removed = 0;
+  while (length_ > maxlen)
+    {
+      auto it = blocks_.first ();
+      BOOST_ASSERT (it.has_value ());
+      auto b = it->value;
+
+      if (length_ - b->live >= maxlen)
+	{
+	  if (limit != 0 && removed + b->live > limit)
+	    break;
+	  removed += b->live;
+	  length_ -= b->live;
+	  erase_block (it.value ());
+	  continue;
+	}
+
+      if (approx)
+	break;
+
+      // Flag entries of the first block until the length is reached.
+      block_reader reader{ b->data, stream_id::from_key (it->key) };
+      decoded_entry e;
+      while (length_ > maxlen && reader.next (e))
+	{
+	  if (e.deleted)
+	    continue;
+	  if (limit != 0 && removed == limit)
+	    return removed;
+	  b->data[e.pos] = static_cast<char> (b->data[e.pos] | flag_deleted);
+	  b->live--;
+	  length_--;
+	  removed++;
+	}
+      break;
+    }
+  return removed;
+}
+
+std::size_t
+stream::trim_minid (const stream_id &minid, bool approx, std::size_t limit)
+{
+  std::size_t removed = 0;
+  while (length_ != 0)
+    {
+      auto it = blocks_.first ();
+      BOOST_ASSERT (it.has_value ());
+      auto b = it->value;
+
+      // The whole block goes if the next one starts at or before minid.
+      // Otherwise it has to be scanned for its last entry.
+      auto next = next_block (stream_id::from_key (it->key));
+      bool whole = next.has_value ()
+		   && stream_id::from_key (next->key) <= minid;
+      if (!whole)
+	{
+	  block_reader reader{ b->data, stream_id::from_key (it->key) };
+	  decoded_entry e;
+	  stream_id block_last = stream_id::min ();
+	  while (reader.next (e))
+	    block_last = e.id;
+	  whole = block_last < minid;
+	}
+
+      if (whole)
+	{
+	  if (limit != 0 && removed + b->live > limit)
+	    break;
+	  removed += b->live;
+	  length_ -= b->live;
+	  erase_block (it.value ());
+	  continue;
+	}
+
+      if (approx)
+	break;
+
+      block_reader reader{ b->data, stream_id::from_key (it->key) };
+      decoded_entry e;
+      while (reader.next (e) && e.id < minid)
+	{
+	  if (e.deleted)
+	    continue;
+	  if (limit != 0 && removed == limit)
+	    return removed;
+	  b->data[e.pos] = static_cast<char> (b->data[e.pos] | flag_deleted);
+	  b->live--;
+	  length_--;
+	  removed++;
+	}
+      break;
+    }
+  return removed;
+}
+
+std::vector<stream::entry>
+stream::range (const stream_id &first, const stream_id &last,
+	       std::size_t count, bool rev) const
+{
+  std::vector<entry> out;
+  if (first > last)
+    return out;
+
+  decoded_entry e;
+  if (!rev)
+    {
+      auto it = blocks_.floor (first.to_key ());
+      if (!it.has_value ())
+	it = blocks_.first ();
+
+      for (; it.has_value (); it = next_block (stream_id::from_key (it->key)))
+	{
+	  auto master = stream_id::from_key (it->key);
+	  if (master > last)
+	    break;
+
+	  block_reader reader{ it->value->data, master };
+	  while (reader.next (e))
+	    {
+	      if (e.deleted || e.id < first)
+		continue;
+	      if (e.id > last)
+		return out;
+	      out.push_back (to_entry (e));
+	      if (count != 0 && out.size () == count)
+		return out;
+	    }
+	}
+      return out;
+    }
+
+  // Blocks are only decoded forwards, so a reverse scan collects the entries
+  // of each block before walking them backwards.
+  std::vector<decoded_entry> block_entries;
+  for (auto it = blocks_.floor (last.to_key ()); it.has_value ();
+       it = prev_block (stream_id::from_key (it->key)))
+    {
+      auto master = stream_id::from_key (it->key);
+      block_reader reader{ it->value->data, master };
+      block_entries.clear ();
+      while (reader.next (e))
+	if (!e.deleted && e.id >= first && e.id <= last)
+	  block_entries.push_back (e);
+
+      for (auto i = block_entries.rbegin (); i != block_entries.rend (); ++i)
+	{
+	  out.push_back (to_entry (*i));
+	  if (count != 0 && out.size () == count)
+	    return out;
+	}
+
+      if (master <= first)
+	break;
+    }
+  return out;
+}
+
+std::string
+stream::dump () const
+{
+  std::string out;
+  put_varint (out, length_);
+  put_varint (out, entries_added_);
+  put_varint (out, last_id_.ms);
+  put_varint (out, last_id_.seq);
+  put_varint (out, max_deleted_id_.ms);
+  put_varint (out, max_deleted_id_.seq);
+  put_varint (out, blocks_.size ());
+
+  for (auto it = blocks_.first (); it.has_value ();
+       it = next_block (stream_id::from_key (it->key)))
+    {
+      auto master = stream_id::from_key (it->key);
+      put_varint (out, master.ms);
+      put_varint (out, master.seq);
+      put_varint (out, it->value->total);
+      put_string (out, it->value->data);
+    }
+  return out;
+}
+
+bool
+stream::restore (string_view raw, stream &out)
+{
+  out = stream{};
+
+  std::uint64_t length, nblocks;
+  if (!get_varint (raw, length) || !get_varint (raw, out.entries_added_)
+      || !get_varint (raw, out.last_id_.ms)
+      || !get_varint (raw, out.last_id_.seq)
+      || !get_varint (raw, out.max_deleted_id_.ms)
+      || !get_varint (raw, out.max_deleted_id_.seq)
+      || !get_varint (raw, nblocks))
+    return false;
+
+  bool any = false;
+  stream_id prev = stream_id::min ();
+  decoded_entry e;
+  for (std::uint64_t i = 0; i < nblocks; i++)
+    {
+      stream_id master;
+      std::uint64_t total;
+      string_view data;
+      if (!get_varint (raw, master.ms) || !get_varint (raw, master.seq)
+	  || !get_varint (raw, total) || !get_string (raw, data))
+	return false;
+
+      // Every entry must decode and ids must be strictly increasing across
+      // the whole stream, starting with the master id of each block.
+      block b{ std::string{ data.data (), data.size () }, 0, 0 };
+      block_reader reader{ b.data, master };
+      while (reader.next (e))
+	{
+	  if ((b.total == 0 && e.id != master) || (any && e.id <= prev)
+	      || e.id > out.last_id_)
+	    return false;
+	  any = true;
+	  prev = e.id;
+	  b.total++;
+	  if (!e.deleted)
+	    b.live++;
+	}
+      if (!reader.ok () || b.total != total || b.live == 0)
+	return false;
+
+      out.length_ += b.live;
+      out.blocks_.insert (master.to_key (), std::move (b));
+    }
+
+  return raw.empty () && out.length_ == length;
+}
+
+optional<stream::block_item>
+stream::next_block (const stream_id &master) const
+{
+  auto id = master;
+  if (!id.incr ())
+    return boost::none;
+  return blocks_.ceil (id.to_key ());
+}
+
+optional<stream::block_item>
+stream::prev_block (const stream_id &master) const
+{
+  auto id = master;
+  if (!id.decr ())
+    return boost::none;
+  return blocks_.floor (id.to_key ());
+}
+
+void
+stream::erase_block (const block_item &it)
+{
+  blocks_.erase (it.key);
+}
+
+} // namespace db
+} // namespace mini_redis
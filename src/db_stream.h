@@ -0,0 +1,124 @@
+#ifndef DB_STREAM_H
+#define DB_STREAM_H
+
+#include "pch.h"
+
+#include "db_radix.h"
+
+namespace mini_redis
+{
+namespace db
+{
+
+struct stream_id
+{
+  std::uint64_t ms;
+  std::uint64_t seq;
+
+  static stream_id min () noexcept;
+  static stream_id max () noexcept;
+
+  // The next / previous possible id; false when there is none.
+  bool incr () noexcept;
+  bool decr () noexcept;
+
+  std::string to_string () const;
+  // 16-byte big-endian form, which sorts like the id itself.
+  std::string to_key () const;
+  static stream_id from_key (string_view key);
+}; // struct stream_id
+
+bool operator== (const stream_id &a, const stream_id &b) noexcept;
+bool operator!= (const stream_id &a, const stream_id &b) noexcept;
+bool operator< (const stream_id &a, const stream_id &b) noexcept;
+bool operator<= (const stream_id &a, const stream_id &b) noexcept;
+bool operator> (const stream_id &a, const stream_id &b) noexcept;
+bool operator>= (const stream_id &a, const stream_id &b) noexcept;
+
+// Parses "<ms>-<seq>", or "<ms>" with seq set to default_seq. seq_given
+// tells which form was used.
+bool parse_stream_id (string_view str, std::uint64_t default_seq,
+		      stream_id &out, bool *seq_given = nullptr);
+
+// An append-only log of entries, each made of an id and field-value pairs.
+//
+// Entries are packed into blocks of at most block_max_entries entries or
+// block_max_bytes bytes, indexed by a radix tree keyed by the id of the
+// first entry of each block (the master id). Inside a block every entry is
+// stored as varint deltas from the master id, and entries whose field names
+// match the first entry of the block only store their values. Deleting an
+// entry only flags it; a block is released once all its entries are gone.
+class stream
+{
+public:
+  struct entry
+  {
+    stream_id id;
+    // field, value, field, value, ...
+    std::vector<std::string> fields;
+  };
+
+  static constexpr std::size_t block_max_bytes = 4096;
+  static constexpr std::size_t block_max_entries = 100;
+
+public:
+  stream () noexcept;
+
+  stream (const stream &other);
+  stream &operator= (const stream &other);
+  stream (stream &&other) noexcept = default;
+  stream &operator= (stream &&other) noexcept = default;
+
+  std::size_t size () const noexcept;
+  stream_id last_id () const noexcept;
+  stream_id max_deleted_id () const noexcept;
+  std::uint64_t entries_added () const noexcept;
+  optional<stream_id> first_id () const;
+
+  // Appends an entry. id must be greater than last_id ().
+  void append (const stream_id &id, span<const std::string> fields);
+  bool erase (const stream_id &id);
+
+  // Trim from the head. When approx is set only whole blocks are removed.
+  // At most limit entries are removed, 0 meaning no limit. Returns the
+  // number of entries removed.
+  std::size_t trim_maxlen (std::uint64_t maxlen, bool approx,
+			   std::size_t limit);
+  std::size_t trim_minid (const stream_id &minid, bool approx,
+			  std::size_t limit);
+
+  // Entries with first <= id <= last, at most count of them (0 meaning no
+  // limit), in ascending order or in descending order when rev is set.
+  std::vector<entry> range (const stream_id &first, const stream_id &last,
+			    std::size_t count, bool rev) const;
+
+  // Raw form used by snapshots.
+  std::string dump () const;
+  static bool restore (string_view raw, stream &out);
+
+private:
+  struct block
+  {
+    std::string data;
+    std::uint32_t live;
+    std::uint32_t total;
+  };
+
+  typedef radix_tree<block>::item block_item;
+
+  optional<block_item> next_block (const stream_id &master) const;
+  optional<block_item> prev_block (const stream_id &master) const;
+  void erase_block (const block_item &it);
+
+private:
+  radix_tree<block> blocks_;
+  std::uint64_t length_;
+  std::uint64_t entries_added_;
+  stream_id last_id_;
+  stream_id max_deleted_id_;
+}; // class stream
+
+} // namespace db
+} // namespace mini_redis
+
+#endif // DB_STREAM_H
@@ -0,0 +1,643 @@
+#include "db_zset.h"
+
+namespace mini_redis
+{
+namespace db
+{
+
+namespace
+{
+
+bool
+entry_less (double lscore, const std::string &lmember, double rscore,
+	    const std::string &rmember)
+{
+  if (lscore != rscore)
+    return lscore < rscore;
+  return lmember < rmember;
+}
+
+} // namespace
+
+constexpr std::size_t zset::packed_max_entries;
+constexpr std::size_t zset::packed_max_member_len;
+constexpr int zset::max_level;
+
+zset::zset () noexcept
+    : packed_{ true }, header_{ nullptr }, tail_{ nullptr }, length_{ 0 },
+      level_{ 0 }
+{
+}
+
+zset::~zset () { clear (); }
+
+zset::zset (const zset &other) : zset{}
+{
+  if (other.packed_)
+    {
+      packed_entries_ = other.packed_entries_;
+      return;
+    }
+
+  packed_ = false;
+  sl_init ();
+  dict_.reserve (other.length_);
+  other.for_each (
+      [this] (const std::string &member, double score)
+	{
+	  auto x = sl_insert (member, score);
+	  dict_.emplace (string_view{ x->member }, x);
+	});
+}
+
+zset &
+zset::operator= (const zset &other)
+{
+  if (this != &other)
+    {
+      zset tmp{ other };
+      *this = std::move (tmp);
+    }
+  return *this;
+}
+
+zset::zset (zset &&other) noexcept
+    : packed_{ other.packed_ },
+      packed_entries_{ std::move (other.packed_entries_) },
+      header_{ other.header_ }, tail_{ other.tail_ }, length_{ other.length_ },
+      level_{ other.level_ }, dict_{ std::move (other.dict_) }
+{
+  other.packed_ = true;
+  other.packed_entries_.clear ();
+  other.header_ = nullptr;
+  other.tail_ = nullptr;
+  other.length_ = 0;
+  other.level_ = 0;
+  other.dict_.clear ();
+}
+
+zset &
+zset::operator= (zset &&other) noexcept
+{
+  if (this != &other)
+    {
+      clear ();
+      packed_ = other.packed_;
+      packed_entries_ = std::move (other.packed_entries_);
+      header_ = other.header_;
+      tail_ = other.tail_;
+      length_ = other.length_;
+      level_ = other.level_;
+      dict_ = std::move (other.dict_);
+
+      other.packed_ = true;
+      other.packed_entries_.clear ();
+      other.header_ = nullptr;
+      other.tail_ = nullptr;
+      other.length_ = 0;
+      other.level_ = 0;
+      other.dict_.clear ();
+    }
+  return *this;
+}
+
+std::size_t
+zset::size () const noexcept
+{
+  return packed_ ? packed_entries_.size () : length_;
+}
+
+bool
+zset::empty () const noexcept
+{
+  return size () == 0;
+}
+
+bool
+zset::is_packed () const noexcept
+{
+  return packed_;
+}
+
+optional<double>
+zset::score (const std::string &member) const
+{
+  if (packed_)
+    {
+      auto it = packed_find (member);
+      if (it == packed_entries_.end ())
+	return boost::none;
+      return it->score;
+    }
+
+  auto it = dict_.find (string_view{ member });
+  if (it == dict_.end ())
+    return boost::none;
+  return it->second->score;
+}
+
+bool
+zset::insert (std::string member, double score)
+{
+  if (packed_)
+    {
+      auto less = [&member, score] (const entry &e)
+	{ return entry_less (e.score, e.member, score, member); };
+
+      auto it = packed_find (member);
+      if (it != packed_entries_.end ())
+	{
+	  if (it->score == score)
+	    return false;
+	  packed_entries_.erase (packed_entries_.begin ()
+				 + (it - packed_entries_.cbegin ()));
+	  auto pos = std::partition_point (packed_entries_.begin (),
+					   packed_entries_.end (), less);
+	  packed_entries_.insert (pos, entry{ std::move (member), score });
+	  return false;
+	}
+
+      if (member.size () <= packed_max_member_len
+	  && packed_entries_.size () < packed_max_entries)
+	{
+	  auto pos = std::partition_point (packed_entries_.begin (),
+					   packed_entries_.end (), less);
+	  packed_entries_.insert (pos, entry{ std::move (member), score });
+	  return true;
+	}
+
+      convert ();
+    }
+
+  auto it = dict_.find (string_view{ member });
+  if (it == dict_.end ())
+    {
+      auto x = sl_insert (std::move (member), score);
+      dict_.emplace (string_view{ x->member }, x);
+      return true;
+    }
+
+  auto x = it->second;
+  if (x->score == score)
+    return false;
+
+  // Update in place when the node keeps its position.
+  auto prev = x->backward;
+  auto next = x->levels[0].forward;
+  if ((prev == nullptr
+       || entry_less (prev->score, prev->member, score, x->member))
+      && (next == nullptr
+	  || entry_less (score, x->member, next->score, next->member)))
+    {
+      x->score = score;
+      return false;
+    }
+
+  dict_.erase (it);
+  sl_unlink (x);
+  member = std::move (x->member);
+  free_node (x);
+  x = sl_insert (std::move (member), score);
+  dict_.emplace (string_view{ x->member }, x);
+  return false;
+}
+
+bool
+zset::erase (const std::string &member)
+{
+  if (packed_)
+    {
+      auto it = packed_find (member);
+      if (it == packed_entries_.end ())
+	return false;
+      packed_entries_.erase (packed_entries_.begin ()
+			     + (it - packed_entries_.cbegin ()));
+      return true;
+    }
+
+  auto it = dict_.find (string_view{ member });
+  if (it == dict_.end ())
+    return false;
+
+  auto x = it->second;
+  dict_.erase (it);
+  sl_erase (x);
+  return true;
+}
+
+optional<std::size_t>
+zset::rank (const std::string &member) const
+{
+  if (packed_)
+    {
+      auto it = packed_find (member);
+      if (it == packed_entries_.end ())
+	return boost::none;
+      return static_cast<std::size_t> (it - packed_entries_.begin ());
+    }
+
+  auto it = dict_.find (string_view{ member });
+  if (it == dict_.end ())
+    return boost::none;
+  return sl_rank (it->second);
+}
+
+template <class Less>
+std::size_t
+zset::count_less (Less less) const
+{
+  if (packed_)
+    {
+      auto b = packed_entries_.begin ();
+      auto e = packed_entries_.end ();
+      auto pred
+	  = [&less] (const entry &x) { return less (x.member, x.score); };
+      return static_cast<std::size_t> (std::partition_point (b, e, pred) - b);
+    }
+
+  std::size_t traversed = 0;
+  const node *x = header_;
+  for (int i = level_ - 1; i >= 0; i--)
+    while (x->levels[i].forward != nullptr
+	   && less (x->levels[i].forward->member,
+		    x->levels[i].forward->score))
+      {
+	traversed += x->levels[i].span;
+	x = x->levels[i].forward;
+      }
+  return traversed;
+}
+
+std::pair<std::size_t, std::size_t>
+zset::rank_range (const score_range &r) const
+{
+  auto before_min = [&r] (const std::string &, double score)
+    { return r.min_ex ? score <= r.min : score < r.min; };
+  auto up_to_max = [&r] (const std::string &, double score)
+    { return r.max_ex ? score < r.max : score <= r.max; };
+
+  auto first = count_less (before_min);
+  auto last = count_less (up_to_max);
+  if (last < first)
+    last = first;
+  return { first, last };
+}
+
+std::pair<std::size_t, std::size_t>
+zset::rank_range (const lex_range &r) const
+{
+  auto before_min = [&r] (const std::string &member, double)
+    {
+      if (r.min_inf)
+	return false;
+      return r.min_ex ? member <= r.min : member < r.min;
+    };
+  auto up_to_max = [&r] (const std::string &member, double)
+    {
+      if (r.max_inf)
+	return true;
+      return r.max_ex ? member < r.max : member <= r.max;
+    };
+
+  auto first = count_less (before_min);
+  auto last = count_less (up_to_max);
+  if (last < first)
+    last = first;
+  return { first, last };
+}
+
+std::vector<zset::entry>
+zset::range (std::size_t first, std::size_t last) const
+{
+  std::vector<entry> out;
+  if (last > size ())
+    last = size ();
+  if (first >= last)
+    return out;
+
+  out.reserve (last - first);
+  if (packed_)
+    {
+      out.assign (packed_entries_.begin () + first,
+		  packed_entries_.begin () + last);
+      return out;
+    }
+
+  auto x = sl_at (first);
+  for (auto n = last - first; n != 0 && x != nullptr; n--)
+    {
+      out.push_back (entry{ x->member, x->score });
+      x = x->levels[0].forward;
+    }
+  return out;
+}
+
+std::size_t
+zset::erase_range (std::size_t first, std::size_t last)
+{
+  if (last > size ())
+    last = size ();
+  if (first >= last)
+    return 0;
+
+  auto n = last - first;
+  if (packed_)
+    {
+      packed_entries_.erase (packed_entries_.begin () + first,
+			     packed_entries_.begin () + last);
+      return n;
+    }
+
+  auto x = const_cast<node *> (sl_at (first));
+  for (auto i = n; i != 0 && x != nullptr; i--)
+    {
+      auto next = x->levels[0].forward;
+      dict_.erase (string_view{ x->member });
+      sl_erase (x);
+      x = next;
+    }
+  return n;
+}
+
+zset::node *
+zset::make_node (int height, std::string member, double score)
+{
+  auto bytes = sizeof (node) + (height - 1) * sizeof (level);
+  auto mem = ::operator new (bytes);
+  auto x = new (mem) node{ std::move (member), score, nullptr, height, {} };
+  for (int i = 0; i < height; i++)
+    x->levels[i] = level{ nullptr, 0 };
+  return x;
+}
+
+void
+zset::free_node (node *x) noexcept
+{
+  x->~node ();
+  ::operator delete (x);
+}
+
+int
+zset::random_level ()
+{
+  static thread_local std::minstd_rand gen{ std::random_device{}() };
+  int height = 1;
+  while (height < max_level && (gen () & 0xffff) < (0xffff >> 2))
+    height++;
+  return height;
+}
+
+void
+zset::convert ()
+{
+  BOOST_ASSERT (packed_);
+
+  std::vector<entry> entries;
+  entries.swap (packed_entries_);
+  packed_entries_.shrink_to_fit ();
+
+  packed_ = false;
+  sl_init ();
+  dict_.reserve (entries.size () + 1);
+  for (auto &e : entries)
+    {
+      auto x = sl_insert (std::move (e.member), e.score);
+      dict_.emplace (string_view{ x->member }, x);
+    }
+}
+
+void
+zset::clear () noexcept
+{
+  dict_.clear ();
+  packed_entries_.clear ();
+  if (header_ != nullptr)
+    {
+      auto x = header_->levels[0].forward;
+      while (x != nullptr)
+	{
+	  auto next = x->levels[0].forward;
+	  free_node (x);
+	  x = next;
+	}
+      free_node (header_);
+    }
+
+  packed_ = true;
+  header_ = nullptr;
+  tail_ = nullptr;
+  length_ = 0;
+  level_ = 0;
+}
+
+void
+zset::sl_init ()
+{
+  header_ = make_node (max_level, std::string{}, 0);
+  tail_ = nullptr;
+  length_ = 0;
+  level_ = 1;
+}
+
+zset::node *
+zset::sl_insert (std::string member, double score)
+{
+  node *update[max_level];
+  std::size_t rank[max_level];
+
+  auto x = header_;
+  for (int i = level_ - 1; i >= 0; i--)
+    {
+      rank[i] = i == level_ - 1 ? 0 : rank[i + 1];
+      while (x->levels[i].forward != nullptr
+	     && entry_less (x->levels[i].forward->score,
+			    x->levels[i].forward->member, score, member))
+	{
+	  rank[i] += x->levels[i].span;
+	  x = x->levels[i].forward;
+	}
+      update[i] = x;
+    }
+
+  int height = random_level ();
+  if (height > level_)
+    {
+      for (int i = level_; i < height; i++)
+	{
+	  rank[i] = 0;
+	  update[i] = header_;
+	  update[i]->levels[i].span = length_;
+	}
+      level_ = height;
+    }
+
+  x = make_node (height, std::move (member), score);
+  for (int i = 0; i < height; i++)
+    {
+      x->levels[i].forward = update[i]->levels[i].forward;
+      update[i]->levels[i].forward = x;
+
+      x->levels[i].span = update[i]->levels[i].span - (rank[0] - rank[i]);
+      update[i]->levels[i].span = (rank[0] - rank[i]) + 1;
+    }
+
+  for (int i = height; i < level_; i++)
+    update[i]->levels[i].span++;
+
+  x->backward = update[0] == header_ ? nullptr : update[0];
+  if (x->levels[0].forward != nullptr)
+    x->levels[0].forward->backward = x;
+  else
+    tail_ = x;
+
+  length_++;
+  return x;
+}
+
+void
+zset::sl_erase (node *target)
+{
+  sl_unlink (target);
+  free_node (target);
+}
+
+void
+zset::sl_unlink (node *target)
+{
+  node *update[max_level];
+
+  auto x = header_;
+  for (int i = level_ - 1; i >= 0; i--)
+    {
+      while (x->levels[i].forward != nullptr
+	     && x->levels[i].forward != target
+	     && entry_less (x->levels[i].forward->score,
+			    x->levels[i].forward->member, target->score,
+			    target->member))
+	x = x->levels[i].forward;
+      update[i] = x;
+    }
+
+  BOOST_ASSERT (update[0]->levels[0].forward == target);
+
+  for (int i = 0; i < level_; i++)
+    {
+      if (update[i]->levels[i].forward == target)
+	{
+	  update[i]->levels[i].span += target->levels[i].span - 1;
+	  update[i]->levels[i].forward = target->levels[i].forward;
+	}
+      else
+	update[i]->levels[i].span--;
+    }
+
+  if (target->levels[0].forward != nullptr)
+    target->levels[0].forward->backward = target->backward;
+  else
+    tail_ = target->backward;
+
+  while (level_ > 1 && header_->levels[level_ - 1].forward == nullptr)
+    level_--;
+
+  length_--;
+}
+
+std::size_t
+zset::sl_rank (const node *target) const
+{
+  std::size_t traversed = 0;
+  const node *x = header_;
+  for (int i = level_ - 1; i >= 0; i--)
+    {
+      while (x->levels[i].forward != nullptr
+	     && (x->levels[i].forward == target
+		 || entry_less (x->levels[i].forward->score,
+				x->levels[i].forward->member, target->score,
+				target->member)))
+	{
+	  traversed += x->levels[i].span;
+	  x = x->levels[i].forward;
+	}
+      if (x == target)
+	return traversed - 1;
+    }
+
+  BOOST_THROW_EXCEPTION (std::logic_error ("zset node not found"));
+}
+
+const zset::node *
+zset::sl_at (std::size_t rank) const
+{
+  // Ranks in the skiplist are 1-based.
+  rank++;
+  std::size_t traversed = 0;
+  const node *x = header_;
+  for (int i = level_ - 1; i >= 0; i--)
+    {
+      while (x->levels[i].forward != nullptr
+	     && traversed + x->levels[i].span <= rank)
+	{
+	  traversed += x->levels[i].span;
+	  x = x->levels[i].forward;
+	}
+      if (traversed == rank)
+	return x;
+    }
+  return nullptr;
+}
+
+zset::packed_iterator
+zset::packed_find (const std::string &member) const
+{
+  return std::find_if (packed_entries_.begin (), packed_entries_.end (),
+		       [&member] (const entry &e)
+			 { return e.member == member; });
+}
+
+std::string
+format_score (double score)
+{
+  if (std::isinf (score))
+    return score > 0 ? "inf" : "-inf";
+
+  char buf[32];
+  for (int precision = 15; precision <= 17; precision++)
+    {
+      std::snprintf (buf, sizeof (buf), "%.*g", precision, score);
+      if (precision == 17 || std::strtod (buf, nullptr) == score)
+	break;
+    }
+  return buf;
+}
+
+bool
+parse_score (string_view str, double &out)
+{
+  if (str.empty () || std::isspace (static_cast<unsigned char> (str[0])))
+    return false;
+
+  std::string s = str.to_string ();
+  boost::to_lower (s);
+  if (s == "inf" || s == "+inf")
+    {
+      out = std::numeric_limits<double>::infinity ();
+      return true;
+    }
+  if (s == "-inf")
+    {
+      out = -std::numeric_limits<double>::infinity ();
+      return true;
+    }
+
+  char *end = nullptr;
+  errno = 0;
+  double d = std::strtod (s.c_str (), &end);
+  if (end != s.c_str () + s.size () || errno == ERANGE || std::isnan (d))
+    return false;
+
+  out = d;
+  return true;
+}
+
+} // namespace db
+} // namespace mini_redis
@@ -0,0 +1,150 @@
+#ifndef DB_ZSET_H
+#define DB_ZSET_H
+
+#include "pch.h"
+
+namespace mini_redis
+{
+namespace db
+{
+
+// A sorted set ordered by (score, member).
+//
+// Small sets are kept as a packed vector sorted by (score, member). Once a
+// set outgrows the packed limits it is converted to a skiplist whose links
+// carry spans, so that rank queries stay O(log n), plus a hash from member to
+// skiplist node for O(1) score lookups. Every query is expressed in terms of
+// ranks, so both encodings share the same interface.
+class zset
+{
+public:
+  struct entry
+  {
+    std::string member;
+    double score;
+  };
+
+  struct score_range
+  {
+    double min;
+    double max;
+    bool min_ex;
+    bool max_ex;
+  };
+
+  struct lex_range
+  {
+    std::string min;
+    std::string max;
+    bool min_ex;
+    bool max_ex;
+    bool min_inf; // min is "-"
+    bool max_inf; // max is "+"
+  };
+
+  static constexpr std::size_t packed_max_entries = 128;
+  static constexpr std::size_t packed_max_member_len = 64;
+
+public:
+  zset () noexcept;
+  ~zset ();
+
+  zset (const zset &other);
+  zset &operator= (const zset &other);
+  zset (zset &&other) noexcept;
+  zset &operator= (zset &&other) noexcept;
+
+  std::size_t size () const noexcept;
+  bool empty () const noexcept;
+  bool is_packed () const noexcept;
+
+  optional<double> score (const std::string &member) const;
+  // Returns true if the member was added, false if its score was updated.
+  bool insert (std::string member, double score);
+  bool erase (const std::string &member);
+
+  // 0-based rank in ascending order.
+  optional<std::size_t> rank (const std::string &member) const;
+
+  // Number of entries that come before the range / are inside or before it.
+  // The entries of the range are the ranks in [first, last).
+  std::pair<std::size_t, std::size_t> rank_range (const score_range &r) const;
+  std::pair<std::size_t, std::size_t> rank_range (const lex_range &r) const;
+
+  // Entries in [first, last) by ascending rank.
+  std::vector<entry> range (std::size_t first, std::size_t last) const;
+  // Removes entries in [first, last) and returns the number removed.
+  std::size_t erase_range (std::size_t first, std::size_t last);
+
+  template <class Fn>
+  void
+  for_each (Fn fn) const
+  {
+    if (packed_)
+      for (const auto &e : packed_entries_)
+	fn (e.member, e.score);
+    else
+      for (auto x = header_->levels[0].forward; x != nullptr;
+	   x = x->levels[0].forward)
+	fn (x->member, x->score);
+  }
+
+private:
+  struct node;
+
+  struct level
+  {
+    node *forward;
+    std::size_t span;
+  };
+
+  struct node
+  {
+    std::string member;
+    double score;
+    node *backward;
+    int height;
+    level levels[1];
+  };
+
+  static constexpr int max_level = 32;
+
+  static node *make_node (int height, std::string member, double score);
+  static void free_node (node *x) noexcept;
+  static int random_level ();
+
+  template <class Less> std::size_t count_less (Less less) const;
+
+  void convert ();
+  void clear () noexcept;
+
+  void sl_init ();
+  node *sl_insert (std::string member, double score);
+  void sl_erase (node *x);
+  void sl_unlink (node *x);
+  std::size_t sl_rank (const node *x) const;
+  const node *sl_at (std::size_t rank) const;
+
+  typedef std::vector<entry>::const_iterator packed_iterator;
+  packed_iterator packed_find (const std::string &member) const;
+
+private:
+  bool packed_;
+  std::vector<entry> packed_entries_;
+
+  node *header_;
+  node *tail_;
+  std::size_t length_;
+  int level_;
+  unordered_flat_map<string_view, node *> dict_;
+}; // class zset
+
+// Shortest text form of a score that parses back to the same value.
+std::string format_score (double score);
+// Parses a score, accepting "inf", "+inf" and "-inf". NaN is rejected.
+bool parse_score (string_view str, double &out);
+
+} // namespace db
+} // namespace mini_redis
+
+#endif // DB_ZSET_H
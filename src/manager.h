@@ -5,6 +5,7 @@
 
 #include "config.h"
 #include "processor.h"
+#include "replica_link.h"
 #include "resp_data.h"
 
 namespace mini_redis
@@ -14,7 +15,9 @@ class manager
 {
 public:
   explicit manager (asio::any_io_executor ex, config cfg)
-      : config_{ std::move (cfg) }, processor_{ config_ }, strand_{ ex }
+      : config_{ std::move (cfg) }, processor_{ config_ }, strand_{ ex },
+	cron_timer_{ strand_ }, save_slice_timer_{ strand_ },
+	script_timer_{ strand_ }
   {
   }
 
@@ -38,10 +41,133 @@ public:
     asio::dispatch (strand_, std::bind (std::move (task), &processor_));
   }
 
+  // Runs processor::cron on the strand every 100 ms.
+  void
+  start_cron ()
+  {
+    cron_timer_.expires_after (milliseconds{ 100 });
+    auto wait_cb = [this] (const error_code &ec)
+      {
+	if (ec)
+	  return;
+	processor_.cron ();
+	run_save_slices ();
+	update_replica_link ();
+	start_cron ();
+      };
+    cron_timer_.async_wait (wait_cb);
+  }
+
+  // Runs the slices of a BGSAVE that does not fork, each as a task of its
+  // own on the strand. Each one waits on an expired timer, which lets the
+  // pending socket events through first, so that the requests that arrived
+  // during a slice run before the next one. Called on the strand.
+  void
+  run_save_slices ()
+  {
+    if (save_slice_posted_ || !processor_.sliced_save_active ())
+      return;
+
+    save_slice_posted_ = true;
+    auto slice = [this] (const error_code &ec)
+      {
+	save_slice_posted_ = false;
+	if (ec)
+	  return;
+	processor_.save_slice ();
+	run_save_slices ();
+      };
+    save_slice_timer_.expires_after (steady_clock::duration::zero ());
+    save_slice_timer_.async_wait (slice);
+  }
+
+  // Runs a script paused past the busy threshold a slice at a time, the
+  // same way, so that the other clients are answered between the slices.
+  // done is called with the reply of the script once it ends. Called on
+  // the strand.
+  void
+  run_script_slices (std::function<void (processor *, resp::data)> done)
+  {
+    auto slice = [this, done] (const error_code &ec)
+      {
+	if (ec)
+	  return;
+	auto reply = processor_.resume_script ();
+	if (!reply.has_value ())
+	  return run_script_slices (done);
+	done (&processor_, std::move (reply.value ()));
+      };
+    script_timer_.expires_after (steady_clock::duration::zero ());
+    script_timer_.async_wait (slice);
+  }
+
+  // Follows REPLICAOF: the link to the primary is replaced whenever the
+  // processor is pointed at another one. Called on the strand.
+  void
+  update_replica_link ()
+  {
+    auto gen = processor_.primary_generation ();
+    if (gen == replica_link_gen_)
+      return;
+
+    replica_link_gen_ = gen;
+    if (replica_link_ != nullptr)
+      replica_link_->stop ();
+    replica_link_.reset ();
+
+    const auto &primary = processor_.primary ();
+    if (!primary.has_value ())
+      return;
+    replica_link_ = std::make_shared<replica_link> (
+	strand_, processor_, primary->host, primary->port,
+	config_.dbfilename + ".sync");
+    replica_link_->start ();
+  }
+
+  result<void, std::string>
+  load_data ()
+  {
+    return processor_.load_data ();
+  }
+
+  // Runs reply on the strand once the writes executed so far have reached
+  // the append-only file. Called on the strand. The flush is posted behind
+  // the work already queued, so every batch executed before it gets there
+  // shares a single write and fsync: pipelined and concurrent clients
+  // amortize the fsync cost of appendfsync always.
+  void
+  after_flush (std::function<void ()> reply)
+  {
+    if (pending_replies_.empty () && !processor_.has_unflushed_writes ())
+      return reply ();
+
+    pending_replies_.push_back (std::move (reply));
+    if (pending_replies_.size () > 1)
+      return;
+
+    auto flush = [this] ()
+      {
+	processor_.flush_append_only_file ();
+	std::vector<std::function<void ()>> replies;
+	replies.swap (pending_replies_);
+	for (auto &reply : replies)
+	  reply ();
+      };
+    asio::post (strand_, flush);
+  }
+
 private:
   config config_;
   processor processor_;
   asio::strand<asio::any_io_executor> strand_;
+  asio::steady_timer cron_timer_;
+  asio::steady_timer save_slice_timer_;
+  asio::steady_timer script_timer_;
+  // Replies waiting for the next append-only file flush.
+  std::vector<std::function<void ()>> pending_replies_;
+  bool save_slice_posted_ = false;
+  std::shared_ptr<replica_link> replica_link_;
+  std::uint64_t replica_link_gen_ = 0;
 }; // class manager
 
 } // namespace mini_redis
@@ -0,0 +1,109 @@
+#include "migrate_link.h"
+
+namespace mini_redis
+{
+
+migrate_link::migrate_link (asio::strand<asio::any_io_executor> strand,
+			    std::string host, std::uint16_t port,
+			    std::string commands, std::size_t count,
+			    milliseconds timeout, callback done)
+    : host_{ std::move (host) }, port_{ port },
+      commands_{ std::move (commands) }, replies_left_{ count },
+      timeout_{ timeout }, done_{ std::move (done) }, resolver_{ strand },
+      socket_{ strand }, timer_{ strand },
+      parser_{ resp::parser::config{} }
+{
+}
+
+void
+migrate_link::start ()
+{
+  auto self = shared_from_this ();
+  auto timeout_cb = [self] (const error_code &ec)
+    {
+      if (!ec)
+	self->finish (std::string{ "IOERR error or timeout talking to the "
+				   "target instance" });
+    };
+  timer_.expires_after (timeout_);
+  timer_.async_wait (timeout_cb);
+
+  auto write_cb = [self] (const error_code &ec, std::size_t)
+    {
+      if (ec)
+	return self->finish (std::string{ "IOERR error or timeout writing "
+					  "to the target instance" });
+      self->start_recv ();
+    };
+  auto connect_cb = [self, write_cb] (const error_code &ec,
+				      const tcp::endpoint &)
+    {
+      if (ec)
+	return self->finish (std::string{ "IOERR error or timeout "
+					  "connecting to the client" });
+      asio::async_write (self->socket_, asio::buffer (self->commands_),
+			 write_cb);
+    };
+  auto resolve_cb = [self, connect_cb] (const error_code &ec,
+					tcp::resolver::results_type results)
+    {
+      if (ec)
+	return self->finish (std::string{ "IOERR error or timeout "
+					  "connecting to the client" });
+      asio::async_connect (self->socket_, results, connect_cb);
+    };
+  resolver_.async_resolve (host_, std::to_string (port_), resolve_cb);
+}
+
+void
+migrate_link::start_recv ()
+{
+  auto self = shared_from_this ();
+  auto receive_cb = [self] (const error_code &ec, std::size_t n)
+    {
+      if (ec)
+	return self->finish (std::string{ "IOERR error or timeout reading "
+					  "from the target instance" });
+
+      auto &parser = self->parser_;
+      parser.append ({ self->recv_buffer_.data (), n });
+      parser.parse ();
+      while (parser.has_data () && self->replies_left_ != 0)
+	{
+	  auto reply = parser.pop_data ();
+	  self->replies_left_--;
+	  auto err = reply.get_if<resp::simple_error> ();
+	  if (err != nullptr && !self->error_.has_value ())
+	    self->error_ = "ERR Target instance replied with error: "
+			   + *err;
+	}
+      if (parser.has_error ())
+	return self->finish (std::string{ "IOERR bad reply from the target "
+					  "instance" });
+      if (self->replies_left_ != 0)
+	return self->start_recv ();
+
+      if (self->error_.has_value ())
+	return self->finish (std::move (self->error_.value ()));
+      self->finish ({});
+    };
+  socket_.async_receive (asio::buffer (recv_buffer_), receive_cb);
+}
+
+void
+migrate_link::finish (result<void, std::string> res)
+{
+  if (!done_)
+    return;
+
+  auto done = std::move (done_);
+  done_ = nullptr;
+  error_code ec;
+  timer_.cancel ();
+  resolver_.cancel ();
+  auto r = socket_.close (ec);
+  (void) r;
+  done (std::move (res));
+}
+
+} // namespace mini_redis
@@ -0,0 +1,51 @@
+#ifndef MIGRATE_LINK_H
+#define MIGRATE_LINK_H
+
+#include "pch.h"
+
+#include "resp_parser.h"
+
+namespace mini_redis
+{
+
+// The connection of a MIGRATE to its target. It sends the commands that
+// restore the keys there, and reads a reply to each of them, all within
+// the timeout; done is then called once, with the first error replied, or
+// the failure to talk to the target.
+class migrate_link : public std::enable_shared_from_this<migrate_link>
+{
+public:
+  typedef std::function<void (result<void, std::string>)> callback;
+
+  migrate_link (asio::strand<asio::any_io_executor> strand, std::string host,
+		std::uint16_t port, std::string commands, std::size_t count,
+		milliseconds timeout, callback done);
+
+  migrate_link (const migrate_link &) = delete;
+  migrate_link &operator= (const migrate_link &) = delete;
+
+  void start ();
+
+private:
+  void start_recv ();
+  void finish (result<void, std::string> res);
+
+private:
+  std::string host_;
+  std::uint16_t port_;
+  std::string commands_;
+  std::size_t replies_left_;
+  milliseconds timeout_;
+  callback done_;
+
+  tcp::resolver resolver_;
+  tcp::socket socket_;
+  asio::steady_timer timer_;
+  std::array<char, 4096> recv_buffer_;
+  resp::parser parser_;
+  optional<std::string> error_;
+}; // class migrate_link
+
+} // namespace mini_redis
+
+#endif // MIGRATE_LINK_H
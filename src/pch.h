@@ -17,18 +17,27 @@
 #include <boost/utility/string_view.hpp>
 #include <boost/variant2.hpp>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cerrno>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <deque>
+#include <functional>
 #include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <random>
 #include <sstream>
 #include <string>
 #include <system_error>
+#include <thread>
 #include <vector>
 
 namespace mini_redis
@@ -54,6 +63,7 @@ using boost::make_span;
 using boost::make_unique;
 using boost::conversion::try_lexical_convert;
 
+using chrono::microseconds;
 using chrono::milliseconds;
 using chrono::seconds;
 using chrono::steady_clock;
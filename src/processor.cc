@@ -1,4 +1,5 @@
 #include "processor.h"
+#include "db_bitops.h"
 #include "db_disk.h"
 
 namespace mini_redis
@@ -6,8 +7,6 @@ namespace mini_redis
 namespace
 {
 
-const char *default_dump_path = "dump.mrdb";
-
 resp::data
 integer (std::int64_t num)
 {
@@ -78,6 +77,59 @@ const resp::data e_index_out_of_range
 const resp::data e_value_out_of_range_positive
     = simple_error ("ERR value is out of range, must be positive");
 
+const resp::data e_bit_offset
+    = simple_error ("ERR bit offset is not an integer or out of range");
+
+const resp::data e_bit_value
+    = simple_error ("ERR bit is not an integer or out of range");
+
+const resp::data e_not_float = simple_error ("ERR value is not a valid float");
+
+const resp::data e_score_nan
+    = simple_error ("ERR resulting score is not a number (NaN)");
+
+const resp::data e_min_max_not_float
+    = simple_error ("ERR min or max is not a float");
+
+const resp::data e_min_max_not_string
+    = simple_error ("ERR min or max not valid string range item");
+
+const resp::data e_bgsave_in_progress
+    = simple_error ("ERR Background save already in progress");
+
+const resp::data e_rewrite_in_progress = simple_error (
+    "ERR Background append only file rewriting already in progress");
+
+const resp::data e_readonly
+    = simple_error ("READONLY You can't write against a read only replica.");
+
+const resp::data e_cluster_disabled
+    = simple_error ("ERR This instance has cluster support disabled");
+
+const resp::data e_crossslot
+    = simple_error ("CROSSSLOT Keys in request don't hash to the same slot");
+
+const resp::data e_clusterdown
+    = simple_error ("CLUSTERDOWN Hash slot not served");
+
+const resp::data e_tryagain = simple_error (
+    "TRYAGAIN Multiple keys request during rehashing of slot");
+
+const resp::data e_key_migrating
+    = simple_error ("TRYAGAIN Key is being migrated");
+
+const resp::data e_invalid_slot
+    = simple_error ("ERR Invalid or out of range slot");
+
+const resp::data e_execabort = simple_error (
+    "EXECABORT Transaction discarded because of previous errors.");
+
+const resp::data e_noscript
+    = simple_error ("NOSCRIPT No matching script. Please use EVAL.");
+
+const resp::data e_busy = simple_error (
+    "BUSY Redis is busy running a script. You can only call SCRIPT KILL.");
+
 resp::data
 e_wrong_num_args (string_view cmd)
 {
@@ -104,6 +156,249 @@ e_persistence (std::string msg)
   return simple_error (std::move (out));
 }
 
+// Collects the keys of a request into out, from the positions of its key
+// specification; see processor::execute. The keys of XREAD follow its
+// STREAMS option instead, and the ones of EVAL and EVALSHA their numkeys.
+void
+command_keys (string_view cmd, const std::vector<std::string> &args,
+	      int first, int last, int step, std::vector<string_view> &out)
+{
+  out.clear ();
+  if (cmd == "eval" || cmd == "evalsha")
+    {
+      std::int64_t n;
+      if (args.size () < 2 || !try_lexical_convert (args[1], n))
+	return;
+      for (std::size_t i = 2; i < args.size () && n > 0; i++, n--)
+	out.push_back (args[i]);
+      return;
+    }
+  if (cmd == "xread")
+    {
+      for (std::size_t i = 0; i < args.size (); i++)
+	if (boost::iequals (args[i], "streams"))
+	  {
+	    auto n = (args.size () - i - 1) / 2;
+	    for (std::size_t k = 0; k < n; k++)
+	      out.push_back (args[i + 1 + k]);
+	    break;
+	  }
+      return;
+    }
+
+  if (first == 0)
+    return;
+  auto argc = static_cast<int> (args.size ()) + 1;
+  if (last < 0)
+    last += argc;
+  for (int i = first; i <= last && i < argc; i += step)
+    out.push_back (args[static_cast<std::size_t> (i - 1)]);
+}
+
+// Yields the bytes of file a piece of at most 1 MiB at a time, and null
+// once they have all been yielded.
+processor::replica_source
+file_source (std::shared_ptr<db::mapped_file> file)
+{
+  std::size_t offset = 0;
+  auto next = [file, offset] () mutable -> std::shared_ptr<const std::string>
+    {
+      const std::size_t piece_size = 1 << 20;
+      auto bytes = file->bytes ();
+      if (offset == bytes.size ())
+	return nullptr;
+      auto n = std::min (piece_size, bytes.size () - offset);
+      auto piece = std::make_shared<std::string> (bytes.data () + offset, n);
+      offset += n;
+      return piece;
+    };
+  return next;
+}
+
+// Parses a hash slot number.
+bool
+parse_slot (const std::string &arg, std::size_t &slot)
+{
+  std::int64_t n;
+  if (!try_lexical_convert (arg, n) || n < 0
+      || n >= static_cast<std::int64_t> (db::slot_count))
+    return false;
+  slot = static_cast<std::size_t> (n);
+  return true;
+}
+
+// Matches one byte of a glob pattern at p, a character class or an
+// escaped byte taking several, and sets next past it.
+bool
+glob_match_one (string_view pattern, std::size_t p, char c, std::size_t &next)
+{
+  if (pattern[p] == '?')
+    {
+      next = p + 1;
+      return true;
+    }
+  if (pattern[p] == '\\' && p + 1 < pattern.size ())
+    {
+      next = p + 2;
+      return pattern[p + 1] == c;
+    }
+  if (pattern[p] != '[')
+    {
+      next = p + 1;
+      return pattern[p] == c;
+    }
+
+  // [abc], [^abc], [a-z] and [\]], up to the end of an unclosed class.
+  auto i = p + 1;
+  bool negate = i < pattern.size () && pattern[i] == '^';
+  if (negate)
+    i++;
+  bool found = false;
+  auto uc = static_cast<unsigned char> (c);
+  for (; i < pattern.size () && pattern[i] != ']'; i++)
+    {
+      if (pattern[i] == '\\' && i + 1 < pattern.size ())
+	found = found || pattern[++i] == c;
+      else if (i + 2 < pattern.size () && pattern[i + 1] == '-'
+	       && pattern[i + 2] != ']')
+	{
+	  auto lo = static_cast<unsigned char> (pattern[i]);
+	  auto hi = static_cast<unsigned char> (pattern[i + 2]);
+	  if (lo > hi)
+	    std::swap (lo, hi);
+	  found = found || (uc >= lo && uc <= hi);
+	  i += 2;
+	}
+      else
+	found = found || pattern[i] == c;
+    }
+  next = i < pattern.size () ? i + 1 : i;
+  return found != negate;
+}
+
+// Glob-style matching as PSUBSCRIBE does it: * ? [...] and \ escapes.
+bool
+glob_match (string_view pattern, string_view str)
+{
+  // On a mismatch, the last * swallows one more byte and matching resumes
+  // after it; earlier stars never need to be revisited.
+  auto star = string_view::npos;
+  std::size_t p = 0, s = 0, star_s = 0;
+  while (s < str.size ())
+    {
+      std::size_t next;
+      if (p < pattern.size () && pattern[p] == '*')
+	{
+	  star = ++p;
+	  star_s = s;
+	  continue;
+	}
+      if (p < pattern.size () && glob_match_one (pattern, p, str[s], next))
+	{
+	  p = next;
+	  s++;
+	  continue;
+	}
+      if (star == string_view::npos)
+	return false;
+      p = star;
+      s = ++star_s;
+    }
+  while (p < pattern.size () && pattern[p] == '*')
+    p++;
+  return p == pattern.size ();
+}
+
+// The commands a client may send while it is subscribed to something.
+bool
+allowed_when_subscribed (string_view cmd)
+{
+  return cmd == "subscribe" || cmd == "psubscribe" || cmd == "unsubscribe"
+	 || cmd == "punsubscribe" || cmd == "ping";
+}
+
+bool
+subscribed (const processor::client_state &client)
+{
+  return !client.channels.empty () || !client.patterns.empty ();
+}
+
+// The commands that cannot be queued by MULTI: the ones that change what
+// the connection is, or that need the connection to complete.
+bool
+allowed_in_multi (string_view cmd)
+{
+  return cmd != "subscribe" && cmd != "psubscribe" && cmd != "unsubscribe"
+	 && cmd != "punsubscribe" && cmd != "psync" && cmd != "replicaof"
+	 && cmd != "migrate";
+}
+
+// Scripts cannot run the commands that cannot be queued either, nor
+// transactions, nor other scripts.
+bool
+allowed_in_script (string_view cmd)
+{
+  return allowed_in_multi (cmd) && cmd != "multi" && cmd != "exec"
+	 && cmd != "discard" && cmd != "watch" && cmd != "unwatch"
+	 && cmd != "eval" && cmd != "evalsha" && cmd != "script";
+}
+
+void
+discard_transaction (processor::client_state &client)
+{
+  client.multi = false;
+  client.multi_failed = false;
+  client.queued.clear ();
+}
+
+// The confirmation of a (un)subscription, with the number of subscriptions
+// the client has left.
+resp::data
+subscription_reply (string_view kind, const std::string *name,
+		    const processor::client_state &client)
+{
+  std::vector<resp::data> out;
+  out.push_back (bulk_string (kind.to_string ()));
+  out.push_back (name != nullptr ? bulk_string (*name) : null_bulk_string ());
+  out.push_back (integer (static_cast<std::int64_t> (
+      client.channels.size () + client.patterns.size ())));
+  return array (std::move (out));
+}
+
+template <class Map>
+void
+remove_subscription (Map &subscribers, const std::string &name,
+		     processor::client_state *client)
+{
+  auto it = subscribers.find (name);
+  if (it == subscribers.end ())
+    return;
+  it->second.erase (client);
+  if (it->second.empty ())
+    subscribers.erase (it);
+}
+
+// 40 random hex digits naming a replication stream.
+std::string
+new_replication_id ()
+{
+  static const char digits[] = "0123456789abcdef";
+  std::random_device rd;
+  std::mt19937_64 gen{ (static_cast<std::uint64_t> (rd ()) << 32) ^ rd () };
+  std::string id (40, '0');
+  for (auto &c : id)
+    c = digits[gen () & 15];
+  return id;
+}
+
+// Milliseconds since the UNIX epoch, as PXAT and PEXPIREAT take them.
+std::string
+unix_time_ms (db::time_point at)
+{
+  auto ms = duration_cast<milliseconds> (at.time_since_epoch ());
+  return std::to_string (ms.count ());
+}
+
 template <class Op>
 optional<std::int64_t>
 checked_calc (std::int64_t lhs, std::int64_t rhs)
@@ -191,1161 +486,6657 @@ normalize_lrange (std::int64_t start, std::int64_t stop, std::size_t len)
   };
 }
 
-} // namespace
-
-processor::processor (config &cfg) : config_{ cfg } {}
+bool
+parse_score_bound (string_view str, double &out, bool &ex)
+{
+  ex = false;
+  if (!str.empty () && str[0] == '(')
+    {
+      ex = true;
+      str.remove_prefix (1);
+    }
+  return db::parse_score (str, out);
+}
 
-resp::data
-processor::execute (resp::data resp)
+bool
+parse_lex_bound (string_view str, std::string &out, bool &ex, bool &inf)
 {
-  typedef resp::data (processor::*exec_fn) ();
-  static const unordered_flat_map<string_view, exec_fn> exec_map{
-    // Connection commands
-    { "ping", &processor::exec_ping },
+  ex = false;
+  inf = false;
+  if (str.empty ())
+    return false;
 
-    // Server commands
-    { "save", &processor::exec_save },
-    { "load", &processor::exec_load },
+  switch (str[0])
+    {
+    case '-':
+    case '+':
+      if (str.size () != 1)
+	return false;
+      inf = true;
+      return true;
 
-    // String commands
-    { "set", &processor::exec_set },
-    { "get", &processor::exec_get },
-    { "incr", &processor::exec_incr },
-    { "incrby", &processor::exec_incrby },
-    { "decr", &processor::exec_decr },
-    { "decrby", &processor::exec_decrby },
+    case '(':
+      ex = true;
+      BOOST_FALLTHROUGH;
 
-    // Generic commands
-    { "del", &processor::exec_del },
-    { "expire", &processor::exec_expire },
-    { "pexpire", &processor::exec_pexpire },
-    { "expireat", &processor::exec_expireat },
-    { "pexpireat", &processor::exec_pexpireat },
-    { "ttl", &processor::exec_ttl },
-    { "pttl", &processor::exec_pttl },
+    case '[':
+      out.assign (str.data () + 1, str.size () - 1);
+      return true;
 
-    // List commands
-    { "llen", &processor::exec_llen },
-    { "lindex", &processor::exec_lindex },
-    { "lrange", &processor::exec_lrange },
-
-    { "lset", &processor::exec_lset },
-    { "lrem", &processor::exec_lrem },
-    { "linsert", &processor::exec_linsert },
-
-    { "lpush", &processor::exec_lpush },
-    { "rpush", &processor::exec_rpush },
-    { "lpop", &processor::exec_lpop },
-    { "rpop", &processor::exec_rpop },
-  };
+    default:
+      return false;
+    }
+}
 
-  if (!resp.is<resp::array> ())
-    return e_protocol;
+void
+append_zset_entries (std::vector<resp::data> &out,
+		     std::vector<db::zset::entry> entries, bool with_scores,
+		     bool reverse)
+{
+  if (reverse)
+    std::reverse (entries.begin (), entries.end ());
 
-  auto &arr = resp.get<resp::array> ();
-  if (!arr.has_value ())
-    return e_protocol;
+  out.reserve (out.size () + entries.size () * (with_scores ? 2 : 1));
+  for (auto &e : entries)
+    {
+      out.push_back (bulk_string (std::move (e.member)));
+      if (with_scores)
+	out.push_back (bulk_string (db::format_score (e.score)));
+    }
+}
 
-  auto &vec = arr.value ();
-  if (vec.empty ())
-    return e_protocol;
+// Bitmaps are limited to 512 MB, like Redis strings.
+const std::uint64_t max_bit_offset = std::uint64_t{ 512 } * 1024 * 1024 * 8;
 
-  bool all_str = true;
-  for (const auto &v : vec)
+bool
+parse_bit_offset (const std::string &str, std::uint64_t &out)
+{
+  std::int64_t n;
+  if (!try_lexical_convert (str, n) || n < 0
+      || static_cast<std::uint64_t> (n) >= max_bit_offset)
+    return false;
+  out = static_cast<std::uint64_t> (n);
+  return true;
+}
+
+// Views the value of a string-like key; integers are rendered into tmp.
+bool
+read_string_value (const db::data &data, std::string &tmp, string_view &out)
+{
+  if (data.is<db::string> ())
     {
-      auto p = v.get_if<resp::bulk_string> ();
-      if (p == nullptr || !p->has_value ())
-	{
-	  all_str = false;
-	  break;
-	}
+      out = data.get<db::string> ();
+      return true;
     }
-  if (!all_str)
-    return e_protocol;
-
-  args_.clear ();
-  args_.reserve (vec.size () - 1);
-  for (auto it = vec.begin () + 1; it != vec.end (); it++)
-    args_.push_back (std::move (it->get<resp::bulk_string> ().value ()));
+  if (data.is<db::integer> ())
+    {
+      tmp = lexical_cast<std::string> (data.get<db::integer> ());
+      out = tmp;
+      return true;
+    }
+  return false;
+}
 
-  const auto &cmd_raw = vec[0].get<resp::bulk_string> ().value ();
-  auto cmd = cmd_raw;
-  boost::to_lower (cmd);
-  auto it = exec_map.find (cmd);
-  if (it == exec_map.end ())
-    return e_unknown_command (cmd_raw);
+// Returns the string of a string-like key for modification, converting an
+// integer value to its string form. Returns nullptr on wrong type.
+std::string *
+write_string_value (db::data &data)
+{
+  if (data.is<db::integer> ())
+    {
+      auto str = lexical_cast<std::string> (data.get<db::integer> ());
+      data = db::data{ db::string{ std::move (str) } };
+    }
+  return data.get_if<db::string> ();
+}
 
-  auto fn = it->second;
-  return (this->*fn) ();
+// Reply for GET-like commands on a string-like value. Returns boost::none
+// on wrong type.
+optional<resp::data>
+string_reply (const db::data &data)
+{
+  std::string tmp;
+  string_view str;
+  if (!read_string_value (data, tmp, str))
+    return boost::none;
+  if (data.is<db::integer> ())
+    return bulk_string (std::move (tmp));
+  return bulk_string (std::string{ str.data (), str.size () });
 }
 
-// Connection commands
 resp::data
-processor::exec_ping ()
+e_invalid_expire (string_view cmd)
 {
-  // PING [message]
+  std::string msg{ "ERR invalid expire time in '" };
+  msg.append (cmd.data (), cmd.size ());
+  msg.append ("' command");
+  return simple_error (std::move (msg));
+}
 
-  // RETURN:
-  // - simple string: PONG when no argument is provided.
-  // - bulk string: the provided argument.
+// Strings are limited to 512 MB, like in Redis.
+const std::size_t max_string_len = 512 * 1024 * 1024;
 
-  switch (args_.size ())
-    {
-    case 0:
-      return simple_string ("PONG");
+// Resolves a [start, end] range given in `len` units, where negative indexes
+// count from the end.
+optional<std::pair<std::uint64_t, std::uint64_t>>
+normalize_bit_range (std::int64_t start, std::int64_t end, std::uint64_t len)
+{
+  if (len == 0)
+    return boost::none;
 
-    case 1:
-      return bulk_string (std::move (args_[0]));
+  auto len_i64 = static_cast<std::int64_t> (len);
+  if (start < 0)
+    start += len_i64;
+  if (end < 0)
+    end += len_i64;
+  if (start < 0)
+    start = 0;
+  if (end < 0)
+    return boost::none;
+  if (end >= len_i64)
+    end = len_i64 - 1;
+  if (start > end)
+    return boost::none;
 
-    default:
-      return e_wrong_num_args ("ping");
-    }
+  return std::pair<std::uint64_t, std::uint64_t>{
+    static_cast<std::uint64_t> (start), static_cast<std::uint64_t> (end)
+  };
 }
 
-// Server commands
-resp::data
-processor::exec_save ()
+// Position of the first bit equal to `bit` in the bit range [first, last].
+optional<std::uint64_t>
+find_bit_in_range (string_view str, std::uint64_t first, std::uint64_t last,
+		   bool bit)
 {
-  // SAVE [TO path]
+  auto p = reinterpret_cast<const unsigned char *> (str.data ());
+  auto test = [p] (std::uint64_t pos)
+    { return ((p[pos >> 3] >> (7 - (pos & 7))) & 1) != 0; };
 
-  // RETURN:
-  // - simple string: OK.
+  auto pos = first;
+  for (; pos <= last && (pos & 7) != 0; pos++)
+    if (test (pos) == bit)
+      return pos;
 
-  std::string path{ default_dump_path };
-  if (!args_.empty ())
+  if (pos + 7 <= last)
     {
-      if (args_.size () != 2)
-	return e_syntax;
+      auto whole = (last + 1 - pos) >> 3;
+      auto found = db::find_bit (p + (pos >> 3), whole, bit);
+      if (found.has_value ())
+	return pos + found.value ();
+      pos += whole << 3;
+    }
 
-      auto opt = args_[0];
-      boost::to_lower (opt);
-      if (opt != "to")
-	return e_syntax;
+  for (; pos <= last; pos++)
+    if (test (pos) == bit)
+      return pos;
 
-      path = std::move (args_[1]);
-    }
+  return boost::none;
+}
 
-  auto ret = db::save_to (path, storage_.create_snapshot ());
-  if (!ret.has_value ())
-    return e_persistence (ret.error ());
 
-  return simple_string ("OK");
+const resp::data e_stream_id = simple_error (
+    "ERR Invalid stream ID specified as stream command argument");
+
+const resp::data e_stream_id_small
+    = simple_error ("ERR The ID specified in XADD is equal or smaller than "
+		    "the target stream top item");
+
+const resp::data e_stream_id_zero
+    = simple_error ("ERR The ID specified in XADD must be greater than 0-0");
+
+const resp::data e_stream_exhausted
+    = simple_error ("ERR The stream has exhausted the last possible ID, "
+		    "unable to add more items");
+
+// Parses an XRANGE bound: "-", "+", an id or an incomplete id (only the ms
+// part), optionally prefixed with "(" to exclude it.
+bool
+parse_stream_bound (string_view str, bool is_start, db::stream_id &out)
+{
+  bool exclusive = !str.empty () && str[0] == '(';
+  if (exclusive)
+    str.remove_prefix (1);
+
+  if (str == "-")
+    out = db::stream_id::min ();
+  else if (str == "+")
+    out = db::stream_id::max ();
+  else if (!db::parse_stream_id (
+	       str, is_start ? 0 : std::numeric_limits<std::uint64_t>::max (),
+	       out))
+    return false;
+
+  if (exclusive)
+    return is_start ? out.incr () : out.decr ();
+  return true;
 }
 
 resp::data
-processor::exec_load ()
+stream_entries (std::vector<db::stream::entry> entries)
 {
-  // LOAD [FROM path]
+  std::vector<resp::data> out;
+  out.reserve (entries.size ());
+  for (auto &e : entries)
+    {
+      std::vector<resp::data> fields;
+      fields.reserve (e.fields.size ());
+      for (auto &f : e.fields)
+	fields.push_back (bulk_string (std::move (f)));
+
+      std::vector<resp::data> item;
+      item.reserve (2);
+      item.push_back (bulk_string (e.id.to_string ()));
+      item.push_back (array (std::move (fields)));
+      out.push_back (array (std::move (item)));
+    }
+  return array (std::move (out));
+}
 
-  // RETURN:
-  // - simple string: OK.
+struct stream_trim
+{
+  bool enabled = false;
+  bool by_minid = false;
+  bool approx = false;
+  std::uint64_t maxlen = 0;
+  db::stream_id minid{ 0, 0 };
+  std::size_t limit = 0;
+};
+
+// Parses "<MAXLEN | MINID> [= | ~] threshold [LIMIT count]" starting at
+// args[i], leaving i at the last consumed argument.
+optional<resp::data>
+parse_stream_trim (const std::vector<std::string> &args, std::size_t &i,
+		   stream_trim &out)
+{
+  auto strategy = args[i];
+  boost::to_lower (strategy);
+  if (++i >= args.size ())
+    return e_syntax;
 
-  std::string path{ default_dump_path };
-  if (!args_.empty ())
+  out.enabled = true;
+  out.by_minid = strategy == "minid";
+  if (args[i] == "~" || args[i] == "=")
     {
-      if (args_.size () != 2)
-	return e_syntax;
-
-      auto opt = args_[0];
-      boost::to_lower (opt);
-      if (opt != "from")
+      out.approx = args[i] == "~";
+      if (++i >= args.size ())
 	return e_syntax;
+    }
 
-      path = std::move (args_[1]);
+  if (out.by_minid)
+    {
+      if (!db::parse_stream_id (args[i], 0, out.minid))
+	return e_stream_id;
+    }
+  else
+    {
+      std::int64_t n;
+      if (!try_lexical_convert (args[i], n))
+	return e_bad_integer;
+      if (n < 0)
+	return simple_error ("ERR The MAXLEN argument must be >= 0.");
+      out.maxlen = static_cast<std::uint64_t> (n);
     }
 
-  db::snapshot snap;
-  auto res = db::load_from (path, snap);
-  if (!res.has_value ())
-    return e_persistence (res.error ());
+  // Approximate trimming is bounded by default so that a single command
+  // never releases an unbounded number of blocks.
+  if (out.approx)
+    out.limit = 100 * db::stream::block_max_entries;
 
-  storage_.replace_with_snapshot (std::move (snap));
-  return simple_string ("OK");
+  if (i + 1 < args.size () && boost::iequals (args[i + 1], "limit"))
+    {
+      i += 2;
+      std::int64_t n;
+      if (i >= args.size ())
+	return e_syntax;
+      if (!try_lexical_convert (args[i], n) || n < 0)
+	return simple_error ("ERR The LIMIT argument must be >= 0.");
+      if (!out.approx)
+	return simple_error (
+	    "ERR syntax error, LIMIT cannot be used without the special ~ "
+	    "option");
+      out.limit = static_cast<std::size_t> (n);
+    }
+  return boost::none;
 }
 
-// String commands
-resp::data
-processor::exec_set ()
+std::size_t
+apply_stream_trim (db::stream &st, const stream_trim &trim)
 {
-  // SET key value [NX | XX] [GET] [EX seconds | PX milliseconds |
-  //   EXAT unix-time-seconds | PXAT unix-time-milliseconds | KEEPTTL]
-
-  // RETURN:
-  // if GET was not specified:
-  //   - nil: Operation was aborted (conflict with one of the XX/NX options).
-  //          The key was not set.
-  //   - simple string: OK: The key was set.
-  // if GET was specified:
-  //   - nil: The key didn't exist before the SET. If XX was specified, the key
-  //          was not set. Otherwise, the key was set.
-  //   - bulk string: The previous value of the key. If NX was specified, the
-  //                  key was not set. Otherwise, the key was set.
+  if (!trim.enabled)
+    return 0;
+  if (trim.by_minid)
+    return st.trim_minid (trim.minid, trim.approx, trim.limit);
+  return st.trim_maxlen (trim.maxlen, trim.approx, trim.limit);
+}
+
+// Parses [TO path] [COMPRESS lz|none] of SAVE, BGSAVE and COMPACT, and
+// INCREMENTAL when incremental is given.
+bool
+parse_save_options (std::vector<std::string> &args, std::string &path,
+		    db::compression &codec, bool *incremental = nullptr)
+{
+  std::size_t i = 0;
+  while (i < args.size ())
+    {
+      auto opt = args[i];
+      boost::to_lower (opt);
+      if (opt == "incremental" && incremental != nullptr)
+	{
+	  *incremental = true;
+	  i++;
+	  continue;
+	}
+
+      if (i + 1 >= args.size ())
+	return false;
+      if (opt == "to")
+	path = std::move (args[i + 1]);
+      else if (opt == "compress")
+	{
+	  auto name = args[i + 1];
+	  boost::to_lower (name);
+	  if (name == "lz")
+	    codec = db::compression_lz;
+	  else if (name == "none")
+	    codec = db::compression_none;
+	  else
+	    return false;
+	}
+      else
+	return false;
+      i += 2;
+    }
+  return true;
+}
+
+} // namespace
+
+processor::processor (config &cfg)
+    : config_{ cfg }, client_{ nullptr }, bgsave_pid_{ -1 },
+      last_bgsave_ok_{ true },
+      last_save_{ db::clock_type::now () }, dirty_{ 0 },
+      dirty_at_bgsave_{ 0 }, last_bgsave_try_{ db::clock_type::now () },
+      chain_size_{ 0 },
+      rewrite_pid_{ -1 }, last_rewrite_ok_{ true }, loading_{ false },
+      aof_last_write_ok_{ true }, aof_last_fsync_{ steady_clock::now () },
+      rewrite_scheduled_{ false }, replid_{ new_replication_id () },
+      repl_offset_{ 0 }, next_replica_id_{ 1 }, sync_full_{ 0 },
+      sync_partial_ok_{ 0 }, sync_partial_err_{ 0 }, primary_gen_{ 0 },
+      primary_link_up_{ false }, from_primary_{ false },
+      exec_running_{ false }, multi_logged_{ false },
+      script_running_{ false }, script_nested_{ false },
+      script_paused_{ false }, script_wrote_{ false },
+      script_killed_{ false }, next_waiter_id_{ 1 }
+{
+  log_expired_keys ();
+  if (config_.cluster_enabled)
+    {
+      cluster_ = make_unique<cluster_table> (new_replication_id (),
+					     config_.cluster_announce_ip,
+					     config_.cluster_announce_port);
+      storage_.index_slots ();
+    }
+}
+
+void
+processor::cron ()
+{
+  // A paused script runs alone: no save or rewrite starts with only some
+  // of its writes made.
+  if (script_ != nullptr)
+    return;
+
+  check_background_save ();
+  check_background_rewrite ();
+  check_save_points ();
+  start_full_syncs ();
+  if (rewrite_scheduled_ && !bgsave_in_progress () && rewrite_pid_ == -1)
+    {
+      auto ret = start_background_rewrite ();
+      if (!ret.has_value ())
+	std::fprintf (stderr, "%s\n", ret.error ().c_str ());
+      rewrite_scheduled_ = false;
+    }
+
+  if (aof_.is_open () && config_.appendfsync == appendfsync_everysec
+      && steady_clock::now () - aof_last_fsync_ >= seconds{ 1 })
+    {
+      auto ret = aof_.sync ();
+      aof_last_write_ok_ = ret.has_value ();
+      aof_last_fsync_ = steady_clock::now ();
+    }
+}
+
+result<void, std::string>
+processor::load_data ()
+{
+  auto start = steady_clock::now ();
+  std::string source;
+  if (config_.appendonly)
+    {
+      auto ret = load_append_only_file ();
+      if (!ret.has_value ())
+	return ret;
+      source = config_.appendfilename;
+    }
+  else if (db::file_exists (config_.dbfilename))
+    {
+      auto ret = load_snapshot (config_.dbfilename);
+      if (!ret.has_value ())
+	return ret;
+      source = config_.dbfilename;
+    }
+  else
+    return {};
+
+  // Neither the replayed commands nor the loaded keys are unsaved.
+  dirty_ = 0;
+  auto elapsed = duration_cast<milliseconds> (steady_clock::now () - start);
+  std::printf ("Loaded %s in %.3f seconds: %zu keys\n", source.c_str (),
+	       static_cast<double> (elapsed.count ()) / 1000,
+	       storage_.size ());
+  std::fflush (stdout);
+  return {};
+}
+
+void
+processor::shutdown ()
+{
+  // A child still writing would outlive the server, and the save below
+  // supersedes it anyway.
+  if (bgsave_pid_ != -1)
+    {
+      db::stop_background_save (bgsave_pid_);
+      bgsave_pid_ = -1;
+    }
+  if (rewrite_pid_ != -1)
+    {
+      db::stop_background_save (rewrite_pid_);
+      rewrite_pid_ = -1;
+      aof_.abort_rewrite ();
+      std::remove ((config_.appendfilename + ".tmp").c_str ());
+    }
+
+  if (!config_.save_points.empty ())
+    {
+      auto ret = save_snapshot (config_.dbfilename, db::compression_none);
+      if (ret.has_value ())
+	std::printf ("Saved %s on shutdown: %zu keys\n",
+		     config_.dbfilename.c_str (), storage_.size ());
+      else
+	std::fprintf (stderr, "Save on shutdown failed: %s\n",
+		      ret.error ().c_str ());
+    }
+
+  if (aof_.is_open ())
+    {
+      auto ret = aof_.flush (true);
+      if (!ret.has_value ())
+	std::fprintf (stderr, "%s\n", ret.error ().c_str ());
+    }
+  std::fflush (stdout);
+}
+
+result<void, std::string>
+processor::load_append_only_file ()
+{
+  // The log holds the commands as they ran: keys that expired meanwhile
+  // are deleted by the commands logged when they expired, not by the clock.
+  loading_ = true;
+  storage_.pause_expiration (true);
+  auto replay = [this] (resp::data request)
+    {
+      execute (std::move (request), &stream_client_);
+      take_block_request ();
+    };
+  auto ret = db::replay_append_only_file (config_.appendfilename, storage_,
+					  replay);
+  storage_.pause_expiration (false);
+  loading_ = false;
+  // A transaction cut short by the end of the file is dropped.
+  discard_transaction (stream_client_);
+  if (!ret.has_value ())
+    return ret.error ();
+
+  return aof_.open (config_.appendfilename);
+}
+
+bool
+processor::append_only () const noexcept
+{
+  return aof_.is_open ();
+}
+
+bool
+processor::has_unflushed_writes () const noexcept
+{
+  return aof_.has_buffered ();
+}
+
+void
+processor::flush_append_only_file ()
+{
+  bool always = config_.appendfsync == appendfsync_always;
+  auto ret = aof_.flush (always);
+  aof_last_write_ok_ = ret.has_value ();
+  if (ret.has_value ())
+    {
+      if (always)
+	aof_last_fsync_ = steady_clock::now ();
+      return;
+    }
+
+  // The replies to the writes must not go out before the writes are
+  // durable, and they cannot be made durable.
+  if (always)
+    {
+      std::fprintf (stderr, "Exiting on append-only file error: %s\n",
+		    ret.error ().c_str ());
+      std::exit (1);
+    }
+}
+
+void
+processor::log_expired_keys ()
+{
+  auto hook = [this] (const std::string &key)
+    {
+      const std::string argv[]{ "DEL", key };
+      propagate (argv);
+      notify (notify_expired, "expired", key);
+    };
+  storage_.set_expire_hook (hook);
+}
+
+void
+processor::propagate (span<const std::string> argv)
+{
+  if (aof_.is_open ())
+    aof_.append (argv);
+
+  // A replica passes on the stream of its primary as it came instead; see
+  // execute_from_primary.
+  if (backlog_ != nullptr && !primary_.has_value ())
+    {
+      auto bytes = std::make_shared<std::string> ();
+      encode_command (argv, *bytes);
+      advance_stream (std::move (bytes));
+    }
+}
+
+void
+processor::advance_stream (std::shared_ptr<const std::string> bytes)
+{
+  repl_offset_ += bytes->size ();
+  if (backlog_ == nullptr)
+    return;
+
+  // Encoded once, the bytes are shared by all the replicas.
+  backlog_->append (*bytes);
+  for (auto &i : replicas_)
+    {
+      auto &r = i.second;
+      if (r.state == replica_online)
+	r.feed (bytes);
+      else if (r.state == replica_wait_snapshot
+	       || r.state == replica_wait_chunks)
+	r.held.append (*bytes);
+    }
+}
+
+resp::data
+processor::execute (resp::data resp, client_state *client)
+{
+  typedef resp::data (processor::*exec_fn) ();
+  struct command
+  {
+    exec_fn fn;
+    // The number of arguments, the command name included, or the least
+    // number when negative.
+    int arity;
+    // Whether the command may modify the dataset, which gets it logged to
+    // the append-only file.
+    bool write;
+    // The positions of the keys in the request, the command name being at
+    // 0, for cluster mode: from first_key to last_key, which counts from
+    // the end when negative, every key_step. 0 when there are none.
+    int first_key;
+    int last_key;
+    int key_step;
+  };
+  static const unordered_flat_map<string_view, command> exec_map{
+    // Connection commands
+    { "ping", { &processor::exec_ping, -1, false, 0, 0, 0 } },
+
+    // Server commands
+    { "save", { &processor::exec_save, -1, false, 0, 0, 0 } },
+    { "load", { &processor::exec_load, -1, false, 0, 0, 0 } },
+    { "bgsave", { &processor::exec_bgsave, -1, false, 0, 0, 0 } },
+    { "compact", { &processor::exec_compact, -1, false, 0, 0, 0 } },
+    { "lastsave", { &processor::exec_lastsave, 1, false, 0, 0, 0 } },
+    { "info", { &processor::exec_info, -1, false, 0, 0, 0 } },
+    { "bgrewriteaof", { &processor::exec_bgrewriteaof, 1, false, 0, 0, 0 } },
+    { "replicaof", { &processor::exec_replicaof, 3, false, 0, 0, 0 } },
+    { "psync", { &processor::exec_psync, -3, false, 0, 0, 0 } },
+    { "dump", { &processor::exec_dump, 2, false, 1, 1, 1 } },
+    { "restore", { &processor::exec_restore, -4, true, 1, 1, 1 } },
+    { "restore-asking",
+      { &processor::exec_restore_asking, -4, true, 1, 1, 1 } },
+    { "migrate", { &processor::exec_migrate, -6, false, 0, 0, 0 } },
+
+    // Transaction commands
+    { "multi", { &processor::exec_multi, 1, false, 0, 0, 0 } },
+    { "exec", { &processor::exec_exec, 1, false, 0, 0, 0 } },
+    { "discard", { &processor::exec_discard, 1, false, 0, 0, 0 } },
+    { "watch", { &processor::exec_watch, -2, false, 1, -1, 1 } },
+    { "unwatch", { &processor::exec_unwatch, 1, false, 0, 0, 0 } },
+
+    // Scripting commands: the writes of the scripts are logged as the
+    // commands they call.
+    { "eval", { &processor::exec_eval, -3, false, 0, 0, 0 } },
+    { "evalsha", { &processor::exec_evalsha, -3, false, 0, 0, 0 } },
+    { "script", { &processor::exec_script, -2, false, 0, 0, 0 } },
+
+    // Cluster commands
+    { "cluster", { &processor::exec_cluster, -2, false, 0, 0, 0 } },
+    { "asking", { &processor::exec_asking, 1, false, 0, 0, 0 } },
+
+    // Pub/Sub commands
+    { "subscribe", { &processor::exec_subscribe, -2, false, 0, 0, 0 } },
+    { "psubscribe", { &processor::exec_psubscribe, -2, false, 0, 0, 0 } },
+    { "unsubscribe", { &processor::exec_unsubscribe, -1, false, 0, 0, 0 } },
+    { "punsubscribe", { &processor::exec_punsubscribe, -1, false, 0, 0, 0 } },
+    { "publish", { &processor::exec_publish, 3, false, 0, 0, 0 } },
+    { "pubsub", { &processor::exec_pubsub, -2, false, 0, 0, 0 } },
+
+    // String commands
+    { "set", { &processor::exec_set, -3, true, 1, 1, 1 } },
+    { "get", { &processor::exec_get, 2, false, 1, 1, 1 } },
+    { "incr", { &processor::exec_incr, -2, true, 1, 1, 1 } },
+    { "incrby", { &processor::exec_incrby, -3, true, 1, 1, 1 } },
+    { "decr", { &processor::exec_decr, -2, true, 1, 1, 1 } },
+    { "decrby", { &processor::exec_decrby, -3, true, 1, 1, 1 } },
+    { "mget", { &processor::exec_mget, -2, false, 1, -1, 1 } },
+    { "mset", { &processor::exec_mset, -3, true, 1, -1, 2 } },
+    { "msetnx", { &processor::exec_msetnx, -3, true, 1, -1, 2 } },
+    { "getset", { &processor::exec_getset, 3, true, 1, 1, 1 } },
+    { "getdel", { &processor::exec_getdel, 2, true, 1, 1, 1 } },
+    { "getex", { &processor::exec_getex, -2, true, 1, 1, 1 } },
+    { "setnx", { &processor::exec_setnx, 3, true, 1, 1, 1 } },
+    { "setex", { &processor::exec_setex, 4, true, 1, 1, 1 } },
+    { "psetex", { &processor::exec_psetex, 4, true, 1, 1, 1 } },
+    { "strlen", { &processor::exec_strlen, 2, false, 1, 1, 1 } },
+    { "append", { &processor::exec_append, 3, true, 1, 1, 1 } },
+    { "getrange", { &processor::exec_getrange, 4, false, 1, 1, 1 } },
+    { "setrange", { &processor::exec_setrange, 4, true, 1, 1, 1 } },
+    { "throttle", { &processor::exec_throttle, -5, true, 1, 1, 1 } },
+
+    // Generic commands
+    { "del", { &processor::exec_del, -2, true, 1, -1, 1 } },
+    { "delex", { &processor::exec_delex, -2, true, 1, 1, 1 } },
+    { "expire", { &processor::exec_expire, -3, true, 1, 1, 1 } },
+    { "pexpire", { &processor::exec_pexpire, -3, true, 1, 1, 1 } },
+    { "expireat", { &processor::exec_expireat, -3, true, 1, 1, 1 } },
+    { "pexpireat", { &processor::exec_pexpireat, -3, true, 1, 1, 1 } },
+    { "ttl", { &processor::exec_ttl, 2, false, 1, 1, 1 } },
+    { "pttl", { &processor::exec_pttl, 2, false, 1, 1, 1 } },
+
+    // List commands
+    { "llen", { &processor::exec_llen, 2, false, 1, 1, 1 } },
+    { "lindex", { &processor::exec_lindex, 3, false, 1, 1, 1 } },
+    { "lrange", { &processor::exec_lrange, 4, false, 1, 1, 1 } },
+
+    { "lset", { &processor::exec_lset, 4, true, 1, 1, 1 } },
+    { "lrem", { &processor::exec_lrem, 4, true, 1, 1, 1 } },
+    { "linsert", { &processor::exec_linsert, 5, true, 1, 1, 1 } },
+
+    { "lpush", { &processor::exec_lpush, -3, true, 1, 1, 1 } },
+    { "rpush", { &processor::exec_rpush, -3, true, 1, 1, 1 } },
+    { "lpop", { &processor::exec_lpop, -2, true, 1, 1, 1 } },
+    { "rpop", { &processor::exec_rpop, -2, true, 1, 1, 1 } },
+
+    // Sorted set commands
+    { "zadd", { &processor::exec_zadd, -4, true, 1, 1, 1 } },
+    { "zincrby", { &processor::exec_zincrby, 4, true, 1, 1, 1 } },
+    { "zscore", { &processor::exec_zscore, 3, false, 1, 1, 1 } },
+    { "zcard", { &processor::exec_zcard, 2, false, 1, 1, 1 } },
+    { "zrank", { &processor::exec_zrank, -3, false, 1, 1, 1 } },
+    { "zrevrank", { &processor::exec_zrevrank, -3, false, 1, 1, 1 } },
+    { "zrange", { &processor::exec_zrange, -4, false, 1, 1, 1 } },
+    { "zrem", { &processor::exec_zrem, -3, true, 1, 1, 1 } },
+    { "zremrangebyscore",
+      { &processor::exec_zremrangebyscore, 4, true, 1, 1, 1 } },
+    { "zpopmin", { &processor::exec_zpopmin, -2, true, 1, 1, 1 } },
+    { "zpopmax", { &processor::exec_zpopmax, -2, true, 1, 1, 1 } },
+
+    // HyperLogLog commands
+    { "pfadd", { &processor::exec_pfadd, -2, true, 1, 1, 1 } },
+    { "pfcount", { &processor::exec_pfcount, -2, false, 1, -1, 1 } },
+    { "pfmerge", { &processor::exec_pfmerge, -2, true, 1, -1, 1 } },
+
+    // Bitmap commands
+    { "setbit", { &processor::exec_setbit, 4, true, 1, 1, 1 } },
+    { "getbit", { &processor::exec_getbit, 3, false, 1, 1, 1 } },
+    { "bitcount", { &processor::exec_bitcount, -2, false, 1, 1, 1 } },
+    { "bitpos", { &processor::exec_bitpos, -3, false, 1, 1, 1 } },
+    { "bitop", { &processor::exec_bitop, -4, true, 2, -1, 1 } },
+    { "bitfield", { &processor::exec_bitfield, -2, true, 1, 1, 1 } },
+    { "bitfield_ro", { &processor::exec_bitfield_ro, -2, false, 1, 1, 1 } },
+
+    // Stream commands
+    { "xadd", { &processor::exec_xadd, -5, true, 1, 1, 1 } },
+    { "xlen", { &processor::exec_xlen, 2, false, 1, 1, 1 } },
+    { "xrange", { &processor::exec_xrange, -4, false, 1, 1, 1 } },
+    { "xrevrange", { &processor::exec_xrevrange, -4, false, 1, 1, 1 } },
+    { "xtrim", { &processor::exec_xtrim, -4, true, 1, 1, 1 } },
+    { "xdel", { &processor::exec_xdel, -3, true, 1, 1, 1 } },
+    { "xread", { &processor::exec_xread, -4, false, 0, 0, 0 } },
+  };
+
+  if (!resp.is<resp::array> ())
+    return e_protocol;
+
+  auto &arr = resp.get<resp::array> ();
+  if (!arr.has_value ())
+    return e_protocol;
+
+  auto &vec = arr.value ();
+  if (vec.empty ())
+    return e_protocol;
+
+  bool all_str = true;
+  for (const auto &v : vec)
+    {
+      auto p = v.get_if<resp::bulk_string> ();
+      if (p == nullptr || !p->has_value ())
+	{
+	  all_str = false;
+	  break;
+	}
+    }
+  if (!all_str)
+    return e_protocol;
+
+  args_.clear ();
+  args_.reserve (vec.size () - 1);
+  for (auto it = vec.begin () + 1; it != vec.end (); it++)
+    args_.push_back (std::move (it->get<resp::bulk_string> ().value ()));
+
+  const auto &cmd_raw = vec[0].get<resp::bulk_string> ().value ();
+  auto cmd = cmd_raw;
+  boost::to_lower (cmd);
+  auto it = exec_map.find (cmd);
+  // Inside MULTI the commands are checked as far as their metadata allows,
+  // then queued; one refused makes EXEC fail.
+  bool queuing = client != nullptr && client->multi && !exec_running_
+		 && cmd != "exec" && cmd != "discard" && cmd != "multi"
+		 && cmd != "watch";
+  auto refuse = [client, queuing] (resp::data err)
+    {
+      if (queuing)
+	client->multi_failed = true;
+      return err;
+    };
+  // While a script is paused, the other clients can only kill it.
+  if (script_ != nullptr && !script_running_
+      && !(cmd == "script" && args_.size () == 1
+	   && boost::iequals (args_[0], "kill")))
+    return refuse (e_busy);
+  if (it == exec_map.end ())
+    return refuse (e_unknown_command (cmd_raw));
+  if (script_running_ && !allowed_in_script (cmd))
+    return simple_error ("ERR This Redis command is not allowed from "
+			 "script");
+
+  const auto &command = it->second;
+  auto argc = static_cast<int> (vec.size ());
+  if (command.arity >= 0 ? argc != command.arity : argc < -command.arity)
+    return refuse (e_wrong_num_args (cmd));
+  bool asking = cmd == "restore-asking";
+  if (client != nullptr)
+    {
+      asking = asking || client->asking;
+      client->asking = false;
+    }
+  client_ = client;
+
+  if (client != nullptr && subscribed (*client)
+      && !allowed_when_subscribed (cmd))
+    return simple_error ("ERR Can't execute '" + cmd
+			 + "': only (P)SUBSCRIBE / (P)UNSUBSCRIBE / PING "
+			   "are allowed in this context");
+  if (queuing && !allowed_in_multi (cmd))
+    return refuse (simple_error ("ERR Command not allowed inside a "
+				 "transaction"));
+
+  // In cluster mode the keys must be in a slot this node serves, and the
+  // keys that MIGRATE is moving cannot be written to meanwhile.
+  bool routed = cluster_ != nullptr && !from_primary_ && !loading_;
+  if (routed || (command.write && !migrating_keys_.empty ()))
+    {
+      command_keys (cmd, args_, command.first_key, command.last_key,
+		    command.key_step, keys_);
+      if (command.write && !migrating_keys_.empty ())
+	for (auto key : keys_)
+	  if (migrating_keys_.count (key.to_string ()) != 0)
+	    return refuse (e_key_migrating);
+      if (routed)
+	{
+	  auto moved = redirect (asking);
+	  if (moved.has_value ())
+	    return refuse (std::move (moved.value ()));
+	}
+    }
+
+  if (command.write && primary_.has_value () && !from_primary_)
+    return refuse (e_readonly);
+
+  if (queuing)
+    {
+      // The arguments go back into the request, which EXEC executes.
+      for (std::size_t i = 0; i < args_.size (); i++)
+	vec[i + 1].get<resp::bulk_string> ().value () = std::move (args_[i]);
+      client->queued.push_back (std::move (resp));
+      return simple_string ("QUEUED");
+    }
+
+  // Moving a key frozen by a snapshot back can rehash the dataset, so the
+  // keys of the command are all moved back before it holds on to any.
+  if (storage_.snapshot_active ())
+    {
+      command_keys (cmd, args_, command.first_key, command.last_key,
+		    command.key_step, keys_);
+      for (auto key : keys_)
+	storage_.thaw (key.to_string ());
+    }
+
+  storage_.mark_changes (command.write && chain_path_.has_value ());
+  storage_.set_writing (command.write);
+  if (!command.write)
+    return (this->*command.fn) ();
+
+  // The arguments are consumed by the command, so the copy to log is taken
+  // up front. Assigning into the previous copy reuses its buffers.
+  bool logged = aof_.is_open ()
+		|| (backlog_ != nullptr && !primary_.has_value ());
+  if (logged)
+    {
+      propagate_.resize (args_.size () + 1);
+      propagate_[0] = cmd_raw;
+      std::copy (args_.begin (), args_.end (), propagate_.begin () + 1);
+    }
+  else
+    propagate_.clear ();
+
+  auto reply = (this->*command.fn) ();
+  if (reply.is<resp::simple_error> () || block_request_.has_value ())
+    return reply;
+  dirty_++;
+  if (script_running_)
+    script_wrote_ = true;
+  if (logged && !propagate_.empty ())
+    {
+      if ((exec_running_ || script_running_) && !multi_logged_)
+	{
+	  const std::string argv[]{ "MULTI" };
+	  propagate (argv);
+	  multi_logged_ = true;
+	}
+      propagate (propagate_);
+    }
+  return reply;
+}
+
+std::vector<resp::data>
+processor::take_leading_replies ()
+{
+  std::vector<resp::data> replies;
+  replies.swap (leading_replies_);
+  return replies;
+}
+
+void
+processor::remove_client (client_state &client)
+{
+  unwatch (client);
+  for (const auto &name : client.channels)
+    remove_subscription (channels_, name, &client);
+  for (const auto &name : client.patterns)
+    remove_subscription (patterns_, name, &client);
+  client.channels.clear ();
+  client.patterns.clear ();
+}
+
+std::size_t
+processor::publish (const std::string &channel, const std::string &message)
+{
+  // Every message is encoded once, and the subscribers share the buffer.
+  std::size_t receivers = 0;
+  auto it = channels_.find (channel);
+  if (it != channels_.end ())
+    {
+      const std::string argv[] = { "message", channel, message };
+      auto bytes = std::make_shared<std::string> ();
+      encode_command (argv, *bytes);
+      std::shared_ptr<const std::string> shared = std::move (bytes);
+      for (auto client : it->second)
+	client->push (shared);
+      receivers += it->second.size ();
+    }
+
+  for (const auto &p : patterns_)
+    {
+      if (!glob_match (p.first, channel))
+	continue;
+      const std::string argv[] = { "pmessage", p.first, channel, message };
+      auto bytes = std::make_shared<std::string> ();
+      encode_command (argv, *bytes);
+      std::shared_ptr<const std::string> shared = std::move (bytes);
+      for (auto client : p.second)
+	client->push (shared);
+      receivers += p.second.size ();
+    }
+  return receivers;
+}
+
+void
+processor::notify (unsigned type, const char *event, const std::string &key)
+{
+  auto flags = config_.notify_keyspace_events;
+  if ((flags & type) == 0 || (channels_.empty () && patterns_.empty ()))
+    return;
+
+  if ((flags & notify_keyspace) != 0)
+    publish ("__keyspace@0__:" + key, event);
+  if ((flags & notify_keyevent) != 0)
+    publish (std::string{ "__keyevent@0__:" } + event, key);
+}
+
+optional<processor::block_request>
+processor::take_block_request ()
+{
+  auto req = std::move (block_request_);
+  block_request_ = boost::none;
+  return req;
+}
+
+std::uint64_t
+processor::add_waiter (const std::vector<std::string> &keys,
+		       std::function<void ()> wake)
+{
+  auto id = next_waiter_id_++;
+  for (const auto &key : keys)
+    waiting_keys_[key].push_back (id);
+  waiters_.emplace (id, waiter{ keys, std::move (wake) });
+  return id;
+}
+
+bool
+processor::remove_waiter (std::uint64_t id)
+{
+  auto it = waiters_.find (id);
+  if (it == waiters_.end ())
+    return false;
+
+  for (const auto &key : it->second.keys)
+    {
+      auto kit = waiting_keys_.find (key);
+      if (kit == waiting_keys_.end ())
+	continue;
+      auto &ids = kit->second;
+      ids.erase (std::remove (ids.begin (), ids.end (), id), ids.end ());
+      if (ids.empty ())
+	waiting_keys_.erase (kit);
+    }
+  waiters_.erase (it);
+  return true;
+}
+
+optional<processor::sync_request>
+processor::take_sync_request ()
+{
+  auto req = std::move (sync_request_);
+  sync_request_ = boost::none;
+  return req;
+}
+
+optional<processor::migration>
+processor::take_migration ()
+{
+  auto m = std::move (migration_);
+  migration_ = boost::none;
+  return m;
+}
+
+resp::data
+processor::finish_migration (const migration &m,
+			     const result<void, std::string> &sent)
+{
+  for (const auto &key : m.keys)
+    migrating_keys_.erase (key);
+  if (!sent.has_value ())
+    return simple_error (sent.error ());
+  if (m.copy)
+    return simple_string ("OK");
+
+  // The target has the keys: they go away here, as with a DEL.
+  std::vector<std::string> del{ "DEL" };
+  storage_.mark_changes (chain_path_.has_value ());
+  for (const auto &key : m.keys)
+    {
+      auto it = storage_.find (key);
+      if (!it.has_value ())
+	continue;
+      storage_.erase (it.value ());
+      notify (notify_generic, "del", key);
+      del.push_back (key);
+    }
+  storage_.mark_changes (false);
+  if (del.size () > 1)
+    {
+      dirty_++;
+      propagate (del);
+    }
+  return simple_string ("OK");
+}
+
+std::uint64_t
+processor::add_replica (const sync_request &req, replica_feed feed,
+			replica_stream stream)
+{
+  if (backlog_ == nullptr)
+    backlog_ = make_unique<repl_backlog> (config_.repl_backlog_size,
+					  repl_offset_);
+
+  auto id = next_replica_id_++;
+  auto &r = replicas_[id];
+  r.feed = std::move (feed);
+  r.stream = std::move (stream);
+  r.since = steady_clock::now ();
+
+  // The replica has the stream up to its offset: it only needs the rest,
+  // if it is still there.
+  if (req.replid == replid_ && req.offset >= 0
+      && backlog_->contains (static_cast<std::uint64_t> (req.offset)))
+    {
+      auto bytes = std::make_shared<std::string> ("+CONTINUE " + replid_
+						  + "\r\n");
+      backlog_->copy_from (static_cast<std::uint64_t> (req.offset), *bytes);
+      r.state = replica_online;
+      r.feed (std::move (bytes));
+      sync_partial_ok_++;
+      return id;
+    }
+
+  if (req.replid == replid_)
+    sync_partial_err_++;
+  sync_full_++;
+  r.state = replica_wait_save;
+  start_full_syncs ();
+  return id;
+}
+
+void
+processor::remove_replica (std::uint64_t id)
+{
+  replicas_.erase (id);
+}
+
+const optional<processor::primary_address> &
+processor::primary () const noexcept
+{
+  return primary_;
+}
+
+std::uint64_t
+processor::primary_generation () const noexcept
+{
+  return primary_gen_;
+}
+
+const std::string &
+processor::replication_id () const noexcept
+{
+  return replid_;
+}
+
+std::uint64_t
+processor::replication_offset () const noexcept
+{
+  return repl_offset_;
+}
+
+void
+processor::primary_link_up (bool up)
+{
+  primary_link_up_ = up;
+}
+
+result<void, std::string>
+processor::load_from_primary (const std::string &path, std::string replid,
+			      std::uint64_t offset)
+{
+  // The snapshot takes the place of the one at dbfilename, which no save
+  // of the old dataset may overwrite afterwards, and whose deltas do not
+  // apply to it.
+  stop_saves ();
+  auto ret = db::remove_deltas (config_.dbfilename);
+  if (!ret.has_value ())
+    return ret;
+  if (std::rename (path.c_str (), config_.dbfilename.c_str ()) != 0)
+    return std::string{ "cannot move the snapshot: " }
+	   + std::strerror (errno);
+  ret = load_snapshot (config_.dbfilename);
+  if (!ret.has_value ())
+    return ret;
+
+  last_save_ = db::clock_type::now ();
+  adopt_stream (std::move (replid), offset);
+  return {};
+}
+
+void
+processor::load_from_primary (db::storage loaded, std::string replid,
+			      std::uint64_t offset)
+{
+  // The dataset is not on disk: the snapshot at dbfilename is older, and
+  // all the keys count as changed for the save points.
+  stop_saves ();
+  loaded.take_watches (storage_);
+  storage_ = std::move (loaded);
+  if (cluster_ != nullptr)
+    storage_.index_slots ();
+  dirty_ = storage_.size ();
+  storage_.pause_expiration (loading_);
+  storage_.keep_expired (primary_.has_value ());
+  log_expired_keys ();
+  adopt_stream (std::move (replid), offset);
+}
+
+void
+processor::stop_saves ()
+{
+  while (storage_.snapshot_active ())
+    save_slice ();
+  if (bgsave_pid_ != -1)
+    {
+      db::stop_background_save (bgsave_pid_);
+      bgsave_pid_ = -1;
+      background_save_done (false);
+    }
+  chain_path_ = boost::none;
+}
+
+void
+processor::adopt_stream (std::string replid, std::uint64_t offset)
+{
+  reset_replication ();
+  discard_transaction (stream_client_);
+  postponed_stream_.clear ();
+  replid_ = std::move (replid);
+  repl_offset_ = offset;
+  // The append-only file logs the old dataset; it is rewritten from the
+  // new one as soon as possible.
+  if (aof_.is_open ())
+    rewrite_scheduled_ = true;
+}
+
+void
+processor::execute_from_primary (resp::data request)
+{
+  if (!primary_.has_value ())
+    return;
+  // A paused script runs alone: the stream waits for it to end.
+  if (script_ != nullptr)
+    {
+      postponed_stream_.push_back (std::move (request));
+      return;
+    }
+
+  // The stream is passed on as it came, so that the replicas of this
+  // server see the same offsets as the ones of its primary. The commands
+  // apply as they did there: the keys that expired are deleted by the DELs
+  // logged for them, not by this clock.
+  auto bytes = std::make_shared<std::string> (request.encode ());
+  from_primary_ = true;
+  storage_.pause_expiration (true);
+  execute (std::move (request), &stream_client_);
+  storage_.pause_expiration (false);
+  take_block_request ();
+  from_primary_ = false;
+  advance_stream (std::move (bytes));
+}
+
+void
+processor::start_full_syncs ()
+{
+  auto waiting = [] (const std::pair<const std::uint64_t, replica> &i)
+    { return i.second.state == replica_wait_save; };
+  if (std::none_of (replicas_.begin (), replicas_.end (), waiting))
+    return;
+  if (config_.repl_diskless_sync)
+    {
+      start_diskless_sync ();
+      return;
+    }
+
+  // A BGSAVE already running serves as well, as long as the stream since
+  // it started is still in the backlog.
+  check_background_save ();
+  if (bgsave_in_progress ())
+    {
+      if (!bgsave_offset_.has_value ()
+	  || !backlog_->contains (bgsave_offset_.value ()))
+	return;
+    }
+  else
+    {
+      if (rewrite_pid_ != -1)
+	return;
+      auto ret = start_background_save (config_.dbfilename,
+					db::compression_none);
+      if (!ret.has_value ())
+	{
+	  std::fprintf (stderr, "full sync failed: %s\n",
+			ret.error ().c_str ());
+	  for (auto it = replicas_.begin (); it != replicas_.end ();)
+	    {
+	      if (!waiting (*it))
+		{
+		  ++it;
+		  continue;
+		}
+	      it->second.feed (nullptr);
+	      it = replicas_.erase (it);
+	    }
+	  return;
+	}
+    }
+
+  auto offset = bgsave_offset_.value ();
+  auto header = std::make_shared<std::string> (
+      "+FULLRESYNC " + replid_ + " " + std::to_string (offset) + "\r\n");
+  for (auto &i : replicas_)
+    {
+      auto &r = i.second;
+      if (r.state != replica_wait_save)
+	continue;
+      r.feed (header);
+      r.held.clear ();
+      backlog_->copy_from (offset, r.held);
+      r.state = replica_wait_snapshot;
+    }
+}
+
+void
+processor::finish_full_syncs (bool ok)
+{
+  // The snapshot goes out as a bulk string, without the final CRLF, then
+  // the stream held since it was taken. The replicas share the mapping of
+  // the file, which each reads a piece at a time as its connection drains,
+  // and which is released once they all have been sent the whole of it.
+  std::shared_ptr<db::mapped_file> file;
+  std::shared_ptr<std::string> header;
+  bool read = false;
+  for (auto it = replicas_.begin (); it != replicas_.end ();)
+    {
+      auto &r = it->second;
+      if (r.state != replica_wait_snapshot)
+	{
+	  ++it;
+	  continue;
+	}
+
+      if (ok && !read)
+	{
+	  read = true;
+	  file = std::make_shared<db::mapped_file> ();
+	  auto ret = file->open (bgsave_path_);
+	  if (ret.has_value ())
+	    header = std::make_shared<std::string> (
+		"$" + std::to_string (file->bytes ().size ()) + "\r\n");
+	  else
+	    {
+	      std::fprintf (stderr, "full sync failed: %s\n",
+			    ret.error ().c_str ());
+	      file.reset ();
+	    }
+	}
+
+      if (file == nullptr)
+	{
+	  r.feed (nullptr);
+	  it = replicas_.erase (it);
+	  continue;
+	}
+
+      r.feed (header);
+      r.stream (file_source (file));
+      if (!r.held.empty ())
+	r.feed (std::make_shared<std::string> (std::move (r.held)));
+      r.held = std::string{};
+      r.state = replica_online;
+      ++it;
+    }
+}
+
+void
+processor::start_diskless_sync ()
+{
+  // One pass runs at a time, and a save in slices holds the snapshot of
+  // the storage meanwhile. The replicas that wait when a pass starts all
+  // share it, and the first one waits for the others a while.
+  if (storage_.snapshot_active ())
+    return;
+  auto now = steady_clock::now ();
+  std::size_t n = 0;
+  for (const auto &i : replicas_)
+    {
+      if (i.second.state != replica_wait_save)
+	continue;
+      if (n == 0 && now - i.second.since < config_.repl_diskless_sync_delay)
+	return;
+      n++;
+    }
+
+  auto header = std::make_shared<std::string> (
+      "+FULLRESYNC " + replid_ + " " + std::to_string (repl_offset_)
+      + "\r\n$CHUNKED\r\n");
+  for (auto &i : replicas_)
+    {
+      auto &r = i.second;
+      if (r.state != replica_wait_save)
+	continue;
+      r.feed (header);
+      r.held.clear ();
+      r.state = replica_wait_chunks;
+    }
+  std::printf ("Streaming a snapshot to %zu replicas\n", n);
+  std::fflush (stdout);
+
+  // Every chunk goes out as its length on a line of its own, then its
+  // bytes, encoded once for all the replicas.
+  diskless_.start (
+      storage_,
+      [this] (std::string chunk)
+	{
+	  auto frame = std::make_shared<std::string> (
+	      std::to_string (chunk.size ()) + "\r\n");
+	  auto bytes = std::make_shared<std::string> (std::move (chunk));
+	  for (auto &i : replicas_)
+	    {
+	      auto &r = i.second;
+	      if (r.state != replica_wait_chunks)
+		continue;
+	      r.feed (frame);
+	      r.feed (bytes);
+	    }
+	});
+}
+
+void
+processor::finish_diskless_sync ()
+{
+  // An empty chunk ends the snapshot; the stream held since follows.
+  auto end = std::make_shared<std::string> ("0\r\n");
+  for (auto &i : replicas_)
+    {
+      auto &r = i.second;
+      if (r.state != replica_wait_chunks)
+	continue;
+      r.feed (end);
+      if (!r.held.empty ())
+	r.feed (std::make_shared<std::string> (std::move (r.held)));
+      r.held = std::string{};
+      r.state = replica_online;
+    }
+}
+
+void
+processor::reset_replication ()
+{
+  // The replicas cannot follow the stream any longer: they reconnect, and
+  // load a new snapshot.
+  for (auto &i : replicas_)
+    i.second.feed (nullptr);
+  replicas_.clear ();
+  backlog_.reset ();
+  bgsave_offset_ = boost::none;
+  replid_ = new_replication_id ();
+}
+
+optional<resp::data>
+processor::redirect (bool asking)
+{
+  if (keys_.empty ())
+    return boost::none;
+
+  auto slot = db::key_slot (keys_[0]);
+  for (auto key : keys_)
+    if (db::key_slot (key) != slot)
+      return e_crossslot;
+
+  auto to = [slot] (const char *kind, const cluster_table::node &n)
+    {
+      return simple_error (std::string{ kind } + " " + std::to_string (slot)
+			   + " " + n.host + ":" + std::to_string (n.port));
+    };
+
+  auto owner = cluster_->owner (slot);
+  if (owner == &cluster_->myself ())
+    {
+      // While the slot migrates, the keys not here any longer may be on
+      // the target already, and new keys are created there.
+      auto target = cluster_->migrating (slot);
+      if (target == nullptr)
+	return boost::none;
+      std::size_t missing = 0;
+      for (auto key : keys_)
+	if (!storage_.find (key.to_string ()).has_value ())
+	  missing++;
+      if (missing == 0)
+	return boost::none;
+      if (missing == keys_.size ())
+	return to ("ASK", *target);
+      return e_tryagain;
+    }
+
+  if (asking && cluster_->importing (slot) != nullptr)
+    return boost::none;
+  if (owner == nullptr)
+    return e_clusterdown;
+  return to ("MOVED", *owner);
+}
+
+void
+processor::signal_key (const std::string &key)
+{
+  auto kit = waiting_keys_.find (key);
+  if (kit == waiting_keys_.end ())
+    return;
+
+  auto ids = kit->second;
+  std::sort (ids.begin (), ids.end ());
+  for (auto id : ids)
+    {
+      auto it = waiters_.find (id);
+      if (it == waiters_.end ())
+	continue;
+      auto wake = std::move (it->second.wake);
+      remove_waiter (id);
+      // The clients a script has served are answered once it ends, not
+      // with BUSY in between its slices.
+      if (script_running_)
+	postponed_wakes_.push_back (std::move (wake));
+      else
+	wake ();
+    }
+}
+
+// Connection commands
+resp::data
+processor::exec_ping ()
+{
+  // PING [message]
+
+  // RETURN:
+  // - simple string: PONG when no argument is provided.
+  // - bulk string: the provided argument.
+
+  // A subscribed client gets ["pong", message] instead, which it can tell
+  // from its messages.
+  if (client_ != nullptr && subscribed (*client_) && args_.size () <= 1)
+    {
+      std::vector<resp::data> out;
+      out.push_back (bulk_string ("pong"));
+      out.push_back (bulk_string (args_.empty () ? std::string{}
+						 : std::move (args_[0])));
+      return array (std::move (out));
+    }
+
+  switch (args_.size ())
+    {
+    case 0:
+      return simple_string ("PONG");
+
+    case 1:
+      return bulk_string (std::move (args_[0]));
+
+    default:
+      return e_wrong_num_args ("ping");
+    }
+}
+
+// Server commands
+resp::data
+processor::exec_save ()
+{
+  // SAVE [TO path] [COMPRESS lz|none] [INCREMENTAL]
+
+  // RETURN:
+  // - simple string: OK.
+
+  std::string path{ config_.dbfilename };
+  auto codec = db::compression_none;
+  bool incremental = false;
+  if (!parse_save_options (args_, path, codec, &incremental))
+    return e_syntax;
+
+  check_background_save ();
+  if (bgsave_in_progress ())
+    return e_bgsave_in_progress;
+
+  // An incremental save appends the keys changed since the last save to
+  // the delta file of the snapshot it extends. Without such a snapshot it
+  // falls back to a full save, which starts a new chain.
+  if (incremental && chain_path_.has_value () && chain_path_.value () == path)
+    {
+      if (storage_.changes () != 0)
+	{
+	  auto ret = db::save_delta (path, chain_size_, storage_, codec);
+	  if (!ret.has_value ())
+	    return e_persistence (ret.error ());
+	  chain_size_ = ret.value ();
+	  storage_.clear_changes ();
+	}
+      dirty_ = 0;
+      last_save_ = db::clock_type::now ();
+      return simple_string ("OK");
+    }
+
+  auto ret = save_snapshot (path, codec);
+  if (!ret.has_value ())
+    return e_persistence (ret.error ());
+  return simple_string ("OK");
+}
+
+resp::data
+processor::exec_load ()
+{
+  // LOAD [FROM path]
+
+  // RETURN:
+  // - simple string: OK.
+
+  // The snapshot is loaded with the deltas saved since. LOAD is not a
+  // write: replaying it from the append-only file, or on the replicas,
+  // would load whatever their file holds then, so the log is rewritten
+  // from the loaded dataset instead, and the replicas resynchronize.
+
+  // A replica follows its primary's dataset.
+  if (primary_.has_value ())
+    return e_readonly;
+
+  std::string path{ config_.dbfilename };
+  if (!args_.empty ())
+    {
+      if (args_.size () != 2)
+	return e_syntax;
+
+      auto opt = args_[0];
+      boost::to_lower (opt);
+      if (opt != "from")
+	return e_syntax;
+
+      path = std::move (args_[1]);
+    }
+
+  auto ret = load_snapshot (path);
+  if (!ret.has_value ())
+    return e_persistence (ret.error ());
+  // The dataset no longer follows from the replication stream, nor from
+  // the append-only file.
+  reset_replication ();
+  if (aof_.is_open ())
+    rewrite_scheduled_ = true;
+  return simple_string ("OK");
+}
+
+resp::data
+processor::exec_bgsave ()
+{
+  // BGSAVE [TO path] [COMPRESS lz|none]
+
+  // RETURN:
+  // - simple string: Background saving started.
+
+  std::string path{ config_.dbfilename };
+  auto codec = db::compression_none;
+  if (!parse_save_options (args_, path, codec))
+    return e_syntax;
+
+  check_background_save ();
+  if (bgsave_in_progress ())
+    return e_bgsave_in_progress;
+  check_background_rewrite ();
+  if (rewrite_pid_ != -1)
+    return e_rewrite_in_progress;
+
+  auto ret = start_background_save (path, codec);
+  if (!ret.has_value ())
+    return e_persistence (ret.error ());
+  return simple_string ("Background saving started");
+}
+
+resp::data
+processor::exec_lastsave ()
+{
+  // LASTSAVE
+
+  // RETURN:
+  // - integer: UNIX timestamp of the last successful save.
+
+  if (!args_.empty ())
+    return e_wrong_num_args ("lastsave");
+
+  check_background_save ();
+  auto secs = duration_cast<seconds> (last_save_.time_since_epoch ());
+  return integer (secs.count ());
+}
+
+resp::data
+processor::exec_info ()
+{
+  // INFO [section]
+
+  // RETURN:
+  // - bulk string: a text of "field:value" lines, grouped into sections.
+
+  if (args_.size () > 1)
+    return e_syntax;
+
+  auto section = args_.empty () ? std::string{ "all" } : args_[0];
+  boost::to_lower (section);
+  bool all = section == "all" || section == "default"
+	     || section == "everything";
+
+  check_background_save ();
+  check_background_rewrite ();
+
+  std::string out;
+  if (all || section == "persistence")
+    {
+      auto secs = duration_cast<seconds> (last_save_.time_since_epoch ());
+      out += "# Persistence\r\n";
+      out += "rdb_bgsave_in_progress:";
+      out += bgsave_in_progress () ? "1" : "0";
+      out += "\r\nrdb_last_save_time:";
+      out += std::to_string (secs.count ());
+      out += "\r\nrdb_last_bgsave_status:";
+      out += last_bgsave_ok_ ? "ok" : "err";
+      out += "\r\nrdb_changes_since_last_save:";
+      out += std::to_string (dirty_);
+      out += "\r\naof_enabled:";
+      out += aof_.is_open () ? "1" : "0";
+      out += "\r\naof_current_size:";
+      out += std::to_string (aof_.size ());
+      out += "\r\naof_last_write_status:";
+      out += aof_last_write_ok_ ? "ok" : "err";
+      out += "\r\naof_rewrite_in_progress:";
+      out += rewrite_pid_ != -1 ? "1" : "0";
+      out += "\r\naof_last_bgrewrite_status:";
+      out += last_rewrite_ok_ ? "ok" : "err";
+      out += "\r\n";
+    }
+
+  if (all || section == "replication")
+    {
+      if (!out.empty ())
+	out += "\r\n";
+      out += "# Replication\r\nrole:";
+      out += primary_.has_value () ? "slave" : "master";
+      if (primary_.has_value ())
+	{
+	  out += "\r\nmaster_host:";
+	  out += primary_->host;
+	  out += "\r\nmaster_port:";
+	  out += std::to_string (primary_->port);
+	  out += "\r\nmaster_link_status:";
+	  out += primary_link_up_ ? "up" : "down";
+	}
+      out += "\r\nconnected_slaves:";
+      out += std::to_string (replicas_.size ());
+      out += "\r\nmaster_replid:";
+      out += replid_;
+      out += "\r\nmaster_repl_offset:";
+      out += std::to_string (repl_offset_);
+      out += "\r\nrepl_backlog_active:";
+      out += backlog_ != nullptr ? "1" : "0";
+      out += "\r\nrepl_backlog_size:";
+      out += std::to_string (config_.repl_backlog_size);
+      out += "\r\nrepl_backlog_first_byte_offset:";
+      out += std::to_string (backlog_ != nullptr ? backlog_->first_offset ()
+						  : repl_offset_);
+      out += "\r\nrepl_backlog_histlen:";
+      out += std::to_string (backlog_ != nullptr
+				 ? backlog_->end_offset ()
+				       - backlog_->first_offset ()
+				 : 0);
+      out += "\r\nsync_full:";
+      out += std::to_string (sync_full_);
+      out += "\r\nsync_partial_ok:";
+      out += std::to_string (sync_partial_ok_);
+      out += "\r\nsync_partial_err:";
+      out += std::to_string (sync_partial_err_);
+      out += "\r\n";
+    }
+
+  if (all || section == "cluster")
+    {
+      if (!out.empty ())
+	out += "\r\n";
+      out += "# Cluster\r\ncluster_enabled:";
+      out += cluster_ != nullptr ? "1" : "0";
+      out += "\r\n";
+    }
+
+  return bulk_string (std::move (out));
+}
+
+resp::data
+processor::exec_bgrewriteaof ()
+{
+  // BGREWRITEAOF
+
+  // RETURN:
+  // - simple string: Background append only file rewriting started.
+
+  if (!args_.empty ())
+    return e_wrong_num_args ("bgrewriteaof");
+
+  check_background_rewrite ();
+  if (rewrite_pid_ != -1)
+    return e_rewrite_in_progress;
+  check_background_save ();
+  if (bgsave_in_progress ())
+    return e_bgsave_in_progress;
+
+  auto ret = start_background_rewrite ();
+  if (!ret.has_value ())
+    return e_persistence (ret.error ());
+  return simple_string ("Background append only file rewriting started");
+}
+
+resp::data
+processor::exec_compact ()
+{
+  // COMPACT [TO path] [COMPRESS lz|none]
+
+  // RETURN:
+  // - simple string: OK.
+
+  std::string path{ config_.dbfilename };
+  auto codec = db::compression_none;
+  if (!parse_save_options (args_, path, codec))
+    return e_syntax;
+
+  // The snapshot on disk is merged with its deltas; the dataset in memory
+  // is not involved, and the chain goes on from the merged snapshot.
+  check_background_save ();
+  if (bgsave_in_progress ())
+    return e_bgsave_in_progress;
+
+  auto ret = db::compact (path, codec);
+  if (!ret.has_value ())
+    return e_persistence (ret.error ());
+
+  if (chain_path_.has_value () && chain_path_.value () == path)
+    chain_size_ = 0;
+  return simple_string ("OK");
+}
+
+result<void, std::string>
+processor::start_background_rewrite ()
+{
+  // The child writes the dataset as it is now; the commands logged from
+  // now on are set aside and appended once it is done.
+  auto temp_path = config_.appendfilename + ".tmp";
+  const auto &st = storage_;
+  auto job = [&temp_path, &st] ()
+    { return db::write_append_only_base (temp_path, st); };
+  auto ret = db::run_in_background (job);
+  if (!ret.has_value ())
+    return "background rewrite failed: " + ret.error ();
+
+  rewrite_pid_ = ret.value ();
+  if (aof_.is_open ())
+    aof_.start_rewrite ();
+  return {};
+}
+
+resp::data
+processor::exec_replicaof ()
+{
+  // REPLICAOF host port | REPLICAOF NO ONE
+
+  // RETURN:
+  // - simple string: OK.
+
+  // The link to the primary is set up in the background.
+
+  if (args_.size () != 2)
+    return e_wrong_num_args ("replicaof");
+
+  if (boost::iequals (args_[0], "no") && boost::iequals (args_[1], "one"))
+    {
+      if (primary_.has_value ())
+	{
+	  // The stream goes on from here, as a new one.
+	  primary_ = boost::none;
+	  storage_.keep_expired (false);
+	  primary_gen_++;
+	  discard_transaction (stream_client_);
+	  primary_link_up_ = false;
+	  replid_ = new_replication_id ();
+	}
+      return simple_string ("OK");
+    }
+
+  std::int64_t port;
+  if (!try_lexical_convert (args_[1], port) || port <= 0
+      || port > std::numeric_limits<std::uint16_t>::max ())
+    return simple_error ("ERR Invalid master port");
+
+  if (primary_.has_value () && primary_->host == args_[0]
+      && primary_->port == port)
+    return simple_string ("OK");
+
+  primary_ = primary_address{ std::move (args_[0]),
+			      static_cast<std::uint16_t> (port) };
+  storage_.keep_expired (true);
+  primary_gen_++;
+  discard_transaction (stream_client_);
+  primary_link_up_ = false;
+  return simple_string ("OK");
+}
+
+resp::data
+processor::exec_psync ()
+{
+  // PSYNC replicationid offset
+
+  // RETURN:
+  // - no reply: the connection carries the replication stream from then
+  //   on, starting with +FULLRESYNC <replicationid> <offset> and a
+  //   snapshot, or with +CONTINUE <replicationid>.
+
+  // offset is how much of the stream of replicationid the replica has.
+
+  if (args_.size () != 2)
+    return e_wrong_num_args ("psync");
+
+  std::int64_t offset;
+  if (!try_lexical_convert (args_[1], offset))
+    return e_bad_integer;
+
+  sync_request_ = sync_request{ std::move (args_[0]), offset };
+  return simple_string ("OK");
+}
+
+resp::data
+processor::exec_dump ()
+{
+  // DUMP key
+
+  // RETURN:
+  // - bulk string: the serialized value, which RESTORE takes.
+  // - nil: the key does not exist.
+
+  if (args_.size () != 1)
+    return e_wrong_num_args ("dump");
+
+  auto it = storage_.find (args_[0]);
+  if (!it.has_value ())
+    return null_bulk_string ();
+  return bulk_string (db::dump_value (it.value ()->second));
+}
+
+resp::data
+processor::exec_restore ()
+{
+  // RESTORE key ttl serialized-value [REPLACE] [ABSTTL]
+
+  // RETURN:
+  // - simple string: OK.
+
+  // ttl is in milliseconds, 0 meaning none, or a UNIX time in milliseconds
+  // with ABSTTL.
+
+  if (args_.size () < 3)
+    return e_wrong_num_args ("restore");
+
+  std::int64_t ttl;
+  if (!try_lexical_convert (args_[1], ttl))
+    return e_bad_integer;
+  if (ttl < 0)
+    return simple_error ("ERR Invalid TTL value, must be >= 0");
+
+  bool replace = false;
+  bool absttl = false;
+  for (std::size_t i = 3; i < args_.size (); i++)
+    {
+      if (boost::iequals (args_[i], "replace"))
+	replace = true;
+      else if (boost::iequals (args_[i], "absttl"))
+	absttl = true;
+      else
+	return e_syntax;
+    }
+
+  const auto &key = args_[0];
+  auto it = storage_.find (key);
+  if (it.has_value () && !replace)
+    return simple_error ("BUSYKEY Target key name already exists.");
+
+  auto value = db::restore_value (args_[2]);
+  if (!value.has_value ())
+    return simple_error ("ERR " + value.error ());
+
+  optional<db::time_point> at;
+  if (ttl != 0 && absttl)
+    at = db::time_point{ milliseconds{ ttl } };
+  else if (ttl != 0)
+    at = db::clock_type::now () + milliseconds{ ttl };
+
+  // A value restored past its expiration time only removes the key.
+  if (at.has_value () && at.value () <= db::clock_type::now ())
+    {
+      if (it.has_value ())
+	{
+	  storage_.erase (it.value ());
+	  notify (notify_generic, "del", key);
+	  if (!propagate_.empty ())
+	    propagate_ = { "DEL", key };
+	}
+      else
+	propagate_.clear ();
+      return simple_string ("OK");
+    }
+
+  auto pos = storage_.insert (key, std::move (value.value ()));
+  if (at.has_value ())
+    storage_.expire_at (pos, at.value ());
+  else
+    storage_.clear_expires (pos);
+  if (!propagate_.empty ())
+    propagate_ = { "RESTORE", key,
+		   at.has_value () ? unix_time_ms (at.value ()) : "0",
+		   args_[2], "REPLACE", "ABSTTL" };
+  signal_key (key);
+  notify (notify_generic, "restore", key);
+  return simple_string ("OK");
+}
+
+resp::data
+processor::exec_restore_asking ()
+{
+  // RESTORE-ASKING key ttl serialized-value [REPLACE] [ABSTTL]
+
+  // RETURN:
+  // - simple string: OK.
+
+  // RESTORE as MIGRATE sends it: in cluster mode, it is served in a slot
+  // being imported, as after ASKING.
+
+  return exec_restore ();
+}
+
+resp::data
+processor::exec_migrate ()
+{
+  // MIGRATE host port key|"" destination-db timeout [COPY] [REPLACE]
+  //   [KEYS key [key ...]]
+
+  // RETURN:
+  // - simple string: OK once the target has restored the keys, which are
+  //   then deleted here unless COPY is given, or NOKEY when none of them
+  //   exists.
+
+  // The server keeps serving other requests while the keys are sent, but
+  // they cannot be written to until the target has replied. timeout, in
+  // milliseconds, bounds the whole exchange.
+
+  if (args_.size () < 5)
+    return e_wrong_num_args ("migrate");
+
+  std::int64_t port, db_index, timeout;
+  if (!try_lexical_convert (args_[1], port)
+      || !try_lexical_convert (args_[3], db_index)
+      || !try_lexical_convert (args_[4], timeout))
+    return e_bad_integer;
+  if (port <= 0 || port > std::numeric_limits<std::uint16_t>::max ())
+    return simple_error ("ERR Invalid port");
+  if (db_index != 0)
+    return simple_error ("ERR DB index is out of range");
+  if (timeout <= 0)
+    timeout = 1000;
+
+  bool copy = false;
+  bool replace = false;
+  std::size_t keys_at = 2;
+  std::size_t keys_end = 3;
+  for (std::size_t i = 5; i < args_.size (); i++)
+    {
+      if (boost::iequals (args_[i], "copy"))
+	copy = true;
+      else if (boost::iequals (args_[i], "replace"))
+	replace = true;
+      else if (boost::iequals (args_[i], "keys"))
+	{
+	  if (!args_[2].empty ())
+	    return simple_error ("ERR When using MIGRATE KEYS option, the "
+				 "key argument must be set to the empty "
+				 "string");
+	  keys_at = i + 1;
+	  keys_end = args_.size ();
+	  break;
+	}
+      else
+	return e_syntax;
+    }
+
+  migration m;
+  m.host = std::move (args_[0]);
+  m.port = static_cast<std::uint16_t> (port);
+  m.timeout = milliseconds{ timeout };
+  m.copy = copy;
+  for (auto i = keys_at; i < keys_end; i++)
+    if (migrating_keys_.count (args_[i]) != 0)
+      return e_key_migrating;
+
+  for (auto i = keys_at; i < keys_end; i++)
+    {
+      auto &key = args_[i];
+      auto it = storage_.find (key);
+      if (!it.has_value () || !migrating_keys_.insert (key).second)
+	continue;
+
+      // The time to live goes relative, as the clocks of the two nodes
+      // may differ.
+      std::string ttl{ "0" };
+      auto left = storage_.ttl (it.value ());
+      if (left.has_value ())
+	ttl = std::to_string (std::max<std::int64_t> (
+	    duration_cast<milliseconds> (left.value ()).count (), 1));
+      std::vector<std::string> argv{ "RESTORE-ASKING", key, std::move (ttl),
+				     db::dump_value (it.value ()->second) };
+      if (replace)
+	argv.push_back ("REPLACE");
+      encode_command (argv, m.commands);
+      m.keys.push_back (std::move (key));
+    }
+
+  if (m.keys.empty ())
+    return simple_string ("NOKEY");
+  migration_ = std::move (m);
+  return simple_string ("OK");
+}
+
+void
+processor::check_background_rewrite ()
+{
+  if (rewrite_pid_ == -1)
+    return;
+
+  auto done = db::poll_background_save (rewrite_pid_);
+  if (!done.has_value ())
+    return;
+
+  rewrite_pid_ = -1;
+  auto temp_path = config_.appendfilename + ".tmp";
+  if (!done.value ())
+    {
+      aof_.abort_rewrite ();
+      std::remove (temp_path.c_str ());
+      last_rewrite_ok_ = false;
+      return;
+    }
+
+  if (!aof_.is_open ())
+    {
+      last_rewrite_ok_ = std::rename (temp_path.c_str (),
+				      config_.appendfilename.c_str ())
+			 == 0;
+      return;
+    }
+
+  auto ret = aof_.finish_rewrite (temp_path);
+  last_rewrite_ok_ = ret.has_value ();
+  if (!ret.has_value ())
+    {
+      std::fprintf (stderr, "%s\n", ret.error ().c_str ());
+      std::remove (temp_path.c_str ());
+    }
+}
+
+result<void, std::string>
+processor::load_snapshot (const std::string &path)
+{
+  // A save in slices, or a diskless sync, refers to the dataset about to
+  // be replaced.
+  while (storage_.snapshot_active ())
+    save_slice ();
+
+  db::storage loaded;
+  auto res = db::load_from (path, loaded);
+  if (!res.has_value ())
+    return res;
+  auto applied = db::load_deltas (path, loaded);
+  if (!applied.has_value ())
+    return applied.error ();
+
+  loaded.take_watches (storage_);
+  storage_ = std::move (loaded);
+  if (cluster_ != nullptr)
+    storage_.index_slots ();
+  chain_path_ = path;
+  chain_size_ = applied.value ();
+  dirty_ = 0;
+  storage_.pause_expiration (loading_);
+  storage_.keep_expired (primary_.has_value ());
+  log_expired_keys ();
+  return {};
+}
+
+result<void, std::string>
+processor::save_snapshot (const std::string &path, db::compression codec)
+{
+  // The deltas of the old snapshot must not outlive it. Until the new one
+  // replaces it, the old one stands alone: older, but consistent.
+  chain_path_ = boost::none;
+  auto ret = db::remove_deltas (path);
+  if (ret.has_value ())
+    ret = db::save_to (path, storage_, codec);
+  if (!ret.has_value ())
+    return ret;
+
+  chain_path_ = path;
+  chain_size_ = 0;
+  storage_.clear_changes ();
+  dirty_ = 0;
+  last_save_ = db::clock_type::now ();
+  return {};
+}
+
+result<void, std::string>
+processor::start_background_save (const std::string &path,
+				  db::compression codec)
+{
+  last_bgsave_try_ = db::clock_type::now ();
+  if (config_.bgsave == bgsave_sliced && storage_.snapshot_active ())
+    return "background save failed: a snapshot is being streamed to "
+	   "replicas";
+
+  // As with SAVE, the new snapshot starts a new chain, which holds the
+  // changes made from now on; it is dropped if the save fails.
+  chain_path_ = boost::none;
+  auto removed = db::remove_deltas (path);
+  if (!removed.has_value ())
+    return removed;
+  if (config_.bgsave == bgsave_sliced)
+    {
+      auto ret = sliced_save_.start (path, storage_, codec);
+      if (!ret.has_value ())
+	return "background save failed: " + ret.error ();
+    }
+  else
+    {
+      auto ret = db::save_in_background (path, storage_, codec);
+      if (!ret.has_value ())
+	return ret.error ();
+      bgsave_pid_ = ret.value ();
+    }
+
+  chain_path_ = path;
+  chain_size_ = 0;
+  storage_.clear_changes ();
+  dirty_at_bgsave_ = dirty_;
+  bgsave_path_ = path;
+  bgsave_offset_ = boost::none;
+  if (backlog_ != nullptr)
+    bgsave_offset_ = repl_offset_;
+  return {};
+}
+
+void
+processor::check_save_points ()
+{
+  if (config_.save_points.empty () || bgsave_in_progress ()
+      || rewrite_pid_ != -1 || storage_.snapshot_active ())
+    return;
+
+  // After a failed save, the next attempt waits a little: whatever made it
+  // fail likely still holds.
+  auto now = db::clock_type::now ();
+  if (!last_bgsave_ok_ && now - last_bgsave_try_ < seconds{ 5 })
+    return;
+
+  for (const auto &point : config_.save_points)
+    {
+      if (dirty_ < point.changes || now - last_save_ < point.interval)
+	continue;
+
+      auto ret = start_background_save (config_.dbfilename,
+					db::compression_none);
+      if (!ret.has_value ())
+	{
+	  std::fprintf (stderr, "%s\n", ret.error ().c_str ());
+	  last_bgsave_ok_ = false;
+	}
+      return;
+    }
+}
+
+void
+processor::check_background_save ()
+{
+  if (bgsave_pid_ == -1)
+    return;
+
+  auto done = db::poll_background_save (bgsave_pid_);
+  if (!done.has_value ())
+    return;
+
+  bgsave_pid_ = -1;
+  background_save_done (done.value ());
+}
+
+bool
+processor::bgsave_in_progress () const noexcept
+{
+  return bgsave_pid_ != -1 || sliced_save_.active ();
+}
+
+void
+processor::background_save_done (bool ok)
+{
+  last_bgsave_ok_ = ok;
+  if (ok)
+    {
+      // The writes made while the save ran are not in it.
+      dirty_ -= std::min (dirty_, dirty_at_bgsave_);
+      last_save_ = db::clock_type::now ();
+    }
+  else
+    chain_path_ = boost::none;
+  finish_full_syncs (ok);
+}
+
+bool
+processor::sliced_save_active () const noexcept
+{
+  return sliced_save_.active () || diskless_.active ();
+}
+
+void
+processor::save_slice ()
+{
+  auto deadline = steady_clock::now () + config_.bgsave_slice;
+  if (diskless_.active ())
+    {
+      if (diskless_.step (storage_, deadline))
+	finish_diskless_sync ();
+      return;
+    }
+  if (!sliced_save_.active ())
+    return;
+
+  if (!sliced_save_.step (storage_, deadline))
+    return;
+
+  auto ret = sliced_save_.finish ();
+  if (!ret.has_value ())
+    std::fprintf (stderr, "background save failed: %s\n",
+		  ret.error ().c_str ());
+  background_save_done (ret.has_value ());
+}
+
+// Transaction commands
+resp::data
+processor::exec_multi ()
+{
+  // MULTI
+
+  // RETURN:
+  // - simple string: OK.
+
+  // The commands that follow are queued, and EXEC runs them all at once,
+  // with no other client's command in between.
+
+  if (!args_.empty ())
+    return e_wrong_num_args ("multi");
+  if (client_ == nullptr)
+    return simple_string ("OK");
+  if (client_->multi)
+    return simple_error ("ERR MULTI calls can not be nested");
+  client_->multi = true;
+  return simple_string ("OK");
+}
+
+resp::data
+processor::exec_exec ()
+{
+  // EXEC
+
+  // RETURN:
+  // - array: the replies of the queued commands, in order.
+  // - null array: a watched key was modified, and nothing ran.
+
+  if (!args_.empty ())
+    return e_wrong_num_args ("exec");
+  if (client_ == nullptr || !client_->multi)
+    return simple_error ("ERR EXEC without MULTI");
+
+  auto client = client_;
+  std::vector<resp::data> queued;
+  queued.swap (client->queued);
+  bool failed = client->multi_failed;
+  discard_transaction (*client);
+  // A watched key that has expired meanwhile is found expired here, which
+  // bumps its version.
+  bool touched = false;
+  for (const auto &w : client->watched)
+    {
+      storage_.find (w.first);
+      if (storage_.version (w.first) != w.second)
+	touched = true;
+    }
+  unwatch (*client);
+  if (failed)
+    return e_execabort;
+  if (touched)
+    return null_array ();
+
+  exec_ = transaction{ client, std::move (queued), {}, 0 };
+  exec_->replies.reserve (exec_->queued.size ());
+  multi_logged_ = false;
+  auto reply = run_transaction ();
+  if (!reply.has_value ())
+    return null_array ();
+  return std::move (reply.value ());
+}
+
+// Executes the commands of the transaction from where it stopped, and
+// returns the reply of EXEC, or none once a script among them is paused.
+// The writes among the commands are logged between MULTI and EXEC, so
+// that the append-only file and the replicas apply them as a whole too.
+optional<resp::data>
+processor::run_transaction ()
+{
+  auto &e = exec_.value ();
+  exec_running_ = true;
+  while (e.next < e.queued.size ())
+    {
+      auto &request = e.queued[e.next++];
+      e.replies.push_back (execute (std::move (request), e.client));
+      // A blocking command does not block in a transaction.
+      if (take_block_request ().has_value ())
+	e.replies.back () = null_array ();
+      if (script_ != nullptr)
+	{
+	  exec_running_ = false;
+	  return boost::none;
+	}
+    }
+  exec_running_ = false;
+  if (multi_logged_)
+    {
+      const std::string argv[]{ "EXEC" };
+      propagate (argv);
+    }
+  auto replies = std::move (e.replies);
+  exec_ = boost::none;
+  return array (std::move (replies));
+}
+
+resp::data
+processor::exec_discard ()
+{
+  // DISCARD
+
+  // RETURN:
+  // - simple string: OK.
+
+  if (!args_.empty ())
+    return e_wrong_num_args ("discard");
+  if (client_ == nullptr || !client_->multi)
+    return simple_error ("ERR DISCARD without MULTI");
+  discard_transaction (*client_);
+  unwatch (*client_);
+  return simple_string ("OK");
+}
+
+resp::data
+processor::exec_watch ()
+{
+  // WATCH key [key ...]
+
+  // RETURN:
+  // - simple string: OK.
+
+  // EXEC fails if one of the keys is modified before it runs. The keys
+  // that have expired are dropped first, so that they do not count as
+  // modified later.
+
+  if (args_.empty ())
+    return e_wrong_num_args ("watch");
+  if (client_ == nullptr)
+    return simple_string ("OK");
+  if (client_->multi)
+    return simple_error ("ERR WATCH inside MULTI is not allowed");
+
+  for (auto &key : args_)
+    {
+      auto &watched = client_->watched;
+      auto same = [&key] (const std::pair<std::string, std::uint64_t> &w)
+	{ return w.first == key; };
+      if (std::any_of (watched.begin (), watched.end (), same))
+	continue;
+      storage_.find (key);
+      auto version = storage_.watch (key);
+      watched.emplace_back (std::move (key), version);
+    }
+  return simple_string ("OK");
+}
+
+resp::data
+processor::exec_unwatch ()
+{
+  // UNWATCH
+
+  // RETURN:
+  // - simple string: OK.
+
+  if (!args_.empty ())
+    return e_wrong_num_args ("unwatch");
+  if (client_ != nullptr)
+    unwatch (*client_);
+  return simple_string ("OK");
+}
+
+void
+processor::unwatch (client_state &client)
+{
+  for (const auto &w : client.watched)
+    storage_.unwatch (w.first);
+  client.watched.clear ();
+}
+
+// Scripting commands
+resp::data
+processor::exec_eval ()
+{
+  // EVAL script numkeys [key ...] [arg ...]
+
+  // RETURN:
+  // - the reply of the script.
+
+  // The script is compiled once, and cached by its SHA1 for EVALSHA.
+
+  if (args_.size () < 2)
+    return e_wrong_num_args ("eval");
+  auto prog = cache_script (script::sha1_hex (args_[0]), args_[0]);
+  if (!prog.has_value ())
+    return simple_error (std::move (prog.error ()));
+  return run_script (std::move (prog.value ()));
+}
+
+resp::data
+processor::exec_evalsha ()
+{
+  // EVALSHA sha1 numkeys [key ...] [arg ...]
+
+  // RETURN:
+  // - the reply of the script.
+
+  if (args_.size () < 2)
+    return e_wrong_num_args ("evalsha");
+  auto it = scripts_.find (boost::to_lower_copy (args_[0]));
+  if (it == scripts_.end ())
+    return e_noscript;
+  return run_script (it->second);
+}
+
+resp::data
+processor::exec_script ()
+{
+  // SCRIPT LOAD script | EXISTS sha1 [sha1 ...] | FLUSH [ASYNC|SYNC]
+  //   | KILL
+
+  // RETURN:
+  // - bulk string: the SHA1 of the script, for LOAD.
+  // - array: 1 or 0 for every SHA1, whether the script is cached, for
+  //   EXISTS.
+  // - simple string: OK, for FLUSH and KILL.
+
+  // KILL stops the script that is paused past the busy threshold, unless
+  // it has written: a part of its writes would stay.
+
+  if (args_.empty ())
+    return e_wrong_num_args ("script");
+
+  auto sub = args_[0];
+  boost::to_lower (sub);
+  if (sub == "load" && args_.size () == 2)
+    {
+      auto sha = script::sha1_hex (args_[1]);
+      auto prog = cache_script (sha, args_[1]);
+      if (!prog.has_value ())
+	return simple_error (std::move (prog.error ()));
+      return bulk_string (std::move (sha));
+    }
+
+  if (sub == "exists" && args_.size () >= 2)
+    {
+      std::vector<resp::data> out;
+      for (std::size_t i = 1; i < args_.size (); i++)
+	{
+	  boost::to_lower (args_[i]);
+	  out.push_back (integer (scripts_.count (args_[i]) != 0 ? 1 : 0));
+	}
+      return array (std::move (out));
+    }
+
+  if (sub == "flush" && args_.size () <= 2)
+    {
+      if (args_.size () == 2 && !boost::iequals (args_[1], "async")
+	  && !boost::iequals (args_[1], "sync"))
+	return e_syntax;
+      scripts_.clear ();
+      return simple_string ("OK");
+    }
+
+  if (sub == "kill" && args_.size () == 1)
+    {
+      if (script_ == nullptr)
+	return simple_error ("NOTBUSY No scripts in execution right now.");
+      if (script_wrote_)
+	return simple_error ("UNKILLABLE Sorry the script already executed "
+			     "write commands against the dataset. You can "
+			     "either wait the script termination or kill the "
+			     "server in a hard way.");
+      script_killed_ = true;
+      return simple_string ("OK");
+    }
+
+  return simple_error ("ERR unknown subcommand or wrong number of "
+		       "arguments for '" + args_[0] + "'");
+}
+
+result<std::shared_ptr<const script::program>, std::string>
+processor::cache_script (const std::string &sha, const std::string &body)
+{
+  auto it = scripts_.find (sha);
+  if (it != scripts_.end ())
+    return it->second;
+  auto prog = script::compile (body);
+  if (!prog.has_value ())
+    return "ERR Error compiling script (new function): " + prog.error ();
+  scripts_.emplace (sha, prog.value ());
+  return prog;
+}
+
+// Runs a script with the arguments of EVAL or EVALSHA. The commands it
+// calls run as the ones of EXEC do, without another client's command in
+// between, and their writes are logged between MULTI and EXEC, unless
+// EXEC runs the script, and logs them already. A script still running at
+// the busy threshold is paused, to go on a slice at a time.
+resp::data
+processor::run_script (std::shared_ptr<const script::program> prog)
+{
+  std::int64_t numkeys;
+  if (!try_lexical_convert (args_[1], numkeys))
+    return e_bad_integer;
+  if (numkeys < 0)
+    return simple_error ("ERR Number of keys can't be negative");
+  if (static_cast<std::uint64_t> (numkeys) > args_.size () - 2)
+    return simple_error ("ERR Number of keys can't be greater than number "
+			 "of args");
+
+  auto first_arg = args_.begin () + 2 + numkeys;
+  std::vector<std::string> keys (
+      std::make_move_iterator (args_.begin () + 2),
+      std::make_move_iterator (first_arg));
+  std::vector<std::string> argv (std::make_move_iterator (first_arg),
+				 std::make_move_iterator (args_.end ()));
+
+  script_nested_ = exec_running_;
+  if (!script_nested_)
+    multi_logged_ = false;
+  script_wrote_ = false;
+  script_killed_ = false;
+  auto run = make_unique<script::execution> (
+      std::move (prog), std::move (keys), std::move (argv),
+      [this] (std::vector<std::string> &args) { return script_call (args); });
+  script_running_ = true;
+  auto reply = run->run (steady_clock::now () + config_.busy_reply_threshold);
+  script_running_ = false;
+  if (!reply.has_value ())
+    {
+      script_ = std::move (run);
+      script_paused_ = true;
+      return null_array ();
+    }
+  return end_script (std::move (reply.value ()));
+}
+
+resp::data
+processor::end_script (resp::data reply)
+{
+  script_.reset ();
+  if (!script_nested_ && multi_logged_)
+    {
+      const std::string argv[]{ "EXEC" };
+      propagate (argv);
+      multi_logged_ = false;
+    }
+  auto wakes = std::move (postponed_wakes_);
+  postponed_wakes_.clear ();
+  for (auto &wake : wakes)
+    wake ();
+  return reply;
+}
+
+bool
+processor::take_script_pause () noexcept
+{
+  bool paused = script_paused_;
+  script_paused_ = false;
+  return paused;
+}
+
+optional<resp::data>
+processor::resume_script ()
+{
+  BOOST_ASSERT (script_ != nullptr);
+
+  // Short slices keep the BUSY replies to the other clients prompt.
+  const milliseconds slice{ 10 };
+  optional<resp::data> reply;
+  if (script_killed_)
+    reply = script_->kill ("Script killed by user with SCRIPT KILL");
+  else
+    {
+      script_running_ = true;
+      reply = script_->run (steady_clock::now () + slice);
+      script_running_ = false;
+    }
+  if (!reply.has_value ())
+    return boost::none;
+
+  reply = end_script (std::move (reply.value ()));
+  // The transaction goes on after the script, and may pause at another.
+  if (script_nested_)
+    {
+      exec_->replies.back () = std::move (reply.value ());
+      reply = run_transaction ();
+      // The caller goes on with the slices of the next script, if any.
+      script_paused_ = false;
+      if (!reply.has_value ())
+	return boost::none;
+    }
+  while (!postponed_stream_.empty ())
+    {
+      auto request = std::move (postponed_stream_.front ());
+      postponed_stream_.pop_front ();
+      execute_from_primary (std::move (request));
+    }
+  return reply;
+}
+
+// Executes a command of a script, for redis.call: the arguments move into
+// a request as they are, with no encoding in between. A blocking command
+// does not block in a script.
+resp::data
+processor::script_call (std::vector<std::string> &argv)
+{
+  std::vector<resp::data> request;
+  request.reserve (argv.size ());
+  for (auto &arg : argv)
+    request.push_back (bulk_string (std::move (arg)));
+  auto reply = execute (array (std::move (request)));
+  if (take_block_request ().has_value ())
+    return null_array ();
+  return reply;
+}
+
+// Cluster commands
+resp::data
+processor::exec_cluster ()
+{
+  // CLUSTER MYID | INFO | SLOTS | SHARDS | KEYSLOT key
+  //   | COUNTKEYSINSLOT slot | GETKEYSINSLOT slot count
+  //   | MEET ip port node-id | ADDSLOTS slot [slot ...]
+  //   | ADDSLOTSRANGE start end [start end ...] | DELSLOTS slot [slot ...]
+  //   | SETSLOT slot IMPORTING node-id | MIGRATING node-id | NODE node-id
+  //     | STABLE
+
+  // RETURN:
+  // - bulk string: the node id for MYID, "field:value" lines for INFO.
+  // - array: for SLOTS, a [start, end, [ip, port, node-id]] array per range
+  //   of slots; for SHARDS, a map of the slots and nodes of every node;
+  //   the keys for GETKEYSINSLOT.
+  // - integer: the slot for KEYSLOT, the number of keys for
+  //   COUNTKEYSINSLOT.
+  // - simple string: OK for the others.
+
+  // MEET takes the id of the other node, which there is no cluster bus to
+  // learn it from; see cluster_table.
+
+  if (args_.empty ())
+    return e_wrong_num_args ("cluster");
+  if (cluster_ == nullptr)
+    return e_cluster_disabled;
+
+  auto sub = args_[0];
+  boost::to_lower (sub);
+  auto argc = args_.size () - 1;
+  std::size_t slot;
+
+  if (sub == "myid" && argc == 0)
+    return bulk_string (cluster_->myself ().id);
+
+  if (sub == "info" && argc == 0)
+    {
+      auto assigned = cluster_->slots_assigned ();
+      std::string out{ "cluster_enabled:1\r\ncluster_state:" };
+      out += assigned == db::slot_count ? "ok" : "fail";
+      out += "\r\ncluster_slots_assigned:";
+      out += std::to_string (assigned);
+      out += "\r\ncluster_known_nodes:";
+      out += std::to_string (cluster_->nodes ().size ());
+      out += "\r\n";
+      return bulk_string (std::move (out));
+    }
+
+  if (sub == "slots" && argc == 0)
+    {
+      std::vector<resp::data> out;
+      for (const auto &r : cluster_->ranges ())
+	{
+	  std::vector<resp::data> node;
+	  node.push_back (bulk_string (r.owner->host));
+	  node.push_back (integer (r.owner->port));
+	  node.push_back (bulk_string (r.owner->id));
+
+	  std::vector<resp::data> item;
+	  item.push_back (integer (static_cast<std::int64_t> (r.first)));
+	  item.push_back (integer (static_cast<std::int64_t> (r.last)));
+	  item.push_back (array (std::move (node)));
+	  out.push_back (array (std::move (item)));
+	}
+      return array (std::move (out));
+    }
+
+  if (sub == "shards" && argc == 0)
+    {
+      auto ranges = cluster_->ranges ();
+      std::vector<resp::data> out;
+      for (const auto &p : cluster_->nodes ())
+	{
+	  const auto &n = p.second;
+	  std::vector<resp::data> slots;
+	  for (const auto &r : ranges)
+	    if (r.owner == &n)
+	      {
+		slots.push_back (
+		    integer (static_cast<std::int64_t> (r.first)));
+		slots.push_back (integer (static_cast<std::int64_t> (r.last)));
+	      }
+
+	  std::vector<resp::data> node;
+	  node.push_back (bulk_string ("id"));
+	  node.push_back (bulk_string (n.id));
+	  node.push_back (bulk_string ("port"));
+	  node.push_back (integer (n.port));
+	  node.push_back (bulk_string ("ip"));
+	  node.push_back (bulk_string (n.host));
+	  node.push_back (bulk_string ("endpoint"));
+	  node.push_back (bulk_string (n.host));
+	  node.push_back (bulk_string ("role"));
+	  node.push_back (bulk_string ("master"));
+	  node.push_back (bulk_string ("health"));
+	  node.push_back (bulk_string ("online"));
+	  std::vector<resp::data> nodes;
+	  nodes.push_back (array (std::move (node)));
+
+	  std::vector<resp::data> shard;
+	  shard.push_back (bulk_string ("slots"));
+	  shard.push_back (array (std::move (slots)));
+	  shard.push_back (bulk_string ("nodes"));
+	  shard.push_back (array (std::move (nodes)));
+	  out.push_back (array (std::move (shard)));
+	}
+      return array (std::move (out));
+    }
+
+  if (sub == "keyslot" && argc == 1)
+    return integer (static_cast<std::int64_t> (db::key_slot (args_[1])));
+
+  if (sub == "countkeysinslot" && argc == 1)
+    {
+      if (!parse_slot (args_[1], slot))
+	return e_invalid_slot;
+      return integer (
+	  static_cast<std::int64_t> (storage_.count_keys_in_slot (slot)));
+    }
+
+  if (sub == "getkeysinslot" && argc == 2)
+    {
+      std::int64_t count;
+      if (!parse_slot (args_[1], slot))
+	return e_invalid_slot;
+      if (!try_lexical_convert (args_[2], count) || count < 0)
+	return simple_error ("ERR Invalid number of keys");
+
+      std::vector<resp::data> out;
+      for (auto &key :
+	   storage_.keys_in_slot (slot, static_cast<std::size_t> (count)))
+	out.push_back (bulk_string (std::move (key)));
+      return array (std::move (out));
+    }
+
+  if (sub == "meet" && argc == 3)
+    {
+      std::int64_t port;
+      if (!try_lexical_convert (args_[2], port) || port <= 0
+	  || port > std::numeric_limits<std::uint16_t>::max ())
+	return simple_error ("ERR Invalid node address specified: "
+			     + args_[1] + ":" + args_[2]);
+      if (args_[3].empty () || args_[3] == cluster_->myself ().id)
+	return simple_error ("ERR Invalid node id: " + args_[3]);
+      cluster_->add_node (args_[3], std::move (args_[1]),
+			  static_cast<std::uint16_t> (port));
+      return simple_string ("OK");
+    }
+
+  if ((sub == "addslots" || sub == "delslots") && argc >= 1)
+    {
+      // All the slots are checked before any is changed.
+      bool add = sub == "addslots";
+      std::vector<std::size_t> slots;
+      for (std::size_t i = 1; i < args_.size (); i++)
+	{
+	  if (!parse_slot (args_[i], slot))
+	    return e_invalid_slot;
+	  auto owner = cluster_->owner (slot);
+	  if (add && owner != nullptr)
+	    return simple_error ("ERR Slot " + args_[i]
+				 + " is already busy");
+	  if (!add && owner == nullptr)
+	    return simple_error ("ERR Slot " + args_[i]
+				 + " is already unassigned");
+	  slots.push_back (slot);
+	}
+      for (auto s : slots)
+	if (add)
+	  cluster_->assign (s, cluster_->myself ().id);
+	else
+	  {
+	    cluster_->unassign (s);
+	    cluster_->set_stable (s);
+	  }
+      return simple_string ("OK");
+    }
+
+  if (sub == "addslotsrange" && argc >= 2 && argc % 2 == 0)
+    {
+      std::vector<std::pair<std::size_t, std::size_t>> ranges;
+      for (std::size_t i = 1; i < args_.size (); i += 2)
+	{
+	  std::size_t first, last;
+	  if (!parse_slot (args_[i], first)
+	      || !parse_slot (args_[i + 1], last))
+	    return e_invalid_slot;
+	  if (first > last)
+	    return simple_error ("ERR start slot number " + args_[i]
+				 + " is greater than end slot number "
+				 + args_[i + 1]);
+	  for (auto s = first; s <= last; s++)
+	    if (cluster_->owner (s) != nullptr)
+	      return simple_error ("ERR Slot " + std::to_string (s)
+				   + " is already busy");
+	  ranges.emplace_back (first, last);
+	}
+      for (const auto &r : ranges)
+	for (auto s = r.first; s <= r.second; s++)
+	  cluster_->assign (s, cluster_->myself ().id);
+      return simple_string ("OK");
+    }
+
+  if (sub == "setslot" && argc >= 2)
+    {
+      if (!parse_slot (args_[1], slot))
+	return e_invalid_slot;
+      auto action = args_[2];
+      boost::to_lower (action);
+
+      if (action == "stable" && argc == 2)
+	{
+	  cluster_->set_stable (slot);
+	  return simple_string ("OK");
+	}
+      if (argc != 3)
+	return e_syntax;
+
+      const auto &id = args_[3];
+      if (cluster_->find_node (id) == nullptr)
+	return simple_error ("ERR Unknown node " + id);
+      bool mine = cluster_->owner (slot) == &cluster_->myself ();
+      if (action == "migrating")
+	{
+	  if (!mine)
+	    return simple_error ("ERR I'm not the owner of hash slot "
+				 + args_[1]);
+	  cluster_->set_migrating (slot, id);
+	}
+      else if (action == "importing")
+	{
+	  if (mine)
+	    return simple_error ("ERR I'm already the owner of hash slot "
+				 + args_[1]);
+	  cluster_->set_importing (slot, id);
+	}
+      else if (action == "node")
+	{
+	  // The migration is over, whichever side this node was on.
+	  cluster_->set_stable (slot);
+	  cluster_->assign (slot, id);
+	}
+      else
+	return e_syntax;
+      return simple_string ("OK");
+    }
+
+  return simple_error ("ERR unknown subcommand or wrong number of "
+		       "arguments for '" + args_[0] + "'");
+}
+
+resp::data
+processor::exec_asking ()
+{
+  // ASKING
+
+  // RETURN:
+  // - simple string: OK.
+
+  // The next command of the connection is served in a slot being imported,
+  // as an ASK redirection requires.
+
+  if (!args_.empty ())
+    return e_wrong_num_args ("asking");
+  if (cluster_ == nullptr)
+    return e_cluster_disabled;
+  if (client_ != nullptr)
+    client_->asking = true;
+  return simple_string ("OK");
+}
+
+// Pub/Sub commands
+resp::data
+processor::exec_subscribe ()
+{
+  // SUBSCRIBE channel [channel ...]
+
+  // RETURN:
+  // - array: ["subscribe", channel, count] for every channel, count being
+  //   the number of channels and patterns the client is subscribed to.
+
+  return subscribe_impl ("subscribe", false);
+}
+
+resp::data
+processor::exec_psubscribe ()
+{
+  // PSUBSCRIBE pattern [pattern ...]
+
+  // RETURN:
+  // - array: ["psubscribe", pattern, count] for every pattern.
+
+  return subscribe_impl ("psubscribe", true);
+}
+
+resp::data
+processor::subscribe_impl (string_view cmd, bool pattern)
+{
+  if (args_.empty ())
+    return e_wrong_num_args (cmd);
+  if (client_ == nullptr || !client_->push)
+    return simple_error ("ERR " + boost::to_upper_copy (cmd.to_string ())
+			 + " is not allowed in this context");
+
+  auto &mine = pattern ? client_->patterns : client_->channels;
+  for (const auto &name : args_)
+    {
+      if (mine.insert (name).second)
+	{
+	  if (pattern)
+	    patterns_[name].insert (client_);
+	  else
+	    channels_[name].insert (client_);
+	}
+      leading_replies_.push_back (subscription_reply (cmd, &name, *client_));
+    }
+
+  auto last = std::move (leading_replies_.back ());
+  leading_replies_.pop_back ();
+  return last;
+}
+
+resp::data
+processor::exec_unsubscribe ()
+{
+  // UNSUBSCRIBE [channel [channel ...]]
+
+  // RETURN:
+  // - array: ["unsubscribe", channel, count] for every channel, all the
+  //   channels of the client when none is given, or a nil channel when
+  //   there are none.
+
+  return unsubscribe_impl ("unsubscribe", false);
+}
+
+resp::data
+processor::exec_punsubscribe ()
+{
+  // PUNSUBSCRIBE [pattern [pattern ...]]
+
+  // RETURN:
+  // - array: ["punsubscribe", pattern, count] for every pattern, as with
+  //   UNSUBSCRIBE.
+
+  return unsubscribe_impl ("punsubscribe", true);
+}
+
+resp::data
+processor::unsubscribe_impl (string_view cmd, bool pattern)
+{
+  if (client_ == nullptr)
+    return simple_error ("ERR " + boost::to_upper_copy (cmd.to_string ())
+			 + " is not allowed in this context");
+
+  auto &mine = pattern ? client_->patterns : client_->channels;
+  if (args_.empty ())
+    args_.assign (mine.begin (), mine.end ());
+  if (args_.empty ())
+    return subscription_reply (cmd, nullptr, *client_);
+
+  for (const auto &name : args_)
+    {
+      if (mine.erase (name) != 0)
+	{
+	  if (pattern)
+	    remove_subscription (patterns_, name, client_);
+	  else
+	    remove_subscription (channels_, name, client_);
+	}
+      leading_replies_.push_back (subscription_reply (cmd, &name, *client_));
+    }
+
+  auto last = std::move (leading_replies_.back ());
+  leading_replies_.pop_back ();
+  return last;
+}
+
+resp::data
+processor::exec_publish ()
+{
+  // PUBLISH channel message
+
+  // RETURN:
+  // - integer: the number of clients that received the message, counting a
+  //   client once per channel or pattern that matched.
+
+  if (args_.size () != 2)
+    return e_wrong_num_args ("publish");
+  return integer (static_cast<std::int64_t> (publish (args_[0], args_[1])));
+}
+
+resp::data
+processor::exec_pubsub ()
+{
+  // PUBSUB CHANNELS [pattern] | NUMSUB [channel ...] | NUMPAT
+
+  // RETURN:
+  // - array: the channels with subscribers, matching the pattern if one is
+  //   given, for CHANNELS; channel, count pairs for NUMSUB.
+  // - integer: the number of patterns with subscribers, for NUMPAT.
+
+  if (args_.empty ())
+    return e_wrong_num_args ("pubsub");
+
+  auto sub = args_[0];
+  boost::to_lower (sub);
+  if (sub == "channels" && args_.size () <= 2)
+    {
+      std::vector<resp::data> out;
+      for (const auto &c : channels_)
+	if (args_.size () == 1 || glob_match (args_[1], c.first))
+	  out.push_back (bulk_string (c.first));
+      return array (std::move (out));
+    }
+
+  if (sub == "numsub")
+    {
+      std::vector<resp::data> out;
+      for (std::size_t i = 1; i < args_.size (); i++)
+	{
+	  auto it = channels_.find (args_[i]);
+	  auto n = it != channels_.end () ? it->second.size () : 0;
+	  out.push_back (bulk_string (std::move (args_[i])));
+	  out.push_back (integer (static_cast<std::int64_t> (n)));
+	}
+      return array (std::move (out));
+    }
+
+  if (sub == "numpat" && args_.size () == 1)
+    return integer (static_cast<std::int64_t> (patterns_.size ()));
+
+  return simple_error ("ERR unknown subcommand or wrong number of "
+		       "arguments for '" + args_[0] + "'");
+}
+
+// String commands
+resp::data
+processor::exec_set ()
+{
+  // SET key value [NX | XX | IFEQ comparison-value | IFNE comparison-value]
+  //   [GET] [EX seconds | PX milliseconds | EXAT unix-time-seconds |
+  //   PXAT unix-time-milliseconds | KEEPTTL]
+
+  // RETURN:
+  // if GET was not specified:
+  //   - nil: Operation was aborted (conflict with one of the XX/NX/IFEQ/IFNE
+  //          options). The key was not set.
+  //   - simple string: OK: The key was set.
+  // if GET was specified:
+  //   - nil: The key didn't exist before the SET. If XX was specified, the key
+  //          was not set. Otherwise, the key was set.
+  //   - bulk string: The previous value of the key. If NX was specified, the
+  //                  key was not set. Otherwise, the key was set.
+
+  if (args_.size () < 2)
+    return e_wrong_num_args ("set");
+
+  bool nx = false;
+  bool xx = false;
+  bool get = false;
+  bool ex = false;
+  bool px = false;
+  bool exat = false;
+  bool pxat = false;
+  bool keepttl = false;
+  // IFEQ sets the key only if it holds the comparison value, IFNE only if
+  // it does not, or does not exist.
+  bool ifne = false;
+  std::size_t cmp_arg = 0;
+  std::int64_t n = 0;
+  std::size_t ttl_arg = 0;
+
+  for (std::size_t i = 2; i < args_.size (); i++)
+    {
+      auto &str = args_[i];
+      boost::to_lower (str);
+      if (str == "nx")
+	{
+	  if (nx || xx || cmp_arg != 0)
+	    return e_syntax;
+	  nx = true;
+	}
+      else if (str == "xx")
+	{
+	  if (nx || xx || cmp_arg != 0)
+	    return e_syntax;
+	  xx = true;
+	}
+      else if (str == "ifeq" || str == "ifne")
+	{
+	  if (nx || xx || cmp_arg != 0)
+	    return e_syntax;
+	  ifne = str == "ifne";
+	  if (++i >= args_.size ())
+	    return e_syntax;
+	  cmp_arg = i;
+	}
+      else if (str == "get")
+	{
+	  if (get)
+	    return e_syntax;
+	  get = true;
+	}
+      else if (str == "keepttl")
+	{
+	  if (ex || px || exat || pxat || keepttl)
+	    return e_syntax;
+	  keepttl = true;
+	}
+      else if (str == "ex" || str == "px" || str == "exat" || str == "pxat")
+	{
+	  if (ex || px || exat || pxat || keepttl)
+	    return e_syntax;
+
+	  if (str == "ex")
+	    ex = true;
+	  else if (str == "px")
+	    px = true;
+	  else if (str == "exat")
+	    exat = true;
+	  else if (str == "pxat")
+	    pxat = true;
+
+	  ttl_arg = i;
+	  if (++i >= args_.size ())
+	    return e_syntax;
+
+	  const auto &num = args_[i];
+	  if (!try_lexical_convert (num, n) || n <= 0)
+	    return e_bad_integer;
+	}
+      else
+	return e_syntax;
+    }
+
+  auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+  bool exists = opt_it.has_value ();
+  resp::data old = null_bulk_string ();
+
+  if (get && exists)
+    {
+      const auto &data = opt_it.value ()->second;
+      if (data.is<db::string> ())
+	{
+	  const auto &str = data.get<db::string> ();
+	  old = bulk_string (str);
+	}
+      else if (data.is<db::integer> ())
+	{
+	  const auto &num = data.get<db::integer> ();
+	  old = bulk_string (lexical_cast<std::string> (num));
+	}
+      else
+	return e_wrong_type;
+    }
+
+  if (nx && exists)
+    return get ? old : null_bulk_string ();
+  if (xx && !exists)
+    return get ? old : null_bulk_string ();
+  if (cmp_arg != 0)
+    {
+      bool equal = false;
+      if (exists)
+	{
+	  std::string tmp;
+	  string_view current;
+	  if (!read_string_value (opt_it.value ()->second, tmp, current))
+	    return e_wrong_type;
+	  equal = current == string_view{ args_[cmp_arg] };
+	}
+      if (ifne ? exists && equal : !equal)
+	return get ? old : null_bulk_string ();
+    }
+
+  auto &value = args_[1];
+  db::data data{ db::string{ std::move (value) } };
+  auto it = storage_.insert (std::move (key), std::move (data));
+
+  if (ex || px)
+    {
+      auto at = db::clock_type::now ();
+      if (ex)
+	at += seconds{ n };
+      else
+	at += milliseconds{ n };
+      storage_.expire_at (it, at);
+
+      // Logged with the absolute time, so that replaying it later does not
+      // extend the expiration.
+      if (!propagate_.empty ())
+	{
+	  propagate_[ttl_arg + 1] = "PXAT";
+	  propagate_[ttl_arg + 2] = unix_time_ms (at);
+	}
+    }
+  else if (exat)
+    {
+      db::time_point tp{ seconds{ n } };
+      storage_.expire_at (it, tp);
+    }
+  else if (pxat)
+    {
+      db::time_point tp{ milliseconds{ n } };
+      storage_.expire_at (it, tp);
+    }
+  else if (!keepttl)
+    storage_.clear_expires (it);
+
+  notify (notify_string, "set", it->first);
+  if (ex || px || exat || pxat)
+    notify (notify_generic, "expire", it->first);
+  return get ? old : simple_string ("OK");
+}
+
+resp::data
+processor::exec_get ()
+{
+  // GET key
+
+  // RETURN:
+  // - bulk string: the value of the key.
+  // - nil: if the key does not exist.
+
+  if (args_.size () != 1)
+    return e_wrong_num_args ("get");
+
+  const auto &key = args_[0];
+
+  auto opt_it = storage_.find (key);
+  if (!opt_it.has_value ())
+    return null_bulk_string ();
+
+  const auto &data = opt_it.value ()->second;
+  if (data.is<db::string> ())
+    {
+      const auto &str = data.get<db::string> ();
+      return bulk_string (str);
+    }
+  else if (data.is<db::integer> ())
+    {
+      const auto &num = data.get<db::integer> ();
+      auto str = lexical_cast<std::string> (num);
+      return bulk_string (std::move (str));
+    }
+
+  return e_wrong_type;
+}
+
+resp::data
+processor::exec_incr ()
+{
+  // INCR key [MIN min] [MAX max]
+
+  // RETURN:
+  // - integer: the value of the key after the increment.
+  // - nil: the value would leave the [min, max] bounds; the key was not
+  //        changed.
+
+  return calc_impl<std::plus> ("incr", false);
+}
+
+resp::data
+processor::exec_incrby ()
+{
+  // INCRBY key increment [MIN min] [MAX max]
+
+  // RETURN:
+  // - integer: the value of the key after the increment.
+  // - nil: the value would leave the [min, max] bounds; the key was not
+  //        changed.
+
+  return calc_impl<std::plus> ("incrby", true);
+}
+
+resp::data
+processor::exec_decr ()
+{
+  // DECR key [MIN min] [MAX max]
+
+  // RETURN:
+  // - integer: the value of the key after decrementing it.
+  // - nil: the value would leave the [min, max] bounds; the key was not
+  //        changed.
+
+  return calc_impl<std::minus> ("decr", false);
+}
+
+resp::data
+processor::exec_decrby ()
+{
+  // DECRBY key decrement [MIN min] [MAX max]
+
+  // RETURN:
+  // - integer: the value of the key after decrementing it.
+  // - nil: the value would leave the [min, max] bounds; the key was not
+  //        changed.
+
+  return calc_impl<std::minus> ("decrby", true);
+}
+
+template <template <class> class Op>
+resp::data
+processor::calc_impl (string_view cmd, bool with_rhs)
+{
+  std::size_t fixed = with_rhs ? 2 : 1;
+  if (args_.size () < fixed)
+    return e_wrong_num_args (cmd);
+
+  auto &key = args_[0];
+  std::int64_t rhs = 1;
+  if (with_rhs)
+    {
+      const auto &num = args_[1];
+      if (!try_lexical_convert (num, rhs))
+	return e_bad_integer;
+    }
+
+  auto lower = std::numeric_limits<std::int64_t>::min ();
+  auto upper = std::numeric_limits<std::int64_t>::max ();
+  for (std::size_t i = fixed; i < args_.size (); i += 2)
+    {
+      auto &opt = args_[i];
+      boost::to_lower (opt);
+      if ((opt != "min" && opt != "max") || i + 1 >= args_.size ())
+	return e_syntax;
+      if (!try_lexical_convert (args_[i + 1], opt == "min" ? lower : upper))
+	return e_bad_integer;
+    }
+
+  auto calc = [rhs] (std::int64_t lhs) -> optional<std::int64_t>
+    { return checked_calc<Op<std::int64_t>> (lhs, rhs); };
+  auto in_bounds = [lower, upper] (std::int64_t n)
+    { return lower <= n && n <= upper; };
+
+  auto opt_it = storage_.find (key);
+  if (!opt_it.has_value ())
+    {
+      auto opt_n = calc (0);
+      if (!opt_n.has_value ())
+	return e_overflow;
+
+      auto n = opt_n.value ();
+      if (!in_bounds (n))
+	return null_bulk_string ();
+      db::data data{ db::integer{ n } };
+      notify (notify_string, "incrby", key);
+      storage_.insert (std::move (key), std::move (data));
+      return integer (n);
+    }
+
+  auto it = opt_it.value ();
+  auto &data = it->second;
+  if (data.is<db::integer> ())
+    {
+      auto &n = data.get<db::integer> ();
+      auto opt_n = calc (n);
+      if (!opt_n.has_value ())
+	return e_overflow;
+      if (!in_bounds (opt_n.value ()))
+	return null_bulk_string ();
+
+      n = opt_n.value ();
+      notify (notify_string, "incrby", key);
+      return integer (n);
+    }
+  else if (data.is<db::string> ())
+    {
+      std::int64_t n;
+      const auto &num = data.get<db::string> ();
+      if (!try_lexical_convert (num, n))
+	return e_bad_integer;
+
+      auto opt_n = calc (n);
+      if (!opt_n.has_value ())
+	return e_overflow;
+      if (!in_bounds (opt_n.value ()))
+	return null_bulk_string ();
+
+      n = opt_n.value ();
+      data = db::data{ db::integer{ n } };
+      notify (notify_string, "incrby", key);
+      return integer (n);
+    }
+  else
+    return e_wrong_type;
+}
+
+resp::data
+processor::exec_mget ()
+{
+  // MGET key [key ...]
+
+  // RETURN:
+  // - array: a list of values at the specified keys, nil for keys that do
+  //          not exist or do not hold a string.
+
+  if (args_.size () < 1)
+    return e_wrong_num_args ("mget");
+
+  auto its = storage_.find (
+      span<const std::string>{ args_.data (), args_.size () });
+
+  std::vector<resp::data> out;
+  out.reserve (its.size ());
+  for (auto &opt_it : its)
+    {
+      optional<resp::data> reply;
+      if (opt_it.has_value ())
+	reply = string_reply (opt_it.value ()->second);
+      out.push_back (reply.has_value () ? std::move (reply.value ())
+					: null_bulk_string ());
+    }
+  return array (std::move (out));
+}
+
+resp::data
+processor::exec_mset ()
+{
+  // MSET key value [key value ...]
+
+  // RETURN:
+  // - simple string: always OK.
+
+  if (args_.size () < 2 || args_.size () % 2 != 0)
+    return e_wrong_num_args ("mset");
+
+  return mset_impl (false);
+}
+
+resp::data
+processor::exec_msetnx ()
+{
+  // MSETNX key value [key value ...]
+
+  // RETURN:
+  // - integer: 0 if no key was set (at least one key already existed).
+  // - integer: 1 if all the keys were set.
+
+  if (args_.size () < 2 || args_.size () % 2 != 0)
+    return e_wrong_num_args ("msetnx");
+
+  return mset_impl (true);
+}
+
+resp::data
+processor::mset_impl (bool nx)
+{
+  auto n = args_.size () / 2;
+  std::vector<std::string> keys;
+  keys.reserve (n);
+  for (std::size_t i = 0; i < n; i++)
+    keys.push_back (std::move (args_[i * 2]));
+
+  auto its = storage_.find (
+      span<const std::string>{ keys.data (), keys.size () });
+  if (nx)
+    for (const auto &opt_it : its)
+      if (opt_it.has_value ())
+	return integer (0);
+
+  // Existing keys are assigned in place, until a new key is inserted: that
+  // may rehash the table, which invalidates the iterators found above, so
+  // the keys after it are inserted, or assigned, by key. The same key may
+  // appear more than once, in which case the last value wins.
+  bool inserted = false;
+  for (std::size_t i = 0; i < n; i++)
+    {
+      db::data data{ db::string{ std::move (args_[i * 2 + 1]) } };
+      db::storage::iterator it;
+      if (its[i].has_value () && !inserted)
+	{
+	  it = its[i].value ();
+	  it->second = std::move (data);
+	}
+      else
+	{
+	  it = storage_.insert (std::move (keys[i]), std::move (data));
+	  inserted = true;
+	}
+      storage_.clear_expires (it);
+      notify (notify_string, "set", it->first);
+    }
+
+  return nx ? integer (1) : simple_string ("OK");
+}
+
+resp::data
+processor::exec_getset ()
+{
+  // GETSET key value
+
+  // RETURN:
+  // - bulk string: the old value stored at the key.
+  // - nil: if the key does not exist.
+
+  if (args_.size () != 2)
+    return e_wrong_num_args ("getset");
+
+  auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+
+  resp::data old = null_bulk_string ();
+  if (opt_it.has_value ())
+    {
+      auto reply = string_reply (opt_it.value ()->second);
+      if (!reply.has_value ())
+	return e_wrong_type;
+      old = std::move (reply.value ());
+    }
+
+  db::data data{ db::string{ std::move (args_[1]) } };
+  auto it = storage_.insert (std::move (key), std::move (data));
+  storage_.clear_expires (it);
+  notify (notify_string, "set", it->first);
+  return old;
+}
+
+resp::data
+processor::exec_getdel ()
+{
+  // GETDEL key
+
+  // RETURN:
+  // - bulk string: the value of the key.
+  // - nil: if the key does not exist.
+
+  if (args_.size () != 1)
+    return e_wrong_num_args ("getdel");
+
+  auto opt_it = storage_.find (args_[0]);
+  if (!opt_it.has_value ())
+    return null_bulk_string ();
+
+  auto reply = string_reply (opt_it.value ()->second);
+  if (!reply.has_value ())
+    return e_wrong_type;
+
+  storage_.erase (opt_it.value ());
+  notify (notify_generic, "del", args_[0]);
+  return std::move (reply.value ());
+}
+
+resp::data
+processor::exec_getex ()
+{
+  // GETEX key [EX seconds | PX milliseconds | EXAT unix-time-seconds |
+  //   PXAT unix-time-milliseconds | PERSIST]
+
+  // RETURN:
+  // - bulk string: the value of the key.
+  // - nil: if the key does not exist.
+
+  if (args_.size () < 1)
+    return e_wrong_num_args ("getex");
+
+  enum
+  {
+    keep = 0,
+    ex,
+    px,
+    exat,
+    pxat,
+    persist,
+  };
+
+  auto mode = keep;
+  std::int64_t n = 0;
+  for (std::size_t i = 1; i < args_.size (); i++)
+    {
+      auto opt = args_[i];
+      boost::to_lower (opt);
+      if (mode != keep)
+	return e_syntax;
+
+      if (opt == "persist")
+	{
+	  mode = persist;
+	  continue;
+	}
+
+      if (opt == "ex")
+	mode = ex;
+      else if (opt == "px")
+	mode = px;
+      else if (opt == "exat")
+	mode = exat;
+      else if (opt == "pxat")
+	mode = pxat;
+      else
+	return e_syntax;
+
+      if (++i >= args_.size ())
+	return e_syntax;
+      if (!try_lexical_convert (args_[i], n))
+	return e_bad_integer;
+      if (n <= 0)
+	return e_invalid_expire ("getex");
+    }
+
+  auto opt_it = storage_.find (args_[0]);
+  if (!opt_it.has_value ())
+    return null_bulk_string ();
+
+  auto it = opt_it.value ();
+  auto reply = string_reply (it->second);
+  if (!reply.has_value ())
+    return e_wrong_type;
+
+  db::time_point at;
+  switch (mode)
+    {
+    case keep:
+      // Nothing changes.
+      propagate_.clear ();
+      break;
+    case ex:
+    case px:
+      at = db::clock_type::now ();
+      if (mode == ex)
+	at += seconds{ n };
+      else
+	at += milliseconds{ n };
+      storage_.expire_at (it, at);
+      if (!propagate_.empty ())
+	propagate_ = { "PEXPIREAT", args_[0], unix_time_ms (at) };
+      break;
+    case exat:
+      storage_.expire_at (it, db::time_point{ seconds{ n } });
+      break;
+    case pxat:
+      storage_.expire_at (it, db::time_point{ milliseconds{ n } });
+      break;
+    case persist:
+      storage_.clear_expires (it);
+      break;
+    }
+
+  if (mode == persist)
+    notify (notify_generic, "persist", it->first);
+  else if (mode != keep)
+    notify (notify_generic, "expire", it->first);
+  return std::move (reply.value ());
+}
+
+resp::data
+processor::exec_setnx ()
+{
+  // SETNX key value
+
+  // RETURN:
+  // - integer: 0 if the key was not set.
+  // - integer: 1 if the key was set.
+
+  if (args_.size () != 2)
+    return e_wrong_num_args ("setnx");
+
+  auto &key = args_[0];
+  if (storage_.find (key).has_value ())
+    return integer (0);
+
+  db::data data{ db::string{ std::move (args_[1]) } };
+  notify (notify_string, "set", key);
+  storage_.insert (std::move (key), std::move (data));
+  return integer (1);
+}
+
+resp::data
+processor::exec_setex ()
+{
+  // SETEX key seconds value
+
+  // RETURN:
+  // - simple string: OK.
+
+  return setex_impl<seconds> ("setex");
+}
+
+resp::data
+processor::exec_psetex ()
+{
+  // PSETEX key milliseconds value
+
+  // RETURN:
+  // - simple string: OK.
+
+  return setex_impl<milliseconds> ("psetex");
+}
+
+template <class Duration>
+resp::data
+processor::setex_impl (string_view cmd)
+{
+  if (args_.size () != 3)
+    return e_wrong_num_args (cmd);
+
+  std::int64_t n;
+  if (!try_lexical_convert (args_[1], n))
+    return e_bad_integer;
+  if (n <= 0)
+    return e_invalid_expire (cmd);
+
+  auto at = db::clock_type::now () + Duration{ n };
+  if (!propagate_.empty ())
+    propagate_ = { "SET", args_[0], args_[2], "PXAT", unix_time_ms (at) };
+
+  db::data data{ db::string{ std::move (args_[2]) } };
+  auto it = storage_.insert (std::move (args_[0]), std::move (data));
+  storage_.expire_at (it, at);
+  notify (notify_string, "set", it->first);
+  notify (notify_generic, "expire", it->first);
+  return simple_string ("OK");
+}
+
+resp::data
+processor::exec_strlen ()
+{
+  // STRLEN key
+
+  // RETURN:
+  // - integer: the length of the string stored at key, or 0 when the key
+  //            does not exist.
+
+  if (args_.size () != 1)
+    return e_wrong_num_args ("strlen");
+
+  auto opt_it = storage_.find (args_[0]);
+  if (!opt_it.has_value ())
+    return integer (0);
+
+  std::string tmp;
+  string_view str;
+  if (!read_string_value (opt_it.value ()->second, tmp, str))
+    return e_wrong_type;
+  return integer (to_int64 (str.size ()));
+}
+
+resp::data
+processor::exec_append ()
+{
+  // APPEND key value
+
+  // RETURN:
+  // - integer: the length of the string after the append operation.
+
+  if (args_.size () != 2)
+    return e_wrong_num_args ("append");
+
+  auto &key = args_[0];
+  const auto &value = args_[1];
+  auto opt_it = storage_.find (key);
+  if (!opt_it.has_value ())
+    {
+      auto len = value.size ();
+      db::data data{ db::string{ std::move (args_[1]) } };
+      notify (notify_string, "append", key);
+      storage_.insert (std::move (key), std::move (data));
+      return integer (to_int64 (len));
+    }
+
+  auto str = write_string_value (opt_it.value ()->second);
+  if (str == nullptr)
+    return e_wrong_type;
+  if (str->size () + value.size () > max_string_len)
+    return simple_error ("ERR string exceeds maximum allowed size");
+
+  str->append (value);
+  notify (notify_string, "append", key);
+  return integer (to_int64 (str->size ()));
+}
+
+resp::data
+processor::exec_getrange ()
+{
+  // GETRANGE key start end
+
+  // RETURN:
+  // - bulk string: the substring of the string value stored at key,
+  //                determined by the offsets start and end (both are
+  //                inclusive).
+
+  if (args_.size () != 3)
+    return e_wrong_num_args ("getrange");
+
+  std::int64_t start, end;
+  if (!try_lexical_convert (args_[1], start)
+      || !try_lexical_convert (args_[2], end))
+    return e_bad_integer;
+
+  auto opt_it = storage_.find (args_[0]);
+  if (!opt_it.has_value ())
+    return bulk_string ("");
+
+  std::string tmp;
+  string_view str;
+  if (!read_string_value (opt_it.value ()->second, tmp, str))
+    return e_wrong_type;
+
+  // Like Redis, a range with both ends negative and start > end is empty.
+  if (start < 0 && end < 0 && start > end)
+    return bulk_string ("");
+
+  auto range = normalize_bit_range (start, end, str.size ());
+  if (!range.has_value ())
+    return bulk_string ("");
+
+  auto first = static_cast<std::size_t> (range.value ().first);
+  auto last = static_cast<std::size_t> (range.value ().second);
+  return bulk_string (std::string{ str.data () + first, last - first + 1 });
+}
+
+resp::data
+processor::exec_setrange ()
+{
+  // SETRANGE key offset value
+
+  // RETURN:
+  // - integer: the length of the string after it was modified by the
+  //            command.
+
+  if (args_.size () != 3)
+    return e_wrong_num_args ("setrange");
+
+  std::int64_t offset;
+  if (!try_lexical_convert (args_[1], offset))
+    return e_bad_integer;
+  if (offset < 0)
+    return simple_error ("ERR offset is out of range");
+
+  const auto &value = args_[2];
+  auto end = static_cast<std::uint64_t> (offset) + value.size ();
+  if (end > max_string_len)
+    return simple_error ("ERR string exceeds maximum allowed size");
+
+  auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+  std::string *str;
+  const std::string *name = &key;
+  if (!opt_it.has_value ())
+    {
+      // Nothing to create for an empty value.
+      if (value.empty ())
+	return integer (0);
+      db::data data{ db::string{} };
+      auto it = storage_.insert (std::move (key), std::move (data));
+      str = &it->second.get<db::string> ();
+      name = &it->first;
+    }
+  else
+    {
+      str = write_string_value (opt_it.value ()->second);
+      if (str == nullptr)
+	return e_wrong_type;
+    }
+
+  if (value.empty ())
+    return integer (to_int64 (str->size ()));
+
+  auto pos = static_cast<std::size_t> (offset);
+  if (str->size () < pos + value.size ())
+    str->resize (pos + value.size (), '\0');
+  str->replace (pos, value.size (), value);
+  notify (notify_string, "setrange", *name);
+  return integer (to_int64 (str->size ()));
+}
+
+resp::data
+processor::exec_throttle ()
+{
+  // THROTTLE key max_burst count_per_period period [quantity]
+
+  // RETURN:
+  // - array: 0 when the request is allowed or 1 when it is limited, the
+  //          limit (max_burst + 1), the requests left, the seconds until a
+  //          retry may succeed (-1 when allowed, or when quantity exceeds
+  //          the limit), and the seconds until the limit is full again.
+
+  if (args_.size () != 4 && args_.size () != 5)
+    return e_wrong_num_args ("throttle");
+
+  std::int64_t burst, count, period, quantity = 1;
+  if (!try_lexical_convert (args_[1], burst)
+      || !try_lexical_convert (args_[2], count)
+      || !try_lexical_convert (args_[3], period)
+      || (args_.size () == 5 && !try_lexical_convert (args_[4], quantity)))
+    return e_bad_integer;
+  if (burst < 0 || count <= 0 || period <= 0 || quantity < 0)
+    return e_value_out_of_range_positive;
+
+  // GCRA, in microseconds: the key holds the theoretical arrival time
+  // (TAT), which every request pushes by one emission interval per unit of
+  // quantity. A request is allowed when the TAT it makes stays within the
+  // tolerance of a full burst from now, and the key expires when the TAT
+  // is reached, as the limit is full again by then.
+  const std::int64_t usecs = 1000000;
+  const auto max = std::numeric_limits<std::int64_t>::max () / 4;
+  if (period > max / usecs || burst >= max)
+    return e_overflow;
+  auto interval = std::max<std::int64_t> (period * usecs / count, 1);
+  if (burst + 1 > max / interval || quantity > max / interval)
+    return e_overflow;
+  auto tolerance = interval * (burst + 1);
+  auto increment = interval * quantity;
+
+  // Logged as SET with the new TAT and its expiration, and not at all when
+  // nothing changes.
+  std::vector<std::string> logged;
+  logged.swap (propagate_);
+
+  auto &key = args_[0];
+  auto at = db::clock_type::now ();
+  auto now = duration_cast<microseconds> (at.time_since_epoch ()).count ();
+  auto tat = now;
+  auto opt_it = storage_.find (key);
+  if (opt_it.has_value ())
+    {
+      const auto &data = opt_it.value ()->second;
+      std::int64_t stored;
+      if (data.is<db::integer> ())
+	stored = data.get<db::integer> ();
+      else if (!data.is<db::string> ())
+	return e_wrong_type;
+      else if (!try_lexical_convert (data.get<db::string> (), stored))
+	return e_bad_integer;
+      tat = std::max (tat, stored);
+    }
+  if (tat - now > max)
+    return e_overflow;
+
+  auto new_tat = tat + increment;
+  auto allow_at = new_tat - tolerance;
+  bool limited = now < allow_at;
+  std::int64_t retry_after = -1;
+  std::int64_t ttl;
+  if (limited)
+    {
+      if (increment <= tolerance)
+	retry_after = allow_at - now;
+      ttl = tat - now;
+    }
+  else
+    {
+      ttl = new_tat - now;
+      if (increment > 0)
+	{
+	  auto expires = at + microseconds{ ttl };
+	  if (!logged.empty ())
+	    propagate_ = { "SET", key, std::to_string (new_tat), "PXAT",
+			   unix_time_ms (expires) };
+	  db::data data{ db::integer{ new_tat } };
+	  db::storage::iterator it;
+	  if (opt_it.has_value ())
+	    {
+	      it = opt_it.value ();
+	      it->second = std::move (data);
+	    }
+	  else
+	    it = storage_.insert (std::move (key), std::move (data));
+	  storage_.expire_at (it, expires);
+	  notify (notify_string, "throttle", it->first);
+	}
+    }
+
+  auto next = tolerance - ttl;
+  auto remaining = next > 0 ? next / interval : 0;
+  // Rounded up, so that a client waiting as long is not turned down again.
+  auto to_seconds = [usecs] (std::int64_t n)
+    { return n < 0 ? n : (n + usecs - 1) / usecs; };
+  std::vector<resp::data> out;
+  out.reserve (5);
+  out.push_back (integer (limited ? 1 : 0));
+  out.push_back (integer (burst + 1));
+  out.push_back (integer (remaining));
+  out.push_back (integer (to_seconds (retry_after)));
+  out.push_back (integer (to_seconds (ttl)));
+  return array (std::move (out));
+}
+
+// Generic commands
+resp::data
+processor::exec_del ()
+{
+  // DEL key [key ...]
+
+  // RETURN:
+  // - integer: the number of keys that were removed.
+
+  if (args_.size () < 1)
+    return e_wrong_num_args ("del");
+
+  std::int64_t n = 0;
+  for (const auto &key : args_)
+    {
+      auto opt_it = storage_.find (key);
+      if (opt_it.has_value ())
+	{
+	  storage_.erase (opt_it.value ());
+	  notify (notify_generic, "del", key);
+	  n++;
+	}
+    }
+
+  return integer (n);
+}
+
+resp::data
+processor::exec_delex ()
+{
+  // DELEX key [IFEQ comparison-value | IFNE comparison-value]
+
+  // RETURN:
+  // - integer: 1 if the key was removed, 0 if it does not exist or the
+  //            condition was not met.
+
+  // Releases a lock only while it is still held by the caller, which set
+  // the key to a token of its own, in a single step.
+
+  if (args_.size () != 1 && args_.size () != 3)
+    return e_wrong_num_args ("delex");
+
+  bool ifne = false;
+  if (args_.size () == 3)
+    {
+      auto &opt = args_[1];
+      boost::to_lower (opt);
+      if (opt != "ifeq" && opt != "ifne")
+	return e_syntax;
+      ifne = opt == "ifne";
+    }
+
+  const auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+  if (!opt_it.has_value ())
+    return integer (0);
+
+  auto it = opt_it.value ();
+  if (args_.size () == 3)
+    {
+      std::string tmp;
+      string_view current;
+      if (!read_string_value (it->second, tmp, current))
+	return e_wrong_type;
+      if ((current == string_view{ args_[2] }) == ifne)
+	return integer (0);
+    }
+
+  storage_.erase (it);
+  notify (notify_generic, "del", key);
+  return integer (1);
+}
+
+resp::data
+processor::exec_expire ()
+{
+  // EXPIRE key seconds [NX | XX | GT | LT]
+
+  // RETURN:
+  // - integer: 0 if the timeout was not set; for example, the key doesn't
+  //            exist, or the operation was skipped because of the provided
+  //            arguments.
+  // - integer: 1 if the timeout was set.
+
+  return expire_impl<seconds, false> ("expire");
+}
+
+resp::data
+processor::exec_pexpire ()
+{
+  // PEXPIRE key milliseconds [NX | XX | GT | LT]
+
+  // RETURN:
+  // - integer: 0 if the timeout was not set. For example, if the key doesn't
+  //            exist, or the operation skipped because of the provided
+  //            arguments.
+  // - integer: 1 if the timeout was set.
+
+  return expire_impl<milliseconds, false> ("pexpire");
+}
+
+resp::data
+processor::exec_expireat ()
+{
+  // EXPIREAT key unix-time-seconds [NX | XX | GT | LT]
+
+  // RETURN:
+  // - integer: 0 if the timeout was not set; for example, the key doesn't
+  //            exist, or the operation was skipped because of the provided
+  //            arguments.
+  // - integer: 1 if the timeout was set.
+
+  return expire_impl<seconds, true> ("expireat");
+}
+
+resp::data
+processor::exec_pexpireat ()
+{
+  // PEXPIREAT key unix-time-milliseconds [NX | XX | GT | LT]
+
+  // RETURN:
+  // - integer: 0 if the timeout was not set. For example, if the key doesn't
+  //            exist, or the operation skipped because of the provided
+  //            arguments.
+  // - integer: 1 if the timeout was set.
+
+  return expire_impl<milliseconds, true> ("pexpireat");
+}
+
+template <class Duration, bool At>
+resp::data
+processor::expire_impl (string_view cmd)
+{
+  if (args_.size () != 2 && args_.size () != 3)
+    return e_wrong_num_args (cmd);
+
+  enum
+  {
+    cond_none = 0,
+    cond_nx,
+    cond_xx,
+    cond_gt,
+    cond_lt,
+  };
+
+  auto cond = cond_none;
+  if (args_.size () == 3)
+    {
+      auto opt = args_[2];
+      boost::to_lower (opt);
+      if (opt == "nx")
+	cond = cond_nx;
+      else if (opt == "xx")
+	cond = cond_xx;
+      else if (opt == "gt")
+	cond = cond_gt;
+      else if (opt == "lt")
+	cond = cond_lt;
+      else
+	return e_syntax;
+    }
+
+  std::int64_t n;
+  const auto &num = args_[1];
+  if (!try_lexical_convert (num, n))
+    return e_bad_integer;
+
+  // Logged as PEXPIREAT, or as DEL when the key goes away, and not at all
+  // when nothing changes.
+  std::vector<std::string> logged;
+  logged.swap (propagate_);
+
+  const auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+  if (!opt_it.has_value ())
+    return integer (0);
+
+  auto it = opt_it.value ();
+  db::time_point expires;
+  auto now = db::clock_type::now ();
+  auto ttl = storage_.ttl (it);
+  auto zero = db::duration::zero ();
+  // While loading, expired keys stay until the log deletes them.
+  if (ttl.has_value () && ttl.value () <= zero && !loading_)
+    {
+      if (!logged.empty ())
+	propagate_ = { "DEL", key };
+      storage_.erase (it);
+      notify (notify_generic, "del", key);
+      return integer (0);
+    }
+
+  if (At)
+    expires = db::time_point{ Duration{ n } };
+  else
+    expires = now + Duration{ n };
+
+  auto new_ttl = expires - now;
+
+  bool can_set = true;
+  switch (cond)
+    {
+    case cond_none:
+      break;
+
+    case cond_nx:
+      can_set = !ttl.has_value ();
+      break;
+
+    case cond_xx:
+      can_set = ttl.has_value ();
+      break;
+
+    case cond_gt:
+      can_set = ttl.has_value () && new_ttl > ttl.value ();
+      break;
+
+    case cond_lt:
+      can_set = !ttl.has_value () || new_ttl < ttl.value ();
+      break;
+
+    default:
+      BOOST_THROW_EXCEPTION (std::logic_error ("bad expire_cond"));
+    }
+  if (!can_set)
+    return integer (0);
+
+  if (new_ttl <= zero && !loading_)
+    {
+      if (!logged.empty ())
+	propagate_ = { "DEL", key };
+      storage_.erase (it);
+      notify (notify_generic, "del", key);
+      return integer (1);
+    }
+  else
+    storage_.expire_at (it, expires);
+  notify (notify_generic, "expire", key);
+
+  if (!logged.empty ())
+    propagate_ = { "PEXPIREAT", key, unix_time_ms (expires) };
+  return integer (1);
+}
+
+resp::data
+processor::exec_ttl ()
+{
+  // TTL key
+
+  // RETURN:
+  // - integer: TTL in seconds.
+  // - integer: -1 if the key exists but has no associated expiration.
+  // - integer: -2 if the key does not exist.
+
+  return ttl_impl<seconds> ("ttl");
+}
+
+resp::data
+processor::exec_pttl ()
+{
+  // PTTL key
+
+  // RETURN:
+  // - integer: TTL in milliseconds.
+  // - integer: -1 if the key exists but has no associated expiration.
+  // - integer: -2 if the key does not exist.
+
+  return ttl_impl<milliseconds> ("pttl");
+}
+
+template <class Duration>
+resp::data
+processor::ttl_impl (string_view cmd)
+{
+  if (args_.size () != 1)
+    return e_wrong_num_args (cmd);
+
+  const auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+  if (!opt_it.has_value ())
+    return integer (-2);
+
+  auto it = opt_it.value ();
+
+  auto ttl = storage_.ttl (it);
+  if (!ttl.has_value ())
+    return integer (-1);
+
+  auto ttl_raw = ttl.value ();
+  if (ttl_raw <= db::duration::zero ())
+    {
+      storage_.erase (it);
+      return integer (-2);
+    }
+
+  auto n = duration_cast<Duration> (ttl_raw).count ();
+  return integer (n);
+}
+
+// List commands
+resp::data
+processor::exec_llen ()
+{
+  // LLEN key
+
+  // RETURN:
+  // - integer: the length of the list.
+
+  if (args_.size () != 1)
+    return e_wrong_num_args ("llen");
+
+  const auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+  if (!opt_it.has_value ())
+    return integer (0);
+
+  const auto &data = opt_it.value ()->second;
+  if (!data.is<db::list> ())
+    return e_wrong_type;
+
+  return integer (to_int64 (data.get<db::list> ().size ()));
+}
+
+resp::data
+processor::exec_lindex ()
+{
+  // LINDEX key index
+
+  // RETURN:
+  // - nil: when index is out of range.
+  // - bulk string: the requested element.
+
+  if (args_.size () != 2)
+    return e_wrong_num_args ("lindex");
+
+  std::int64_t index;
+  if (!try_lexical_convert (args_[1], index))
+    return e_bad_integer;
+
+  const auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+  if (!opt_it.has_value ())
+    return null_bulk_string ();
+
+  const auto &data = opt_it.value ()->second;
+  if (!data.is<db::list> ())
+    return e_wrong_type;
+
+  const auto &ls = data.get<db::list> ();
+  auto opt_pos = normalize_lindex (index, ls.size ());
+  if (!opt_pos.has_value ())
+    return null_bulk_string ();
+
+  return bulk_string (ls[opt_pos.value ()]);
+}
+
+resp::data
+processor::exec_lrange ()
+{
+  // LRANGE key start stop
+
+  // RETURN:
+  // - array: a list of elements in the specified range,
+  //          or an empty array if the key doesn't exist.
+
+  if (args_.size () != 3)
+    return e_wrong_num_args ("lrange");
+
+  std::int64_t start;
+  std::int64_t stop;
+  if (!try_lexical_convert (args_[1], start)
+      || !try_lexical_convert (args_[2], stop))
+    return e_bad_integer;
+
+  const auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+  if (!opt_it.has_value ())
+    return empty_array ();
+
+  const auto &data = opt_it.value ()->second;
+  if (!data.is<db::list> ())
+    return e_wrong_type;
+
+  const auto &ls = data.get<db::list> ();
+  auto range = normalize_lrange (start, stop, ls.size ());
+  if (!range.has_value ())
+    return empty_array ();
+
+  const auto first = range.value ().first;
+  const auto last = range.value ().second;
+  std::vector<resp::data> out;
+  out.reserve (last - first + 1);
+  for (auto i = first; i <= last; i++)
+    out.push_back (bulk_string (ls[i]));
+
+  return array (std::move (out));
+}
+
+resp::data
+processor::exec_lset ()
+{
+  // LSET key index element
+
+  // RETURN:
+  // - simple string: OK.
+
+  if (args_.size () != 3)
+    return e_wrong_num_args ("lset");
+
+  std::int64_t index;
+  if (!try_lexical_convert (args_[1], index))
+    return e_bad_integer;
+
+  const auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+  if (!opt_it.has_value ())
+    return e_no_such_key;
+
+  auto it = opt_it.value ();
+  auto &data = it->second;
+  if (!data.is<db::list> ())
+    return e_wrong_type;
+
+  auto &ls = data.get<db::list> ();
+  auto opt_pos = normalize_lindex (index, ls.size ());
+  if (!opt_pos.has_value ())
+    return e_index_out_of_range;
+
+  ls[opt_pos.value ()] = std::move (args_[2]);
+  notify (notify_list, "lset", key);
+  return simple_string ("OK");
+}
+
+resp::data
+processor::exec_lrem ()
+{
+  // LREM key count element
+
+  // RETURN:
+  // - integer: the number of removed elements.
+
+  if (args_.size () != 3)
+    return e_wrong_num_args ("lrem");
+
+  std::int64_t count;
+  if (!try_lexical_convert (args_[1], count))
+    return e_bad_integer;
+
+  const auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+  if (!opt_it.has_value ())
+    return integer (0);
+
+  auto it = opt_it.value ();
+  auto &data = it->second;
+  if (!data.is<db::list> ())
+    return e_wrong_type;
+
+  const auto &element = args_[2];
+  auto &ls = data.get<db::list> ();
+
+  std::int64_t removed = 0;
+  if (count == 0)
+    {
+      for (auto iter = ls.begin (); iter != ls.end ();)
+	{
+	  if (*iter == element)
+	    {
+	      iter = ls.erase (iter);
+	      removed++;
+	    }
+	  else
+	    ++iter;
+	}
+    }
+  else if (count > 0)
+    {
+      for (auto iter = ls.begin (); iter != ls.end () && removed < count;)
+	{
+	  if (*iter == element)
+	    {
+	      iter = ls.erase (iter);
+	      removed++;
+	    }
+	  else
+	    ++iter;
+	}
+    }
+  else
+    {
+      auto limit = count == std::numeric_limits<std::int64_t>::min ()
+		       ? std::numeric_limits<std::int64_t>::max ()
+		       : -count;
+
+      for (auto iter = ls.end (); iter != ls.begin () && removed < limit;)
+	{
+	  --iter;
+	  if (*iter == element)
+	    {
+	      iter = ls.erase (iter);
+	      removed++;
+	    }
+	}
+    }
+
+  if (removed != 0)
+    notify (notify_list, "lrem", key);
+  if (ls.empty ())
+    {
+      storage_.erase (it);
+      notify (notify_generic, "del", key);
+    }
+
+  return integer (removed);
+}
+
+resp::data
+processor::exec_linsert ()
+{
+  // LINSERT key <BEFORE | AFTER> pivot element
+
+  // RETURN:
+  // - integer: the list length after a successful insert operation.
+  // - integer: 0 when the key doesn't exist.
+  // - integer: -1 when the pivot wasn't found.
+
+  if (args_.size () != 4)
+    return e_wrong_num_args ("linsert");
+
+  auto where = args_[1];
+  boost::to_lower (where);
+
+  bool before = false;
+  if (where == "before")
+    before = true;
+  else if (where != "after")
+    return e_syntax;
+
+  const auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+  if (!opt_it.has_value ())
+    return integer (0);
+
+  auto it = opt_it.value ();
+  auto &data = it->second;
+  if (!data.is<db::list> ())
+    return e_wrong_type;
+
+  auto &ls = data.get<db::list> ();
+
+  auto pos = ls.end ();
+  for (auto iter = ls.begin (); iter != ls.end (); ++iter)
+    if (*iter == args_[2])
+      {
+	pos = iter;
+	break;
+      }
+
+  if (pos == ls.end ())
+    return integer (-1);
+
+  if (!before)
+    ++pos;
+  ls.insert (pos, std::move (args_[3]));
+  notify (notify_list, "linsert", key);
+  return integer (to_int64 (ls.size ()));
+}
+
+resp::data
+processor::exec_lpush ()
+{
+  // LPUSH key element [element ...]
+
+  // RETURN:
+  // - integer: the length of the list after the push operation.
 
   if (args_.size () < 2)
-    return e_wrong_num_args ("set");
+    return e_wrong_num_args ("lpush");
 
-  bool nx = false;
-  bool xx = false;
-  bool get = false;
-  bool ex = false;
-  bool px = false;
-  bool exat = false;
-  bool pxat = false;
-  bool keepttl = false;
-  std::int64_t n = 0;
+  auto &key = args_[0];
+  auto opt_it = storage_.find (key);
 
-  for (std::size_t i = 2; i < args_.size (); i++)
+  db::storage::iterator it;
+  if (!opt_it.has_value ())
     {
-      auto &str = args_[i];
-      boost::to_lower (str);
-      if (str == "nx")
+      db::data data{ db::list{} };
+      it = storage_.insert (std::move (key), std::move (data));
+    }
+  else
+    {
+      it = opt_it.value ();
+      if (!it->second.is<db::list> ())
+	return e_wrong_type;
+    }
+
+  auto &ls = it->second.get<db::list> ();
+  for (std::size_t i = 1; i < args_.size (); i++)
+    ls.push_front (std::move (args_[i]));
+
+  notify (notify_list, "lpush", it->first);
+  return integer (to_int64 (ls.size ()));
+}
+
+resp::data
+processor::exec_rpush ()
+{
+  // RPUSH key element [element ...]
+
+  // RETURN:
+  // - integer: the length of the list after the push operation.
+
+  if (args_.size () < 2)
+    return e_wrong_num_args ("rpush");
+
+  auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+
+  db::storage::iterator it;
+  if (!opt_it.has_value ())
+    {
+      db::data data{ db::list{} };
+      it = storage_.insert (std::move (key), std::move (data));
+    }
+  else
+    {
+      it = opt_it.value ();
+      if (!it->second.is<db::list> ())
+	return e_wrong_type;
+    }
+
+  auto &ls = it->second.get<db::list> ();
+  for (std::size_t i = 1; i < args_.size (); i++)
+    ls.push_back (std::move (args_[i]));
+
+  notify (notify_list, "rpush", it->first);
+  return integer (to_int64 (ls.size ()));
+}
+
+resp::data
+processor::exec_lpop ()
+{
+  // LPOP key [count]
+
+  // RETURN:
+  // - nil if the key does not exist.
+  // - bulk string: when called without the count argument,
+  //                the value of the first element.
+  // - array: when called with the count argument,
+  //          a list of popped elements.
+
+  if (args_.size () != 1 && args_.size () != 2)
+    return e_wrong_num_args ("lpop");
+
+  bool with_count = args_.size () == 2;
+  std::int64_t count = 1;
+  if (with_count)
+    {
+      if (!try_lexical_convert (args_[1], count))
+	return e_bad_integer;
+      if (count <= 0)
+	return e_value_out_of_range_positive;
+    }
+
+  const auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+  if (!opt_it.has_value ())
+    return with_count ? null_array () : null_bulk_string ();
+
+  auto it = opt_it.value ();
+  auto &data = it->second;
+  if (!data.is<db::list> ())
+    return e_wrong_type;
+
+  auto &ls = data.get<db::list> ();
+  if (!with_count)
+    {
+      if (ls.empty ())
 	{
-	  if (nx || xx)
-	    return e_syntax;
-	  nx = true;
+	  storage_.erase (it);
+	  return null_bulk_string ();
 	}
-      else if (str == "xx")
+
+      std::string out = std::move (ls.front ());
+      ls.pop_front ();
+      notify (notify_list, "lpop", key);
+      if (ls.empty ())
 	{
-	  if (nx || xx)
-	    return e_syntax;
-	  xx = true;
+	  storage_.erase (it);
+	  notify (notify_generic, "del", key);
 	}
-      else if (str == "get")
+      return bulk_string (std::move (out));
+    }
+
+  if (ls.empty ())
+    {
+      storage_.erase (it);
+      return null_array ();
+    }
+
+  std::vector<resp::data> out;
+  while (count > 0 && !ls.empty ())
+    {
+      std::string val = std::move (ls.front ());
+      ls.pop_front ();
+      out.push_back (bulk_string (std::move (val)));
+      count--;
+    }
+
+  notify (notify_list, "lpop", key);
+  if (ls.empty ())
+    {
+      storage_.erase (it);
+      notify (notify_generic, "del", key);
+    }
+  return array (std::move (out));
+}
+
+resp::data
+processor::exec_rpop ()
+{
+  // RPOP key [count]
+
+  // RETURN:
+  // - nil if the key does not exist.
+  // - bulk string: when called without the count argument,
+  //                the value of the first element.
+  // - array: when called with the count argument,
+  //          a list of popped elements.
+
+  if (args_.size () != 1 && args_.size () != 2)
+    return e_wrong_num_args ("rpop");
+
+  bool with_count = args_.size () == 2;
+  std::int64_t count = 1;
+  if (with_count)
+    {
+      if (!try_lexical_convert (args_[1], count))
+	return e_bad_integer;
+      if (count <= 0)
+	return e_value_out_of_range_positive;
+    }
+
+  const auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+  if (!opt_it.has_value ())
+    return with_count ? null_array () : null_bulk_string ();
+
+  auto it = opt_it.value ();
+  auto &data = it->second;
+  if (!data.is<db::list> ())
+    return e_wrong_type;
+
+  auto &ls = data.get<db::list> ();
+  if (!with_count)
+    {
+      if (ls.empty ())
 	{
-	  if (get)
-	    return e_syntax;
-	  get = true;
+	  storage_.erase (it);
+	  return null_bulk_string ();
 	}
-      else if (str == "keepttl")
+
+      std::string out = std::move (ls.back ());
+      ls.pop_back ();
+      notify (notify_list, "rpop", key);
+      if (ls.empty ())
 	{
-	  if (ex || px || exat || pxat || keepttl)
-	    return e_syntax;
-	  keepttl = true;
+	  storage_.erase (it);
+	  notify (notify_generic, "del", key);
 	}
-      else if (str == "ex" || str == "px" || str == "exat" || str == "pxat")
-	{
-	  if (ex || px || exat || pxat || keepttl)
-	    return e_syntax;
+      return bulk_string (std::move (out));
+    }
+
+  if (ls.empty ())
+    {
+      storage_.erase (it);
+      return null_array ();
+    }
+
+  std::vector<resp::data> out;
+  while (count > 0 && !ls.empty ())
+    {
+      std::string val = std::move (ls.back ());
+      ls.pop_back ();
+      out.push_back (bulk_string (std::move (val)));
+      count--;
+    }
 
-	  if (str == "ex")
-	    ex = true;
-	  else if (str == "px")
-	    px = true;
-	  else if (str == "exat")
-	    exat = true;
-	  else if (str == "pxat")
-	    pxat = true;
+  notify (notify_list, "rpop", key);
+  if (ls.empty ())
+    {
+      storage_.erase (it);
+      notify (notify_generic, "del", key);
+    }
+  return array (std::move (out));
+}
 
-	  if (++i >= args_.size ())
-	    return e_syntax;
+// Sorted set commands
+resp::data
+processor::exec_zadd ()
+{
+  // ZADD key [NX | XX] [GT | LT] [CH] [INCR] score member [score member ...]
 
-	  const auto &num = args_[i];
-	  if (!try_lexical_convert (num, n) || n <= 0)
-	    return e_bad_integer;
-	}
+  // RETURN:
+  // if INCR was not specified:
+  //   - integer: the number of new members when the CH option is not used.
+  //   - integer: the number of new or updated members when the CH option is
+  //              used.
+  // if INCR was specified:
+  //   - nil: if the operation was aborted (when called with either the XX or
+  //          the NX option).
+  //   - bulk string: the updated score of the member.
+
+  if (args_.size () < 3)
+    return e_wrong_num_args ("zadd");
+
+  bool nx = false;
+  bool xx = false;
+  bool gt = false;
+  bool lt = false;
+  bool ch = false;
+  bool incr = false;
+
+  std::size_t i = 1;
+  for (; i < args_.size (); i++)
+    {
+      auto opt = args_[i];
+      boost::to_lower (opt);
+      if (opt == "nx")
+	nx = true;
+      else if (opt == "xx")
+	xx = true;
+      else if (opt == "gt")
+	gt = true;
+      else if (opt == "lt")
+	lt = true;
+      else if (opt == "ch")
+	ch = true;
+      else if (opt == "incr")
+	incr = true;
       else
-	return e_syntax;
+	break;
     }
 
-  auto &key = args_[0];
+  auto elements = args_.size () - i;
+  if (elements == 0 || elements % 2 != 0)
+    return e_syntax;
+  if (nx && xx)
+    return simple_error (
+	"ERR XX and NX options at the same time are not compatible");
+  if ((gt && nx) || (lt && nx) || (gt && lt))
+    return simple_error (
+	"ERR GT, LT, and/or NX options at the same time are not compatible");
+  if (incr && elements > 2)
+    return simple_error (
+	"ERR INCR option supports a single increment-element pair");
+
+  std::vector<double> scores;
+  scores.reserve (elements / 2);
+  for (auto j = i; j < args_.size (); j += 2)
+    {
+      double score;
+      if (!db::parse_score (args_[j], score))
+	return e_not_float;
+      scores.push_back (score);
+    }
+
+  const auto &key = args_[0];
   auto opt_it = storage_.find (key);
-  bool exists = opt_it.has_value ();
-  resp::data old = null_bulk_string ();
+  if (opt_it.has_value () && !opt_it.value ()->second.is<db::sorted_set> ())
+    return e_wrong_type;
 
-  if (get && exists)
+  db::storage::iterator it;
+  if (opt_it.has_value ())
+    it = opt_it.value ();
+  else if (xx)
+    return incr ? null_bulk_string () : integer (0);
+  else
+    it = storage_.insert (key, db::data{ db::sorted_set{} });
+
+  auto &zs = it->second.get<db::sorted_set> ();
+  std::int64_t added = 0;
+  std::int64_t changed = 0;
+  optional<double> incr_result;
+  for (std::size_t n = 0; n < scores.size (); n++)
     {
-      const auto &data = opt_it.value ()->second;
-      if (data.is<db::string> ())
+      auto &member = args_[i + n * 2 + 1];
+      auto score = scores[n];
+      auto cur = zs.score (member);
+      if (cur.has_value ())
 	{
-	  const auto &str = data.get<db::string> ();
-	  old = bulk_string (str);
+	  if (nx)
+	    continue;
+
+	  if (incr)
+	    {
+	      score += cur.value ();
+	      if (std::isnan (score))
+		{
+		  if (zs.empty ())
+		    storage_.erase (it);
+		  return e_score_nan;
+		}
+	    }
+
+	  if ((lt && score >= cur.value ()) || (gt && score <= cur.value ()))
+	    continue;
+
+	  incr_result = score;
+	  if (score != cur.value ())
+	    {
+	      zs.insert (std::move (member), score);
+	      changed++;
+	    }
 	}
-      else if (data.is<db::integer> ())
+      else
 	{
-	  const auto &num = data.get<db::integer> ();
-	  old = bulk_string (lexical_cast<std::string> (num));
+	  if (xx)
+	    continue;
+
+	  incr_result = score;
+	  zs.insert (std::move (member), score);
+	  added++;
 	}
-      else
-	return e_wrong_type;
     }
 
-  if (nx && exists)
-    return get ? old : null_bulk_string ();
-  if (xx && !exists)
-    return get ? old : null_bulk_string ();
-
-  auto &value = args_[1];
-  db::data data{ db::string{ std::move (value) } };
-  auto it = storage_.insert (std::move (key), std::move (data));
+  if (added + changed != 0)
+    notify (notify_zset, incr ? "zincr" : "zadd", key);
+  if (zs.empty ())
+    storage_.erase (it);
 
-  if (ex)
-    storage_.expire_after (it, seconds{ n });
-  else if (px)
-    storage_.expire_after (it, milliseconds{ n });
-  else if (exat)
-    {
-      db::time_point tp{ seconds{ n } };
-      storage_.expire_at (it, tp);
-    }
-  else if (pxat)
+  if (incr)
     {
-      db::time_point tp{ milliseconds{ n } };
-      storage_.expire_at (it, tp);
+      if (!incr_result.has_value ())
+	return null_bulk_string ();
+      return bulk_string (db::format_score (incr_result.value ()));
     }
-  else if (!keepttl)
-    storage_.clear_expires (it);
 
-  return get ? old : simple_string ("OK");
+  return integer (ch ? added + changed : added);
 }
 
 resp::data
-processor::exec_get ()
+processor::exec_zincrby ()
 {
-  // GET key
+  // ZINCRBY key increment member
 
   // RETURN:
-  // - bulk string: the value of the key.
-  // - nil: if the key does not exist.
+  // - bulk string: the new score of member.
 
-  if (args_.size () != 1)
-    return e_wrong_num_args ("get");
+  if (args_.size () != 3)
+    return e_wrong_num_args ("zincrby");
 
-  const auto &key = args_[0];
+  double incr;
+  if (!db::parse_score (args_[1], incr))
+    return e_not_float;
 
+  auto &key = args_[0];
   auto opt_it = storage_.find (key);
-  if (!opt_it.has_value ())
-    return null_bulk_string ();
 
-  const auto &data = opt_it.value ()->second;
-  if (data.is<db::string> ())
+  db::storage::iterator it;
+  if (!opt_it.has_value ())
     {
-      const auto &str = data.get<db::string> ();
-      return bulk_string (str);
+      if (std::isnan (incr))
+	return e_score_nan;
+      db::data data{ db::sorted_set{} };
+      it = storage_.insert (std::move (key), std::move (data));
     }
-  else if (data.is<db::integer> ())
+  else
     {
-      const auto &num = data.get<db::integer> ();
-      auto str = lexical_cast<std::string> (num);
-      return bulk_string (std::move (str));
+      it = opt_it.value ();
+      if (!it->second.is<db::sorted_set> ())
+	return e_wrong_type;
     }
 
-  return e_wrong_type;
+  auto &zs = it->second.get<db::sorted_set> ();
+  auto &member = args_[2];
+  auto score = zs.score (member).value_or (0) + incr;
+  if (std::isnan (score))
+    {
+      if (zs.empty ())
+	storage_.erase (it);
+      return e_score_nan;
+    }
+
+  zs.insert (std::move (member), score);
+  notify (notify_zset, "zincr", it->first);
+  return bulk_string (db::format_score (score));
 }
 
 resp::data
-processor::exec_incr ()
+processor::exec_zscore ()
 {
-  // INCR key
+  // ZSCORE key member
 
   // RETURN:
-  // - integer: the value of the key after the increment.
+  // - bulk string: the score of the member.
+  // - nil: if member does not exist in the sorted set, or the key does not
+  //        exist.
 
-  return calc_impl<std::plus> ("incr", false);
+  if (args_.size () != 2)
+    return e_wrong_num_args ("zscore");
+
+  const auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+  if (!opt_it.has_value ())
+    return null_bulk_string ();
+
+  const auto &data = opt_it.value ()->second;
+  if (!data.is<db::sorted_set> ())
+    return e_wrong_type;
+
+  auto score = data.get<db::sorted_set> ().score (args_[1]);
+  if (!score.has_value ())
+    return null_bulk_string ();
+
+  return bulk_string (db::format_score (score.value ()));
 }
 
 resp::data
-processor::exec_incrby ()
+processor::exec_zcard ()
 {
-  // INCRBY key increment
+  // ZCARD key
 
   // RETURN:
-  // - integer: the value of the key after the increment.
+  // - integer: the cardinality (number of members) of the sorted set, or 0
+  //            if the key doesn't exist.
 
-  return calc_impl<std::plus> ("incrby", true);
+  if (args_.size () != 1)
+    return e_wrong_num_args ("zcard");
+
+  const auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+  if (!opt_it.has_value ())
+    return integer (0);
+
+  const auto &data = opt_it.value ()->second;
+  if (!data.is<db::sorted_set> ())
+    return e_wrong_type;
+
+  return integer (to_int64 (data.get<db::sorted_set> ().size ()));
 }
 
 resp::data
-processor::exec_decr ()
+processor::exec_zrank ()
 {
-  // DECR key
+  // ZRANK key member [WITHSCORE]
 
   // RETURN:
-  // - integer: the value of the key after decrementing it.
+  // - nil: if the key does not exist or the member does not exist in the
+  //        sorted set.
+  // - integer: the rank of the member when WITHSCORE is not used.
+  // - array: the rank and score of the member when WITHSCORE is used.
 
-  return calc_impl<std::minus> ("decr", false);
+  return zrank_impl<false> ("zrank");
 }
 
 resp::data
-processor::exec_decrby ()
+processor::exec_zrevrank ()
 {
-  // DECRBY key decrement
+  // ZREVRANK key member [WITHSCORE]
 
   // RETURN:
-  // - integer: the value of the key after decrementing it.
+  // - nil: if the key does not exist or the member does not exist in the
+  //        sorted set.
+  // - integer: the rank of the member when WITHSCORE is not used.
+  // - array: the rank and score of the member when WITHSCORE is used.
 
-  return calc_impl<std::minus> ("decrby", true);
+  return zrank_impl<true> ("zrevrank");
 }
 
-template <template <class> class Op>
+template <bool Rev>
 resp::data
-processor::calc_impl (string_view cmd, bool with_rhs)
+processor::zrank_impl (string_view cmd)
 {
-  if ((!with_rhs && args_.size () != 1) || (with_rhs && args_.size () != 2))
+  if (args_.size () != 2 && args_.size () != 3)
     return e_wrong_num_args (cmd);
 
-  auto &key = args_[0];
-  std::int64_t rhs = 1;
-  if (with_rhs)
+  bool with_score = false;
+  if (args_.size () == 3)
     {
-      const auto &num = args_[1];
-      if (!try_lexical_convert (num, rhs))
-	return e_bad_integer;
+      auto opt = args_[2];
+      boost::to_lower (opt);
+      if (opt != "withscore")
+	return e_syntax;
+      with_score = true;
     }
 
-  auto calc = [rhs] (std::int64_t lhs) -> optional<std::int64_t>
-    { return checked_calc<Op<std::int64_t>> (lhs, rhs); };
+  auto nil = with_score ? null_array () : null_bulk_string ();
 
+  const auto &key = args_[0];
   auto opt_it = storage_.find (key);
   if (!opt_it.has_value ())
-    {
-      auto opt_n = calc (0);
-      if (!opt_n.has_value ())
-	return e_overflow;
+    return nil;
 
-      auto n = opt_n.value ();
-      db::data data{ db::integer{ n } };
-      storage_.insert (std::move (key), std::move (data));
-      return integer (n);
-    }
+  const auto &data = opt_it.value ()->second;
+  if (!data.is<db::sorted_set> ())
+    return e_wrong_type;
 
-  auto it = opt_it.value ();
-  auto &data = it->second;
-  if (data.is<db::integer> ())
-    {
-      auto &n = data.get<db::integer> ();
-      auto opt_n = calc (n);
-      if (!opt_n.has_value ())
-	return e_overflow;
+  const auto &zs = data.get<db::sorted_set> ();
+  const auto &member = args_[1];
+  auto rank = zs.rank (member);
+  if (!rank.has_value ())
+    return nil;
 
-      n = opt_n.value ();
-      return integer (n);
+  auto n = rank.value ();
+  if (Rev)
+    n = zs.size () - 1 - n;
+  if (!with_score)
+    return integer (to_int64 (n));
+
+  std::vector<resp::data> out;
+  out.push_back (integer (to_int64 (n)));
+  out.push_back (bulk_string (db::format_score (zs.score (member).value ())));
+  return array (std::move (out));
+}
+
+resp::data
+processor::exec_zrange ()
+{
+  // ZRANGE key start stop [BYSCORE | BYLEX] [REV] [LIMIT offset count]
+  //   [WITHSCORES]
+
+  // RETURN:
+  // - array: a list of members in the specified range with, optionally,
+  //          their scores in case the WITHSCORES option is given.
+
+  if (args_.size () < 3)
+    return e_wrong_num_args ("zrange");
+
+  enum
+  {
+    by_rank = 0,
+    by_score,
+    by_lex,
+  };
+
+  auto by = by_rank;
+  bool rev = false;
+  bool with_scores = false;
+  bool with_limit = false;
+  std::int64_t offset = 0;
+  std::int64_t count = -1;
+
+  for (std::size_t i = 3; i < args_.size (); i++)
+    {
+      auto opt = args_[i];
+      boost::to_lower (opt);
+      if (opt == "byscore" && by == by_rank)
+	by = by_score;
+      else if (opt == "bylex" && by == by_rank)
+	by = by_lex;
+      else if (opt == "rev")
+	rev = true;
+      else if (opt == "withscores")
+	with_scores = true;
+      else if (opt == "limit" && i + 2 < args_.size ())
+	{
+	  if (!try_lexical_convert (args_[i + 1], offset)
+	      || !try_lexical_convert (args_[i + 2], count))
+	    return e_bad_integer;
+	  with_limit = true;
+	  i += 2;
+	}
+      else
+	return e_syntax;
     }
-  else if (data.is<db::string> ())
+
+  if (with_limit && by == by_rank)
+    return simple_error ("ERR syntax error, LIMIT is only supported in "
+			 "combination with either BYSCORE or BYLEX");
+  if (with_scores && by == by_lex)
+    return simple_error ("ERR syntax error, WITHSCORES not supported in "
+			 "combination with BYLEX");
+
+  // With REV, the range is given from the highest to the lowest element.
+  const auto &min_arg = rev && by != by_rank ? args_[2] : args_[1];
+  const auto &max_arg = rev && by != by_rank ? args_[1] : args_[2];
+
+  std::int64_t start = 0;
+  std::int64_t stop = 0;
+  db::zset::score_range score_range{};
+  db::zset::lex_range lex_range{};
+  switch (by)
     {
-      std::int64_t n;
-      const auto &num = data.get<db::string> ();
-      if (!try_lexical_convert (num, n))
+    case by_rank:
+      if (!try_lexical_convert (args_[1], start)
+	  || !try_lexical_convert (args_[2], stop))
 	return e_bad_integer;
+      break;
 
-      auto opt_n = calc (n);
-      if (!opt_n.has_value ())
-	return e_overflow;
+    case by_score:
+      if (!parse_score_bound (min_arg, score_range.min, score_range.min_ex)
+	  || !parse_score_bound (max_arg, score_range.max, score_range.max_ex))
+	return e_min_max_not_float;
+      break;
 
-      n = opt_n.value ();
-      data = db::data{ db::integer{ n } };
-      return integer (n);
+    case by_lex:
+      if (!parse_lex_bound (min_arg, lex_range.min, lex_range.min_ex,
+			    lex_range.min_inf)
+	  || !parse_lex_bound (max_arg, lex_range.max, lex_range.max_ex,
+			       lex_range.max_inf)
+	  || min_arg == "+" || max_arg == "-")
+	{
+	  if (min_arg == "+" || max_arg == "-")
+	    return empty_array ();
+	  return e_min_max_not_string;
+	}
+      break;
+
+    default:
+      BOOST_THROW_EXCEPTION (std::logic_error ("bad zrange mode"));
     }
-  else
+
+  const auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+  if (!opt_it.has_value ())
+    return empty_array ();
+
+  const auto &data = opt_it.value ()->second;
+  if (!data.is<db::sorted_set> ())
     return e_wrong_type;
+
+  const auto &zs = data.get<db::sorted_set> ();
+  const auto len = zs.size ();
+
+  // Ascending ranks in [first, last).
+  std::size_t first = 0;
+  std::size_t last = 0;
+  if (by == by_rank)
+    {
+      auto range = normalize_lrange (start, stop, len);
+      if (!range.has_value ())
+	return empty_array ();
+
+      first = range.value ().first;
+      last = range.value ().second + 1;
+      if (rev)
+	{
+	  auto rev_first = len - last;
+	  last = len - first;
+	  first = rev_first;
+	}
+    }
+  else
+    {
+      auto range = by == by_score ? zs.rank_range (score_range)
+				  : zs.rank_range (lex_range);
+      first = range.first;
+      last = range.second;
+
+      if (offset < 0 || static_cast<std::uint64_t> (offset) >= last - first)
+	return empty_array ();
+
+      auto skip = static_cast<std::size_t> (offset);
+      auto avail = last - first - skip;
+      auto take = count < 0 || static_cast<std::uint64_t> (count) > avail
+		      ? avail
+		      : static_cast<std::size_t> (count);
+      if (rev)
+	{
+	  last -= skip;
+	  first = last - take;
+	}
+      else
+	{
+	  first += skip;
+	  last = first + take;
+	}
+    }
+
+  std::vector<resp::data> out;
+  append_zset_entries (out, zs.range (first, last), with_scores, rev);
+  return array (std::move (out));
 }
 
-// Generic commands
 resp::data
-processor::exec_del ()
+processor::exec_zrem ()
 {
-  // DEL key [key ...]
+  // ZREM key member [member ...]
 
   // RETURN:
-  // - integer: the number of keys that were removed.
+  // - integer: the number of members removed from the sorted set, not
+  //            including non-existing members.
 
-  if (args_.size () < 1)
-    return e_wrong_num_args ("del");
+  if (args_.size () < 2)
+    return e_wrong_num_args ("zrem");
 
-  std::int64_t n = 0;
-  for (const auto &key : args_)
+  const auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+  if (!opt_it.has_value ())
+    return integer (0);
+
+  auto it = opt_it.value ();
+  auto &data = it->second;
+  if (!data.is<db::sorted_set> ())
+    return e_wrong_type;
+
+  auto &zs = data.get<db::sorted_set> ();
+  std::int64_t removed = 0;
+  for (std::size_t i = 1; i < args_.size (); i++)
+    if (zs.erase (args_[i]))
+      removed++;
+
+  if (removed != 0)
+    notify (notify_zset, "zrem", key);
+  if (zs.empty ())
     {
-      auto opt_it = storage_.find (key);
-      if (opt_it.has_value ())
-	{
-	  storage_.erase (opt_it.value ());
-	  n++;
-	}
+      storage_.erase (it);
+      notify (notify_generic, "del", key);
     }
 
-  return integer (n);
+  return integer (removed);
 }
 
 resp::data
-processor::exec_expire ()
+processor::exec_zremrangebyscore ()
 {
-  // EXPIRE key seconds [NX | XX | GT | LT]
+  // ZREMRANGEBYSCORE key min max
 
   // RETURN:
-  // - integer: 0 if the timeout was not set; for example, the key doesn't
-  //            exist, or the operation was skipped because of the provided
-  //            arguments.
-  // - integer: 1 if the timeout was set.
+  // - integer: the number of members removed.
 
-  return expire_impl<seconds, false> ("expire");
-}
+  if (args_.size () != 3)
+    return e_wrong_num_args ("zremrangebyscore");
 
-resp::data
-processor::exec_pexpire ()
-{
-  // PEXPIRE key milliseconds [NX | XX | GT | LT]
+  db::zset::score_range range;
+  if (!parse_score_bound (args_[1], range.min, range.min_ex)
+      || !parse_score_bound (args_[2], range.max, range.max_ex))
+    return e_min_max_not_float;
 
-  // RETURN:
-  // - integer: 0 if the timeout was not set. For example, if the key doesn't
-  //            exist, or the operation skipped because of the provided
-  //            arguments.
-  // - integer: 1 if the timeout was set.
+  const auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+  if (!opt_it.has_value ())
+    return integer (0);
 
-  return expire_impl<milliseconds, false> ("pexpire");
+  auto it = opt_it.value ();
+  auto &data = it->second;
+  if (!data.is<db::sorted_set> ())
+    return e_wrong_type;
+
+  auto &zs = data.get<db::sorted_set> ();
+  auto ranks = zs.rank_range (range);
+  auto removed = zs.erase_range (ranks.first, ranks.second);
+
+  if (removed != 0)
+    notify (notify_zset, "zremrangebyscore", key);
+  if (zs.empty ())
+    {
+      storage_.erase (it);
+      notify (notify_generic, "del", key);
+    }
+
+  return integer (to_int64 (removed));
 }
 
 resp::data
-processor::exec_expireat ()
+processor::exec_zpopmin ()
 {
-  // EXPIREAT key unix-time-seconds [NX | XX | GT | LT]
+  // ZPOPMIN key [count]
 
   // RETURN:
-  // - integer: 0 if the timeout was not set; for example, the key doesn't
-  //            exist, or the operation was skipped because of the provided
-  //            arguments.
-  // - integer: 1 if the timeout was set.
+  // - array: a list of popped elements and scores.
 
-  return expire_impl<seconds, true> ("expireat");
+  return zpop_impl<false> ("zpopmin");
 }
 
 resp::data
-processor::exec_pexpireat ()
+processor::exec_zpopmax ()
 {
-  // PEXPIREAT key unix-time-milliseconds [NX | XX | GT | LT]
+  // ZPOPMAX key [count]
 
   // RETURN:
-  // - integer: 0 if the timeout was not set. For example, if the key doesn't
-  //            exist, or the operation skipped because of the provided
-  //            arguments.
-  // - integer: 1 if the timeout was set.
+  // - array: a list of popped elements and scores.
 
-  return expire_impl<milliseconds, true> ("pexpireat");
+  return zpop_impl<true> ("zpopmax");
 }
 
-template <class Duration, bool At>
+template <bool Max>
 resp::data
-processor::expire_impl (string_view cmd)
+processor::zpop_impl (string_view cmd)
 {
-  if (args_.size () != 2 && args_.size () != 3)
+  if (args_.size () != 1 && args_.size () != 2)
     return e_wrong_num_args (cmd);
 
-  enum
-  {
-    cond_none = 0,
-    cond_nx,
-    cond_xx,
-    cond_gt,
-    cond_lt,
-  };
-
-  auto cond = cond_none;
-  if (args_.size () == 3)
+  std::int64_t count = 1;
+  if (args_.size () == 2)
     {
-      auto opt = args_[2];
-      boost::to_lower (opt);
-      if (opt == "nx")
-	cond = cond_nx;
-      else if (opt == "xx")
-	cond = cond_xx;
-      else if (opt == "gt")
-	cond = cond_gt;
-      else if (opt == "lt")
-	cond = cond_lt;
-      else
-	return e_syntax;
+      if (!try_lexical_convert (args_[1], count))
+	return e_bad_integer;
+      if (count < 0)
+	return e_value_out_of_range_positive;
     }
 
-  std::int64_t n;
-  const auto &num = args_[1];
-  if (!try_lexical_convert (num, n))
-    return e_bad_integer;
-
   const auto &key = args_[0];
   auto opt_it = storage_.find (key);
   if (!opt_it.has_value ())
-    return integer (0);
+    return empty_array ();
 
   auto it = opt_it.value ();
-  db::time_point expires;
-  auto now = db::clock_type::now ();
-  auto ttl = storage_.ttl (it);
-  auto zero = db::duration::zero ();
-  if (ttl.has_value () && ttl.value () <= zero)
-    {
-      storage_.erase (it);
-      return integer (0);
-    }
+  auto &data = it->second;
+  if (!data.is<db::sorted_set> ())
+    return e_wrong_type;
 
-  if (At)
-    expires = db::time_point{ Duration{ n } };
-  else
-    expires = now + Duration{ n };
+  auto &zs = data.get<db::sorted_set> ();
+  auto len = zs.size ();
+  auto n = static_cast<std::uint64_t> (count) > len
+	       ? len
+	       : static_cast<std::size_t> (count);
+  auto first = Max ? len - n : 0;
+  auto last = Max ? len : n;
 
-  auto new_ttl = expires - now;
+  std::vector<resp::data> out;
+  append_zset_entries (out, zs.range (first, last), true, Max);
+  zs.erase_range (first, last);
 
-  bool can_set = true;
-  switch (cond)
+  if (n != 0)
+    notify (notify_zset, Max ? "zpopmax" : "zpopmin", key);
+  if (zs.empty ())
     {
-    case cond_none:
-      break;
+      storage_.erase (it);
+      notify (notify_generic, "del", key);
+    }
 
-    case cond_nx:
-      can_set = !ttl.has_value ();
-      break;
+  return array (std::move (out));
+}
 
-    case cond_xx:
-      can_set = ttl.has_value ();
-      break;
+// HyperLogLog commands
+resp::data
+processor::exec_pfadd ()
+{
+  // PFADD key [element [element ...]]
 
-    case cond_gt:
-      can_set = ttl.has_value () && new_ttl > ttl.value ();
-      break;
+  // RETURN:
+  // - integer: 1 if at least one HyperLogLog internal register was altered.
+  // - integer: 0 if no HyperLogLog internal registers were altered.
 
-    case cond_lt:
-      can_set = !ttl.has_value () || new_ttl < ttl.value ();
-      break;
+  if (args_.size () < 1)
+    return e_wrong_num_args ("pfadd");
 
-    default:
-      BOOST_THROW_EXCEPTION (std::logic_error ("bad expire_cond"));
-    }
-  if (!can_set)
-    return integer (0);
+  auto &key = args_[0];
+  auto opt_it = storage_.find (key);
 
-  if (new_ttl <= zero)
+  bool updated = false;
+  db::storage::iterator it;
+  if (!opt_it.has_value ())
     {
-      storage_.erase (it);
-      return integer (1);
+      db::data data{ db::hll{} };
+      it = storage_.insert (std::move (key), std::move (data));
+      updated = true;
     }
   else
-    storage_.expire_at (it, expires);
+    {
+      it = opt_it.value ();
+      if (!it->second.is<db::hll> ())
+	return e_wrong_type;
+    }
 
-  return integer (1);
+  auto &h = it->second.get<db::hll> ();
+  for (std::size_t i = 1; i < args_.size (); i++)
+    if (h.add (args_[i]))
+      updated = true;
+
+  if (updated)
+    notify (notify_string, "pfadd", it->first);
+  return integer (updated ? 1 : 0);
 }
 
 resp::data
-processor::exec_ttl ()
+processor::exec_pfcount ()
 {
-  // TTL key
+  // PFCOUNT key [key ...]
 
   // RETURN:
-  // - integer: TTL in seconds.
-  // - integer: -1 if the key exists but has no associated expiration.
-  // - integer: -2 if the key does not exist.
+  // - integer: the approximated number of unique elements observed via
+  //            PFADD.
 
-  return ttl_impl<seconds> ("ttl");
+  if (args_.size () < 1)
+    return e_wrong_num_args ("pfcount");
+
+  if (args_.size () == 1)
+    {
+      auto opt_it = storage_.find (args_[0]);
+      if (!opt_it.has_value ())
+	return integer (0);
+
+      const auto &data = opt_it.value ()->second;
+      if (!data.is<db::hll> ())
+	return e_wrong_type;
+
+      return integer (to_int64 (data.get<db::hll> ().count ()));
+    }
+
+  // Merge every source into one register array, then estimate once.
+  std::vector<std::uint8_t> regs (db::hyperloglog::registers, 0);
+  for (const auto &key : args_)
+    {
+      auto opt_it = storage_.find (key);
+      if (!opt_it.has_value ())
+	continue;
+
+      const auto &data = opt_it.value ()->second;
+      if (!data.is<db::hll> ())
+	return e_wrong_type;
+
+      db::hyperloglog::merge_dense (regs.data (), data.get<db::hll> ());
+    }
+
+  return integer (to_int64 (db::hyperloglog::estimate (regs.data ())));
 }
 
 resp::data
-processor::exec_pttl ()
+processor::exec_pfmerge ()
 {
-  // PTTL key
+  // PFMERGE destkey [sourcekey [sourcekey ...]]
 
   // RETURN:
-  // - integer: TTL in milliseconds.
-  // - integer: -1 if the key exists but has no associated expiration.
-  // - integer: -2 if the key does not exist.
+  // - simple string: OK.
 
-  return ttl_impl<milliseconds> ("pttl");
+  if (args_.size () < 1)
+    return e_wrong_num_args ("pfmerge");
+
+  std::vector<db::storage::iterator> sources;
+  sources.reserve (args_.size ());
+  for (const auto &key : args_)
+    {
+      auto opt_it = storage_.find (key);
+      if (!opt_it.has_value ())
+	continue;
+      if (!opt_it.value ()->second.is<db::hll> ())
+	return e_wrong_type;
+      sources.push_back (opt_it.value ());
+    }
+
+  db::hyperloglog merged;
+  for (auto it : sources)
+    merged.merge (it->second.get<db::hll> ());
+
+  auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+  if (opt_it.has_value ())
+    {
+      opt_it.value ()->second.get<db::hll> () = std::move (merged);
+      notify (notify_string, "pfadd", key);
+    }
+  else
+    {
+      db::data data{ db::hll{ std::move (merged) } };
+      notify (notify_string, "pfadd", key);
+      storage_.insert (std::move (key), std::move (data));
+    }
+
+  return simple_string ("OK");
 }
 
-template <class Duration>
+// Bitmap commands
 resp::data
-processor::ttl_impl (string_view cmd)
+processor::exec_setbit ()
 {
-  if (args_.size () != 1)
-    return e_wrong_num_args (cmd);
+  // SETBIT key offset value
 
-  const auto &key = args_[0];
-  auto opt_it = storage_.find (key);
-  if (!opt_it.has_value ())
-    return integer (-2);
+  // RETURN:
+  // - integer: the original bit value stored at offset.
 
-  auto it = opt_it.value ();
+  if (args_.size () != 3)
+    return e_wrong_num_args ("setbit");
 
-  auto ttl = storage_.ttl (it);
-  if (!ttl.has_value ())
-    return integer (-1);
+  std::uint64_t offset;
+  if (!parse_bit_offset (args_[1], offset))
+    return e_bit_offset;
 
-  auto ttl_raw = ttl.value ();
-  if (ttl_raw <= db::duration::zero ())
+  const auto &value = args_[2];
+  if (value != "0" && value != "1")
+    return e_bit_value;
+
+  auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+
+  db::storage::iterator it;
+  if (!opt_it.has_value ())
     {
-      storage_.erase (it);
-      return integer (-2);
+      db::data data{ db::string{} };
+      it = storage_.insert (std::move (key), std::move (data));
     }
+  else
+    it = opt_it.value ();
+
+  auto str = write_string_value (it->second);
+  if (str == nullptr)
+    return e_wrong_type;
 
-  auto n = duration_cast<Duration> (ttl_raw).count ();
-  return integer (n);
+  auto byte = static_cast<std::size_t> (offset >> 3);
+  if (str->size () <= byte)
+    str->resize (byte + 1, '\0');
+
+  auto mask = static_cast<unsigned char> (1 << (7 - (offset & 7)));
+  auto &c = reinterpret_cast<unsigned char &> ((*str)[byte]);
+  bool old = (c & mask) != 0;
+  if (value == "1")
+    c = static_cast<unsigned char> (c | mask);
+  else
+    c = static_cast<unsigned char> (c & ~mask);
+
+  notify (notify_string, "setbit", it->first);
+  return integer (old ? 1 : 0);
 }
 
-// List commands
 resp::data
-processor::exec_llen ()
+processor::exec_getbit ()
 {
-  // LLEN key
+  // GETBIT key offset
 
   // RETURN:
-  // - integer: the length of the list.
+  // - integer: the bit value stored at offset, 0 when the key or the offset
+  //            does not exist.
 
-  if (args_.size () != 1)
-    return e_wrong_num_args ("llen");
+  if (args_.size () != 2)
+    return e_wrong_num_args ("getbit");
+
+  std::uint64_t offset;
+  if (!parse_bit_offset (args_[1], offset))
+    return e_bit_offset;
 
   const auto &key = args_[0];
   auto opt_it = storage_.find (key);
   if (!opt_it.has_value ())
     return integer (0);
 
-  const auto &data = opt_it.value ()->second;
-  if (!data.is<db::list> ())
+  std::string tmp;
+  string_view str;
+  if (!read_string_value (opt_it.value ()->second, tmp, str))
     return e_wrong_type;
 
-  return integer (to_int64 (data.get<db::list> ().size ()));
+  auto byte = offset >> 3;
+  if (byte >= str.size ())
+    return integer (0);
+
+  auto c = static_cast<unsigned char> (str[byte]);
+  return integer ((c >> (7 - (offset & 7))) & 1);
 }
 
 resp::data
-processor::exec_lindex ()
+processor::exec_bitcount ()
 {
-  // LINDEX key index
+  // BITCOUNT key [start end [BYTE | BIT]]
 
   // RETURN:
-  // - nil: when index is out of range.
-  // - bulk string: the requested element.
+  // - integer: the number of bits set to 1.
 
-  if (args_.size () != 2)
-    return e_wrong_num_args ("lindex");
+  if (args_.size () != 1 && args_.size () != 3 && args_.size () != 4)
+    {
+      if (args_.size () == 2)
+	return e_syntax;
+      return e_wrong_num_args ("bitcount");
+    }
 
-  std::int64_t index;
-  if (!try_lexical_convert (args_[1], index))
-    return e_bad_integer;
+  bool bit_mode = false;
+  std::int64_t start = 0;
+  std::int64_t end = -1;
+  if (args_.size () >= 3)
+    {
+      if (!try_lexical_convert (args_[1], start)
+	  || !try_lexical_convert (args_[2], end))
+	return e_bad_integer;
+    }
+  if (args_.size () == 4)
+    {
+      auto unit = args_[3];
+      boost::to_lower (unit);
+      if (unit == "bit")
+	bit_mode = true;
+      else if (unit != "byte")
+	return e_syntax;
+    }
 
   const auto &key = args_[0];
   auto opt_it = storage_.find (key);
   if (!opt_it.has_value ())
-    return null_bulk_string ();
+    return integer (0);
 
-  const auto &data = opt_it.value ()->second;
-  if (!data.is<db::list> ())
+  std::string tmp;
+  string_view str;
+  if (!read_string_value (opt_it.value ()->second, tmp, str))
     return e_wrong_type;
 
-  const auto &ls = data.get<db::list> ();
-  auto opt_pos = normalize_lindex (index, ls.size ());
-  if (!opt_pos.has_value ())
-    return null_bulk_string ();
+  std::uint64_t len = str.size ();
+  auto range = normalize_bit_range (start, end, bit_mode ? len * 8 : len);
+  if (!range.has_value ())
+    return integer (0);
 
-  return bulk_string (ls[opt_pos.value ()]);
+  auto first = range.value ().first;
+  auto last = range.value ().second;
+  if (!bit_mode)
+    {
+      first *= 8;
+      last = last * 8 + 7;
+    }
+
+  auto p = reinterpret_cast<const unsigned char *> (str.data ());
+  auto first_byte = first >> 3;
+  auto last_byte = last >> 3;
+  auto count = db::popcount (p + first_byte, last_byte - first_byte + 1);
+
+  // Drop the bits of the edge bytes that are outside of the range.
+  auto head = static_cast<int> (first & 7);
+  auto tail = static_cast<int> (7 - (last & 7));
+  if (head != 0)
+    {
+      auto outside = static_cast<unsigned char> (p[first_byte] >> (8 - head));
+      count -= db::popcount (&outside, 1);
+    }
+  if (tail != 0)
+    {
+      auto outside = static_cast<unsigned char> (p[last_byte]
+						 & ((1u << tail) - 1));
+      count -= db::popcount (&outside, 1);
+    }
+
+  return integer (to_int64 (count));
 }
 
 resp::data
-processor::exec_lrange ()
+processor::exec_bitpos ()
 {
-  // LRANGE key start stop
+  // BITPOS key bit [start [end [BYTE | BIT]]]
 
   // RETURN:
-  // - array: a list of elements in the specified range,
-  //          or an empty array if the key doesn't exist.
-
-  if (args_.size () != 3)
-    return e_wrong_num_args ("lrange");
-
-  std::int64_t start;
-  std::int64_t stop;
-  if (!try_lexical_convert (args_[1], start)
-      || !try_lexical_convert (args_[2], stop))
+  // - integer: the position of the first bit set to 1 or 0 according to the
+  //            request.
+  // - integer: -1 when looking for set bits and no bit is set in the range.
+  // - integer: when looking for clear bits and the string is all ones, the
+  //            first bit past the string, unless an end was given, in which
+  //            case -1.
+
+  if (args_.size () < 2 || args_.size () > 5)
+    return e_wrong_num_args ("bitpos");
+
+  const auto &bit_arg = args_[1];
+  if (bit_arg != "0" && bit_arg != "1")
+    return simple_error ("ERR The bit argument must be 1 or 0.");
+  bool bit = bit_arg == "1";
+
+  bool bit_mode = false;
+  bool end_given = args_.size () >= 4;
+  std::int64_t start = 0;
+  std::int64_t end = -1;
+  if (args_.size () >= 3 && !try_lexical_convert (args_[2], start))
     return e_bad_integer;
+  if (args_.size () >= 4 && !try_lexical_convert (args_[3], end))
+    return e_bad_integer;
+  if (args_.size () == 5)
+    {
+      auto unit = args_[4];
+      boost::to_lower (unit);
+      if (unit == "bit")
+	bit_mode = true;
+      else if (unit != "byte")
+	return e_syntax;
+    }
 
   const auto &key = args_[0];
   auto opt_it = storage_.find (key);
   if (!opt_it.has_value ())
-    return empty_array ();
+    return integer (bit ? -1 : 0);
 
-  const auto &data = opt_it.value ()->second;
-  if (!data.is<db::list> ())
+  std::string tmp;
+  string_view str;
+  if (!read_string_value (opt_it.value ()->second, tmp, str))
     return e_wrong_type;
 
-  const auto &ls = data.get<db::list> ();
-  auto range = normalize_lrange (start, stop, ls.size ());
+  std::uint64_t len = str.size ();
+  auto range = normalize_bit_range (start, end, bit_mode ? len * 8 : len);
   if (!range.has_value ())
-    return empty_array ();
+    return integer (-1);
 
-  const auto first = range.value ().first;
-  const auto last = range.value ().second;
-  std::vector<resp::data> out;
-  out.reserve (last - first + 1);
-  for (auto i = first; i <= last; i++)
-    out.push_back (bulk_string (ls[i]));
+  auto first = range.value ().first;
+  auto last = range.value ().second;
+  if (!bit_mode)
+    {
+      first *= 8;
+      last = last * 8 + 7;
+    }
 
-  return array (std::move (out));
+  auto pos = find_bit_in_range (str, first, last, bit);
+  if (pos.has_value ())
+    return integer (to_int64 (pos.value ()));
+
+  // Clear bits are assumed past the end of the string unless the range was
+  // given explicitly.
+  if (!bit && !end_given)
+    return integer (to_int64 (len * 8));
+  return integer (-1);
 }
 
 resp::data
-processor::exec_lset ()
+processor::exec_bitop ()
 {
-  // LSET key index element
+  // BITOP <AND | OR | XOR | NOT> destkey key [key ...]
 
   // RETURN:
-  // - simple string: OK.
+  // - integer: the size of the string stored in the destination key.
+
+  if (args_.size () < 3)
+    return e_wrong_num_args ("bitop");
+
+  auto op = args_[0];
+  boost::to_lower (op);
+
+  bool is_not = false;
+  db::bitop_kind kind = db::bitop_and;
+  if (op == "and")
+    kind = db::bitop_and;
+  else if (op == "or")
+    kind = db::bitop_or;
+  else if (op == "xor")
+    kind = db::bitop_xor;
+  else if (op == "not")
+    is_not = true;
+  else
+    return e_syntax;
 
-  if (args_.size () != 3)
-    return e_wrong_num_args ("lset");
+  if (is_not && args_.size () != 3)
+    return simple_error (
+	"ERR BITOP NOT must be called with a single source key.");
 
-  std::int64_t index;
-  if (!try_lexical_convert (args_[1], index))
-    return e_bad_integer;
+  // Integer values are rendered into owned strings kept alive until the
+  // result is built.
+  std::deque<std::string> tmps;
+  std::vector<string_view> srcs;
+  srcs.reserve (args_.size () - 2);
+  for (std::size_t i = 2; i < args_.size (); i++)
+    {
+      auto opt_it = storage_.find (args_[i]);
+      if (!opt_it.has_value ())
+	{
+	  srcs.push_back (string_view{});
+	  continue;
+	}
 
-  const auto &key = args_[0];
-  auto opt_it = storage_.find (key);
-  if (!opt_it.has_value ())
-    return e_no_such_key;
+      tmps.emplace_back ();
+      string_view str;
+      if (!read_string_value (opt_it.value ()->second, tmps.back (), str))
+	return e_wrong_type;
+      srcs.push_back (str);
+    }
 
-  auto it = opt_it.value ();
-  auto &data = it->second;
-  if (!data.is<db::list> ())
-    return e_wrong_type;
+  std::string result;
+  if (is_not)
+    {
+      result.assign (srcs[0].data (), srcs[0].size ());
+      db::bitop_not (reinterpret_cast<unsigned char *> (&result[0]),
+		     result.size ());
+    }
+  else
+    db::bitop (kind, result, srcs);
 
-  auto &ls = data.get<db::list> ();
-  auto opt_pos = normalize_lindex (index, ls.size ());
-  if (!opt_pos.has_value ())
-    return e_index_out_of_range;
+  auto &key = args_[1];
+  auto len = result.size ();
+  if (len == 0)
+    {
+      auto opt_it = storage_.find (key);
+      if (opt_it.has_value ())
+	{
+	  storage_.erase (opt_it.value ());
+	  notify (notify_generic, "del", key);
+	}
+      return integer (0);
+    }
 
-  ls[opt_pos.value ()] = std::move (args_[2]);
-  return simple_string ("OK");
+  db::data data{ db::string{ std::move (result) } };
+  auto it = storage_.insert (std::move (key), std::move (data));
+  storage_.clear_expires (it);
+  notify (notify_string, "set", it->first);
+  return integer (to_int64 (len));
 }
 
 resp::data
-processor::exec_lrem ()
+processor::exec_bitfield ()
 {
-  // LREM key count element
+  // BITFIELD key [GET encoding offset | [OVERFLOW <WRAP | SAT | FAIL>]
+  //   <SET encoding offset value | INCRBY encoding offset increment>
+  //   [GET encoding offset | [OVERFLOW <WRAP | SAT | FAIL>]
+  //   <SET encoding offset value | INCRBY encoding offset increment>
+  //   ...]]
 
   // RETURN:
-  // - integer: the number of removed elements.
+  // - array: each entry being the corresponding result of the sub-command
+  //          given at the same position.
+  // - nil: for SET/INCRBY that were not applied because of OVERFLOW FAIL.
 
-  if (args_.size () != 3)
-    return e_wrong_num_args ("lrem");
+  return bitfield_impl ("bitfield", false);
+}
 
-  std::int64_t count;
-  if (!try_lexical_convert (args_[1], count))
-    return e_bad_integer;
+resp::data
+processor::exec_bitfield_ro ()
+{
+  // BITFIELD_RO key [GET encoding offset [GET encoding offset ...]]
+
+  // RETURN:
+  // - array: each entry being the corresponding result of the sub-command
+  //          given at the same position.
+
+  return bitfield_impl ("bitfield_ro", true);
+}
+
+resp::data
+processor::bitfield_impl (string_view cmd, bool read_only)
+{
+  if (args_.size () < 1)
+    return e_wrong_num_args (cmd);
+
+  enum
+  {
+    op_get,
+    op_set,
+    op_incrby,
+  };
+
+  enum
+  {
+    overflow_wrap,
+    overflow_sat,
+    overflow_fail,
+  };
+
+  struct field_op
+  {
+    int op;
+    int overflow;
+    bool is_signed;
+    int bits;
+    std::uint64_t offset;
+    std::int64_t value;
+  };
+
+  const auto e_bad_type = simple_error (
+      "ERR Invalid bitfield type. Use something like i16 u8. Note that u64 "
+      "is not supported but i64 is.");
+
+  std::vector<field_op> ops;
+  bool has_write = false;
+  int overflow = overflow_wrap;
+  for (std::size_t i = 1; i < args_.size (); i++)
+    {
+      auto name = args_[i];
+      boost::to_lower (name);
+
+      if (name == "overflow" && !read_only)
+	{
+	  if (++i >= args_.size ())
+	    return e_syntax;
+	  auto mode = args_[i];
+	  boost::to_lower (mode);
+	  if (mode == "wrap")
+	    overflow = overflow_wrap;
+	  else if (mode == "sat")
+	    overflow = overflow_sat;
+	  else if (mode == "fail")
+	    overflow = overflow_fail;
+	  else
+	    return simple_error ("ERR Invalid OVERFLOW type specified");
+	  continue;
+	}
+
+      field_op fop{};
+      if (name == "get")
+	fop.op = op_get;
+      else if (name == "set" && !read_only)
+	fop.op = op_set;
+      else if (name == "incrby" && !read_only)
+	fop.op = op_incrby;
+      else if ((name == "set" || name == "incrby") && read_only)
+	return simple_error (
+	    "ERR BITFIELD_RO only supports the GET subcommand");
+      else
+	return e_syntax;
+
+      auto nargs = fop.op == op_get ? 2u : 3u;
+      if (i + nargs >= args_.size ())
+	return e_syntax;
+
+      const auto &type = args_[i + 1];
+      std::int64_t bits = 0;
+      if (type.size () < 2 || (type[0] != 'i' && type[0] != 'I'
+			       && type[0] != 'u' && type[0] != 'U')
+	  || !try_lexical_convert (type.substr (1), bits))
+	return e_bad_type;
+      fop.is_signed = type[0] == 'i' || type[0] == 'I';
+      if (bits < 1 || (fop.is_signed && bits > 64)
+	  || (!fop.is_signed && bits > 63))
+	return e_bad_type;
+      fop.bits = static_cast<int> (bits);
+
+      auto offset_arg = string_view{ args_[i + 2] };
+      bool scaled = !offset_arg.empty () && offset_arg[0] == '#';
+      if (scaled)
+	offset_arg.remove_prefix (1);
+      std::int64_t offset;
+      if (!try_lexical_convert (offset_arg, offset) || offset < 0)
+	return e_bit_offset;
+      if (scaled)
+	{
+	  if (offset > std::numeric_limits<std::int64_t>::max () / bits)
+	    return e_bit_offset;
+	  offset *= bits;
+	}
+      if (static_cast<std::uint64_t> (offset) + bits > max_bit_offset)
+	return e_bit_offset;
+      fop.offset = static_cast<std::uint64_t> (offset);
+
+      if (fop.op != op_get)
+	{
+	  if (!try_lexical_convert (args_[i + 3], fop.value))
+	    return e_bad_integer;
+	  has_write = true;
+	}
+
+      fop.overflow = overflow;
+      ops.push_back (fop);
+      i += nargs;
+    }
 
   const auto &key = args_[0];
   auto opt_it = storage_.find (key);
-  if (!opt_it.has_value ())
-    return integer (0);
-
-  auto it = opt_it.value ();
-  auto &data = it->second;
-  if (!data.is<db::list> ())
-    return e_wrong_type;
 
-  const auto &element = args_[2];
-  auto &ls = data.get<db::list> ();
+  std::string tmp;
+  string_view view;
+  std::string *str = nullptr;
+  if (opt_it.has_value ())
+    {
+      auto &data = opt_it.value ()->second;
+      if (has_write)
+	{
+	  str = write_string_value (data);
+	  if (str == nullptr)
+	    return e_wrong_type;
+	}
+      else if (!read_string_value (data, tmp, view))
+	return e_wrong_type;
+    }
+  else if (has_write)
+    {
+      db::data data{ db::string{} };
+      auto it = storage_.insert (key, std::move (data));
+      str = &it->second.get<db::string> ();
+    }
 
-  std::int64_t removed = 0;
-  if (count == 0)
+  // Reads a field with zero padding past the end of the string.
+  auto read_field = [&] (const field_op &fop) -> std::uint64_t
     {
-      for (auto iter = ls.begin (); iter != ls.end ();)
+      string_view s = str != nullptr ? string_view{ *str } : view;
+      unsigned char buf[9] = {};
+      auto byte = fop.offset >> 3;
+      for (std::size_t j = 0; j < sizeof (buf) && byte + j < s.size (); j++)
+	buf[j] = static_cast<unsigned char> (s[byte + j]);
+      return db::get_bits (buf, fop.offset & 7, fop.bits);
+    };
+
+  auto to_signed = [] (std::uint64_t v, int bits) -> std::int64_t
+    {
+      if (bits < 64 && (v & (std::uint64_t{ 1 } << (bits - 1))) != 0)
+	v |= ~std::uint64_t{ 0 } << bits;
+      return static_cast<std::int64_t> (v);
+    };
+
+  // Applies the overflow policy to value + incr. Returns false when the
+  // operation must fail.
+  auto apply = [] (const field_op &fop, std::int64_t value, std::int64_t incr,
+		   std::int64_t &out) -> bool
+    {
+      auto u = static_cast<std::uint64_t> (value);
+      auto d = static_cast<std::uint64_t> (incr);
+      auto wrapped = u + d;
+
+      bool over = false;
+      bool under = false;
+      std::int64_t limit_max;
+      std::int64_t limit_min;
+      if (fop.is_signed)
 	{
-	  if (*iter == element)
+	  limit_max = std::numeric_limits<std::int64_t>::max ();
+	  if (fop.bits < 64)
+	    limit_max = (std::int64_t{ 1 } << (fop.bits - 1)) - 1;
+	  limit_min = -limit_max - 1;
+	  if (incr > 0 && value > limit_max - incr)
+	    over = true;
+	  else if (incr < 0 && value < limit_min - incr)
+	    under = true;
+	  else if (value > limit_max)
+	    over = true;
+	  else if (value < limit_min)
+	    under = true;
+
+	  if (fop.bits < 64)
 	    {
-	      iter = ls.erase (iter);
-	      removed++;
+	      auto msb = std::uint64_t{ 1 } << (fop.bits - 1);
+	      auto mask = ~std::uint64_t{ 0 } << fop.bits;
+	      wrapped
+		  = (wrapped & msb) != 0 ? wrapped | mask : wrapped & ~mask;
 	    }
-	  else
-	    ++iter;
 	}
+      else
+	{
+	  auto max = (std::uint64_t{ 1 } << fop.bits) - 1;
+	  limit_max = static_cast<std::int64_t> (max);
+	  limit_min = 0;
+	  if (u > max || (incr > 0 && d > max - u))
+	    over = true;
+	  else if (incr < 0
+		   && static_cast<std::uint64_t> (-(incr + 1)) + 1 > u)
+	    under = true;
+	  wrapped &= max;
+	}
+
+      if (!over && !under)
+	{
+	  out = static_cast<std::int64_t> (wrapped);
+	  return true;
+	}
+
+      switch (fop.overflow)
+	{
+	case overflow_wrap:
+	  out = static_cast<std::int64_t> (wrapped);
+	  return true;
+	case overflow_sat:
+	  out = over ? limit_max : limit_min;
+	  return true;
+	default:
+	  return false;
+	}
+    };
+
+  std::vector<resp::data> out;
+  out.reserve (ops.size ());
+  bool changed = false;
+  for (const auto &fop : ops)
+    {
+      auto raw = read_field (fop);
+      std::int64_t old = fop.is_signed ? to_signed (raw, fop.bits)
+				       : static_cast<std::int64_t> (raw);
+      if (fop.op == op_get)
+	{
+	  out.push_back (integer (old));
+	  continue;
+	}
+
+      std::int64_t next;
+      bool ok = fop.op == op_set ? apply (fop, fop.value, 0, next)
+				 : apply (fop, old, fop.value, next);
+      if (!ok)
+	{
+	  out.push_back (null_bulk_string ());
+	  continue;
+	}
+
+      auto need = static_cast<std::size_t> ((fop.offset + fop.bits + 7) >> 3);
+      if (str->size () < need)
+	str->resize (need, '\0');
+      db::set_bits (reinterpret_cast<unsigned char *> (&(*str)[0]),
+		    fop.offset, fop.bits, static_cast<std::uint64_t> (next));
+      out.push_back (integer (fop.op == op_set ? old : next));
+      changed = true;
     }
-  else if (count > 0)
+
+  if (changed)
+    notify (notify_string, "setbit", key);
+  return array (std::move (out));
+}
+
+
+// Stream commands
+resp::data
+processor::exec_xadd ()
+{
+  // XADD key [NOMKSTREAM] [<MAXLEN | MINID> [= | ~] threshold
+  //   [LIMIT count]] <* | id> field value [field value ...]
+
+  // RETURN:
+  // - bulk string: the ID of the added entry.
+  // - nil: if the NOMKSTREAM option is given and the key doesn't exist.
+
+  if (args_.size () < 4)
+    return e_wrong_num_args ("xadd");
+
+  bool no_mkstream = false;
+  stream_trim trim;
+  std::size_t i = 1;
+  for (; i < args_.size (); i++)
+    {
+      auto opt = args_[i];
+      boost::to_lower (opt);
+      if (opt == "nomkstream")
+	no_mkstream = true;
+      else if (opt == "maxlen" || opt == "minid")
+	{
+	  auto err = parse_stream_trim (args_, i, trim);
+	  if (err.has_value ())
+	    return std::move (err.value ());
+	}
+      else
+	break;
+    }
+
+  // The id plus at least one field-value pair.
+  if (i >= args_.size () || (args_.size () - i - 1) % 2 != 0
+      || args_.size () - i < 3)
+    return e_wrong_num_args ("xadd");
+
+  const auto &key = args_[0];
+  auto opt_it = storage_.find (key);
+  if (opt_it.has_value () && !opt_it.value ()->second.is<db::stream_type> ())
+    return e_wrong_type;
+
+  db::stream empty;
+  const auto &cur = opt_it.has_value ()
+			? opt_it.value ()->second.get<db::stream_type> ()
+			: empty;
+  auto last = cur.last_id ();
+
+  db::stream_id id;
+  const auto &id_arg = args_[i];
+  if (id_arg == "*")
     {
-      for (auto iter = ls.begin (); iter != ls.end () && removed < count;)
+      auto now = duration_cast<milliseconds> (
+		     db::clock_type::now ().time_since_epoch ())
+		     .count ();
+      id = { static_cast<std::uint64_t> (now), 0 };
+      if (id <= last)
 	{
-	  if (*iter == element)
-	    {
-	      iter = ls.erase (iter);
-	      removed++;
-	    }
-	  else
-	    ++iter;
+	  id = last;
+	  if (!id.incr ())
+	    return e_stream_exhausted;
 	}
     }
   else
     {
-      auto limit = count == std::numeric_limits<std::int64_t>::min ()
-		       ? std::numeric_limits<std::int64_t>::max ()
-		       : -count;
-
-      for (auto iter = ls.end (); iter != ls.begin () && removed < limit;)
+      bool seq_auto = id_arg.size () > 2
+		      && id_arg.compare (id_arg.size () - 2, 2, "-*") == 0;
+      string_view ms_part{ id_arg };
+      if (seq_auto)
+	ms_part = ms_part.substr (0, ms_part.size () - 2);
+      if (!db::parse_stream_id (ms_part, 0, id)
+	  || (seq_auto && ms_part.find ('-') != string_view::npos))
+	return e_stream_id;
+
+      if (seq_auto && id.ms == last.ms)
 	{
-	  --iter;
-	  if (*iter == element)
-	    {
-	      iter = ls.erase (iter);
-	      removed++;
-	    }
+	  id = last;
+	  if (!id.incr () || id.ms != last.ms)
+	    return e_stream_id_small;
 	}
+      if (id == db::stream_id::min ())
+	return e_stream_id_zero;
+      if (id <= last)
+	return e_stream_id_small;
     }
 
-  if (ls.empty ())
-    storage_.erase (it);
+  db::storage::iterator it;
+  if (opt_it.has_value ())
+    it = opt_it.value ();
+  else
+    {
+      if (no_mkstream)
+	return null_bulk_string ();
+      db::data data{ db::stream_type{} };
+      it = storage_.insert (key, std::move (data));
+    }
 
-  return integer (removed);
+  // An id generated from the clock is logged as it came out.
+  if (!propagate_.empty ())
+    propagate_[i + 1] = id.to_string ();
+
+  auto &st = it->second.get<db::stream_type> ();
+  auto fields = args_.size () - i - 1;
+  st.append (id, span<const std::string>{ args_.data () + i + 1, fields });
+  notify (notify_stream, "xadd", key);
+  if (apply_stream_trim (st, trim) > 0)
+    notify (notify_stream, "xtrim", key);
+  signal_key (key);
+  return bulk_string (id.to_string ());
 }
 
 resp::data
-processor::exec_linsert ()
+processor::exec_xlen ()
 {
-  // LINSERT key <BEFORE | AFTER> pivot element
+  // XLEN key
 
   // RETURN:
-  // - integer: the list length after a successful insert operation.
-  // - integer: 0 when the key doesn't exist.
-  // - integer: -1 when the pivot wasn't found.
+  // - integer: the number of entries of the stream at key.
 
-  if (args_.size () != 4)
-    return e_wrong_num_args ("linsert");
-
-  auto where = args_[1];
-  boost::to_lower (where);
-
-  bool before = false;
-  if (where == "before")
-    before = true;
-  else if (where != "after")
-    return e_syntax;
+  if (args_.size () != 1)
+    return e_wrong_num_args ("xlen");
 
-  const auto &key = args_[0];
-  auto opt_it = storage_.find (key);
+  auto opt_it = storage_.find (args_[0]);
   if (!opt_it.has_value ())
     return integer (0);
 
-  auto it = opt_it.value ();
-  auto &data = it->second;
-  if (!data.is<db::list> ())
+  const auto &data = opt_it.value ()->second;
+  if (!data.is<db::stream_type> ())
     return e_wrong_type;
+  return integer (to_int64 (data.get<db::stream_type> ().size ()));
+}
 
-  auto &ls = data.get<db::list> ();
-
-  auto pos = ls.end ();
-  for (auto iter = ls.begin (); iter != ls.end (); ++iter)
-    if (*iter == args_[2])
-      {
-	pos = iter;
-	break;
-      }
+resp::data
+processor::exec_xrange ()
+{
+  // XRANGE key start end [COUNT count]
 
-  if (pos == ls.end ())
-    return integer (-1);
+  // RETURN:
+  // - array: a list of stream entries with IDs matching the specified
+  //          range.
 
-  if (!before)
-    ++pos;
-  ls.insert (pos, std::move (args_[3]));
-  return integer (to_int64 (ls.size ()));
+  return xrange_impl<false> ("xrange");
 }
 
 resp::data
-processor::exec_lpush ()
+processor::exec_xrevrange ()
 {
-  // LPUSH key element [element ...]
+  // XREVRANGE key end start [COUNT count]
 
   // RETURN:
-  // - integer: the length of the list after the push operation.
+  // - array: a list of stream entries with IDs matching the specified
+  //          range, in reverse order.
 
-  if (args_.size () < 2)
-    return e_wrong_num_args ("lpush");
+  return xrange_impl<true> ("xrevrange");
+}
 
-  auto &key = args_[0];
-  auto opt_it = storage_.find (key);
+template <bool Rev>
+resp::data
+processor::xrange_impl (string_view cmd)
+{
+  if (args_.size () != 3 && args_.size () != 5)
+    return e_wrong_num_args (cmd);
 
-  db::storage::iterator it;
-  if (!opt_it.has_value ())
-    {
-      db::data data{ db::list{} };
-      it = storage_.insert (std::move (key), std::move (data));
-    }
-  else
+  db::stream_id first, last;
+  if (!parse_stream_bound (args_[Rev ? 2 : 1], true, first)
+      || !parse_stream_bound (args_[Rev ? 1 : 2], false, last))
+    return e_stream_id;
+
+  std::int64_t count = -1;
+  if (args_.size () == 5)
     {
-      it = opt_it.value ();
-      if (!it->second.is<db::list> ())
-	return e_wrong_type;
+      if (!boost::iequals (args_[3], "count"))
+	return e_syntax;
+      if (!try_lexical_convert (args_[4], count))
+	return e_bad_integer;
+      if (count < 0)
+	count = 0;
     }
 
-  auto &ls = it->second.get<db::list> ();
-  for (std::size_t i = 1; i < args_.size (); i++)
-    ls.push_front (std::move (args_[i]));
+  auto opt_it = storage_.find (args_[0]);
+  if (!opt_it.has_value () || count == 0)
+    return empty_array ();
 
-  return integer (to_int64 (ls.size ()));
+  const auto &data = opt_it.value ()->second;
+  if (!data.is<db::stream_type> ())
+    return e_wrong_type;
+
+  const auto &st = data.get<db::stream_type> ();
+  auto n = count < 0 ? 0 : static_cast<std::size_t> (count);
+  return stream_entries (st.range (first, last, n, Rev));
 }
 
 resp::data
-processor::exec_rpush ()
+processor::exec_xtrim ()
 {
-  // RPUSH key element [element ...]
+  // XTRIM key <MAXLEN | MINID> [= | ~] threshold [LIMIT count]
 
   // RETURN:
-  // - integer: the length of the list after the push operation.
+  // - integer: the number of entries deleted from the stream.
 
-  if (args_.size () < 2)
-    return e_wrong_num_args ("rpush");
+  if (args_.size () < 3)
+    return e_wrong_num_args ("xtrim");
 
-  auto &key = args_[0];
-  auto opt_it = storage_.find (key);
+  auto strategy = args_[1];
+  boost::to_lower (strategy);
+  if (strategy != "maxlen" && strategy != "minid")
+    return e_syntax;
 
-  db::storage::iterator it;
+  stream_trim trim;
+  std::size_t i = 1;
+  auto err = parse_stream_trim (args_, i, trim);
+  if (err.has_value ())
+    return std::move (err.value ());
+  if (i + 1 != args_.size ())
+    return e_syntax;
+
+  auto opt_it = storage_.find (args_[0]);
   if (!opt_it.has_value ())
-    {
-      db::data data{ db::list{} };
-      it = storage_.insert (std::move (key), std::move (data));
-    }
-  else
-    {
-      it = opt_it.value ();
-      if (!it->second.is<db::list> ())
-	return e_wrong_type;
-    }
+    return integer (0);
 
-  auto &ls = it->second.get<db::list> ();
-  for (std::size_t i = 1; i < args_.size (); i++)
-    ls.push_back (std::move (args_[i]));
+  auto &data = opt_it.value ()->second;
+  if (!data.is<db::stream_type> ())
+    return e_wrong_type;
 
-  return integer (to_int64 (ls.size ()));
+  auto &st = data.get<db::stream_type> ();
+  auto removed = apply_stream_trim (st, trim);
+  if (removed > 0)
+    notify (notify_stream, "xtrim", args_[0]);
+  return integer (to_int64 (removed));
 }
 
 resp::data
-processor::exec_lpop ()
+processor::exec_xdel ()
 {
-  // LPOP key [count]
+  // XDEL key id [id ...]
 
   // RETURN:
-  // - nil if the key does not exist.
-  // - bulk string: when called without the count argument,
-  //                the value of the first element.
-  // - array: when called with the count argument,
-  //          a list of popped elements.
+  // - integer: the number of entries that were deleted.
 
-  if (args_.size () != 1 && args_.size () != 2)
-    return e_wrong_num_args ("lpop");
+  if (args_.size () < 2)
+    return e_wrong_num_args ("xdel");
 
-  bool with_count = args_.size () == 2;
-  std::int64_t count = 1;
-  if (with_count)
-    {
-      if (!try_lexical_convert (args_[1], count))
-	return e_bad_integer;
-      if (count <= 0)
-	return e_value_out_of_range_positive;
-    }
+  std::vector<db::stream_id> ids (args_.size () - 1);
+  for (std::size_t i = 1; i < args_.size (); i++)
+    if (!db::parse_stream_id (args_[i], 0, ids[i - 1]))
+      return e_stream_id;
 
-  const auto &key = args_[0];
-  auto opt_it = storage_.find (key);
+  auto opt_it = storage_.find (args_[0]);
   if (!opt_it.has_value ())
-    return with_count ? null_array () : null_bulk_string ();
+    return integer (0);
 
-  auto it = opt_it.value ();
-  auto &data = it->second;
-  if (!data.is<db::list> ())
+  auto &data = opt_it.value ()->second;
+  if (!data.is<db::stream_type> ())
     return e_wrong_type;
 
-  auto &ls = data.get<db::list> ();
-  if (!with_count)
-    {
-      if (ls.empty ())
-	{
-	  storage_.erase (it);
-	  return null_bulk_string ();
-	}
-
-      std::string out = std::move (ls.front ());
-      ls.pop_front ();
-      if (ls.empty ())
-	storage_.erase (it);
-      return bulk_string (std::move (out));
-    }
-
-  if (ls.empty ())
-    {
-      storage_.erase (it);
-      return null_array ();
-    }
-
-  std::vector<resp::data> out;
-  while (count > 0 && !ls.empty ())
-    {
-      std::string val = std::move (ls.front ());
-      ls.pop_front ();
-      out.push_back (bulk_string (std::move (val)));
-      count--;
-    }
-
-  if (ls.empty ())
-    storage_.erase (it);
-  return array (std::move (out));
+  auto &st = data.get<db::stream_type> ();
+  std::int64_t deleted = 0;
+  for (const auto &id : ids)
+    if (st.erase (id))
+      deleted++;
+  if (deleted > 0)
+    notify (notify_stream, "xdel", args_[0]);
+  return integer (deleted);
 }
 
 resp::data
-processor::exec_rpop ()
+processor::exec_xread ()
 {
-  // RPOP key [count]
+  // XREAD [COUNT count] [BLOCK milliseconds] STREAMS key [key ...] id
+  //   [id ...]
 
   // RETURN:
-  // - nil if the key does not exist.
-  // - bulk string: when called without the count argument,
-  //                the value of the first element.
-  // - array: when called with the count argument,
-  //          a list of popped elements.
-
-  if (args_.size () != 1 && args_.size () != 2)
-    return e_wrong_num_args ("rpop");
-
-  bool with_count = args_.size () == 2;
-  std::int64_t count = 1;
-  if (with_count)
+  // - array: a list of streams, each being a key and the entries with IDs
+  //          greater than the requested one.
+  // - nil: if BLOCK is given and the timeout expired without data, or if
+  //        no stream has new entries.
+
+  if (args_.size () < 3)
+    return e_wrong_num_args ("xread");
+
+  std::int64_t count = 0;
+  optional<std::int64_t> block;
+  std::size_t streams = 0;
+  for (std::size_t i = 0; i < args_.size () && streams == 0; i++)
     {
-      if (!try_lexical_convert (args_[1], count))
-	return e_bad_integer;
-      if (count <= 0)
-	return e_value_out_of_range_positive;
+      auto opt = args_[i];
+      boost::to_lower (opt);
+      if (opt == "count" && i + 1 < args_.size ())
+	{
+	  if (!try_lexical_convert (args_[++i], count))
+	    return e_bad_integer;
+	  if (count < 0)
+	    count = 0;
+	}
+      else if (opt == "block" && i + 1 < args_.size ())
+	{
+	  std::int64_t ms;
+	  if (!try_lexical_convert (args_[++i], ms))
+	    return simple_error (
+		"ERR timeout is not an integer or out of range");
+	  if (ms < 0)
+	    return simple_error ("ERR timeout is negative");
+	  block = ms;
+	}
+      else if (opt == "streams")
+	streams = i + 1;
+      else
+	return e_syntax;
     }
 
-  const auto &key = args_[0];
-  auto opt_it = storage_.find (key);
-  if (!opt_it.has_value ())
-    return with_count ? null_array () : null_bulk_string ();
-
-  auto it = opt_it.value ();
-  auto &data = it->second;
-  if (!data.is<db::list> ())
-    return e_wrong_type;
+  auto nargs = args_.size () - streams;
+  if (streams == 0 || nargs == 0 || nargs % 2 != 0)
+    return simple_error ("ERR Unbalanced 'xread' list of streams: for each "
+			 "stream key an ID or '$' must be specified.");
 
-  auto &ls = data.get<db::list> ();
-  if (!with_count)
+  auto nkeys = nargs / 2;
+  std::vector<db::stream_id> ids (nkeys);
+  for (std::size_t k = 0; k < nkeys; k++)
     {
-      if (ls.empty ())
-	{
-	  storage_.erase (it);
-	  return null_bulk_string ();
-	}
+      const auto &key = args_[streams + k];
+      auto &id_arg = args_[streams + nkeys + k];
 
-      std::string out = std::move (ls.back ());
-      ls.pop_back ();
-      if (ls.empty ())
-	storage_.erase (it);
-      return bulk_string (std::move (out));
-    }
+      auto opt_it = storage_.find (key);
+      if (opt_it.has_value ()
+	  && !opt_it.value ()->second.is<db::stream_type> ())
+	return e_wrong_type;
 
-  if (ls.empty ())
-    {
-      storage_.erase (it);
-      return null_array ();
+      if (id_arg == "$")
+	{
+	  // Only entries added after the command count; pin the id so that a
+	  // blocked client that is woken up does not skip them.
+	  ids[k] = db::stream_id::min ();
+	  if (opt_it.has_value ())
+	    {
+	      const auto &st = opt_it.value ()->second.get<db::stream_type> ();
+	      ids[k] = st.last_id ();
+	    }
+	  id_arg = ids[k].to_string ();
+	}
+      else if (!db::parse_stream_id (id_arg, 0, ids[k]))
+	return e_stream_id;
     }
 
   std::vector<resp::data> out;
-  while (count > 0 && !ls.empty ())
+  for (std::size_t k = 0; k < nkeys; k++)
     {
-      std::string val = std::move (ls.back ());
-      ls.pop_back ();
-      out.push_back (bulk_string (std::move (val)));
-      count--;
+      const auto &key = args_[streams + k];
+      auto opt_it = storage_.find (key);
+      if (!opt_it.has_value ())
+	continue;
+
+      auto first = ids[k];
+      if (!first.incr ())
+	continue;
+
+      const auto &st = opt_it.value ()->second.get<db::stream_type> ();
+      auto entries = st.range (first, db::stream_id::max (),
+			       static_cast<std::size_t> (count), false);
+      if (entries.empty ())
+	continue;
+
+      std::vector<resp::data> item;
+      item.reserve (2);
+      item.push_back (bulk_string (key));
+      item.push_back (stream_entries (std::move (entries)));
+      out.push_back (array (std::move (item)));
     }
 
-  if (ls.empty ())
-    storage_.erase (it);
-  return array (std::move (out));
+  if (!out.empty ())
+    return array (std::move (out));
+  if (!block.has_value ())
+    return null_array ();
+
+  block_request req;
+  req.keys.assign (args_.begin () + streams,
+		   args_.begin () + streams + nkeys);
+  req.timeout = milliseconds{ block.value () };
+
+  std::vector<resp::data> cmd;
+  cmd.reserve (args_.size () + 1);
+  cmd.push_back (bulk_string ("xread"));
+  for (auto &arg : args_)
+    cmd.push_back (bulk_string (std::move (arg)));
+  req.request = array (std::move (cmd));
+
+  block_request_ = std::move (req);
+  return null_array ();
 }
 
 } // namespace mini_redis
@@ -1,8 +1,13 @@
 #ifndef PROCESSOR_H
 #define PROCESSOR_H
 
+#include "cluster.h"
 #include "config.h"
+#include "db_aof.h"
+#include "db_disk.h"
 #include "db_storage.h"
+#include "repl_backlog.h"
+#include "script.h"
 
 namespace mini_redis
 {
@@ -12,15 +17,235 @@ class processor
 public:
   explicit processor (config &cfg);
 
-  resp::data execute (resp::data resp);
+  // The state of a connection, which the caller keeps and passes along
+  // with every request of the connection.
+  struct client_state
+  {
+    // Set by ASKING, for the next command only.
+    bool asking = false;
+    // Where the messages of the channels and patterns the client subscribes
+    // to go, set by the caller. It is called on the manager strand with
+    // each message encoded, in a buffer all the subscribers share.
+    std::function<void (std::shared_ptr<const std::string>)> push;
+    std::set<std::string> channels;
+    std::set<std::string> patterns;
+    // Set by MULTI: the commands are queued until EXEC runs them, unless
+    // one of them was refused, which makes EXEC fail.
+    bool multi = false;
+    bool multi_failed = false;
+    std::vector<resp::data> queued;
+    // The keys WATCH watches until EXEC, with their versions then.
+    std::vector<std::pair<std::string, std::uint64_t>> watched;
+  };
+
+  resp::data execute (resp::data resp, client_state *client = nullptr);
+  // A command with several replies, like SUBSCRIBE with one per channel,
+  // returns the last one and leaves the others here, to go before it.
+  std::vector<resp::data> take_leading_replies ();
+  // Drops the subscriptions and the watches of a client whose connection
+  // is closed.
+  void remove_client (client_state &client);
+
+  // Periodic housekeeping, run on the manager strand.
+  void cron ();
+
+  // Loads the dataset on startup: replays the append-only file when it is
+  // enabled, then opens it to log the write commands, or else loads the
+  // snapshot at dbfilename, if there is one. Called before any request is
+  // executed.
+  result<void, std::string> load_data ();
+  // Called once on shutdown: stops the background jobs, saves the dataset
+  // when save points are set, and syncs the append-only file.
+  void shutdown ();
+  bool append_only () const noexcept;
+  // Whether commands were logged since the last flush_append_only_file.
+  bool has_unflushed_writes () const noexcept;
+  // Writes the logged commands to the append-only file, and fsyncs it
+  // under appendfsync always.
+  void flush_append_only_file ();
+
+  // Whether a BGSAVE, or the snapshot of a diskless full sync, runs in
+  // slices, which save_slice runs one at a time.
+  bool sliced_save_active () const noexcept;
+  void save_slice ();
+
+  // A blocking command that finds nothing to reply with leaves a block
+  // request behind, and its reply must be discarded. The caller parks the
+  // client on the keys with add_waiter, executes the request again once it
+  // is woken up, and replies with a null array when the timeout expires.
+  struct block_request
+  {
+    std::vector<std::string> keys;
+    // Zero means no timeout.
+    milliseconds timeout;
+    resp::data request;
+  };
+
+  optional<block_request> take_block_request ();
+
+  // wake is called at most once, after the waiter has been removed.
+  std::uint64_t add_waiter (const std::vector<std::string> &keys,
+			    std::function<void ()> wake);
+  bool remove_waiter (std::uint64_t id);
+
+  // Replication, primary side. PSYNC leaves a sync request behind, and the
+  // caller turns the connection into a replica with add_replica. The feed
+  // is called on the strand with the bytes to send, in order; a null
+  // pointer means the connection must be closed. A payload too large to
+  // hold at once, the snapshot of a full sync, is passed to stream in its
+  // place, as a source that the connection pulls a piece at a time from,
+  // as it drains, until it returns null.
+  struct sync_request
+  {
+    std::string replid;
+    std::int64_t offset;
+  };
+
+  typedef std::function<void (std::shared_ptr<const std::string>)>
+      replica_feed;
+  typedef std::function<std::shared_ptr<const std::string> ()>
+      replica_source;
+  typedef std::function<void (replica_source)> replica_stream;
+
+  optional<sync_request> take_sync_request ();
+  std::uint64_t add_replica (const sync_request &req, replica_feed feed,
+			     replica_stream stream);
+  void remove_replica (std::uint64_t id);
+
+  // MIGRATE leaves a migration behind, whose reply must be discarded. The
+  // caller sends the commands to the target, then completes it with
+  // finish_migration, whose reply is the one of MIGRATE. The keys cannot
+  // be written to meanwhile.
+  struct migration
+  {
+    std::string host;
+    std::uint16_t port;
+    milliseconds timeout;
+    // RESTORE-ASKING commands, one per key, encoded.
+    std::string commands;
+    std::vector<std::string> keys;
+    bool copy;
+  };
+
+  optional<migration> take_migration ();
+  resp::data finish_migration (const migration &m,
+			       const result<void, std::string> &sent);
+
+  // Set when the last command paused a script that ran past the busy
+  // threshold: its reply, of EVAL or of the EXEC that runs the script,
+  // must be discarded. The caller goes on with resume_script, a slice at
+  // a time, until it returns the reply; in between, the other clients are
+  // refused with BUSY, and may only stop a script that has not written
+  // with SCRIPT KILL.
+  bool take_script_pause () noexcept;
+  optional<resp::data> resume_script ();
+
+  // Replication, replica side. REPLICAOF sets the primary, and bumps the
+  // generation, which the owner of the link to the primary follows.
+  struct primary_address
+  {
+    std::string host;
+    std::uint16_t port;
+  };
+
+  const optional<primary_address> &primary () const noexcept;
+  std::uint64_t primary_generation () const noexcept;
+  const std::string &replication_id () const noexcept;
+  std::uint64_t replication_offset () const noexcept;
+  void primary_link_up (bool up);
+  // A full sync: the snapshot received at path, of the stream of replid at
+  // offset, replaces the dataset.
+  result<void, std::string> load_from_primary (const std::string &path,
+					       std::string replid,
+					       std::uint64_t offset);
+  // A diskless full sync: the storage the snapshot was streamed into
+  // replaces the dataset.
+  void load_from_primary (db::storage loaded, std::string replid,
+			  std::uint64_t offset);
+  // Executes a command of the replication stream.
+  void execute_from_primary (resp::data request);
 
 private:
+  result<void, std::string> load_append_only_file ();
+  result<void, std::string> load_snapshot (const std::string &path);
+  void signal_key (const std::string &key);
+  void log_expired_keys ();
+  void propagate (span<const std::string> argv);
+  void advance_stream (std::shared_ptr<const std::string> bytes);
+  void start_full_syncs ();
+  void finish_full_syncs (bool ok);
+  void start_diskless_sync ();
+  void finish_diskless_sync ();
+  void stop_saves ();
+  void adopt_stream (std::string replid, std::uint64_t offset);
+  void reset_replication ();
+  optional<resp::data> redirect (bool asking);
+  std::size_t publish (const std::string &channel,
+		       const std::string &message);
+  // Publishes a keyspace event of a class (notify_flags), if the class is
+  // enabled and anybody is subscribed to anything.
+  void notify (unsigned type, const char *event, const std::string &key);
+
   // Connection commands
   resp::data exec_ping ();
 
   // Server commands
   resp::data exec_save ();
   resp::data exec_load ();
+  resp::data exec_bgsave ();
+  resp::data exec_lastsave ();
+  resp::data exec_info ();
+  resp::data exec_bgrewriteaof ();
+  resp::data exec_compact ();
+  resp::data exec_replicaof ();
+  resp::data exec_psync ();
+  resp::data exec_dump ();
+  resp::data exec_restore ();
+  resp::data exec_restore_asking ();
+  resp::data exec_migrate ();
+  result<void, std::string> save_snapshot (const std::string &path,
+					  db::compression codec);
+  result<void, std::string>
+  start_background_save (const std::string &path, db::compression codec);
+  void check_save_points ();
+  void check_background_save ();
+  bool bgsave_in_progress () const noexcept;
+  void background_save_done (bool ok);
+  result<void, std::string> start_background_rewrite ();
+  void check_background_rewrite ();
+
+  // Transaction commands
+  resp::data exec_multi ();
+  resp::data exec_exec ();
+  optional<resp::data> run_transaction ();
+  resp::data exec_discard ();
+  resp::data exec_watch ();
+  resp::data exec_unwatch ();
+  void unwatch (client_state &client);
+
+  // Scripting commands
+  resp::data exec_eval ();
+  resp::data exec_evalsha ();
+  resp::data exec_script ();
+  result<std::shared_ptr<const script::program>, std::string>
+  cache_script (const std::string &sha, const std::string &body);
+  resp::data run_script (std::shared_ptr<const script::program> prog);
+  resp::data end_script (resp::data reply);
+  resp::data script_call (std::vector<std::string> &argv);
+
+  // Cluster commands
+  resp::data exec_cluster ();
+  resp::data exec_asking ();
+
+  // Pub/Sub commands
+  resp::data exec_subscribe ();
+  resp::data exec_psubscribe ();
+  resp::data subscribe_impl (string_view cmd, bool pattern);
+  resp::data exec_unsubscribe ();
+  resp::data exec_punsubscribe ();
+  resp::data unsubscribe_impl (string_view cmd, bool pattern);
+  resp::data exec_publish ();
+  resp::data exec_pubsub ();
 
   // String commands
   resp::data exec_set ();
@@ -31,9 +256,26 @@ private:
   resp::data exec_decrby ();
   template <template <class> class Op>
   resp::data calc_impl (string_view cmd, bool with_rhs);
+  resp::data exec_mget ();
+  resp::data exec_mset ();
+  resp::data exec_msetnx ();
+  resp::data mset_impl (bool nx);
+  resp::data exec_getset ();
+  resp::data exec_getdel ();
+  resp::data exec_getex ();
+  resp::data exec_setnx ();
+  resp::data exec_setex ();
+  resp::data exec_psetex ();
+  template <class Duration> resp::data setex_impl (string_view cmd);
+  resp::data exec_strlen ();
+  resp::data exec_append ();
+  resp::data exec_getrange ();
+  resp::data exec_setrange ();
+  resp::data exec_throttle ();
 
   // Generic commands
   resp::data exec_del ();
+  resp::data exec_delex ();
   resp::data exec_expire ();
   resp::data exec_pexpire ();
   resp::data exec_expireat ();
@@ -59,10 +301,187 @@ private:
   resp::data exec_lpop ();
   resp::data exec_rpop ();
 
+  // Sorted set commands
+  resp::data exec_zadd ();
+  resp::data exec_zincrby ();
+  resp::data exec_zscore ();
+  resp::data exec_zcard ();
+  resp::data exec_zrank ();
+  resp::data exec_zrevrank ();
+  template <bool Rev>
+  resp::data zrank_impl (string_view cmd);
+  resp::data exec_zrange ();
+  resp::data exec_zrem ();
+  resp::data exec_zremrangebyscore ();
+  resp::data exec_zpopmin ();
+  resp::data exec_zpopmax ();
+  template <bool Max>
+  resp::data zpop_impl (string_view cmd);
+
+  // HyperLogLog commands
+  resp::data exec_pfadd ();
+  resp::data exec_pfcount ();
+  resp::data exec_pfmerge ();
+
+  // Bitmap commands
+  resp::data exec_setbit ();
+  resp::data exec_getbit ();
+  resp::data exec_bitcount ();
+  resp::data exec_bitpos ();
+  resp::data exec_bitop ();
+  resp::data exec_bitfield ();
+  resp::data exec_bitfield_ro ();
+  resp::data bitfield_impl (string_view cmd, bool read_only);
+
+  // Stream commands
+  resp::data exec_xadd ();
+  resp::data exec_xlen ();
+  resp::data exec_xrange ();
+  resp::data exec_xrevrange ();
+  template <bool Rev>
+  resp::data xrange_impl (string_view cmd);
+  resp::data exec_xtrim ();
+  resp::data exec_xdel ();
+  resp::data exec_xread ();
+
 private:
   config &config_;
   db::storage storage_;
   std::vector<std::string> args_;
+  // The connection of the current request, if any, and the keys of the
+  // request, in cluster mode.
+  client_state *client_;
+  std::vector<string_view> keys_;
+
+  // Persistence state
+  int bgsave_pid_;
+  bool last_bgsave_ok_;
+  db::time_point last_save_;
+  db::sliced_save sliced_save_;
+  // Successful writes since the last save, and their count when the
+  // running BGSAVE started.
+  std::uint64_t dirty_;
+  std::uint64_t dirty_at_bgsave_;
+  db::time_point last_bgsave_try_;
+  // The snapshot the running BGSAVE writes, and the replication offset it
+  // was taken at, unless the stream was not kept then.
+  std::string bgsave_path_;
+  optional<std::uint64_t> bgsave_offset_;
+  // The snapshot that SAVE INCREMENTAL extends, set by a full save or a
+  // load, and the length of the valid part of its delta file. Changed keys
+  // are only tracked while it is set.
+  optional<std::string> chain_path_;
+  std::uint64_t chain_size_;
+
+  // Append-only file state
+  int rewrite_pid_;
+  bool last_rewrite_ok_;
+  db::append_only_file aof_;
+  // The command logged for the current write request: a copy of it taken
+  // before it runs, which commands depending on the clock rewrite into an
+  // absolute form, or clear to log nothing.
+  std::vector<std::string> propagate_;
+  bool loading_;
+  bool aof_last_write_ok_;
+  steady_clock::time_point aof_last_fsync_;
+  bool rewrite_scheduled_;
+
+  // Replication state. The stream is only kept, and its offset only moves,
+  // once a replica has connected and created the backlog.
+  enum replica_state
+  {
+    // Waits for a BGSAVE to start.
+    replica_wait_save,
+    // Waits for the snapshot; the stream since it was taken is held.
+    replica_wait_snapshot,
+    // Receives the chunks of a snapshot streamed from memory, and holds
+    // the stream since it was taken.
+    replica_wait_chunks,
+    replica_online,
+  };
+
+  struct replica
+  {
+    replica_feed feed;
+    replica_stream stream;
+    replica_state state;
+    std::string held;
+    steady_clock::time_point since;
+  };
+
+  std::string replid_;
+  std::uint64_t repl_offset_;
+  std::unique_ptr<repl_backlog> backlog_;
+  std::map<std::uint64_t, replica> replicas_;
+  std::uint64_t next_replica_id_;
+  optional<sync_request> sync_request_;
+  db::streamed_snapshot diskless_;
+  std::uint64_t sync_full_;
+  std::uint64_t sync_partial_ok_;
+  std::uint64_t sync_partial_err_;
+  optional<primary_address> primary_;
+  std::uint64_t primary_gen_;
+  bool primary_link_up_;
+  bool from_primary_;
+
+  // Transaction state: whether EXEC is running the queued commands, and
+  // whether it has logged the MULTI that the writes among them follow.
+  // The commands of the append-only file and of the replication stream
+  // are run as the ones of stream_client_.
+  bool exec_running_;
+  bool multi_logged_;
+  client_state stream_client_;
+  // The transaction being executed, kept while a script among its
+  // commands is paused.
+  struct transaction
+  {
+    client_state *client;
+    std::vector<resp::data> queued;
+    std::vector<resp::data> replies;
+    std::size_t next;
+  };
+  optional<transaction> exec_;
+
+  // Scripting state: the scripts compiled, by SHA1, and whether one runs,
+  // whose writes are logged between MULTI and EXEC too.
+  unordered_flat_map<std::string, std::shared_ptr<const script::program>>
+      scripts_;
+  bool script_running_;
+  // The script paused past the busy threshold, if any; whether EXEC runs
+  // it, whether it has written, and whether SCRIPT KILL has stopped it.
+  // The stream from the primary, and the clients its writes wake, wait
+  // for it to end.
+  std::unique_ptr<script::execution> script_;
+  bool script_nested_;
+  bool script_paused_;
+  bool script_wrote_;
+  bool script_killed_;
+  std::deque<resp::data> postponed_stream_;
+  std::vector<std::function<void ()>> postponed_wakes_;
+
+  // Cluster state; null unless cluster mode is enabled.
+  std::unique_ptr<cluster_table> cluster_;
+  optional<migration> migration_;
+  // The keys of the migrations in progress.
+  unordered_flat_set<std::string> migrating_keys_;
+
+  // Pub/Sub state: the subscribers of every channel and pattern.
+  std::vector<resp::data> leading_replies_;
+  unordered_flat_map<std::string, unordered_flat_set<client_state *>>
+      channels_;
+  std::map<std::string, unordered_flat_set<client_state *>> patterns_;
+
+  struct waiter
+  {
+    std::vector<std::string> keys;
+    std::function<void ()> wake;
+  };
+
+  optional<block_request> block_request_;
+  std::uint64_t next_waiter_id_;
+  // Ordered by id, so that clients are woken up in the order they blocked.
+  std::map<std::uint64_t, waiter> waiters_;
+  unordered_flat_map<std::string, std::vector<std::uint64_t>> waiting_keys_;
 }; // class processor
 
 } // namespace mini_redis
@@ -0,0 +1,89 @@
+#include "repl_backlog.h"
+
+namespace mini_redis
+{
+
+namespace
+{
+
+void
+put_header (std::string &out, char prefix, std::size_t n)
+{
+  out.push_back (prefix);
+  out.append (std::to_string (n));
+  out.append ("\r\n");
+}
+
+} // namespace
+
+void
+encode_command (span<const std::string> argv, std::string &out)
+{
+  put_header (out, '*', argv.size ());
+  for (const auto &arg : argv)
+    {
+      put_header (out, '$', arg.size ());
+      out.append (arg);
+      out.append ("\r\n");
+    }
+}
+
+repl_backlog::repl_backlog (std::size_t capacity, std::uint64_t offset)
+    : ring_ (capacity, '\0'), head_{ 0 }, size_{ 0 }, end_{ offset }
+{
+  BOOST_ASSERT (capacity != 0);
+}
+
+void
+repl_backlog::append (string_view bytes)
+{
+  auto cap = ring_.size ();
+  end_ += bytes.size ();
+  // Only the last capacity bytes survive anyway.
+  if (bytes.size () > cap)
+    bytes.remove_prefix (bytes.size () - cap);
+
+  auto first = std::min (bytes.size (), cap - head_);
+  std::memcpy (&ring_[head_], bytes.data (), first);
+  std::memcpy (&ring_[0], bytes.data () + first, bytes.size () - first);
+  head_ = (head_ + bytes.size ()) % cap;
+  size_ = std::min (size_ + bytes.size (), cap);
+}
+
+std::size_t
+repl_backlog::capacity () const noexcept
+{
+  return ring_.size ();
+}
+
+std::uint64_t
+repl_backlog::first_offset () const noexcept
+{
+  return end_ - size_;
+}
+
+std::uint64_t
+repl_backlog::end_offset () const noexcept
+{
+  return end_;
+}
+
+bool
+repl_backlog::contains (std::uint64_t offset) const noexcept
+{
+  return offset >= first_offset () && offset <= end_;
+}
+
+void
+repl_backlog::copy_from (std::uint64_t offset, std::string &out) const
+{
+  BOOST_ASSERT (contains (offset));
+  auto cap = ring_.size ();
+  auto n = static_cast<std::size_t> (end_ - offset);
+  auto start = (head_ + cap - n) % cap;
+  auto first = std::min (n, cap - start);
+  out.append (ring_, start, first);
+  out.append (ring_, 0, n - first);
+}
+
+} // namespace mini_redis
@@ -0,0 +1,47 @@
+#ifndef REPL_BACKLOG_H
+#define REPL_BACKLOG_H
+
+#include "pch.h"
+
+namespace mini_redis
+{
+
+// The replication stream is made of the write commands executed on the
+// primary, each encoded as a RESP array of bulk strings; its offsets count
+// bytes. Appends the encoded form of argv to out.
+void encode_command (span<const std::string> argv, std::string &out);
+
+// The tail of the replication stream, kept in a ring buffer of fixed
+// capacity, so that a replica that lost its link for a short while can
+// resume from its offset instead of loading a new snapshot.
+class repl_backlog
+{
+public:
+  // The stream resumes at offset.
+  repl_backlog (std::size_t capacity, std::uint64_t offset);
+
+  repl_backlog (const repl_backlog &) = delete;
+  repl_backlog &operator= (const repl_backlog &) = delete;
+
+  void append (string_view bytes);
+
+  std::size_t capacity () const noexcept;
+  // The part of the stream held is [first_offset (), end_offset ()).
+  std::uint64_t first_offset () const noexcept;
+  std::uint64_t end_offset () const noexcept;
+  // Whether the stream from offset up to the end is held.
+  bool contains (std::uint64_t offset) const noexcept;
+  // Appends the stream from offset, which must be held, to out.
+  void copy_from (std::uint64_t offset, std::string &out) const;
+
+private:
+  std::string ring_;
+  // Where the next byte goes, and how many bytes are held before it.
+  std::size_t head_;
+  std::size_t size_;
+  std::uint64_t end_;
+}; // class repl_backlog
+
+} // namespace mini_redis
+
+#endif // REPL_BACKLOG_H
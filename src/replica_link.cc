@@ -0,0 +1,386 @@
+#include "replica_link.h"
+
+namespace mini_redis
+{
+
+namespace
+{
+
+const milliseconds retry_delay{ 500 };
+// No reply line from a primary is anywhere close.
+const std::size_t max_line_len = 1024;
+
+} // namespace
+
+replica_link::replica_link (asio::strand<asio::any_io_executor> strand,
+			    processor &pro, std::string host,
+			    std::uint16_t port, std::string temp_path)
+    : state_{ stopped }, processor_{ pro },
+      generation_{ pro.primary_generation () }, host_{ std::move (host) },
+      port_{ port }, temp_path_{ std::move (temp_path) },
+      resolver_{ strand }, socket_{ strand }, retry_timer_{ strand },
+      parser_{ resp::parser::config{} }, offset_{ 0 }, snapshot_left_{ 0 },
+      snapshot_{ nullptr }
+{
+}
+
+replica_link::~replica_link ()
+{
+  if (snapshot_ != nullptr)
+    {
+      std::fclose (snapshot_);
+      std::remove (temp_path_.c_str ());
+    }
+}
+
+void
+replica_link::start ()
+{
+  connect ();
+}
+
+void
+replica_link::stop ()
+{
+  state_ = stopped;
+  error_code ec;
+  resolver_.cancel ();
+  retry_timer_.cancel ();
+  auto r = socket_.close (ec);
+  (void) r;
+  if (snapshot_ != nullptr)
+    {
+      std::fclose (snapshot_);
+      std::remove (temp_path_.c_str ());
+      snapshot_ = nullptr;
+    }
+  incoming_.reset ();
+}
+
+void
+replica_link::connect ()
+{
+  state_ = connecting;
+  input_.clear ();
+  parser_ = resp::parser{ resp::parser::config{} };
+
+  auto self = shared_from_this ();
+  auto connect_cb = [self] (const error_code &ec, const tcp::endpoint &)
+    {
+      if (self->state_ == stopped)
+	return;
+      if (ec)
+	return self->fail ("cannot connect: " + ec.message ());
+
+      // The primary sends the part of the stream the processor is missing,
+      // or a snapshot when it cannot.
+      const std::string argv[]{
+	"PSYNC", self->processor_.replication_id (),
+	std::to_string (self->processor_.replication_offset ())
+      };
+      self->request_.clear ();
+      encode_command (argv, self->request_);
+      self->state_ = waiting_reply;
+
+      auto write_cb = [self] (const error_code &ec, std::size_t)
+	{
+	  if (self->state_ == stopped)
+	    return;
+	  if (ec)
+	    return self->fail ("cannot send PSYNC: " + ec.message ());
+	  self->start_recv ();
+	};
+      asio::async_write (self->socket_, asio::buffer (self->request_),
+			 write_cb);
+    };
+  auto resolve_cb = [self, connect_cb] (const error_code &ec,
+					tcp::resolver::results_type results)
+    {
+      if (self->state_ == stopped)
+	return;
+      if (ec)
+	return self->fail ("cannot resolve: " + ec.message ());
+      asio::async_connect (self->socket_, results, connect_cb);
+    };
+  resolver_.async_resolve (host_, std::to_string (port_), resolve_cb);
+}
+
+void
+replica_link::start_recv ()
+{
+  auto self = shared_from_this ();
+  auto receive_cb = [self] (const error_code &ec, std::size_t n)
+    {
+      if (self->state_ == stopped)
+	return;
+      if (ec)
+	return self->fail ("link lost: " + ec.message ());
+      if (self->consume ({ self->recv_buffer_.data (), n }))
+	self->start_recv ();
+    };
+  socket_.async_receive (asio::buffer (recv_buffer_), receive_cb);
+}
+
+bool
+replica_link::consume (string_view chunk)
+{
+  // The processor may have been pointed elsewhere meanwhile; the link is
+  // about to be replaced.
+  if (processor_.primary_generation () != generation_)
+    {
+      stop ();
+      return false;
+    }
+
+  if (state_ == streaming)
+    parser_.append (chunk);
+  else
+    input_.append (chunk.data (), chunk.size ());
+
+  bool more = true;
+  while (more)
+    switch (state_)
+      {
+      case waiting_reply:
+	more = read_reply ();
+	break;
+      case waiting_snapshot_header:
+	more = read_snapshot_header ();
+	break;
+      case receiving_snapshot:
+	more = read_snapshot ();
+	break;
+      case receiving_chunks:
+	more = read_chunk ();
+	break;
+      case streaming:
+	read_stream ();
+	more = false;
+	break;
+      default:
+	more = false;
+	break;
+      }
+  return state_ != connecting && state_ != stopped;
+}
+
+bool
+replica_link::read_reply ()
+{
+  auto eol = input_.find ("\r\n");
+  if (eol == std::string::npos)
+    {
+      if (input_.size () > max_line_len)
+	fail ("reply to PSYNC too long");
+      return false;
+    }
+
+  auto line = input_.substr (0, eol);
+  input_.erase (0, eol + 2);
+  std::vector<std::string> words;
+  boost::split (words, line, boost::is_any_of (" "));
+
+  if (words.size () == 3 && words[0] == "+FULLRESYNC"
+      && try_lexical_convert (words[2], offset_))
+    {
+      replid_ = std::move (words[1]);
+      state_ = waiting_snapshot_header;
+      return true;
+    }
+  if (words.size () == 2 && words[0] == "+CONTINUE")
+    {
+      std::printf ("Resumed replication from %s:%u at offset %llu\n",
+		   host_.c_str (), static_cast<unsigned> (port_),
+		   static_cast<unsigned long long> (
+		       processor_.replication_offset ()));
+      std::fflush (stdout);
+      begin_stream ();
+      return true;
+    }
+
+  fail ("unexpected reply to PSYNC: " + line);
+  return false;
+}
+
+bool
+replica_link::read_snapshot_header ()
+{
+  auto eol = input_.find ("\r\n");
+  if (eol == std::string::npos)
+    {
+      if (input_.size () > max_line_len)
+	fail ("snapshot header too long");
+      return false;
+    }
+
+  auto line = input_.substr (0, eol);
+  input_.erase (0, eol + 2);
+  if (line == "$CHUNKED")
+    {
+      incoming_ = make_unique<db::storage> ();
+      snapshot_left_ = 0;
+      state_ = receiving_chunks;
+      return true;
+    }
+  if (line.empty () || line[0] != '$'
+      || !try_lexical_convert (line.substr (1), snapshot_left_))
+    {
+      fail ("bad snapshot header: " + line);
+      return false;
+    }
+
+  snapshot_ = std::fopen (temp_path_.c_str (), "wb");
+  if (snapshot_ == nullptr)
+    {
+      fail (std::string{ "cannot open " } + temp_path_ + ": "
+	    + std::strerror (errno));
+      return false;
+    }
+  state_ = receiving_snapshot;
+  return true;
+}
+
+bool
+replica_link::read_snapshot ()
+{
+  auto n = static_cast<std::size_t> (
+      std::min<std::uint64_t> (snapshot_left_, input_.size ()));
+  if (n != 0 && std::fwrite (input_.data (), 1, n, snapshot_) != n)
+    {
+      fail ("cannot write the snapshot");
+      return false;
+    }
+  input_.erase (0, n);
+  snapshot_left_ -= n;
+  if (snapshot_left_ != 0)
+    return false;
+
+  auto closed = std::fclose (snapshot_);
+  snapshot_ = nullptr;
+  if (closed != 0)
+    {
+      std::remove (temp_path_.c_str ());
+      fail ("cannot write the snapshot");
+      return false;
+    }
+
+  auto ret = processor_.load_from_primary (temp_path_, replid_, offset_);
+  if (!ret.has_value ())
+    std::remove (temp_path_.c_str ());
+  return synchronized (std::move (ret));
+}
+
+bool
+replica_link::read_chunk ()
+{
+  // Every chunk is its length on a line, then its bytes; an empty one
+  // ends the snapshot.
+  if (snapshot_left_ == 0)
+    {
+      auto eol = input_.find ("\r\n");
+      if (eol == std::string::npos)
+	{
+	  if (input_.size () > max_line_len)
+	    fail ("chunk header too long");
+	  return false;
+	}
+
+      auto line = input_.substr (0, eol);
+      input_.erase (0, eol + 2);
+      if (!try_lexical_convert (line, snapshot_left_))
+	{
+	  fail ("bad chunk header: " + line);
+	  return false;
+	}
+      if (snapshot_left_ == 0)
+	{
+	  auto loaded = std::move (incoming_);
+	  processor_.load_from_primary (std::move (*loaded), replid_,
+					offset_);
+	  return synchronized ({});
+	}
+    }
+
+  if (input_.size () < snapshot_left_)
+    return false;
+  auto n = static_cast<std::size_t> (snapshot_left_);
+  auto ret = db::load_snapshot_chunk ({ input_.data (), n }, *incoming_);
+  if (!ret.has_value ())
+    {
+      fail ("cannot load the snapshot: " + ret.error ());
+      return false;
+    }
+  input_.erase (0, n);
+  snapshot_left_ = 0;
+  return true;
+}
+
+// Follows the load of a snapshot: the stream starts once it succeeded.
+bool
+replica_link::synchronized (result<void, std::string> loaded)
+{
+  if (!loaded.has_value ())
+    {
+      fail ("cannot load the snapshot: " + loaded.error ());
+      return false;
+    }
+
+  std::printf ("Synchronized with %s:%u at offset %llu\n", host_.c_str (),
+	       static_cast<unsigned> (port_),
+	       static_cast<unsigned long long> (offset_));
+  std::fflush (stdout);
+  begin_stream ();
+  return true;
+}
+
+void
+replica_link::begin_stream ()
+{
+  state_ = streaming;
+  processor_.primary_link_up (true);
+  parser_.append (input_);
+  input_ = std::string{};
+}
+
+void
+replica_link::read_stream ()
+{
+  parser_.parse ();
+  while (parser_.has_data ())
+    processor_.execute_from_primary (parser_.pop_data ());
+  if (parser_.has_error ())
+    fail ("bad replication stream: " + parser_.pop_error ());
+}
+
+void
+replica_link::fail (string_view what)
+{
+  if (state_ == stopped)
+    return;
+
+  std::fprintf (stderr, "Replication from %s:%u: %s\n", host_.c_str (),
+		static_cast<unsigned> (port_), what.to_string ().c_str ());
+  processor_.primary_link_up (false);
+  error_code ec;
+  auto r = socket_.close (ec);
+  (void) r;
+  if (snapshot_ != nullptr)
+    {
+      std::fclose (snapshot_);
+      std::remove (temp_path_.c_str ());
+      snapshot_ = nullptr;
+    }
+  incoming_.reset ();
+
+  state_ = connecting;
+  auto self = shared_from_this ();
+  auto retry_cb = [self] (const error_code &ec)
+    {
+      if (!ec && self->state_ != stopped)
+	self->connect ();
+    };
+  retry_timer_.expires_after (retry_delay);
+  retry_timer_.async_wait (retry_cb);
+}
+
+} // namespace mini_redis
@@ -0,0 +1,90 @@
+#ifndef REPLICA_LINK_H
+#define REPLICA_LINK_H
+
+#include "pch.h"
+
+#include "processor.h"
+#include "resp_parser.h"
+
+namespace mini_redis
+{
+
+// The link of a replica to its primary. It sends PSYNC with the
+// replication id and offset of the processor, then either receives a
+// snapshot into temp_path, which the processor loads, or resumes the
+// stream; the commands of the stream are executed as they arrive. A lost
+// link is set up again after a while.
+//
+// A snapshot streamed from the memory of the primary comes in chunks
+// instead, loaded one by one into a fresh storage, which replaces the
+// dataset once complete.
+//
+// The link runs on the strand of the processor, and feeds it directly.
+class replica_link : public std::enable_shared_from_this<replica_link>
+{
+public:
+  replica_link (asio::strand<asio::any_io_executor> strand, processor &pro,
+		std::string host, std::uint16_t port, std::string temp_path);
+  ~replica_link ();
+
+  replica_link (const replica_link &) = delete;
+  replica_link &operator= (const replica_link &) = delete;
+
+  void start ();
+  void stop ();
+
+private:
+  void connect ();
+  void start_recv ();
+  // Consumes what was received; false once the link is down.
+  bool consume (string_view chunk);
+  bool read_reply ();
+  bool read_snapshot_header ();
+  bool read_snapshot ();
+  bool read_chunk ();
+  bool synchronized (result<void, std::string> loaded);
+  void begin_stream ();
+  void read_stream ();
+  void fail (string_view what);
+
+private:
+  enum
+  {
+    connecting,
+    waiting_reply,
+    waiting_snapshot_header,
+    receiving_snapshot,
+    receiving_chunks,
+    streaming,
+    stopped,
+  };
+
+  int state_;
+  processor &processor_;
+  // The REPLICAOF the link was set up for.
+  std::uint64_t generation_;
+  std::string host_;
+  std::uint16_t port_;
+  std::string temp_path_;
+  tcp::resolver resolver_;
+  tcp::socket socket_;
+  asio::steady_timer retry_timer_;
+
+  std::array<char, 16 * 1024> recv_buffer_;
+  // Received bytes not consumed yet, before the stream starts.
+  std::string input_;
+  std::string request_;
+  resp::parser parser_;
+
+  // The sync in progress.
+  std::string replid_;
+  std::uint64_t offset_;
+  // Bytes left of the snapshot, or of the current chunk.
+  std::uint64_t snapshot_left_;
+  std::FILE *snapshot_;
+  std::unique_ptr<db::storage> incoming_;
+}; // class replica_link
+
+} // namespace mini_redis
+
+#endif // REPLICA_LINK_H
@@ -0,0 +1,4548 @@
+#include "script.h"
+
+#include <boost/smart_ptr/intrusive_ptr.hpp>
+
+namespace mini_redis
+{
+namespace script
+{
+
+namespace
+{
+
+using boost::variant2::get;
+using boost::variant2::get_if;
+
+std::uint32_t
+rotate_left (std::uint32_t v, int n)
+{
+  return (v << n) | (v >> (32 - n));
+}
+
+void
+sha1_block (std::uint32_t state[5], const unsigned char *p)
+{
+  std::uint32_t w[80];
+  for (int i = 0; i < 16; i++)
+    w[i] = (std::uint32_t{ p[i * 4] } << 24)
+	   | (std::uint32_t{ p[i * 4 + 1] } << 16)
+	   | (std::uint32_t{ p[i * 4 + 2] } << 8) | p[i * 4 + 3];
+  for (int i = 16; i < 80; i++)
+    w[i] = rotate_left (w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+  auto a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+  for (int i = 0; i < 80; i++)
+    {
+      std::uint32_t f, k;
+      if (i < 20)
+	{
+	  f = (b & c) | (~b & d);
+	  k = 0x5a827999;
+	}
+      else if (i < 40)
+	{
+	  f = b ^ c ^ d;
+	  k = 0x6ed9eba1;
+	}
+      else if (i < 60)
+	{
+	  f = (b & c) | (b & d) | (c & d);
+	  k = 0x8f1bbcdc;
+	}
+      else
+	{
+	  f = b ^ c ^ d;
+	  k = 0xca62c1d6;
+	}
+      auto t = rotate_left (a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rotate_left (b, 30);
+      b = a;
+      a = t;
+    }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+// Values. Tables are counted references, freed once unused; the ones
+// left at the end of a run, in cycles, are freed then.
+
+struct table;
+typedef boost::intrusive_ptr<table> table_ptr;
+
+struct nil_type
+{
+};
+
+// A function of the libraries, by its builtin_id.
+struct builtin
+{
+  int id;
+  // What the iterator of gmatch, or a builtin that goes on once the
+  // function it called returns, keeps, or null.
+  table_ptr state;
+};
+
+// A function of the script, by the index of its prototype. The locals of
+// the functions around it that it uses are boxes, tables of one value,
+// which upvalues holds in the order of the upvalues of the prototype.
+struct function_ref
+{
+  int proto;
+  table_ptr upvalues;
+};
+
+typedef variant<nil_type, bool, double, std::string, table_ptr, builtin,
+		function_ref>
+    value;
+
+enum value_kind
+{
+  k_nil,
+  k_boolean,
+  k_number,
+  k_string,
+  k_table,
+  k_builtin,
+  k_function,
+};
+
+const char *
+type_name (const value &v)
+{
+  static const char *const names[]
+      = { "nil", "boolean", "number", "string", "table", "function",
+	  "function" };
+  return names[v.index ()];
+}
+
+bool
+truthy (const value &v)
+{
+  auto b = get_if<bool> (&v);
+  return v.index () != k_nil && (b == nullptr || *b);
+}
+
+bool
+is_nil (const value &v)
+{
+  return v.index () == k_nil;
+}
+
+bool
+equal (const value &a, const value &b)
+{
+  if (a.index () != b.index ())
+    return false;
+  switch (a.index ())
+    {
+    case k_boolean:
+      return get<bool> (a) == get<bool> (b);
+    case k_number:
+      return get<double> (a) == get<double> (b);
+    case k_string:
+      return get<std::string> (a) == get<std::string> (b);
+    case k_table:
+      return get<table_ptr> (a) == get<table_ptr> (b);
+    case k_builtin:
+      return get<builtin> (a).id == get<builtin> (b).id
+	     && get<builtin> (a).state == get<builtin> (b).state;
+    case k_function:
+      return get<function_ref> (a).proto == get<function_ref> (b).proto
+	     && get<function_ref> (a).upvalues
+		    == get<function_ref> (b).upvalues;
+    default:
+      return true;
+    }
+}
+
+// Orders the keys of the hash part of tables.
+struct value_less
+{
+  bool
+  operator() (const value &a, const value &b) const
+  {
+    if (a.index () != b.index ())
+      return a.index () < b.index ();
+    switch (a.index ())
+      {
+      case k_boolean:
+	return get<bool> (a) < get<bool> (b);
+      case k_number:
+	return get<double> (a) < get<double> (b);
+      case k_string:
+	return get<std::string> (a) < get<std::string> (b);
+      case k_table:
+	return std::less<table *> () (get<table_ptr> (a).get (),
+				      get<table_ptr> (b).get ());
+      case k_builtin:
+	{
+	  const auto &x = get<builtin> (a);
+	  const auto &y = get<builtin> (b);
+	  if (x.id != y.id)
+	    return x.id < y.id;
+	  return std::less<table *> () (x.state.get (), y.state.get ());
+	}
+      case k_function:
+	{
+	  const auto &x = get<function_ref> (a);
+	  const auto &y = get<function_ref> (b);
+	  if (x.proto != y.proto)
+	    return x.proto < y.proto;
+	  return std::less<table *> () (x.upvalues.get (),
+					y.upvalues.get ());
+	}
+      default:
+	return false;
+      }
+  }
+};
+
+// The position of key in the array part of a table, from 1, or 0 when it
+// is not a positive integer.
+std::size_t
+array_index (const value &key)
+{
+  auto n = get_if<double> (&key);
+  if (n == nullptr || !(*n >= 1 && *n <= 9007199254740992.0)
+      || *n != std::floor (*n))
+    return 0;
+  return static_cast<std::size_t> (*n);
+}
+
+// The array part holds t[1] to t[n] as long as they follow each other, and
+// the hash part the other keys. The length of a table is the one of its
+// array part.
+struct table
+{
+  std::vector<value> array;
+  std::map<value, value, value_less> hash;
+
+  // The tables of a run are linked, and the unused ones go to its
+  // graveyard: the run frees them one at a time, rather than recursively.
+  std::size_t refs = 0;
+  table *prev = nullptr;
+  table *next = nullptr;
+  std::vector<table *> *graveyard = nullptr;
+
+  value
+  get (const value &key) const
+  {
+    auto i = array_index (key);
+    if (i != 0 && i <= array.size ())
+      return array[i - 1];
+    if (hash.empty ())
+      return {};
+    auto it = hash.find (key);
+    return it == hash.end () ? value{} : it->second;
+  }
+
+  // key is neither nil nor NaN.
+  void
+  set (value key, value v)
+  {
+    auto i = array_index (key);
+    if (i != 0 && i <= array.size ())
+      {
+	array[i - 1] = std::move (v);
+	while (!array.empty () && is_nil (array.back ()))
+	  array.pop_back ();
+	return;
+      }
+    if (i != 0 && i == array.size () + 1 && !is_nil (v))
+      {
+	array.push_back (std::move (v));
+	// The keys that follow move over from the hash part.
+	while (!hash.empty ())
+	  {
+	    auto it = hash.find (value{ double (array.size () + 1) });
+	    if (it == hash.end ())
+	      break;
+	    array.push_back (std::move (it->second));
+	    hash.erase (it);
+	  }
+	return;
+      }
+    if (is_nil (v))
+      hash.erase (key);
+    else
+      hash[std::move (key)] = std::move (v);
+  }
+};
+
+void
+intrusive_ptr_add_ref (table *t)
+{
+  t->refs++;
+}
+
+void
+intrusive_ptr_release (table *t)
+{
+  if (--t->refs != 0)
+    return;
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->graveyard->push_back (t);
+}
+
+std::string
+number_to_string (double n)
+{
+  // Integers, the common case, print the same without printf.
+  if (std::fabs (n) < 1e14 && n == std::floor (n)
+      && (n != 0 || !std::signbit (n)))
+    return std::to_string (static_cast<long long> (n));
+  char buf[32];
+  std::snprintf (buf, sizeof (buf), "%.14g", n);
+  return buf;
+}
+
+// Converts the way Lua does: surrounding spaces are allowed, and hex
+// numbers too.
+bool
+string_to_number (const std::string &s, double &out)
+{
+  auto begin = s.c_str ();
+  char *end;
+  out = std::strtod (begin, &end);
+  if (end == begin)
+    return false;
+  while (*end != '\0' && std::isspace (static_cast<unsigned char> (*end)))
+    end++;
+  return end == begin + s.size ();
+}
+
+bool
+to_number (const value &v, double &out)
+{
+  if (auto n = get_if<double> (&v))
+    {
+      out = *n;
+      return true;
+    }
+  auto s = get_if<std::string> (&v);
+  return s != nullptr && string_to_number (*s, out);
+}
+
+bool
+to_string (const value &v, std::string &out)
+{
+  if (auto s = get_if<std::string> (&v))
+    {
+      out = *s;
+      return true;
+    }
+  auto n = get_if<double> (&v);
+  if (n == nullptr)
+    return false;
+  out = number_to_string (*n);
+  return true;
+}
+
+std::int64_t
+to_integer (double n)
+{
+  if (n != n)
+    return 0;
+  if (n >= 9223372036854775807.0)
+    return std::numeric_limits<std::int64_t>::max ();
+  if (n <= -9223372036854775808.0)
+    return std::numeric_limits<std::int64_t>::min ();
+  return static_cast<std::int64_t> (n);
+}
+
+// Builtins, in the order of builtin_names.
+enum builtin_id
+{
+  // redis
+  f_call,
+  f_pcall,
+  f_error_reply,
+  f_status_reply,
+  f_sha1hex,
+  f_log,
+  // base
+  f_assert,
+  f_error,
+  f_ipairs,
+  f_next,
+  f_pairs,
+  f_base_pcall,
+  f_select,
+  f_tonumber,
+  f_tostring,
+  f_type,
+  f_unpack,
+  // string
+  f_byte,
+  f_char,
+  f_find,
+  f_format,
+  f_gmatch,
+  f_gsub,
+  f_len,
+  f_lower,
+  f_match,
+  f_rep,
+  f_reverse,
+  f_sub,
+  f_upper,
+  // table
+  f_concat,
+  f_getn,
+  f_insert,
+  f_remove,
+  f_table_unpack,
+  // math
+  f_abs,
+  f_ceil,
+  f_floor,
+  f_fmod,
+  f_max,
+  f_min,
+  f_pow,
+  f_sqrt,
+  // The iterators that ipairs and gmatch return, and the builtins that gsub
+  // and pcall go on with once the function they called returns.
+  f_ipairs_step,
+  f_gmatch_step,
+  f_gsub_step,
+  f_pcall_step,
+};
+
+const struct builtin_name
+{
+  // Empty for the base library.
+  const char *library;
+  const char *name;
+} builtin_names[] = {
+  { "redis", "call" },	  { "redis", "pcall" },	 { "redis", "error_reply" },
+  { "redis", "status_reply" }, { "redis", "sha1hex" }, { "redis", "log" },
+  { "", "assert" },	  { "", "error" },	 { "", "ipairs" },
+  { "", "next" },	  { "", "pairs" },	 { "", "pcall" },
+  { "", "select" },	  { "", "tonumber" },	 { "", "tostring" },
+  { "", "type" },	  { "", "unpack" },	 { "string", "byte" },
+  { "string", "char" },	  { "string", "find" },	 { "string", "format" },
+  { "string", "gmatch" }, { "string", "gsub" },	 { "string", "len" },
+  { "string", "lower" },  { "string", "match" }, { "string", "rep" },
+  { "string", "reverse" }, { "string", "sub" },	 { "string", "upper" },
+  { "table", "concat" },  { "table", "getn" },	 { "table", "insert" },
+  { "table", "remove" },  { "table", "unpack" }, { "math", "abs" },
+  { "math", "ceil" },	  { "math", "floor" },	 { "math", "fmod" },
+  { "math", "max" },	  { "math", "min" },	 { "math", "pow" },
+  { "math", "sqrt" },	  { "", "ipairs_step" }, { "", "gmatch_step" },
+  { "", "gsub_step" },	  { "", "pcall_step" },
+};
+
+const struct library_constant
+{
+  const char *library;
+  const char *name;
+  double value;
+} library_constants[] = {
+  { "redis", "LOG_DEBUG", 0 },
+  { "redis", "LOG_VERBOSE", 1 },
+  { "redis", "LOG_NOTICE", 2 },
+  { "redis", "LOG_WARNING", 3 },
+  { "math", "huge", std::numeric_limits<double>::infinity () },
+  { "math", "pi", 3.14159265358979323846 },
+};
+
+bool
+is_library (const std::string &name)
+{
+  return name == "redis" || name == "string" || name == "table"
+	 || name == "math";
+}
+
+int
+find_builtin (const std::string &library, const std::string &name)
+{
+  for (int i = 0; i < f_ipairs_step; i++)
+    if (library == builtin_names[i].library
+	&& name == builtin_names[i].name)
+      return i;
+  return -1;
+}
+
+// Bytecode. The locals of a function live in the slots of its frame, and
+// the operands above them; a and b of the instructions count from there.
+
+enum op_code : std::uint8_t
+{
+  op_nil,
+  op_true,
+  op_false,
+  op_const,	   // a: constant
+  op_local,	   // a: slot
+  op_set_local,	   // a: slot, b: 1 where the local is declared; pops
+		   // the value
+  op_get_box,	   // a: slot of a local in a box
+  op_set_box,	   // a: slot of a local in a box; pops the value
+  op_new_box,	   // a: slot; pops the value into a new box there
+  op_upvalue,	   // a: upvalue
+  op_set_upvalue,  // a: upvalue; pops the value
+  op_vararg,	   // b: values, -1 for all
+  op_global,	   // a: 0 for KEYS, 1 for ARGV
+  op_builtin,	   // a: builtin_id
+  op_closure,	   // a: prototype
+  op_new_table,
+  op_index,	   // t k -> t[k]
+  op_set_index,	   // a: operand of t, then k; pops the value
+  op_set_item,	   // t v -> t, with t[b] = v
+  op_set_field,	   // t k v -> t, with t[k] = v
+  op_append_items, // a: operand of t; t[b], t[b + 1]... = the values above
+  op_self,	   // a: builtin_id; s -> f s, for s:f()
+  op_add,
+  op_sub,
+  op_mul,
+  op_div,
+  op_mod,
+  op_pow,
+  op_concat,
+  op_eq,	   // a: 1 for ~=
+  op_lt,	   // a: 1 for >
+  op_le,	   // a: 1 for >=
+  op_not,
+  op_neg,
+  op_len,
+  op_jump,	   // a: target
+  op_jump_if_false, // a: target; pops the value
+  op_and,	   // a: target; jumps with the value if false, else pops it
+  op_or,	   // a: target; jumps with the value if true, else pops it
+  op_call,	   // a: operand of the function, which the arguments
+		   // follow up to the top; b: results, -1 for all
+  op_return,	   // a: first operand returned, up to the top
+  op_pop,	   // a: count
+  op_for_prep,	   // a: slot of index, limit and step
+  op_for_check,	   // a: slot of index, limit and step; b: exit; pushes
+		   // the index
+  op_for_loop,	   // a: slot of index, limit and step; b: check
+  op_tfor_check,   // a: slot of the control variable; b: exit; the first
+		   // value of the round is on top, popped on exit
+};
+
+struct instruction
+{
+  op_code op;
+  int a;
+  int b;
+};
+
+// Where a function takes an upvalue from when it is created: a local of
+// the function around it, by slot, or one of its upvalues.
+struct upvalue
+{
+  bool local;
+  int index;
+};
+
+struct prototype
+{
+  std::vector<instruction> code;
+  // The line of every instruction, for the errors.
+  std::vector<int> lines;
+  std::vector<value> constants;
+  std::vector<upvalue> upvalues;
+  int params = 0;
+  // The parameters that the functions within use, which the call puts in
+  // boxes.
+  std::vector<int> boxed_params;
+  bool vararg = false;
+  int slots = 0;
+};
+
+} // namespace
+
+struct program
+{
+  // The main chunk comes first.
+  std::vector<prototype> protos;
+};
+
+namespace
+{
+
+const int max_levels = 200;
+const int max_locals = 200;
+const std::size_t max_upvalues = 60;
+const std::size_t max_frames = 200;
+const std::size_t max_reply_depth = 100;
+const std::size_t max_string = 512 * 1024 * 1024;
+
+enum token_kind
+{
+  t_eof = 256,
+  t_name,
+  t_string,
+  t_number,
+  t_and,
+  t_break,
+  t_do,
+  t_else,
+  t_elseif,
+  t_end,
+  t_false,
+  t_for,
+  t_function,
+  t_if,
+  t_in,
+  t_local,
+  t_nil,
+  t_not,
+  t_or,
+  t_repeat,
+  t_return,
+  t_then,
+  t_true,
+  t_until,
+  t_while,
+  t_eq,
+  t_ne,
+  t_le,
+  t_ge,
+  t_concat,
+  t_dots,
+};
+
+const struct
+{
+  const char *word;
+  int token;
+} keywords[] = {
+  { "and", t_and },	  { "break", t_break },	  { "do", t_do },
+  { "else", t_else },	  { "elseif", t_elseif }, { "end", t_end },
+  { "false", t_false },	  { "for", t_for },	  { "function", t_function },
+  { "if", t_if },	  { "in", t_in },	  { "local", t_local },
+  { "nil", t_nil },	  { "not", t_not },	  { "or", t_or },
+  { "repeat", t_repeat }, { "return", t_return }, { "then", t_then },
+  { "true", t_true },	  { "until", t_until },	  { "while", t_while },
+};
+
+// What an expression compiled so far leaves: a value on the operand
+// stack, or something that still needs an instruction to become one, or
+// to be assigned to.
+struct expr
+{
+  enum kind_type
+  {
+    pushed,
+    // a: slot
+    local,
+    // t and k pushed, a: operand of t
+    indexed,
+    // a: operand of the function, or the first value of ..., b:
+    // instruction; one result by default
+    call,
+    // a: upvalue
+    upvalue,
+    // name: the library
+    library,
+    // name: an undefined global
+    unknown,
+  };
+
+  kind_type kind = pushed;
+  int a = 0;
+  int b = 0;
+  std::string name;
+};
+
+struct local_var
+{
+  std::string name;
+  int slot;
+  // Whether a function within uses it, which puts it in a box, and the
+  // instructions that use its slot, to change once it is.
+  bool boxed;
+  std::vector<int> uses;
+};
+
+struct function_state
+{
+  function_state *parent = nullptr;
+  int proto = 0;
+  std::vector<local_var> locals;
+  // The names of the upvalues of the prototype.
+  std::vector<std::string> upvalues;
+  int active_slots = 0;
+  int max_slots = 0;
+  // The operands on the stack at this point of the code.
+  int depth = 0;
+  // The jumps of the break statements of the innermost loop.
+  std::vector<int> *breaks = nullptr;
+};
+
+// A recursive descent compiler that emits the code as it parses, in the
+// way of the one of Lua. The first error stops the lexer, so that the
+// parse unwinds quickly once it has failed.
+class compiler
+{
+public:
+  explicit compiler (string_view src) : src_ (src) {}
+
+  result<std::shared_ptr<const program>, std::string> compile ();
+
+private:
+  // Lexer
+  void next ();
+  int peek ();
+  void skip_space ();
+  int long_bracket ();
+  void read_long (int level, std::string *out);
+  void read_name ();
+  void read_number ();
+  void read_string (char quote);
+  std::string near () const;
+  void error (const std::string &msg);
+  void error_expected (const char *what);
+  bool test_next (int token);
+  void check (int token, const char *what);
+  std::string check_name ();
+
+  // Code
+  prototype &proto ();
+  int pc ();
+  int emit (op_code op, int a = 0, int b = 0);
+  void patch (int jump);
+  int add_constant (value v);
+  void add_local (std::string name);
+  local_var *find_local (function_state *fs, int slot);
+  void emit_local (op_code op, int slot, bool declare = false);
+  void box_local (function_state *fs, local_var &var);
+  void enter_level ();
+  void leave_level ();
+
+  // Statements
+  void statements ();
+  void block ();
+  bool block_follow () const;
+  void statement ();
+  void if_stat ();
+  void while_stat ();
+  void repeat_stat ();
+  void for_stat ();
+  void numeric_for (std::string name);
+  void generic_for (std::string name);
+  void loop_body (std::vector<int> &breaks);
+  void local_stat ();
+  void local_function ();
+  int function_body ();
+  void return_stat ();
+  void break_stat ();
+  void expr_stat ();
+  void assignment (expr &first);
+
+  // Expressions
+  int explist (expr &last);
+  void adjust (int count, expr &last, int want);
+  void expression (expr &e);
+  void subexpr (expr &e, int limit);
+  void simple_exp (expr &e);
+  void primary_exp (expr &e);
+  void suffixed_exp (expr &e);
+  void call_args (expr &e, int func);
+  void table_constructor (expr &e);
+  void single_var (const std::string &name, expr &e);
+  bool find_var (function_state *fs, const std::string &name, expr &e);
+  void discharge (expr &e);
+  void set_returns (expr &e, int n);
+
+  string_view src_;
+  std::size_t pos_ = 0;
+  int line_ = 1;
+  int tok_ = t_eof;
+  std::size_t tok_start_ = 0;
+  int tok_line_ = 1;
+  int last_line_ = 1;
+  std::string text_;
+  double number_ = 0;
+  std::string error_;
+  int levels_ = 0;
+
+  std::vector<prototype> protos_;
+  function_state *fs_ = nullptr;
+};
+
+result<std::shared_ptr<const program>, std::string>
+compiler::compile ()
+{
+  function_state fs;
+  fs_ = &fs;
+  protos_.emplace_back ();
+  protos_[0].vararg = true;
+  next ();
+  statements ();
+  if (tok_ != t_eof)
+    error_expected ("<eof>");
+  emit (op_return, 0);
+  protos_[0].slots = fs.max_slots;
+  if (!error_.empty ())
+    return error_;
+
+  auto prog = std::make_shared<program> ();
+  prog->protos = std::move (protos_);
+  return std::shared_ptr<const program>{ std::move (prog) };
+}
+
+// Lexer
+
+void
+compiler::next ()
+{
+  last_line_ = tok_line_;
+  if (!error_.empty ())
+    {
+      tok_ = t_eof;
+      return;
+    }
+  skip_space ();
+  tok_start_ = pos_;
+  tok_line_ = line_;
+  if (pos_ >= src_.size ())
+    {
+      tok_ = t_eof;
+      return;
+    }
+
+  auto c = src_[pos_];
+  auto next_char = pos_ + 1 < src_.size () ? src_[pos_ + 1] : '\0';
+  if (std::isalpha (static_cast<unsigned char> (c)) || c == '_')
+    return read_name ();
+  if (std::isdigit (static_cast<unsigned char> (c))
+      || (c == '.' && std::isdigit (static_cast<unsigned char> (next_char))))
+    return read_number ();
+
+  switch (c)
+    {
+    case '"':
+    case '\'':
+      return read_string (c);
+    case '[':
+      {
+	auto level = long_bracket ();
+	if (level < 0)
+	  break;
+	std::string s;
+	read_long (level, &s);
+	text_ = std::move (s);
+	tok_ = t_string;
+	return;
+      }
+    case '=':
+    case '<':
+    case '>':
+    case '~':
+      if (next_char == '=')
+	{
+	  pos_ += 2;
+	  tok_ = c == '=' ? t_eq : c == '<' ? t_le : c == '>' ? t_ge : t_ne;
+	  return;
+	}
+      if (c == '~')
+	return error ("unexpected symbol near '~'");
+      break;
+    case '.':
+      if (next_char == '.')
+	{
+	  auto dots = pos_ + 2 < src_.size () && src_[pos_ + 2] == '.';
+	  pos_ += dots ? 3 : 2;
+	  tok_ = dots ? t_dots : t_concat;
+	  return;
+	}
+      break;
+    }
+  if (c == '\0' || std::strchr ("+-*/%^#<>=(){}[];:,.", c) == nullptr)
+    return error ("unexpected symbol near '" + std::string (1, c) + "'");
+  pos_++;
+  tok_ = static_cast<unsigned char> (c);
+}
+
+// The next token, which stays to be read.
+int
+compiler::peek ()
+{
+  auto pos = pos_;
+  auto line = line_;
+  auto tok = tok_;
+  auto tok_start = tok_start_;
+  auto tok_line = tok_line_;
+  auto last_line = last_line_;
+  auto text = text_;
+  auto number = number_;
+  next ();
+  auto ahead = tok_;
+  pos_ = pos;
+  line_ = line;
+  tok_ = tok;
+  tok_start_ = tok_start;
+  tok_line_ = tok_line;
+  last_line_ = last_line;
+  text_ = std::move (text);
+  number_ = number;
+  return ahead;
+}
+
+void
+compiler::skip_space ()
+{
+  while (pos_ < src_.size ())
+    {
+      auto c = src_[pos_];
+      if (c == '\n')
+	{
+	  line_++;
+	  pos_++;
+	}
+      else if (std::isspace (static_cast<unsigned char> (c)))
+	pos_++;
+      else if (c == '-' && pos_ + 1 < src_.size () && src_[pos_ + 1] == '-')
+	{
+	  pos_ += 2;
+	  if (pos_ < src_.size () && src_[pos_] == '[')
+	    {
+	      auto level = long_bracket ();
+	      if (level >= 0)
+		{
+		  read_long (level, nullptr);
+		  continue;
+		}
+	    }
+	  while (pos_ < src_.size () && src_[pos_] != '\n')
+	    pos_++;
+	}
+      else
+	break;
+    }
+}
+
+// The level of the long bracket [[, [=[, ... at pos_, or -1.
+int
+compiler::long_bracket ()
+{
+  auto p = pos_ + 1;
+  while (p < src_.size () && src_[p] == '=')
+    p++;
+  if (p < src_.size () && src_[p] == '[')
+    return static_cast<int> (p - pos_ - 1);
+  return -1;
+}
+
+void
+compiler::read_long (int level, std::string *out)
+{
+  pos_ += static_cast<std::size_t> (level) + 2;
+  // A newline right after the bracket is skipped.
+  if (pos_ < src_.size () && src_[pos_] == '\r')
+    pos_++;
+  if (pos_ < src_.size () && src_[pos_] == '\n')
+    {
+      line_++;
+      pos_++;
+    }
+  while (pos_ < src_.size ())
+    {
+      auto c = src_[pos_];
+      if (c == ']')
+	{
+	  auto p = pos_ + 1;
+	  while (p < src_.size () && src_[p] == '=')
+	    p++;
+	  if (p < src_.size () && src_[p] == ']'
+	      && static_cast<int> (p - pos_ - 1) == level)
+	    {
+	      pos_ = p + 1;
+	      return;
+	    }
+	}
+      if (c == '\n')
+	line_++;
+      if (out != nullptr)
+	out->push_back (c);
+      pos_++;
+    }
+  error (out != nullptr ? "unfinished long string near '<eof>'"
+			: "unfinished long comment near '<eof>'");
+}
+
+void
+compiler::read_name ()
+{
+  auto start = pos_;
+  while (pos_ < src_.size ()
+	 && (std::isalnum (static_cast<unsigned char> (src_[pos_]))
+	     || src_[pos_] == '_'))
+    pos_++;
+  text_.assign (src_.data () + start, pos_ - start);
+  for (const auto &k : keywords)
+    if (text_ == k.word)
+      {
+	tok_ = k.token;
+	return;
+      }
+  tok_ = t_name;
+}
+
+void
+compiler::read_number ()
+{
+  auto start = pos_;
+  while (pos_ < src_.size ())
+    {
+      auto c = src_[pos_];
+      auto prev = pos_ > start ? src_[pos_ - 1] : '\0';
+      if (std::isalnum (static_cast<unsigned char> (c)) || c == '.'
+	  || ((c == '+' || c == '-') && (prev == 'e' || prev == 'E')))
+	pos_++;
+      else
+	break;
+    }
+  std::string s (src_.data () + start, pos_ - start);
+  if (!string_to_number (s, number_))
+    return error ("malformed number near '" + s + "'");
+  tok_ = t_number;
+}
+
+void
+compiler::read_string (char quote)
+{
+  std::string s;
+  pos_++;
+  while (true)
+    {
+      if (pos_ >= src_.size ())
+	return error ("unfinished string near '<eof>'");
+      auto c = src_[pos_++];
+      if (c == quote)
+	break;
+      if (c == '\n')
+	return error ("unfinished string near '" + std::string (1, quote)
+		      + s + "'");
+      if (c != '\\')
+	{
+	  s.push_back (c);
+	  continue;
+	}
+      if (pos_ >= src_.size ())
+	return error ("unfinished string near '<eof>'");
+      c = src_[pos_++];
+      switch (c)
+	{
+	case 'a':
+	  s.push_back ('\a');
+	  break;
+	case 'b':
+	  s.push_back ('\b');
+	  break;
+	case 'f':
+	  s.push_back ('\f');
+	  break;
+	case 'n':
+	  s.push_back ('\n');
+	  break;
+	case 'r':
+	  s.push_back ('\r');
+	  break;
+	case 't':
+	  s.push_back ('\t');
+	  break;
+	case 'v':
+	  s.push_back ('\v');
+	  break;
+	case '\n':
+	  line_++;
+	  s.push_back ('\n');
+	  break;
+	case '\\':
+	case '"':
+	case '\'':
+	  s.push_back (c);
+	  break;
+	case 'x':
+	  {
+	    int v = 0;
+	    for (int i = 0; i < 2; i++)
+	      {
+		auto h = pos_ < src_.size () ? src_[pos_] : '\0';
+		if (!std::isxdigit (static_cast<unsigned char> (h)))
+		  return error ("hexadecimal digit expected");
+		v = v * 16
+		    + (std::isdigit (static_cast<unsigned char> (h))
+			   ? h - '0'
+			   : std::tolower (static_cast<unsigned char> (h))
+				 - 'a' + 10);
+		pos_++;
+	      }
+	    s.push_back (static_cast<char> (v));
+	    break;
+	  }
+	default:
+	  {
+	    if (!std::isdigit (static_cast<unsigned char> (c)))
+	      return error ("invalid escape sequence near '\\"
+			    + std::string (1, c) + "'");
+	    int v = c - '0';
+	    for (int i = 0; i < 2 && pos_ < src_.size ()
+			    && std::isdigit (
+				static_cast<unsigned char> (src_[pos_]));
+		 i++)
+	      v = v * 10 + (src_[pos_++] - '0');
+	    if (v > 255)
+	      return error ("escape sequence too large");
+	    s.push_back (static_cast<char> (v));
+	  }
+	}
+    }
+  text_ = std::move (s);
+  tok_ = t_string;
+}
+
+std::string
+compiler::near () const
+{
+  if (tok_ == t_eof)
+    return "<eof>";
+  return std::string (src_.data () + tok_start_, pos_ - tok_start_);
+}
+
+void
+compiler::error (const std::string &msg)
+{
+  if (error_.empty ())
+    error_ = "user_script:" + std::to_string (tok_line_) + ": " + msg;
+  tok_ = t_eof;
+}
+
+void
+compiler::error_expected (const char *what)
+{
+  error (std::string{ "'" } + what + "' expected near '" + near () + "'");
+}
+
+bool
+compiler::test_next (int token)
+{
+  if (tok_ != token)
+    return false;
+  next ();
+  return true;
+}
+
+void
+compiler::check (int token, const char *what)
+{
+  if (!test_next (token))
+    error_expected (what);
+}
+
+std::string
+compiler::check_name ()
+{
+  if (tok_ != t_name)
+    {
+      error_expected ("<name>");
+      return {};
+    }
+  auto name = std::move (text_);
+  next ();
+  return name;
+}
+
+// Code
+
+prototype &
+compiler::proto ()
+{
+  return protos_[static_cast<std::size_t> (fs_->proto)];
+}
+
+int
+compiler::pc ()
+{
+  return static_cast<int> (proto ().code.size ());
+}
+
+int
+compiler::emit (op_code op, int a, int b)
+{
+  auto &p = proto ();
+  p.code.push_back ({ op, a, b });
+  p.lines.push_back (last_line_);
+  switch (op)
+    {
+    case op_nil:
+    case op_true:
+    case op_false:
+    case op_const:
+    case op_local:
+    case op_get_box:
+    case op_upvalue:
+    case op_global:
+    case op_builtin:
+    case op_closure:
+    case op_new_table:
+    case op_self:
+    case op_for_check:
+      fs_->depth++;
+      break;
+    case op_set_local:
+    case op_set_box:
+    case op_new_box:
+    case op_set_upvalue:
+    case op_index:
+    case op_set_index:
+    case op_set_item:
+    case op_add:
+    case op_sub:
+    case op_mul:
+    case op_div:
+    case op_mod:
+    case op_pow:
+    case op_concat:
+    case op_eq:
+    case op_lt:
+    case op_le:
+    case op_jump_if_false:
+    case op_and:
+    case op_or:
+      fs_->depth--;
+      break;
+    case op_set_field:
+      fs_->depth -= 2;
+      break;
+    case op_pop:
+      fs_->depth -= a;
+      break;
+    default:
+      // The calls, returns and ... set the depth themselves.
+      break;
+    }
+  return static_cast<int> (p.code.size ()) - 1;
+}
+
+// Points a jump at the next instruction.
+void
+compiler::patch (int jump)
+{
+  proto ().code[static_cast<std::size_t> (jump)].a = pc ();
+}
+
+int
+compiler::add_constant (value v)
+{
+  auto &constants = proto ().constants;
+  constants.push_back (std::move (v));
+  return static_cast<int> (constants.size ()) - 1;
+}
+
+void
+compiler::add_local (std::string name)
+{
+  if (fs_->active_slots >= max_locals)
+    return error ("too many local variables");
+  auto slot = fs_->active_slots++;
+  fs_->max_slots = std::max (fs_->max_slots, fs_->active_slots);
+  fs_->locals.push_back ({ std::move (name), slot, false, {} });
+}
+
+// The local of fs declared last in slot.
+local_var *
+compiler::find_local (function_state *fs, int slot)
+{
+  for (auto it = fs->locals.rbegin (); it != fs->locals.rend (); it++)
+    if (it->slot == slot)
+      return &*it;
+  return nullptr;
+}
+
+namespace
+{
+
+void
+use_box (instruction &in)
+{
+  in.op = in.op == op_local ? op_get_box
+	  : in.b != 0	    ? op_new_box
+			    : op_set_box;
+}
+
+} // namespace
+
+// Loads or stores a named local, through its box once it has one.
+void
+compiler::emit_local (op_code op, int slot, bool declare)
+{
+  auto pc = emit (op, slot, declare ? 1 : 0);
+  auto var = find_local (fs_, slot);
+  if (var == nullptr)
+    return;
+  var->uses.push_back (pc);
+  if (var->boxed)
+    use_box (proto ().code[static_cast<std::size_t> (pc)]);
+}
+
+// Puts a local in a box, so that the functions within share it with the
+// one of fs: the code that used its slot so far goes through the box.
+void
+compiler::box_local (function_state *fs, local_var &var)
+{
+  if (var.boxed)
+    return;
+  var.boxed = true;
+  auto &p = protos_[static_cast<std::size_t> (fs->proto)];
+  for (auto pc : var.uses)
+    use_box (p.code[static_cast<std::size_t> (pc)]);
+  if (var.slot < p.params)
+    p.boxed_params.push_back (var.slot);
+}
+
+void
+compiler::enter_level ()
+{
+  if (++levels_ > max_levels)
+    error ("chunk has too many syntax levels");
+}
+
+void
+compiler::leave_level ()
+{
+  levels_--;
+}
+
+// Statements
+
+void
+compiler::statements ()
+{
+  while (!block_follow ())
+    {
+      if (tok_ == t_return)
+	{
+	  statement ();
+	  if (!block_follow ())
+	    error_expected ("end");
+	  return;
+	}
+      statement ();
+    }
+}
+
+void
+compiler::block ()
+{
+  auto locals = fs_->locals.size ();
+  auto slots = fs_->active_slots;
+  statements ();
+  fs_->locals.resize (locals);
+  fs_->active_slots = slots;
+}
+
+bool
+compiler::block_follow () const
+{
+  return tok_ == t_else || tok_ == t_elseif || tok_ == t_end
+	 || tok_ == t_until || tok_ == t_eof;
+}
+
+void
+compiler::statement ()
+{
+  enter_level ();
+  switch (tok_)
+    {
+    case ';':
+      next ();
+      break;
+    case t_if:
+      if_stat ();
+      break;
+    case t_while:
+      while_stat ();
+      break;
+    case t_do:
+      next ();
+      block ();
+      check (t_end, "end");
+      break;
+    case t_for:
+      for_stat ();
+      break;
+    case t_repeat:
+      repeat_stat ();
+      break;
+    case t_function:
+      error ("Script attempted to create a global function; use local "
+	     "function");
+      break;
+    case t_local:
+      next ();
+      if (test_next (t_function))
+	local_function ();
+      else
+	local_stat ();
+      break;
+    case t_return:
+      return_stat ();
+      break;
+    case t_break:
+      break_stat ();
+      break;
+    default:
+      expr_stat ();
+    }
+  leave_level ();
+}
+
+void
+compiler::if_stat ()
+{
+  std::vector<int> exits;
+  do
+    {
+      next ();
+      expr cond;
+      expression (cond);
+      discharge (cond);
+      auto skip = emit (op_jump_if_false);
+      check (t_then, "then");
+      block ();
+      if (tok_ == t_else || tok_ == t_elseif)
+	exits.push_back (emit (op_jump));
+      patch (skip);
+    }
+  while (tok_ == t_elseif);
+  if (test_next (t_else))
+    block ();
+  check (t_end, "end");
+  for (auto jump : exits)
+    patch (jump);
+}
+
+void
+compiler::while_stat ()
+{
+  next ();
+  auto start = pc ();
+  expr cond;
+  expression (cond);
+  discharge (cond);
+  auto exit = emit (op_jump_if_false);
+  check (t_do, "do");
+  std::vector<int> breaks;
+  loop_body (breaks);
+  emit (op_jump, start);
+  check (t_end, "end");
+  patch (exit);
+  for (auto jump : breaks)
+    patch (jump);
+}
+
+void
+compiler::repeat_stat ()
+{
+  next ();
+  auto start = pc ();
+  std::vector<int> breaks;
+  auto saved = fs_->breaks;
+  fs_->breaks = &breaks;
+  // The condition sees the locals of the body.
+  auto locals = fs_->locals.size ();
+  auto slots = fs_->active_slots;
+  statements ();
+  fs_->breaks = saved;
+  check (t_until, "until");
+  expr cond;
+  expression (cond);
+  discharge (cond);
+  emit (op_jump_if_false, start);
+  fs_->locals.resize (locals);
+  fs_->active_slots = slots;
+  for (auto jump : breaks)
+    patch (jump);
+}
+
+void
+compiler::loop_body (std::vector<int> &breaks)
+{
+  auto saved = fs_->breaks;
+  fs_->breaks = &breaks;
+  block ();
+  fs_->breaks = saved;
+}
+
+void
+compiler::for_stat ()
+{
+  next ();
+  auto name = check_name ();
+  if (tok_ == '=')
+    numeric_for (std::move (name));
+  else if (tok_ == ',' || tok_ == t_in)
+    generic_for (std::move (name));
+  else
+    error_expected ("=' or 'in");
+}
+
+void
+compiler::numeric_for (std::string name)
+{
+  next ();
+  auto locals = fs_->locals.size ();
+  auto slots = fs_->active_slots;
+  auto base = fs_->active_slots;
+  for (auto hidden : { "(for index)", "(for limit)", "(for step)" })
+    add_local (hidden);
+
+  expr e;
+  expression (e);
+  discharge (e);
+  check (',', ",");
+  expression (e);
+  discharge (e);
+  if (test_next (','))
+    {
+      expression (e);
+      discharge (e);
+    }
+  else
+    emit (op_const, add_constant (value{ 1.0 }));
+  for (int i = 2; i >= 0; i--)
+    emit (op_set_local, base + i);
+  emit (op_for_prep, base);
+  check (t_do, "do");
+
+  auto loop = emit (op_for_check, base);
+  add_local (std::move (name));
+  emit_local (op_set_local, base + 3, true);
+  std::vector<int> breaks;
+  loop_body (breaks);
+  emit (op_for_loop, base, loop);
+  proto ().code[static_cast<std::size_t> (loop)].b = pc ();
+  for (auto jump : breaks)
+    patch (jump);
+  check (t_end, "end");
+  fs_->locals.resize (locals);
+  fs_->active_slots = slots;
+}
+
+void
+compiler::generic_for (std::string name)
+{
+  std::vector<std::string> names{ std::move (name) };
+  while (test_next (','))
+    names.push_back (check_name ());
+  check (t_in, "in");
+
+  auto locals = fs_->locals.size ();
+  auto slots = fs_->active_slots;
+  auto base = fs_->active_slots;
+  for (auto hidden : { "(for generator)", "(for state)", "(for control)" })
+    add_local (hidden);
+
+  expr last;
+  auto count = explist (last);
+  adjust (count, last, 3);
+  for (int i = 2; i >= 0; i--)
+    emit (op_set_local, base + i);
+  for (auto &n : names)
+    add_local (std::move (n));
+  check (t_do, "do");
+
+  // Every round calls the generator with the state and the control
+  // variable, which takes the first value it returns, until that is nil.
+  // The variables are new in every round, for the functions that keep
+  // them.
+  auto loop = pc ();
+  auto func = fs_->depth;
+  for (int i = 0; i < 3; i++)
+    emit (op_local, base + i);
+  auto vars = static_cast<int> (names.size ());
+  emit (op_call, func, vars);
+  fs_->depth = func + vars;
+  for (int i = vars - 1; i > 0; i--)
+    emit_local (op_set_local, base + 3 + i, true);
+  auto exit = emit (op_tfor_check, base + 2);
+  emit_local (op_set_local, base + 3, true);
+  std::vector<int> breaks;
+  loop_body (breaks);
+  emit (op_jump, loop);
+  proto ().code[static_cast<std::size_t> (exit)].b = pc ();
+  for (auto jump : breaks)
+    patch (jump);
+  check (t_end, "end");
+  fs_->locals.resize (locals);
+  fs_->active_slots = slots;
+}
+
+void
+compiler::local_stat ()
+{
+  std::vector<std::string> names;
+  do
+    names.push_back (check_name ());
+  while (test_next (','));
+
+  auto want = static_cast<int> (names.size ());
+  if (test_next ('='))
+    {
+      expr last;
+      auto count = explist (last);
+      adjust (count, last, want);
+    }
+  else
+    for (int i = 0; i < want; i++)
+      emit (op_nil);
+
+  // The names only take effect after the statement.
+  auto base = fs_->active_slots;
+  for (auto &name : names)
+    add_local (std::move (name));
+  for (int i = want - 1; i >= 0; i--)
+    emit_local (op_set_local, base + i, true);
+}
+
+// The local is declared before the body, which may call itself through
+// it, as local f; f = function ... end does.
+void
+compiler::local_function ()
+{
+  auto slot = fs_->active_slots;
+  add_local (check_name ());
+  emit (op_nil);
+  emit_local (op_set_local, slot, true);
+  emit (op_closure, function_body ());
+  emit_local (op_set_local, slot);
+}
+
+int
+compiler::function_body ()
+{
+  auto index = static_cast<int> (protos_.size ());
+  protos_.emplace_back ();
+  function_state fs;
+  fs.parent = fs_;
+  fs.proto = index;
+  fs_ = &fs;
+
+  check ('(', "(");
+  if (tok_ != ')')
+    do
+      {
+	if (test_next (t_dots))
+	  {
+	    proto ().vararg = true;
+	    break;
+	  }
+	add_local (check_name ());
+      }
+    while (test_next (','));
+  check (')', ")");
+  proto ().params = fs.active_slots;
+  statements ();
+  check (t_end, "end");
+  emit (op_return, 0);
+  proto ().slots = fs.max_slots;
+  fs_ = fs.parent;
+  return index;
+}
+
+void
+compiler::return_stat ()
+{
+  next ();
+  auto first = fs_->depth;
+  if (!block_follow () && tok_ != ';')
+    {
+      expr last;
+      explist (last);
+      if (last.kind == expr::call)
+	set_returns (last, -1);
+      else
+	discharge (last);
+    }
+  emit (op_return, first);
+  fs_->depth = first;
+  test_next (';');
+}
+
+void
+compiler::break_stat ()
+{
+  next ();
+  if (fs_->breaks == nullptr)
+    return error ("no loop to break");
+  fs_->breaks->push_back (emit (op_jump));
+}
+
+void
+compiler::expr_stat ()
+{
+  expr e;
+  suffixed_exp (e);
+  if (tok_ == '=' || tok_ == ',')
+    return assignment (e);
+  if (e.kind != expr::call)
+    return error ("syntax error near '" + near () + "'");
+  set_returns (e, 0);
+}
+
+// The values are all evaluated before any is assigned, and the tables
+// and keys of the indexed targets before the values.
+void
+compiler::assignment (expr &first)
+{
+  std::vector<expr> targets;
+  targets.push_back (std::move (first));
+  while (true)
+    {
+      auto &target = targets.back ();
+      switch (target.kind)
+	{
+	case expr::local:
+	case expr::upvalue:
+	case expr::indexed:
+	  break;
+	case expr::unknown:
+	  return error ("Script attempted to create global variable '"
+			+ target.name + "'");
+	case expr::library:
+	  return error ("Attempt to modify a readonly table");
+	default:
+	  return error ("syntax error near '" + near () + "'");
+	}
+      if (!test_next (','))
+	break;
+      expr next_target;
+      suffixed_exp (next_target);
+      targets.push_back (std::move (next_target));
+    }
+  check ('=', "=");
+
+  expr last;
+  auto count = explist (last);
+  adjust (count, last, static_cast<int> (targets.size ()));
+  int indexed = 0;
+  for (auto it = targets.rbegin (); it != targets.rend (); it++)
+    if (it->kind == expr::local)
+      emit_local (op_set_local, it->a);
+    else if (it->kind == expr::upvalue)
+      emit (op_set_upvalue, it->a);
+    else
+      {
+	emit (op_set_index, it->a);
+	indexed++;
+      }
+  if (indexed != 0)
+    emit (op_pop, indexed * 2);
+}
+
+// Expressions
+
+// Pushes all the expressions but the last one, which is left as it is;
+// returns their count.
+int
+compiler::explist (expr &last)
+{
+  int count = 1;
+  expression (last);
+  while (test_next (','))
+    {
+      discharge (last);
+      last = expr{};
+      expression (last);
+      count++;
+    }
+  return count;
+}
+
+// Leaves exactly want values from count expressions, the last one being
+// still to push: a call in last place fills in the missing values.
+void
+compiler::adjust (int count, expr &last, int want)
+{
+  auto missing = want - count;
+  if (last.kind == expr::call)
+    {
+      set_returns (last, std::max (missing + 1, 0));
+      missing = 0;
+    }
+  else
+    discharge (last);
+  for (; missing > 0; missing--)
+    emit (op_nil);
+  if (missing < 0)
+    emit (op_pop, -missing);
+}
+
+void
+compiler::expression (expr &e)
+{
+  subexpr (e, 0);
+}
+
+// Precedence climbing, with the priorities of Lua: the left one of a
+// binary operator binds it to what precedes, the right one to what
+// follows.
+void
+compiler::subexpr (expr &e, int limit)
+{
+  struct binary
+  {
+    int token;
+    op_code op;
+    int a;
+    int left;
+    int right;
+  };
+  static const binary binaries[] = {
+    { t_or, op_or, 0, 1, 1 },	  { t_and, op_and, 0, 2, 2 },
+    { '<', op_lt, 0, 3, 3 },	  { '>', op_lt, 1, 3, 3 },
+    { t_le, op_le, 0, 3, 3 },	  { t_ge, op_le, 1, 3, 3 },
+    { t_eq, op_eq, 0, 3, 3 },	  { t_ne, op_eq, 1, 3, 3 },
+    { t_concat, op_concat, 0, 5, 4 }, { '+', op_add, 0, 6, 6 },
+    { '-', op_sub, 0, 6, 6 },	  { '*', op_mul, 0, 7, 7 },
+    { '/', op_div, 0, 7, 7 },	  { '%', op_mod, 0, 7, 7 },
+    { '^', op_pow, 0, 10, 9 },
+  };
+  const int unary_priority = 8;
+
+  enter_level ();
+  if (tok_ == t_not || tok_ == '-' || tok_ == '#')
+    {
+      auto op = tok_ == t_not ? op_not : tok_ == '-' ? op_neg : op_len;
+      next ();
+      subexpr (e, unary_priority);
+      discharge (e);
+      emit (op);
+    }
+  else
+    simple_exp (e);
+
+  while (true)
+    {
+      auto it = std::find_if (std::begin (binaries), std::end (binaries),
+			      [this] (const binary &b)
+				{ return b.token == tok_; });
+      if (it == std::end (binaries) || it->left <= limit)
+	break;
+      next ();
+      discharge (e);
+      expr rhs;
+      if (it->op == op_and || it->op == op_or)
+	{
+	  auto jump = emit (it->op);
+	  subexpr (rhs, it->right);
+	  discharge (rhs);
+	  patch (jump);
+	}
+      else
+	{
+	  subexpr (rhs, it->right);
+	  discharge (rhs);
+	  emit (it->op, it->a);
+	}
+      e = expr{};
+    }
+  leave_level ();
+}
+
+void
+compiler::simple_exp (expr &e)
+{
+  switch (tok_)
+    {
+    case t_number:
+      emit (op_const, add_constant (value{ number_ }));
+      next ();
+      break;
+    case t_string:
+      emit (op_const, add_constant (value{ std::move (text_) }));
+      next ();
+      break;
+    case t_nil:
+      emit (op_nil);
+      next ();
+      break;
+    case t_true:
+      emit (op_true);
+      next ();
+      break;
+    case t_false:
+      emit (op_false);
+      next ();
+      break;
+    case t_dots:
+      if (!proto ().vararg)
+	return error ("cannot use '...' outside a vararg function");
+      next ();
+      e = expr{};
+      e.kind = expr::call;
+      e.a = fs_->depth;
+      e.b = emit (op_vararg, 0, 1);
+      fs_->depth = e.a + 1;
+      return;
+    case '{':
+      return table_constructor (e);
+    case t_function:
+      next ();
+      emit (op_closure, function_body ());
+      break;
+    default:
+      return suffixed_exp (e);
+    }
+  e = expr{};
+}
+
+void
+compiler::primary_exp (expr &e)
+{
+  if (tok_ == t_name)
+    {
+      auto name = check_name ();
+      return single_var (name, e);
+    }
+  if (tok_ == '(')
+    {
+      next ();
+      expression (e);
+      // A call in parentheses has one result.
+      discharge (e);
+      check (')', ")");
+      return;
+    }
+  error ("unexpected symbol near '" + near () + "'");
+}
+
+void
+compiler::suffixed_exp (expr &e)
+{
+  primary_exp (e);
+  while (true)
+    switch (tok_)
+      {
+      case '.':
+	{
+	  next ();
+	  auto name = check_name ();
+	  if (e.kind == expr::library)
+	    {
+	      auto id = find_builtin (e.name, name);
+	      if (id >= 0)
+		emit (op_builtin, id);
+	      else
+		{
+		  auto c = std::find_if (
+		      std::begin (library_constants),
+		      std::end (library_constants),
+		      [&e, &name] (const library_constant &k)
+			{ return e.name == k.library && name == k.name; });
+		  if (c == std::end (library_constants))
+		    return error ("unsupported function '" + e.name + "."
+				  + name + "'");
+		  emit (op_const, add_constant (value{ c->value }));
+		}
+	      e = expr{};
+	      break;
+	    }
+	  discharge (e);
+	  emit (op_const, add_constant (value{ std::move (name) }));
+	  e = expr{};
+	  e.kind = expr::indexed;
+	  e.a = fs_->depth - 2;
+	  break;
+	}
+      case '[':
+	{
+	  discharge (e);
+	  next ();
+	  expr key;
+	  expression (key);
+	  discharge (key);
+	  check (']', "]");
+	  e = expr{};
+	  e.kind = expr::indexed;
+	  e.a = fs_->depth - 2;
+	  break;
+	}
+      case ':':
+	{
+	  // Only strings have methods.
+	  next ();
+	  auto name = check_name ();
+	  auto id = find_builtin ("string", name);
+	  if (id < 0)
+	    return error ("unsupported method '" + name + "'");
+	  discharge (e);
+	  emit (op_self, id);
+	  call_args (e, fs_->depth - 2);
+	  break;
+	}
+      case '(':
+      case '{':
+      case t_string:
+	discharge (e);
+	call_args (e, fs_->depth - 1);
+	break;
+      default:
+	return;
+      }
+}
+
+void
+compiler::call_args (expr &e, int func)
+{
+  switch (tok_)
+    {
+    case t_string:
+      emit (op_const, add_constant (value{ std::move (text_) }));
+      next ();
+      break;
+    case '{':
+      {
+	expr t;
+	table_constructor (t);
+	break;
+      }
+    case '(':
+      next ();
+      if (tok_ != ')')
+	{
+	  expr last;
+	  explist (last);
+	  if (last.kind == expr::call)
+	    set_returns (last, -1);
+	  else
+	    discharge (last);
+	}
+      check (')', ")");
+      break;
+    default:
+      return error ("function arguments expected near '" + near () + "'");
+    }
+  e = expr{};
+  e.kind = expr::call;
+  e.a = func;
+  e.b = emit (op_call, func, 1);
+  fs_->depth = func + 1;
+}
+
+// The positional items are only stored once the next one shows up, so that
+// a call in last place can add all its results.
+void
+compiler::table_constructor (expr &e)
+{
+  check ('{', "{");
+  emit (op_new_table);
+  auto t = fs_->depth - 1;
+  int index = 1;
+  bool pending = false;
+  expr item;
+  auto flush = [&] (bool last)
+    {
+      if (!pending)
+	return;
+      pending = false;
+      if (last && item.kind == expr::call)
+	{
+	  set_returns (item, -1);
+	  emit (op_append_items, t, index);
+	  fs_->depth = t + 1;
+	  return;
+	}
+      discharge (item);
+      emit (op_set_item, 0, index++);
+    };
+
+  while (tok_ != '}' && tok_ != t_eof)
+    {
+      flush (false);
+      if ((tok_ == t_name && peek () == '=') || tok_ == '[')
+	{
+	  expr key;
+	  if (tok_ == t_name)
+	    {
+	      emit (op_const, add_constant (value{ check_name () }));
+	    }
+	  else
+	    {
+	      next ();
+	      expression (key);
+	      discharge (key);
+	      check (']', "]");
+	    }
+	  check ('=', "=");
+	  expr v;
+	  expression (v);
+	  discharge (v);
+	  emit (op_set_field);
+	}
+      else
+	{
+	  item = expr{};
+	  expression (item);
+	  pending = true;
+	}
+      if (!test_next (',') && !test_next (';'))
+	break;
+    }
+  flush (true);
+  check ('}', "}");
+  e = expr{};
+}
+
+void
+compiler::single_var (const std::string &name, expr &e)
+{
+  e = expr{};
+  if (find_var (fs_, name, e))
+    return;
+
+  if (name == "KEYS" || name == "ARGV")
+    emit (op_global, name == "KEYS" ? 0 : 1);
+  else if (is_library (name))
+    {
+      e.kind = expr::library;
+      e.name = name;
+    }
+  else
+    {
+      auto id = find_builtin ("", name);
+      if (id >= 0)
+	emit (op_builtin, id);
+      else
+	{
+	  e.kind = expr::unknown;
+	  e.name = name;
+	}
+    }
+}
+
+// Finds name in the locals of fs, or of the functions around it, which fs
+// then reaches through an upvalue; false for a global.
+bool
+compiler::find_var (function_state *fs, const std::string &name, expr &e)
+{
+  for (auto it = fs->locals.rbegin (); it != fs->locals.rend (); it++)
+    if (it->name == name)
+      {
+	if (fs != fs_)
+	  box_local (fs, *it);
+	e.kind = expr::local;
+	e.a = it->slot;
+	return true;
+      }
+  auto &names = fs->upvalues;
+  auto it = std::find (names.begin (), names.end (), name);
+  if (it != names.end ())
+    {
+      e.kind = expr::upvalue;
+      e.a = static_cast<int> (it - names.begin ());
+      return true;
+    }
+  if (fs->parent == nullptr || !find_var (fs->parent, name, e))
+    return false;
+  if (names.size () >= max_upvalues)
+    error ("too many upvalues");
+  auto &p = protos_[static_cast<std::size_t> (fs->proto)];
+  p.upvalues.push_back ({ e.kind == expr::local, e.a });
+  names.push_back (name);
+  e.kind = expr::upvalue;
+  e.a = static_cast<int> (names.size ()) - 1;
+  return true;
+}
+
+void
+compiler::discharge (expr &e)
+{
+  switch (e.kind)
+    {
+    case expr::local:
+      emit_local (op_local, e.a);
+      break;
+    case expr::upvalue:
+      emit (op_upvalue, e.a);
+      break;
+    case expr::indexed:
+      emit (op_index);
+      break;
+    case expr::library:
+      error ("unsupported use of '" + e.name + "'");
+      break;
+    case expr::unknown:
+      error ("Script attempted to access nonexistent global variable '"
+	     + e.name + "'");
+      break;
+    default:
+      break;
+    }
+  e = expr{};
+}
+
+void
+compiler::set_returns (expr &e, int n)
+{
+  proto ().code[static_cast<std::size_t> (e.b)].b = n;
+  if (n >= 0)
+    fs_->depth = e.a + n;
+  e = expr{};
+}
+
+// Lua patterns, matched the way the string library of Lua 5.1 does. The
+// strings end with a '\0', which the matcher reads past the end of the
+// pattern, as lstrlib.c does.
+class pattern_matcher
+{
+public:
+  pattern_matcher (const std::string &s, const std::string &p)
+      : src_ (s.data ()), src_end_ (s.data () + s.size ()),
+	p_end_ (p.data () + p.size ())
+  {
+  }
+
+  // The end of the match of the pattern from p against the subject from
+  // s, or null, with an error when the pattern is malformed.
+  const char *
+  match (const char *s, const char *p)
+  {
+    level_ = 0;
+    depth_ = max_depth;
+    return do_match (s, p);
+  }
+
+  const std::string &
+  error () const
+  {
+    return error_;
+  }
+
+  // The values of the captures of the match from s to e, the whole match
+  // when there are none, unless s is null.
+  bool captures (const char *s, const char *e, std::vector<value> &out);
+  bool capture (int i, const char *s, const char *e, value &out);
+
+private:
+  static const int max_captures = 32;
+  static const int max_depth = 200;
+  static const std::ptrdiff_t unfinished = -1;
+  static const std::ptrdiff_t position = -2;
+
+  const char *do_match (const char *s, const char *p);
+  const char *fail (const std::string &msg);
+  const char *class_end (const char *p);
+  bool single_match (const char *s, const char *p, const char *ep) const;
+  const char *match_balance (const char *s, const char *p);
+  const char *max_expand (const char *s, const char *p, const char *ep);
+  const char *min_expand (const char *s, const char *p, const char *ep);
+  const char *start_capture (const char *s, const char *p,
+			     std::ptrdiff_t what);
+  const char *end_capture (const char *s, const char *p);
+  const char *match_capture (const char *s, int l);
+
+  const char *src_;
+  const char *src_end_;
+  const char *p_end_;
+  int level_ = 0;
+  int depth_ = 0;
+  struct
+  {
+    const char *init;
+    std::ptrdiff_t len;
+  } capture_[max_captures];
+  std::string error_;
+};
+
+bool
+match_class (int c, int cl)
+{
+  bool r;
+  switch (std::tolower (cl))
+    {
+    case 'a':
+      r = std::isalpha (c);
+      break;
+    case 'c':
+      r = std::iscntrl (c);
+      break;
+    case 'd':
+      r = std::isdigit (c);
+      break;
+    case 'l':
+      r = std::islower (c);
+      break;
+    case 'p':
+      r = std::ispunct (c);
+      break;
+    case 's':
+      r = std::isspace (c);
+      break;
+    case 'u':
+      r = std::isupper (c);
+      break;
+    case 'w':
+      r = std::isalnum (c);
+      break;
+    case 'x':
+      r = std::isxdigit (c);
+      break;
+    case 'z':
+      r = c == 0;
+      break;
+    default:
+      return cl == c;
+    }
+  // An upper case class is the complement of the lower case one.
+  return std::isupper (cl) ? !r : r;
+}
+
+// Whether c is in the set from the '[' at p to the ']' at ec.
+bool
+match_bracket_class (int c, const char *p, const char *ec)
+{
+  bool in = true;
+  if (p[1] == '^')
+    {
+      in = false;
+      p++;
+    }
+  while (++p < ec)
+    {
+      auto u = static_cast<unsigned char> (*p);
+      if (*p == '%')
+	{
+	  p++;
+	  if (match_class (c, static_cast<unsigned char> (*p)))
+	    return in;
+	}
+      else if (p[1] == '-' && p + 2 < ec)
+	{
+	  p += 2;
+	  if (u <= c && c <= static_cast<unsigned char> (*p))
+	    return in;
+	}
+      else if (u == c)
+	return in;
+    }
+  return !in;
+}
+
+const char *
+pattern_matcher::fail (const std::string &msg)
+{
+  if (error_.empty ())
+    error_ = msg;
+  return nullptr;
+}
+
+// Past the single character class at p.
+const char *
+pattern_matcher::class_end (const char *p)
+{
+  switch (*p++)
+    {
+    case '%':
+      if (p == p_end_)
+	return fail ("malformed pattern (ends with '%')");
+      return p + 1;
+    case '[':
+      if (*p == '^')
+	p++;
+      // The first ']' is in the set.
+      do
+	{
+	  if (p == p_end_)
+	    return fail ("malformed pattern (missing ']')");
+	  if (*p++ == '%' && p < p_end_)
+	    p++;
+	}
+      while (*p != ']');
+      return p + 1;
+    default:
+      return p;
+    }
+}
+
+bool
+pattern_matcher::single_match (const char *s, const char *p,
+			       const char *ep) const
+{
+  if (s >= src_end_)
+    return false;
+  auto c = static_cast<unsigned char> (*s);
+  switch (*p)
+    {
+    case '.':
+      return true;
+    case '%':
+      return match_class (c, static_cast<unsigned char> (p[1]));
+    case '[':
+      return match_bracket_class (c, p, ep - 1);
+    default:
+      return static_cast<unsigned char> (*p) == c;
+    }
+}
+
+const char *
+pattern_matcher::do_match (const char *s, const char *p)
+{
+  if (!error_.empty ())
+    return nullptr;
+  if (depth_-- == 0)
+    return fail ("pattern too complex");
+  // The tail calls of the recursion loop instead.
+  while (p != p_end_)
+    {
+      const char *ep;
+      switch (*p)
+	{
+	case '(':
+	  if (p[1] == ')')
+	    s = start_capture (s, p + 2, position);
+	  else
+	    s = start_capture (s, p + 1, unfinished);
+	  break;
+	case ')':
+	  s = end_capture (s, p + 1);
+	  break;
+	case '$':
+	  if (p + 1 != p_end_)
+	    goto single;
+	  if (s != src_end_)
+	    s = nullptr;
+	  break;
+	case '%':
+	  switch (p[1])
+	    {
+	    case 'b':
+	      s = match_balance (s, p + 2);
+	      if (s != nullptr)
+		{
+		  p += 4;
+		  continue;
+		}
+	      break;
+	    case 'f':
+	      {
+		p += 2;
+		if (*p != '[')
+		  return fail ("missing '[' after '%f' in pattern");
+		ep = class_end (p);
+		if (ep == nullptr)
+		  return nullptr;
+		auto prev = s == src_ ? '\0' : s[-1];
+		auto cur = s == src_end_ ? '\0' : *s;
+		if (!match_bracket_class (static_cast<unsigned char> (prev), p,
+					  ep - 1)
+		    && match_bracket_class (static_cast<unsigned char> (cur),
+					    p, ep - 1))
+		  {
+		    p = ep;
+		    continue;
+		  }
+		s = nullptr;
+		break;
+	      }
+	    default:
+	      if (!std::isdigit (static_cast<unsigned char> (p[1])))
+		goto single;
+	      s = match_capture (s, static_cast<unsigned char> (p[1]));
+	      if (s != nullptr)
+		{
+		  p += 2;
+		  continue;
+		}
+	    }
+	  break;
+	default:
+	single:
+	  ep = class_end (p);
+	  if (ep == nullptr)
+	    return nullptr;
+	  if (!single_match (s, p, ep))
+	    {
+	      // Zero of them is a match too.
+	      if (*ep == '*' || *ep == '?' || *ep == '-')
+		{
+		  p = ep + 1;
+		  continue;
+		}
+	      s = nullptr;
+	      break;
+	    }
+	  switch (*ep)
+	    {
+	    case '?':
+	      {
+		auto r = do_match (s + 1, ep + 1);
+		if (r == nullptr && error_.empty ())
+		  {
+		    p = ep + 1;
+		    continue;
+		  }
+		s = r;
+		break;
+	      }
+	    case '+':
+	      s = max_expand (s + 1, p, ep);
+	      break;
+	    case '*':
+	      s = max_expand (s, p, ep);
+	      break;
+	    case '-':
+	      s = min_expand (s, p, ep);
+	      break;
+	    default:
+	      s++;
+	      p = ep;
+	      continue;
+	    }
+	}
+      break;
+    }
+  depth_++;
+  return s;
+}
+
+// %bxy: from an x to the y that balances it.
+const char *
+pattern_matcher::match_balance (const char *s, const char *p)
+{
+  if (p >= p_end_ - 1)
+    return fail ("malformed pattern (missing arguments to '%b')");
+  if (s >= src_end_ || *s != *p)
+    return nullptr;
+  int open = 1;
+  while (++s < src_end_)
+    {
+      if (*s == p[1])
+	{
+	  if (--open == 0)
+	    return s + 1;
+	}
+      else if (*s == *p)
+	open++;
+    }
+  return nullptr;
+}
+
+const char *
+pattern_matcher::max_expand (const char *s, const char *p, const char *ep)
+{
+  std::ptrdiff_t i = 0;
+  while (single_match (s + i, p, ep))
+    i++;
+  // The longest run that the rest of the pattern still matches after.
+  for (; i >= 0; i--)
+    {
+      auto r = do_match (s + i, ep + 1);
+      if (r != nullptr || !error_.empty ())
+	return r;
+    }
+  return nullptr;
+}
+
+const char *
+pattern_matcher::min_expand (const char *s, const char *p, const char *ep)
+{
+  while (true)
+    {
+      auto r = do_match (s, ep + 1);
+      if (r != nullptr || !error_.empty ())
+	return r;
+      if (!single_match (s, p, ep))
+	return nullptr;
+      s++;
+    }
+}
+
+const char *
+pattern_matcher::start_capture (const char *s, const char *p,
+				std::ptrdiff_t what)
+{
+  if (level_ >= max_captures)
+    return fail ("too many captures");
+  capture_[level_].init = s;
+  capture_[level_].len = what;
+  level_++;
+  auto r = do_match (s, p);
+  if (r == nullptr)
+    level_--;
+  return r;
+}
+
+const char *
+pattern_matcher::end_capture (const char *s, const char *p)
+{
+  int l = level_ - 1;
+  while (l >= 0 && capture_[l].len != unfinished)
+    l--;
+  if (l < 0)
+    return fail ("invalid pattern capture");
+  capture_[l].len = s - capture_[l].init;
+  auto r = do_match (s, p);
+  if (r == nullptr)
+    capture_[l].len = unfinished;
+  return r;
+}
+
+// %1 to %9: the same text as the capture.
+const char *
+pattern_matcher::match_capture (const char *s, int l)
+{
+  l -= '1';
+  if (l < 0 || l >= level_ || capture_[l].len == unfinished)
+    return fail ("invalid capture index");
+  auto len = static_cast<std::size_t> (capture_[l].len);
+  if (static_cast<std::size_t> (src_end_ - s) >= len
+      && std::memcmp (capture_[l].init, s, len) == 0)
+    return s + len;
+  return nullptr;
+}
+
+bool
+pattern_matcher::capture (int i, const char *s, const char *e, value &out)
+{
+  if (i >= level_)
+    {
+      if (i != 0)
+	{
+	  fail ("invalid capture index");
+	  return false;
+	}
+      out = std::string (s, static_cast<std::size_t> (e - s));
+      return true;
+    }
+  auto len = capture_[i].len;
+  if (len == unfinished)
+    {
+      fail ("unfinished capture");
+      return false;
+    }
+  if (len == position)
+    out = double (capture_[i].init - src_ + 1);
+  else
+    out = std::string (capture_[i].init, static_cast<std::size_t> (len));
+  return true;
+}
+
+bool
+pattern_matcher::captures (const char *s, const char *e,
+			   std::vector<value> &out)
+{
+  auto count = level_ == 0 && s != nullptr ? 1 : level_;
+  for (int i = 0; i < count; i++)
+    {
+      value v;
+      if (!capture (i, s, e, v))
+	return false;
+      out.push_back (std::move (v));
+    }
+  return true;
+}
+
+} // namespace
+
+// The virtual machine.
+class machine
+{
+public:
+  machine (const program &prog, const command_fn &call)
+      : prog_ (prog), call_ (call)
+  {
+    live_.prev = live_.next = &live_;
+  }
+
+  ~machine ();
+
+  void start (std::vector<std::string> keys, std::vector<std::string> argv);
+  optional<resp::data> resume (steady_clock::time_point deadline);
+  resp::data kill (const std::string &msg);
+
+private:
+  // A builtin that called a function has a frame with no fn under the one
+  // of that function, and is at ret, with want, to go on with what it
+  // returns.
+  struct frame
+  {
+    const prototype *fn;
+    std::size_t pc;
+    // The first slot, and the first operand.
+    std::size_t base;
+    std::size_t operands;
+    // Where the function was, which its results replace, and how many
+    // the caller wants, or -1 for all.
+    std::size_t ret;
+    int want;
+    // The boxes of the upvalues, which the function value at ret holds,
+    // and the arguments past the parameters of a vararg function.
+    table *upvalues;
+    std::vector<value> varargs;
+  };
+
+  bool execute (value &result, steady_clock::time_point deadline);
+  bool run (value &result, steady_clock::time_point deadline);
+  bool recover ();
+  bool call (std::size_t func, int want);
+  bool call_back (std::size_t func, int want);
+  bool end_callbacks ();
+  bool fail (const std::string &msg);
+  table_ptr new_box (value v);
+  table_ptr new_table ();
+  void bury ();
+  bool index (const value &t, const value &key, value &out);
+  bool set_index (value &t, value key, value v);
+  bool arith (op_code op);
+  bool concat ();
+  bool compare (const value &x, const value &y, bool or_equal, bool &out);
+  value from_resp (resp::data &reply);
+  resp::data to_resp (const value &v, std::size_t depth);
+  std::string describe (const value &v);
+
+  // Builtins, which take their arguments from the stack and put their
+  // results in out.
+  bool call_builtin (int id, table *state, std::size_t first,
+		     std::size_t count, std::vector<value> &out);
+  bool redis_call (bool protect, std::vector<value> &out);
+  bool string_format (std::vector<value> &out);
+  bool string_find (bool find, std::vector<value> &out);
+  bool gmatch_step (table *state, std::vector<value> &out);
+  bool gsub (table *state, std::vector<value> &out);
+  bool next (std::vector<value> &out);
+  const value &arg (std::size_t i) const;
+  bool bad_arg (std::size_t i, const std::string &msg);
+  bool check_table (std::size_t i, table *&out);
+  bool check_number (std::size_t i, double &out);
+  bool check_integer (std::size_t i, std::int64_t &out);
+  bool check_string (std::size_t i, std::string &out);
+  bool opt_integer (std::size_t i, std::int64_t fallback,
+		    std::int64_t &out);
+
+  const program &prog_;
+  const command_fn &call_;
+  // The head of the list of the tables alive, and the ones to free.
+  table live_;
+  std::vector<table *> dead_;
+  std::vector<value> stack_;
+  std::vector<frame> frames_;
+  std::vector<value> results_;
+  value globals_[2];
+  // The error of a failure, and the value that pcall returns for it.
+  resp::data error_;
+  value thrown_;
+  // The builtin to go on with once the function that the running one put
+  // first in its results returns, or nil.
+  value then_;
+  value nil_;
+  // The arguments of the running builtin.
+  int builtin_ = 0;
+  std::size_t first_ = 0;
+  std::size_t count_ = 0;
+  // The instructions executed, and whether execute stopped at its deadline
+  // rather than at the end of the script.
+  std::uint64_t ticks_ = 0;
+  bool paused_ = false;
+};
+
+void
+machine::start (std::vector<std::string> keys, std::vector<std::string> argv)
+{
+  std::vector<std::string> *lists[] = { &keys, &argv };
+  for (int i = 0; i < 2; i++)
+    {
+      auto t = new_table ();
+      t->array.reserve (lists[i]->size ());
+      for (auto &s : *lists[i])
+	t->array.emplace_back (std::move (s));
+      globals_[i] = t;
+    }
+
+  const auto &main = prog_.protos[0];
+  auto slots = static_cast<std::size_t> (main.slots);
+  stack_.resize (slots);
+  frames_.push_back ({ &main, 0, 0, slots, 0, 0, nullptr, {} });
+}
+
+optional<resp::data>
+machine::resume (steady_clock::time_point deadline)
+{
+  paused_ = false;
+  value result;
+  if (!execute (result, deadline))
+    return std::move (error_);
+  if (paused_)
+    return boost::none;
+  return to_resp (result, 0);
+}
+
+resp::data
+machine::kill (const std::string &msg)
+{
+  fail (msg);
+  return std::move (error_);
+}
+
+// A failure under a pcall of the base library goes on from there.
+bool
+machine::execute (value &result, steady_clock::time_point deadline)
+{
+  while (!run (result, deadline))
+    if (!recover ())
+      return false;
+  return true;
+}
+
+bool
+machine::run (value &result, steady_clock::time_point deadline)
+{
+  // Reading the clock costs more than most instructions.
+  const std::uint64_t ticks_per_clock_check = 1024;
+  if (!end_callbacks ())
+    return false;
+  while (true)
+    {
+      if (++ticks_ % ticks_per_clock_check == 0
+	  && steady_clock::now () >= deadline)
+	{
+	  paused_ = true;
+	  return true;
+	}
+
+      auto &f = frames_.back ();
+      const auto &in = f.fn->code[f.pc++];
+      switch (in.op)
+	{
+	case op_nil:
+	  stack_.emplace_back ();
+	  break;
+	case op_true:
+	  stack_.emplace_back (true);
+	  break;
+	case op_false:
+	  stack_.emplace_back (false);
+	  break;
+	case op_const:
+	  stack_.push_back (f.fn->constants[static_cast<std::size_t> (in.a)]);
+	  break;
+	case op_local:
+	  stack_.push_back (stack_[f.base + static_cast<std::size_t> (in.a)]);
+	  break;
+	case op_set_local:
+	  stack_[f.base + static_cast<std::size_t> (in.a)]
+	      = std::move (stack_.back ());
+	  stack_.pop_back ();
+	  break;
+	case op_get_box:
+	  {
+	    auto slot = f.base + static_cast<std::size_t> (in.a);
+	    const auto &box = get<table_ptr> (stack_[slot]);
+	    stack_.push_back (box->array[0]);
+	    break;
+	  }
+	case op_set_box:
+	  {
+	    auto slot = f.base + static_cast<std::size_t> (in.a);
+	    const auto &box = get<table_ptr> (stack_[slot]);
+	    box->array[0] = std::move (stack_.back ());
+	    stack_.pop_back ();
+	    break;
+	  }
+	case op_new_box:
+	  {
+	    auto box = new_box (std::move (stack_.back ()));
+	    stack_.pop_back ();
+	    stack_[f.base + static_cast<std::size_t> (in.a)] = std::move (box);
+	    break;
+	  }
+	case op_upvalue:
+	  {
+	    const auto &box = get<table_ptr> (
+		f.upvalues->array[static_cast<std::size_t> (in.a)]);
+	    stack_.push_back (box->array[0]);
+	    break;
+	  }
+	case op_set_upvalue:
+	  {
+	    const auto &box = get<table_ptr> (
+		f.upvalues->array[static_cast<std::size_t> (in.a)]);
+	    box->array[0] = std::move (stack_.back ());
+	    stack_.pop_back ();
+	    break;
+	  }
+	case op_vararg:
+	  {
+	    auto count = in.b < 0 ? f.varargs.size ()
+				  : static_cast<std::size_t> (in.b);
+	    for (std::size_t i = 0; i < count; i++)
+	      if (i < f.varargs.size ())
+		stack_.push_back (f.varargs[i]);
+	      else
+		stack_.emplace_back ();
+	    break;
+	  }
+	case op_global:
+	  stack_.push_back (globals_[in.a]);
+	  break;
+	case op_builtin:
+	  stack_.emplace_back (builtin{ in.a, nullptr });
+	  break;
+	case op_closure:
+	  {
+	    const auto &p = prog_.protos[static_cast<std::size_t> (in.a)];
+	    function_ref fn{ in.a, nullptr };
+	    if (!p.upvalues.empty ())
+	      {
+		fn.upvalues = new_table ();
+		auto &boxes = fn.upvalues->array;
+		boxes.reserve (p.upvalues.size ());
+		for (const auto &u : p.upvalues)
+		  {
+		    auto i = static_cast<std::size_t> (u.index);
+		    boxes.push_back (u.local ? stack_[f.base + i]
+					     : f.upvalues->array[i]);
+		  }
+	      }
+	    stack_.emplace_back (std::move (fn));
+	    break;
+	  }
+	case op_new_table:
+	  stack_.emplace_back (new_table ());
+	  break;
+	case op_index:
+	  {
+	    value v;
+	    auto n = stack_.size ();
+	    if (!index (stack_[n - 2], stack_[n - 1], v))
+	      return false;
+	    stack_.pop_back ();
+	    stack_.back () = std::move (v);
+	    break;
+	  }
+	case op_set_index:
+	  {
+	    auto t = f.operands + static_cast<std::size_t> (in.a);
+	    auto v = std::move (stack_.back ());
+	    stack_.pop_back ();
+	    if (!set_index (stack_[t], stack_[t + 1], std::move (v)))
+	      return false;
+	    break;
+	  }
+	case op_set_item:
+	  {
+	    auto t = get<table_ptr> (stack_[stack_.size () - 2]);
+	    t->set (value{ double (in.b) }, std::move (stack_.back ()));
+	    stack_.pop_back ();
+	    break;
+	  }
+	case op_set_field:
+	  {
+	    auto n = stack_.size ();
+	    auto v = std::move (stack_[n - 1]);
+	    auto key = std::move (stack_[n - 2]);
+	    stack_.resize (n - 2);
+	    if (!set_index (stack_.back (), std::move (key), std::move (v)))
+	      return false;
+	    break;
+	  }
+	case op_append_items:
+	  {
+	    auto pos = f.operands + static_cast<std::size_t> (in.a);
+	    auto t = get<table_ptr> (stack_[pos]);
+	    for (auto i = pos + 1; i < stack_.size (); i++)
+	      {
+		auto key = double (in.b) + double (i - pos - 1);
+		t->set (value{ key }, std::move (stack_[i]));
+	      }
+	    stack_.resize (pos + 1);
+	    break;
+	  }
+	case op_self:
+	  {
+	    if (stack_.back ().index () != k_string)
+	      return fail (std::string{ "attempt to index a " }
+			   + type_name (stack_.back ()) + " value");
+	    auto s = std::move (stack_.back ());
+	    stack_.back () = builtin{ in.a, nullptr };
+	    stack_.push_back (std::move (s));
+	    break;
+	  }
+	case op_add:
+	case op_sub:
+	case op_mul:
+	case op_div:
+	case op_mod:
+	case op_pow:
+	  if (!arith (in.op))
+	    return false;
+	  break;
+	case op_concat:
+	  if (!concat ())
+	    return false;
+	  break;
+	case op_eq:
+	  {
+	    auto n = stack_.size ();
+	    bool r = equal (stack_[n - 2], stack_[n - 1]) != (in.a != 0);
+	    stack_.pop_back ();
+	    stack_.back () = r;
+	    break;
+	  }
+	case op_lt:
+	case op_le:
+	  {
+	    auto n = stack_.size ();
+	    const auto *x = &stack_[n - 2];
+	    const auto *y = &stack_[n - 1];
+	    if (in.a != 0)
+	      std::swap (x, y);
+	    bool r;
+	    if (!compare (*x, *y, in.op == op_le, r))
+	      return false;
+	    stack_.pop_back ();
+	    stack_.back () = r;
+	    break;
+	  }
+	case op_not:
+	  stack_.back () = !truthy (stack_.back ());
+	  break;
+	case op_neg:
+	  {
+	    double n;
+	    if (!to_number (stack_.back (), n))
+	      return fail (std::string{ "attempt to perform arithmetic on a " }
+			   + type_name (stack_.back ()) + " value");
+	    stack_.back () = -n;
+	    break;
+	  }
+	case op_len:
+	  {
+	    auto &v = stack_.back ();
+	    if (auto s = get_if<std::string> (&v))
+	      v = double (s->size ());
+	    else if (auto t = get_if<table_ptr> (&v))
+	      v = double ((*t)->array.size ());
+	    else
+	      return fail (std::string{ "attempt to get length of a " }
+			   + type_name (v) + " value");
+	    break;
+	  }
+	case op_jump:
+	  f.pc = static_cast<std::size_t> (in.a);
+	  break;
+	case op_jump_if_false:
+	  {
+	    bool t = truthy (stack_.back ());
+	    stack_.pop_back ();
+	    if (!t)
+	      f.pc = static_cast<std::size_t> (in.a);
+	    break;
+	  }
+	case op_and:
+	case op_or:
+	  if (truthy (stack_.back ()) == (in.op == op_or))
+	    f.pc = static_cast<std::size_t> (in.a);
+	  else
+	    stack_.pop_back ();
+	  break;
+	case op_call:
+	  // May push a frame, which f no longer refers to.
+	  if (!call (f.operands + static_cast<std::size_t> (in.a), in.b)
+	      || !end_callbacks ())
+	    return false;
+	  break;
+	case op_return:
+	  {
+	    auto first = f.operands + static_cast<std::size_t> (in.a);
+	    auto count = stack_.size () - first;
+	    if (frames_.size () == 1)
+	      {
+		if (count != 0)
+		  result = std::move (stack_[first]);
+		return true;
+	      }
+	    auto ret = f.ret;
+	    auto want = f.want;
+	    frames_.pop_back ();
+	    for (std::size_t i = 0; i < count; i++)
+	      stack_[ret + i] = std::move (stack_[first + i]);
+	    stack_.resize (ret + count);
+	    if (want >= 0)
+	      stack_.resize (ret + static_cast<std::size_t> (want));
+	    if (!end_callbacks ())
+	      return false;
+	    break;
+	  }
+	case op_pop:
+	  stack_.resize (stack_.size () - static_cast<std::size_t> (in.a));
+	  break;
+	case op_for_prep:
+	  {
+	    static const char *const what[]
+		= { "initial value", "limit", "step" };
+	    auto base = f.base + static_cast<std::size_t> (in.a);
+	    for (std::size_t i = 0; i < 3; i++)
+	      {
+		double n;
+		if (!to_number (stack_[base + i], n))
+		  return fail (std::string{ "'for' " } + what[i]
+			       + " must be a number");
+		stack_[base + i] = n;
+	      }
+	    if (get<double> (stack_[base + 2]) == 0)
+	      return fail ("'for' step is zero");
+	    break;
+	  }
+	case op_for_check:
+	  {
+	    auto base = f.base + static_cast<std::size_t> (in.a);
+	    auto i = get<double> (stack_[base]);
+	    auto limit = get<double> (stack_[base + 1]);
+	    auto step = get<double> (stack_[base + 2]);
+	    if (step > 0 ? i <= limit : i >= limit)
+	      stack_.emplace_back (i);
+	    else
+	      f.pc = static_cast<std::size_t> (in.b);
+	    break;
+	  }
+	case op_for_loop:
+	  {
+	    auto base = f.base + static_cast<std::size_t> (in.a);
+	    stack_[base] = get<double> (stack_[base])
+			   + get<double> (stack_[base + 2]);
+	    f.pc = static_cast<std::size_t> (in.b);
+	    break;
+	  }
+	case op_tfor_check:
+	  {
+	    if (is_nil (stack_.back ()))
+	      {
+		stack_.pop_back ();
+		f.pc = static_cast<std::size_t> (in.b);
+	      }
+	    else
+	      stack_[f.base + static_cast<std::size_t> (in.a)]
+		  = stack_.back ();
+	    break;
+	  }
+	}
+    }
+}
+
+bool
+machine::call (std::size_t func, int want)
+{
+  const auto &callee = stack_[func];
+  if (auto b = get_if<builtin> (&callee))
+    {
+      results_.clear ();
+      if (!call_builtin (b->id, b->state.get (), func + 1,
+			 stack_.size () - func - 1, results_))
+	return false;
+      stack_.resize (func);
+      if (!is_nil (then_))
+	return call_back (func, want);
+      auto count = want < 0 ? results_.size ()
+			    : static_cast<std::size_t> (want);
+      for (std::size_t i = 0; i < count; i++)
+	if (i < results_.size ())
+	  stack_.push_back (std::move (results_[i]));
+	else
+	  stack_.emplace_back ();
+      return true;
+    }
+  if (auto fn = get_if<function_ref> (&callee))
+    {
+      if (frames_.size () >= max_frames)
+	return fail ("stack overflow");
+      const auto &p = prog_.protos[static_cast<std::size_t> (fn->proto)];
+      // fn goes with the stack once it grows.
+      auto upvalues = fn->upvalues.get ();
+      auto base = func + 1;
+      auto params = static_cast<std::size_t> (p.params);
+      // The missing arguments are nil, and the extra ones dropped, or
+      // kept for ... by a vararg function.
+      std::vector<value> varargs;
+      if (p.vararg && stack_.size () > base + params)
+	varargs.assign (
+	    std::make_move_iterator (stack_.begin ()
+				     + static_cast<std::ptrdiff_t> (base
+								    + params)),
+	    std::make_move_iterator (stack_.end ()));
+      stack_.resize (base + params);
+      stack_.resize (base + static_cast<std::size_t> (p.slots));
+      for (auto slot : p.boxed_params)
+	{
+	  auto &v = stack_[base + static_cast<std::size_t> (slot)];
+	  v = new_box (std::move (v));
+	}
+      frames_.push_back ({ &p, 0, base,
+			   base + static_cast<std::size_t> (p.slots), func,
+			   want, upvalues, std::move (varargs) });
+      return true;
+    }
+  return fail (std::string{ "attempt to call a " } + type_name (callee)
+	       + " value");
+}
+
+// The builtin just called, whose results were left in results_, calls
+// the first one with the others, and goes on with then_, which replaces
+// it at func, once that returns.
+bool
+machine::call_back (std::size_t func, int want)
+{
+  stack_.push_back (std::move (then_));
+  then_ = nil_type{};
+  if (frames_.size () >= max_frames)
+    return fail ("stack overflow");
+  for (auto &v : results_)
+    stack_.push_back (std::move (v));
+  frames_.push_back ({ nullptr, 0, func, func, func, want, nullptr, {} });
+  return call (func + 1, -1);
+}
+
+// The builtins on top of the frames have had their function return, and go
+// on with its results as their arguments; they may call another one.
+bool
+machine::end_callbacks ()
+{
+  while (frames_.back ().fn == nullptr)
+    {
+      auto ret = frames_.back ().ret;
+      auto want = frames_.back ().want;
+      frames_.pop_back ();
+      if (!call (ret, want))
+	return false;
+    }
+  return true;
+}
+
+// Unwinds to the innermost pcall of the base library, which returns false
+// and the error, or tells there is none.
+bool
+machine::recover ()
+{
+  for (auto i = frames_.size (); i-- > 1;)
+    {
+      const auto &f = frames_[i];
+      auto b = f.fn == nullptr ? get_if<builtin> (&stack_[f.ret]) : nullptr;
+      if (b == nullptr || b->id != f_pcall_step)
+	continue;
+      auto ret = f.ret;
+      auto want = f.want;
+      frames_.erase (frames_.begin () + static_cast<std::ptrdiff_t> (i),
+		     frames_.end ());
+      stack_.resize (ret);
+      stack_.emplace_back (false);
+      stack_.push_back (std::move (thrown_));
+      thrown_ = nil_type{};
+      if (want >= 0)
+	stack_.resize (ret + static_cast<std::size_t> (want));
+      return true;
+    }
+  return false;
+}
+
+bool
+machine::fail (const std::string &msg)
+{
+  // A function is stopped before its first instruction when the script is
+  // killed right after the call. A builtin that called a function fails
+  // at the line of its own call.
+  auto f = frames_.rbegin ();
+  while (f->fn == nullptr)
+    f++;
+  auto where = "user_script:"
+	       + std::to_string (f->fn->lines[f->pc != 0 ? f->pc - 1 : 0])
+	       + ": " + msg;
+  error_ = resp::simple_error{ "ERR " + where };
+  thrown_ = std::move (where);
+  return false;
+}
+
+table_ptr
+machine::new_box (value v)
+{
+  auto box = new_table ();
+  box->array.push_back (std::move (v));
+  return box;
+}
+
+// Empties the tables left, which frees them, cycles included.
+machine::~machine ()
+{
+  stack_.clear ();
+  results_.clear ();
+  globals_[0] = globals_[1] = nil_type{};
+  std::vector<table_ptr> left;
+  for (auto t = live_.next; t != &live_; t = t->next)
+    left.emplace_back (t);
+  for (auto &t : left)
+    {
+      t->array.clear ();
+      t->hash.clear ();
+    }
+  left.clear ();
+  bury ();
+}
+
+table_ptr
+machine::new_table ()
+{
+  bury ();
+  auto t = new table;
+  t->graveyard = &dead_;
+  t->next = live_.next;
+  t->prev = &live_;
+  live_.next->prev = t;
+  live_.next = t;
+  return table_ptr{ t };
+}
+
+// Freeing a table may add the ones it held to the graveyard, which is
+// emptied until it stays so.
+void
+machine::bury ()
+{
+  while (!dead_.empty ())
+    {
+      auto t = dead_.back ();
+      dead_.pop_back ();
+      delete t;
+    }
+}
+
+bool
+machine::index (const value &t, const value &key, value &out)
+{
+  auto p = get_if<table_ptr> (&t);
+  if (p == nullptr)
+    return fail (std::string{ "attempt to index a " } + type_name (t)
+		 + " value");
+  out = (*p)->get (key);
+  return true;
+}
+
+bool
+machine::set_index (value &t, value key, value v)
+{
+  auto p = get_if<table_ptr> (&t);
+  if (p == nullptr)
+    return fail (std::string{ "attempt to index a " } + type_name (t)
+		 + " value");
+  if (is_nil (key))
+    return fail ("table index is nil");
+  auto n = get_if<double> (&key);
+  if (n != nullptr && *n != *n)
+    return fail ("table index is NaN");
+  (*p)->set (std::move (key), std::move (v));
+  return true;
+}
+
+bool
+machine::arith (op_code op)
+{
+  auto n = stack_.size ();
+  double x, y;
+  if (!to_number (stack_[n - 2], x))
+    return fail (std::string{ "attempt to perform arithmetic on a " }
+		 + type_name (stack_[n - 2]) + " value");
+  if (!to_number (stack_[n - 1], y))
+    return fail (std::string{ "attempt to perform arithmetic on a " }
+		 + type_name (stack_[n - 1]) + " value");
+  double r;
+  switch (op)
+    {
+    case op_add:
+      r = x + y;
+      break;
+    case op_sub:
+      r = x - y;
+      break;
+    case op_mul:
+      r = x * y;
+      break;
+    case op_div:
+      r = x / y;
+      break;
+    case op_mod:
+      r = x - std::floor (x / y) * y;
+      break;
+    default:
+      r = std::pow (x, y);
+    }
+  stack_.pop_back ();
+  stack_.back () = r;
+  return true;
+}
+
+// Appends to the string on the left in place, as strings are values.
+bool
+machine::concat ()
+{
+  auto n = stack_.size ();
+  auto &x = stack_[n - 2];
+  const auto &y = stack_[n - 1];
+  const value *operands[] = { &x, &y };
+  for (auto v : operands)
+    if (v->index () != k_string && v->index () != k_number)
+      return fail (std::string{ "attempt to concatenate a " }
+		   + type_name (*v) + " value");
+  if (auto num = get_if<double> (&x))
+    x = number_to_string (*num);
+  auto &s = get<std::string> (x);
+  if (auto t = get_if<std::string> (&y))
+    {
+      if (s.size () + t->size () > max_string)
+	return fail ("string length overflow");
+      s += *t;
+    }
+  else
+    s += number_to_string (get<double> (y));
+  stack_.pop_back ();
+  return true;
+}
+
+bool
+machine::compare (const value &x, const value &y, bool or_equal, bool &out)
+{
+  auto a = get_if<double> (&x);
+  auto b = get_if<double> (&y);
+  if (a != nullptr && b != nullptr)
+    {
+      out = or_equal ? *a <= *b : *a < *b;
+      return true;
+    }
+  auto s = get_if<std::string> (&x);
+  auto t = get_if<std::string> (&y);
+  if (s != nullptr && t != nullptr)
+    {
+      auto c = s->compare (*t);
+      out = or_equal ? c <= 0 : c < 0;
+      return true;
+    }
+  if (x.index () == y.index ())
+    return fail (std::string{ "attempt to compare two " } + type_name (x)
+		 + " values");
+  return fail (std::string{ "attempt to compare " } + type_name (x)
+	       + " with " + type_name (y));
+}
+
+// Replies become Lua values the way Redis converts them: a null is false,
+// a status a table with an ok field, an error one with an err field.
+value
+machine::from_resp (resp::data &reply)
+{
+  if (auto n = reply.get_if<resp::integer> ())
+    return double (*n);
+  if (auto s = reply.get_if<resp::bulk_string> ())
+    {
+      if (!s->has_value ())
+	return false;
+      return std::move (s->value ());
+    }
+  if (auto a = reply.get_if<resp::array> ())
+    {
+      if (!a->has_value ())
+	return false;
+      auto t = new_table ();
+      t->array.reserve (a->value ().size ());
+      for (auto &item : a->value ())
+	t->array.push_back (from_resp (item));
+      // A false item ends the array part only when it is the last one.
+      return t;
+    }
+  auto t = new_table ();
+  if (auto s = reply.get_if<resp::simple_string> ())
+    t->set (std::string{ "ok" }, std::move (*s));
+  else
+    t->set (std::string{ "err" },
+	    std::move (reply.get<resp::simple_error> ()));
+  return t;
+}
+
+// And back: numbers are truncated to integers, true is 1, false is a null,
+// and an array stops at its first nil.
+resp::data
+machine::to_resp (const value &v, std::size_t depth)
+{
+  switch (v.index ())
+    {
+    case k_boolean:
+      if (get<bool> (v))
+	return resp::integer{ 1 };
+      break;
+    case k_number:
+      return resp::integer{ to_integer (get<double> (v)) };
+    case k_string:
+      return resp::bulk_string{ get<std::string> (v) };
+    case k_table:
+      {
+	auto t = get<table_ptr> (v);
+	for (const char *field : { "err", "ok" })
+	  {
+	    auto s = t->get (std::string{ field });
+	    if (auto p = get_if<std::string> (&s))
+	      {
+		if (*field == 'e')
+		  return resp::simple_error{ std::move (*p) };
+		return resp::simple_string{ std::move (*p) };
+	      }
+	  }
+	if (depth >= max_reply_depth)
+	  return resp::simple_error{ "ERR reached lua stack limit" };
+	std::vector<resp::data> items;
+	items.reserve (t->array.size ());
+	for (const auto &item : t->array)
+	  {
+	    if (is_nil (item))
+	      break;
+	    items.push_back (to_resp (item, depth + 1));
+	  }
+	return resp::array{ std::move (items) };
+      }
+    default:
+      break;
+    }
+  return resp::bulk_string{ boost::none };
+}
+
+std::string
+machine::describe (const value &v)
+{
+  char buf[64];
+  switch (v.index ())
+    {
+    case k_nil:
+      return "nil";
+    case k_boolean:
+      return get<bool> (v) ? "true" : "false";
+    case k_number:
+      return number_to_string (get<double> (v));
+    case k_string:
+      return get<std::string> (v);
+    case k_table:
+      std::snprintf (buf, sizeof (buf), "table: %p",
+		     static_cast<void *> (get<table_ptr> (v).get ()));
+      return buf;
+    case k_builtin:
+      return std::string{ "function: builtin: " }
+	     + builtin_names[get<builtin> (v).id].name;
+    default:
+      std::snprintf (buf, sizeof (buf), "function: %d",
+		     get<function_ref> (v).proto);
+      return buf;
+    }
+}
+
+const value &
+machine::arg (std::size_t i) const
+{
+  return i < count_ ? stack_[first_ + i] : nil_;
+}
+
+bool
+machine::bad_arg (std::size_t i, const std::string &msg)
+{
+  return fail ("bad argument #" + std::to_string (i + 1) + " to '"
+	       + builtin_names[builtin_].name + "' (" + msg + ")");
+}
+
+bool
+machine::check_table (std::size_t i, table *&out)
+{
+  auto p = get_if<table_ptr> (&arg (i));
+  if (p == nullptr)
+    return bad_arg (i, std::string{ "table expected, got " }
+			   + (i < count_ ? type_name (arg (i)) : "no value"));
+  out = p->get ();
+  return true;
+}
+
+bool
+machine::check_number (std::size_t i, double &out)
+{
+  if (!to_number (arg (i), out))
+    return bad_arg (i, std::string{ "number expected, got " }
+			   + (i < count_ ? type_name (arg (i)) : "no value"));
+  return true;
+}
+
+bool
+machine::check_integer (std::size_t i, std::int64_t &out)
+{
+  double n;
+  if (!check_number (i, n))
+    return false;
+  out = to_integer (n);
+  return true;
+}
+
+bool
+machine::check_string (std::size_t i, std::string &out)
+{
+  if (!to_string (arg (i), out))
+    return bad_arg (i, std::string{ "string expected, got " }
+			   + (i < count_ ? type_name (arg (i)) : "no value"));
+  return true;
+}
+
+bool
+machine::opt_integer (std::size_t i, std::int64_t fallback,
+		      std::int64_t &out)
+{
+  if (is_nil (arg (i)))
+    {
+      out = fallback;
+      return true;
+    }
+  return check_integer (i, out);
+}
+
+namespace
+{
+
+// A position in a string of length len, from 1, or from the end when
+// negative.
+std::int64_t
+string_position (std::int64_t pos, std::size_t len)
+{
+  if (pos >= 0)
+    return pos;
+  auto n = static_cast<std::int64_t> (len);
+  return -pos > n ? 0 : n + pos + 1;
+}
+
+} // namespace
+
+bool
+machine::call_builtin (int id, table *state, std::size_t first,
+		       std::size_t count, std::vector<value> &out)
+{
+  builtin_ = id;
+  first_ = first;
+  count_ = count;
+  switch (id)
+    {
+    case f_call:
+    case f_pcall:
+      return redis_call (id == f_pcall, out);
+    case f_error_reply:
+    case f_status_reply:
+      {
+	std::string s;
+	if (!check_string (0, s))
+	  return false;
+	auto t = new_table ();
+	t->set (std::string{ id == f_error_reply ? "err" : "ok" },
+		std::move (s));
+	out.emplace_back (t);
+	return true;
+      }
+    case f_sha1hex:
+      {
+	std::string s;
+	if (!check_string (0, s))
+	  return false;
+	out.emplace_back (sha1_hex (s));
+	return true;
+      }
+    case f_log:
+      return true;
+
+    case f_assert:
+      if (truthy (arg (0)))
+	{
+	  out.assign (stack_.begin () + static_cast<std::ptrdiff_t> (first),
+		      stack_.end ());
+	  return true;
+	}
+      if (auto s = get_if<std::string> (&arg (1)))
+	return fail (*s);
+      return fail ("assertion failed!");
+    case f_error:
+      {
+	// A table with an err field is the error reply itself, as the
+	// ones redis.pcall returns.
+	if (auto t = get_if<table_ptr> (&arg (0)))
+	  {
+	    auto err = (*t)->get (std::string{ "err" });
+	    if (auto s = get_if<std::string> (&err))
+	      {
+		thrown_ = arg (0);
+		error_ = resp::simple_error{ std::move (*s) };
+		return false;
+	      }
+	  }
+	// pcall returns the value raised, with the position only when it
+	// is a string or number.
+	fail (describe (arg (0)));
+	if (arg (0).index () != k_string && arg (0).index () != k_number)
+	  thrown_ = arg (0);
+	return false;
+      }
+    case f_ipairs:
+      {
+	table *t;
+	if (!check_table (0, t))
+	  return false;
+	out.emplace_back (builtin{ f_ipairs_step, nullptr });
+	out.push_back (arg (0));
+	out.emplace_back (0.0);
+	return true;
+      }
+    case f_ipairs_step:
+      {
+	table *t;
+	double i;
+	if (!check_table (0, t) || !check_number (1, i))
+	  return false;
+	auto v = t->get (value{ i + 1 });
+	if (is_nil (v))
+	  out.emplace_back ();
+	else
+	  {
+	    out.emplace_back (i + 1);
+	    out.push_back (std::move (v));
+	  }
+	return true;
+      }
+    case f_next:
+      return next (out);
+    case f_pairs:
+      {
+	table *t;
+	if (!check_table (0, t))
+	  return false;
+	out.emplace_back (builtin{ f_next, nullptr });
+	out.push_back (arg (0));
+	out.emplace_back ();
+	return true;
+      }
+    case f_base_pcall:
+      // The function runs from a frame of its own, and pcall_step adds
+      // true to what it returns; recover returns false and the error.
+      if (count == 0)
+	return bad_arg (0, "value expected");
+      then_ = builtin{ f_pcall_step, nullptr };
+      out.assign (stack_.begin () + static_cast<std::ptrdiff_t> (first),
+		  stack_.end ());
+      return true;
+    case f_pcall_step:
+      out.emplace_back (true);
+      out.insert (out.end (),
+		  stack_.begin () + static_cast<std::ptrdiff_t> (first),
+		  stack_.end ());
+      return true;
+    case f_select:
+      {
+	auto s = get_if<std::string> (&arg (0));
+	if (s != nullptr && *s == "#")
+	  {
+	    out.emplace_back (double (count - 1));
+	    return true;
+	  }
+	std::int64_t n;
+	if (!check_integer (0, n))
+	  return false;
+	auto rest = static_cast<std::int64_t> (count) - 1;
+	if (n < 0)
+	  n += rest + 1;
+	if (n < 1)
+	  return bad_arg (0, "index out of range");
+	for (auto i = static_cast<std::size_t> (n); i <= count - 1; i++)
+	  out.push_back (arg (i));
+	return true;
+      }
+    case f_tonumber:
+      {
+	if (is_nil (arg (1)))
+	  {
+	    double n;
+	    if (to_number (arg (0), n))
+	      out.emplace_back (n);
+	    else
+	      out.emplace_back ();
+	    return true;
+	  }
+	std::int64_t base;
+	std::string s;
+	if (!check_integer (1, base) || !check_string (0, s))
+	  return false;
+	if (base < 2 || base > 36)
+	  return bad_arg (1, "base out of range");
+	boost::trim (s);
+	char *end;
+	errno = 0;
+	auto n = std::strtoull (s.c_str (), &end, static_cast<int> (base));
+	if (s.empty () || *end != '\0' || errno != 0 || s[0] == '-')
+	  out.emplace_back ();
+	else
+	  out.emplace_back (double (n));
+	return true;
+      }
+    case f_tostring:
+      out.emplace_back (describe (arg (0)));
+      return true;
+    case f_type:
+      if (count == 0)
+	return bad_arg (0, "value expected");
+      out.emplace_back (std::string{ type_name (arg (0)) });
+      return true;
+    case f_unpack:
+    case f_table_unpack:
+      {
+	table *t;
+	std::int64_t i, j;
+	if (!check_table (0, t) || !opt_integer (1, 1, i)
+	    || !opt_integer (2, static_cast<std::int64_t> (t->array.size ()),
+			     j))
+	  return false;
+	if (i <= j && j - i >= 1 << 20)
+	  return fail ("too many results to unpack");
+	for (auto k = i; k <= j; k++)
+	  out.push_back (t->get (value{ double (k) }));
+	return true;
+      }
+
+    case f_byte:
+      {
+	std::string s;
+	std::int64_t i, j;
+	if (!check_string (0, s) || !opt_integer (1, 1, i))
+	  return false;
+	if (!opt_integer (2, i, j))
+	  return false;
+	i = std::max<std::int64_t> (string_position (i, s.size ()), 1);
+	j = std::min<std::int64_t> (string_position (j, s.size ()),
+				    static_cast<std::int64_t> (s.size ()));
+	for (auto k = i; k <= j; k++)
+	  out.emplace_back (
+	      double (static_cast<unsigned char> (s[std::size_t (k - 1)])));
+	return true;
+      }
+    case f_char:
+      {
+	std::string s;
+	for (std::size_t i = 0; i < count; i++)
+	  {
+	    std::int64_t c;
+	    if (!check_integer (i, c))
+	      return false;
+	    if (c < 0 || c > 255)
+	      return bad_arg (i, "invalid value");
+	    s.push_back (static_cast<char> (c));
+	  }
+	out.emplace_back (std::move (s));
+	return true;
+      }
+    case f_find:
+    case f_match:
+      return string_find (id == f_find, out);
+    case f_format:
+      return string_format (out);
+    case f_gmatch:
+      {
+	std::string s, pattern;
+	if (!check_string (0, s) || !check_string (1, pattern))
+	  return false;
+	auto t = new_table ();
+	t->array = { std::move (s), std::move (pattern), 0.0 };
+	out.emplace_back (builtin{ f_gmatch_step, std::move (t) });
+	return true;
+      }
+    case f_gmatch_step:
+      return gmatch_step (state, out);
+    case f_gsub:
+      {
+	std::string s, pattern;
+	std::int64_t n;
+	if (!check_string (0, s) || !check_string (1, pattern)
+	    || !opt_integer (3, static_cast<std::int64_t> (s.size ()) + 1, n))
+	  return false;
+	auto k = arg (2).index ();
+	if (k != k_number && k != k_string && k != k_table
+	    && k != k_builtin && k != k_function)
+	  return bad_arg (2, "string/function/table expected");
+	bool anchor = !pattern.empty () && pattern[0] == '^';
+	if (anchor)
+	  pattern.erase (0, 1);
+	auto t = new_table ();
+	t->array = { std::move (s),	   std::move (pattern), arg (2),
+		     std::string{},	   0.0,			double (n),
+		     0.0,		   anchor,		-1.0 };
+	return gsub (t.get (), out);
+      }
+    case f_gsub_step:
+      {
+	// The result of the function replaces the match, unless false or
+	// nil.
+	auto &a = state->array;
+	const auto &s = get<std::string> (a[0]);
+	auto &res = get<std::string> (a[3]);
+	auto pos = static_cast<std::size_t> (get<double> (a[4]));
+	auto end = static_cast<std::size_t> (get<double> (a[8]));
+	std::string r;
+	if (!truthy (arg (0)))
+	  r = s.substr (pos, end - pos);
+	else if (!to_string (arg (0), r))
+	  return fail (std::string{ "invalid replacement value (a " }
+		       + type_name (arg (0)) + ")");
+	if (res.size () + r.size () > max_string)
+	  return fail ("resulting string too large");
+	res += r;
+	return gsub (state, out);
+      }
+    case f_len:
+      {
+	std::string s;
+	if (!check_string (0, s))
+	  return false;
+	out.emplace_back (double (s.size ()));
+	return true;
+      }
+    case f_lower:
+    case f_upper:
+    case f_reverse:
+      {
+	std::string s;
+	if (!check_string (0, s))
+	  return false;
+	if (id == f_lower)
+	  boost::to_lower (s);
+	else if (id == f_upper)
+	  boost::to_upper (s);
+	else
+	  std::reverse (s.begin (), s.end ());
+	out.emplace_back (std::move (s));
+	return true;
+      }
+    case f_rep:
+      {
+	std::string s, r;
+	std::int64_t n;
+	if (!check_string (0, s) || !check_integer (1, n))
+	  return false;
+	if (n > 0 && !s.empty ()
+	    && static_cast<std::uint64_t> (n) > max_string / s.size ())
+	  return fail ("resulting string too large");
+	for (std::int64_t i = 0; i < n; i++)
+	  r += s;
+	out.emplace_back (std::move (r));
+	return true;
+      }
+    case f_sub:
+      {
+	std::string s;
+	std::int64_t i, j;
+	if (!check_string (0, s) || !opt_integer (1, 1, i)
+	    || !opt_integer (2, -1, j))
+	  return false;
+	i = std::max<std::int64_t> (string_position (i, s.size ()), 1);
+	j = std::min<std::int64_t> (string_position (j, s.size ()),
+				    static_cast<std::int64_t> (s.size ()));
+	if (i > j)
+	  out.emplace_back (std::string{});
+	else
+	  out.emplace_back (
+	      s.substr (std::size_t (i - 1), std::size_t (j - i + 1)));
+	return true;
+      }
+
+    case f_concat:
+      {
+	table *t;
+	std::string sep, s, item;
+	std::int64_t i, j;
+	if (!check_table (0, t))
+	  return false;
+	if (!is_nil (arg (1)) && !check_string (1, sep))
+	  return false;
+	if (!opt_integer (2, 1, i)
+	    || !opt_integer (3, static_cast<std::int64_t> (t->array.size ()),
+			     j))
+	  return false;
+	for (auto k = i; k <= j; k++)
+	  {
+	    if (!to_string (t->get (value{ double (k) }), item))
+	      return fail ("invalid value (at index " + std::to_string (k)
+			   + ") in table for 'concat'");
+	    if (s.size () + item.size () + sep.size () > max_string)
+	      return fail ("resulting string too large");
+	    s += item;
+	    if (k != j)
+	      s += sep;
+	  }
+	out.emplace_back (std::move (s));
+	return true;
+      }
+    case f_getn:
+      {
+	table *t;
+	if (!check_table (0, t))
+	  return false;
+	out.emplace_back (double (t->array.size ()));
+	return true;
+      }
+    case f_insert:
+      {
+	table *t;
+	if (!check_table (0, t))
+	  return false;
+	auto n = static_cast<std::int64_t> (t->array.size ());
+	std::int64_t pos = n + 1;
+	if (count == 3)
+	  {
+	    if (!check_integer (1, pos))
+	      return false;
+	    if (pos < 1 || pos > n + 1)
+	      return bad_arg (1, "position out of bounds");
+	  }
+	else if (count != 2)
+	  return fail ("wrong number of arguments to 'insert'");
+	for (auto k = n; k >= pos; k--)
+	  t->set (value{ double (k + 1) }, t->get (value{ double (k) }));
+	auto v = arg (count - 1);
+	if (!is_nil (v))
+	  t->set (value{ double (pos) }, std::move (v));
+	return true;
+      }
+    case f_remove:
+      {
+	table *t;
+	if (!check_table (0, t))
+	  return false;
+	auto n = static_cast<std::int64_t> (t->array.size ());
+	std::int64_t pos;
+	if (!opt_integer (1, n, pos))
+	  return false;
+	if (n == 0 && is_nil (arg (1)))
+	  return true;
+	if (pos < 1 || pos > n + 1)
+	  return bad_arg (1, "position out of bounds");
+	out.push_back (t->get (value{ double (pos) }));
+	for (auto k = pos; k < n; k++)
+	  t->set (value{ double (k) }, t->get (value{ double (k + 1) }));
+	if (pos <= n)
+	  t->set (value{ double (n) }, value{});
+	return true;
+      }
+
+    case f_max:
+    case f_min:
+      {
+	double r;
+	if (!check_number (0, r))
+	  return false;
+	for (std::size_t i = 1; i < count; i++)
+	  {
+	    double n;
+	    if (!check_number (i, n))
+	      return false;
+	    r = id == f_max ? std::max (r, n) : std::min (r, n);
+	  }
+	out.emplace_back (r);
+	return true;
+      }
+    case f_fmod:
+    case f_pow:
+      {
+	double x, y;
+	if (!check_number (0, x) || !check_number (1, y))
+	  return false;
+	out.emplace_back (id == f_fmod ? std::fmod (x, y) : std::pow (x, y));
+	return true;
+      }
+    default:
+      {
+	double x;
+	if (!check_number (0, x))
+	  return false;
+	switch (id)
+	  {
+	  case f_abs:
+	    x = std::fabs (x);
+	    break;
+	  case f_ceil:
+	    x = std::ceil (x);
+	    break;
+	  case f_floor:
+	    x = std::floor (x);
+	    break;
+	  default:
+	    x = std::sqrt (x);
+	  }
+	out.emplace_back (x);
+	return true;
+      }
+    }
+}
+
+// The arguments go to the command as they are: the strings are moved off
+// the stack, which drops them after the call anyway.
+bool
+machine::redis_call (bool protect, std::vector<value> &out)
+{
+  if (count_ == 0)
+    return fail ("Please specify at least one argument for this redis lib "
+		 "call");
+  std::vector<std::string> argv;
+  argv.reserve (count_);
+  for (std::size_t i = 0; i < count_; i++)
+    {
+      auto &v = stack_[first_ + i];
+      if (auto s = get_if<std::string> (&v))
+	argv.push_back (std::move (*s));
+      else if (auto n = get_if<double> (&v))
+	argv.push_back (number_to_string (*n));
+      else
+	return fail ("Lua redis lib command arguments must be strings or "
+		     "integers");
+    }
+
+  auto reply = call_ (argv);
+  if (!protect && reply.is<resp::simple_error> ())
+    {
+      // pcall of the base library returns the error as redis.pcall does.
+      error_ = reply;
+      thrown_ = from_resp (reply);
+      return false;
+    }
+  out.push_back (from_resp (reply));
+  return true;
+}
+
+// find returns where the match is, then its captures, and match only
+// the captures.
+bool
+machine::string_find (bool find, std::vector<value> &out)
+{
+  std::string s, pattern;
+  std::int64_t init;
+  if (!check_string (0, s) || !check_string (1, pattern)
+      || !opt_integer (2, 1, init))
+    return false;
+  init = std::max<std::int64_t> (string_position (init, s.size ()), 1);
+  if (init > static_cast<std::int64_t> (s.size ()) + 1)
+    {
+      out.emplace_back ();
+      return true;
+    }
+  if (find
+      && (truthy (arg (3))
+	  || pattern.find_first_of ("^$*+?.([%-") == std::string::npos))
+    {
+      auto pos = s.find (pattern, std::size_t (init - 1));
+      if (pos == std::string::npos)
+	out.emplace_back ();
+      else
+	{
+	  out.emplace_back (double (pos + 1));
+	  out.emplace_back (double (pos + pattern.size ()));
+	}
+      return true;
+    }
+
+  pattern_matcher m{ s, pattern };
+  auto p = pattern.data ();
+  bool anchor = *p == '^';
+  if (anchor)
+    p++;
+  auto src = s.data () + (init - 1);
+  do
+    {
+      auto e = m.match (src, p);
+      if (e != nullptr)
+	{
+	  if (!find)
+	    return m.captures (src, e, out) || fail (m.error ());
+	  out.emplace_back (double (src - s.data () + 1));
+	  out.emplace_back (double (e - s.data ()));
+	  return m.captures (nullptr, nullptr, out) || fail (m.error ());
+	}
+      if (!m.error ().empty ())
+	return fail (m.error ());
+    }
+  while (src++ < s.data () + s.size () && !anchor);
+  out.emplace_back ();
+  return true;
+}
+
+// The next match from the position in state on, past which the next
+// round starts; nothing once there is none.
+bool
+machine::gmatch_step (table *state, std::vector<value> &out)
+{
+  auto &a = state->array;
+  const auto &s = get<std::string> (a[0]);
+  const auto &pattern = get<std::string> (a[1]);
+  pattern_matcher m{ s, pattern };
+  auto end = s.data () + s.size ();
+  for (auto src = s.data () + static_cast<std::size_t> (get<double> (a[2]));
+       src <= end; src++)
+    {
+      auto e = m.match (src, pattern.data ());
+      if (!m.error ().empty ())
+	return fail (m.error ());
+      if (e == nullptr)
+	continue;
+      // An empty match moves on by one still.
+      a[2] = double (e - s.data () + (e == src ? 1 : 0));
+      return m.captures (src, e, out) || fail (m.error ());
+    }
+  a[2] = double (s.size () + 1);
+  return true;
+}
+
+// Replaces the matches from the position in state on. state holds the
+// string, the pattern, the replacement, the result so far, the position,
+// the replacements left, the count, whether the pattern is anchored and
+// the end of the match that a function called back replaces, or -1. The
+// function is called with the captures, and gsub_step goes on once it
+// returns.
+bool
+machine::gsub (table *state, std::vector<value> &out)
+{
+  auto &a = state->array;
+  const auto &s = get<std::string> (a[0]);
+  const auto &pattern = get<std::string> (a[1]);
+  const auto &repl = a[2];
+  auto &res = get<std::string> (a[3]);
+  auto pos = static_cast<std::size_t> (get<double> (a[4]));
+  auto left = get<double> (a[5]);
+  auto count = get<double> (a[6]);
+  auto anchor = get<bool> (a[7]);
+  auto end = get<double> (a[8]);
+  pattern_matcher m{ s, pattern };
+  while (true)
+    {
+      if (end < 0)
+	{
+	  if (left <= 0)
+	    break;
+	  auto src = s.data () + pos;
+	  auto e = m.match (src, pattern.data ());
+	  if (!m.error ().empty ())
+	    return fail (m.error ());
+	  if (e != nullptr)
+	    {
+	      count++;
+	      left--;
+	      end = double (e - s.data ());
+	      value r;
+	      switch (repl.index ())
+		{
+		case k_table:
+		  if (!m.capture (0, src, e, r))
+		    return fail (m.error ());
+		  r = get<table_ptr> (repl)->get (r);
+		  break;
+		case k_builtin:
+		case k_function:
+		  a[4] = double (pos);
+		  a[5] = left;
+		  a[6] = count;
+		  a[8] = end;
+		  out.push_back (repl);
+		  if (!m.captures (src, e, out))
+		    return fail (m.error ());
+		  then_ = builtin{ f_gsub_step, table_ptr{ state } };
+		  return true;
+		default:
+		  {
+		    // %0 is the match, %1 to %9 the captures.
+		    std::string t;
+		    to_string (repl, t);
+		    std::string text;
+		    for (std::size_t i = 0; i < t.size (); i++)
+		      if (t[i] != '%' || i + 1 == t.size ())
+			text.push_back (t[i]);
+		      else if (!std::isdigit (
+				   static_cast<unsigned char> (t[++i])))
+			text.push_back (t[i]);
+		      else if (t[i] == '0')
+			text.append (src, e);
+		      else
+			{
+			  value c;
+			  std::string cs;
+			  if (!m.capture (t[i] - '1', src, e, c))
+			    return fail (m.error ());
+			  to_string (c, cs);
+			  text += cs;
+			}
+		    r = std::move (text);
+		  }
+		}
+	      std::string text;
+	      if (!truthy (r))
+		text.assign (src, e);
+	      else if (!to_string (r, text))
+		return fail (std::string{ "invalid replacement value (a " }
+			     + type_name (r) + ")");
+	      if (res.size () + text.size () > max_string)
+		return fail ("resulting string too large");
+	      res += text;
+	    }
+	}
+      // Past the match, or one character on when it was empty or there
+      // was none.
+      if (end > double (pos))
+	pos = static_cast<std::size_t> (end);
+      else if (pos < s.size ())
+	res.push_back (s[pos++]);
+      else
+	break;
+      end = -1;
+      if (anchor)
+	break;
+    }
+  res.append (s, pos, std::string::npos);
+  out.emplace_back (std::move (res));
+  out.emplace_back (count);
+  return true;
+}
+
+bool
+machine::string_format (std::vector<value> &out)
+{
+  std::string fmt, s;
+  if (!check_string (0, fmt))
+    return false;
+  std::size_t next_arg = 1;
+  for (std::size_t i = 0; i < fmt.size (); i++)
+    {
+      if (fmt[i] != '%')
+	{
+	  s.push_back (fmt[i]);
+	  continue;
+	}
+      if (++i < fmt.size () && fmt[i] == '%')
+	{
+	  s.push_back ('%');
+	  continue;
+	}
+
+      // %[flags][width][.precision]conversion, as in C.
+      std::string spec{ "%" };
+      while (i < fmt.size () && std::strchr ("-+ #0", fmt[i]) != nullptr
+	     && fmt[i] != '\0')
+	spec.push_back (fmt[i++]);
+      auto digit = [&] () {
+	return i < fmt.size ()
+	       && std::isdigit (static_cast<unsigned char> (fmt[i]));
+      };
+      for (int part = 0; part < 2; part++)
+	{
+	  if (part == 1)
+	    {
+	      if (i >= fmt.size () || fmt[i] != '.')
+		break;
+	      spec.push_back (fmt[i++]);
+	    }
+	  for (int d = 0; d < 2 && digit (); d++)
+	    spec.push_back (fmt[i++]);
+	}
+      if (i >= fmt.size ())
+	return fail ("invalid option '%' to 'format'");
+      auto conv = fmt[i];
+      auto n = next_arg++;
+      char buf[512];
+      switch (conv)
+	{
+	case 'd':
+	case 'i':
+	case 'o':
+	case 'u':
+	case 'x':
+	case 'X':
+	case 'c':
+	  {
+	    std::int64_t v;
+	    if (!check_integer (n, v))
+	      return false;
+	    if (conv == 'c')
+	      spec.push_back (conv);
+	    else
+	      spec += std::string{ "ll" } + conv;
+	    if (conv == 'c')
+	      std::snprintf (buf, sizeof (buf), spec.c_str (), int (v));
+	    else
+	      std::snprintf (buf, sizeof (buf), spec.c_str (),
+			     static_cast<long long> (v));
+	    s += buf;
+	    break;
+	  }
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'g':
+	case 'G':
+	  {
+	    double v;
+	    if (!check_number (n, v))
+	      return false;
+	    spec.push_back (conv);
+	    std::snprintf (buf, sizeof (buf), spec.c_str (), v);
+	    s += buf;
+	    break;
+	  }
+	case 's':
+	  {
+	    std::string v;
+	    if (n >= count_)
+	      return bad_arg (n, "string expected, got no value");
+	    v = describe (arg (n));
+	    if (spec.size () == 1)
+	      s += v;
+	    else
+	      {
+		spec.push_back (conv);
+		std::snprintf (buf, sizeof (buf), spec.c_str (), v.c_str ());
+		s += buf;
+	      }
+	    break;
+	  }
+	case 'q':
+	  {
+	    std::string v;
+	    if (!check_string (n, v))
+	      return false;
+	    s.push_back ('"');
+	    for (auto c : v)
+	      switch (c)
+		{
+		case '"':
+		case '\\':
+		case '\n':
+		  s.push_back ('\\');
+		  s.push_back (c);
+		  break;
+		case '\r':
+		  s += "\\r";
+		  break;
+		case '\0':
+		  s += "\\000";
+		  break;
+		default:
+		  s.push_back (c);
+		}
+	    s.push_back ('"');
+	    break;
+	  }
+	default:
+	  return fail (std::string{ "invalid option '%" } + conv
+		       + "' to 'format'");
+	}
+    }
+  out.emplace_back (std::move (s));
+  return true;
+}
+
+// The array part first, then the hash part, in key order. A key may be
+// cleared while traversing, as it is still found past.
+bool
+machine::next (std::vector<value> &out)
+{
+  table *t;
+  if (!check_table (0, t))
+    return false;
+  const auto &key = arg (1);
+  std::size_t i = 0;
+  bool in_array = true;
+  if (!is_nil (key))
+    {
+      i = array_index (key);
+      in_array = i != 0 && i <= t->array.size ();
+    }
+
+  auto it = t->hash.begin ();
+  if (in_array)
+    {
+      for (; i < t->array.size (); i++)
+	if (!is_nil (t->array[i]))
+	  {
+	    out.emplace_back (double (i + 1));
+	    out.push_back (t->array[i]);
+	    return true;
+	  }
+    }
+  else
+    it = t->hash.upper_bound (key);
+  if (it == t->hash.end ())
+    out.emplace_back ();
+  else
+    {
+      out.push_back (it->first);
+      out.push_back (it->second);
+    }
+  return true;
+}
+
+std::string
+sha1_hex (string_view body)
+{
+  std::uint32_t state[5]
+      = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+  auto p = reinterpret_cast<const unsigned char *> (body.data ());
+  std::size_t i = 0;
+  for (; i + 64 <= body.size (); i += 64)
+    sha1_block (state, p + i);
+
+  // The rest, a 1 bit, zeros and the length in bits, in one or two blocks.
+  unsigned char tail[128] = {};
+  auto rest = body.size () - i;
+  if (rest != 0)
+    std::memcpy (tail, p + i, rest);
+  tail[rest] = 0x80;
+  std::size_t len = rest + 9 <= 64 ? 64 : 128;
+  auto bits = static_cast<std::uint64_t> (body.size ()) * 8;
+  for (std::size_t k = 0; k < 8; k++)
+    tail[len - 1 - k] = static_cast<unsigned char> (bits >> (8 * k));
+  sha1_block (state, tail);
+  if (len == 128)
+    sha1_block (state, tail + 64);
+
+  static const char digits[] = "0123456789abcdef";
+  std::string out;
+  out.reserve (40);
+  for (auto word : state)
+    for (int shift = 28; shift >= 0; shift -= 4)
+      out.push_back (digits[(word >> shift) & 15]);
+  return out;
+}
+
+result<std::shared_ptr<const program>, std::string>
+compile (string_view source)
+{
+  compiler c{ source };
+  return c.compile ();
+}
+
+execution::execution (std::shared_ptr<const program> prog,
+		      std::vector<std::string> keys,
+		      std::vector<std::string> argv, command_fn call)
+    : prog_ (std::move (prog)), call_ (std::move (call)),
+      machine_ (make_unique<machine> (*prog_, call_))
+{
+  machine_->start (std::move (keys), std::move (argv));
+}
+
+execution::~execution () = default;
+
+optional<resp::data>
+execution::run (steady_clock::time_point deadline)
+{
+  return machine_->resume (deadline);
+}
+
+resp::data
+execution::kill (const std::string &msg)
+{
+  return machine_->kill (msg);
+}
+
+} // namespace script
+} // namespace mini_redis
@@ -0,0 +1,67 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include "pch.h"
+
+#include "resp_data.h"
+
+namespace mini_redis
+{
+namespace script
+{
+
+// Scripts are written in the subset of Lua 5.1 that Redis scripts use:
+// local variables and functions, tables, if, while, repeat, numeric and
+// generic for, and the usual operators, with KEYS, ARGV, redis.call and
+// redis.pcall, and the common part of the base, string, table and math
+// libraries. Functions cannot use the locals of the functions around them,
+// besides the local functions. A script is compiled once into the bytecode
+// of a stack machine, which run then executes as many times as needed.
+
+struct program;
+
+// The SHA1 of a script, in 40 lowercase hex digits, which names it.
+std::string sha1_hex (string_view body);
+
+// Fails with "user_script:<line>: <message>" on a syntax error.
+result<std::shared_ptr<const program>, std::string>
+compile (string_view source);
+
+// Executes a command for redis.call and redis.pcall. argv holds the name
+// of the command then its arguments, and may be consumed.
+typedef std::function<resp::data (std::vector<std::string> &argv)>
+    command_fn;
+
+class machine;
+
+// A script being run. It runs until it returns or fails, or until a
+// deadline passes: then it stops between two instructions, and goes on
+// from there when run again.
+class execution
+{
+public:
+  execution (std::shared_ptr<const program> prog,
+	     std::vector<std::string> keys, std::vector<std::string> argv,
+	     command_fn call);
+  ~execution ();
+
+  execution (const execution &) = delete;
+  execution &operator= (const execution &) = delete;
+
+  // Returns the reply of the script, the value it returns converted the
+  // way Redis does, or the error that stopped it; none if it still runs
+  // at the deadline.
+  optional<resp::data> run (steady_clock::time_point deadline);
+  // Stops the script where it is, which fails with msg.
+  resp::data kill (const std::string &msg);
+
+private:
+  std::shared_ptr<const program> prog_;
+  command_fn call_;
+  std::unique_ptr<machine> machine_;
+};
+
+} // namespace script
+} // namespace mini_redis
+
+#endif // SCRIPT_H
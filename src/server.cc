@@ -5,7 +5,7 @@ namespace mini_redis
 {
 
 server::server (std::uint16_t port, config cfg)
-    : acceptor_{ ioc_, tcp::endpoint{ tcp::v4 (), port } },
+    : port_{ port }, acceptor_{ ioc_ },
       signals_{ ioc_, SIGINT, SIGTERM },
       manager_{ ioc_.get_executor (), std::move (cfg) }
 {
@@ -14,10 +14,30 @@ server::server (std::uint16_t port, config cfg)
 
 server::~server () { stop (); }
 
-void
+result<void, std::string>
 server::start ()
 {
+  auto ret = manager_.load_data ();
+  if (!ret.has_value ())
+    return ret;
+
+  // Clients are only let in once the dataset is loaded.
+  tcp::endpoint ep{ tcp::v4 (), port_ };
+  error_code ec;
+  acceptor_.open (ep.protocol (), ec);
+  if (!ec)
+    acceptor_.set_option (tcp::acceptor::reuse_address (true), ec);
+  if (!ec)
+    acceptor_.bind (ep, ec);
+  if (!ec)
+    acceptor_.listen (asio::socket_base::max_listen_connections, ec);
+  if (ec)
+    return "cannot listen on port " + std::to_string (port_) + ": "
+	   + ec.message ();
+
+  manager_.start_cron ();
   start_accept ();
+  return {};
 }
 
 void
@@ -37,8 +57,16 @@ server::wait_signals ()
 {
   auto wait_cb = [this] (const error_code &ec, int sig)
     {
-      if (!ec && (sig == SIGINT || sig == SIGTERM))
-	this->stop ();
+      if (ec || (sig != SIGINT && sig != SIGTERM))
+	return;
+      // The final save runs on the strand, after the requests queued
+      // there, and nothing runs after it.
+      manager_.post (
+	  [this] (processor *pro)
+	    {
+	      pro->shutdown ();
+	      this->stop ();
+	    });
     };
   signals_.async_wait (wait_cb);
 }
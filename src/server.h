@@ -20,7 +20,9 @@ public:
   server (server &&) noexcept = delete;
   server &operator= (server &&) noexcept = delete;
 
-  void start ();
+  // Loads the dataset, then starts listening. Fails if the dataset cannot
+  // be loaded or the port cannot be bound.
+  result<void, std::string> start ();
   void stop ();
   void run ();
 
@@ -29,6 +31,7 @@ private:
   void start_accept ();
 
 private:
+  std::uint16_t port_;
   asio::io_context ioc_;
   tcp::acceptor acceptor_;
   asio::signal_set signals_;
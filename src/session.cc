@@ -1,4 +1,5 @@
 #include "session.h"
+#include "migrate_link.h"
 
 namespace mini_redis
 {
@@ -41,18 +42,39 @@ session::make (tcp::socket sock, manager &mgr)
 }
 
 session::session (tcp::socket sock, manager &mgr)
-    : state_{ normal }, socket_{ std::move (sock) },
+    : state_{ normal }, replying_{ false }, reply_waiting_{ false },
+      subscriber_{ false },
+      socket_{ std::move (sock) },
       strand_{ socket_.get_executor () },
       idle_timeout_{ get_conn_idle_timeout (mgr.get_config ()) },
-      idle_timer_{ strand_ }, manager_{ mgr },
-      parser_{ make_parser_config (mgr.get_config ()) }
+      idle_timer_{ strand_ }, block_timer_{ strand_ }, pushed_bytes_{ 0 },
+      manager_{ mgr },
+      parser_{ make_parser_config (mgr.get_config ()) }, waiter_{ 0 },
+      replica_{ 0 }
 {
+  // Replies to a pipeline may go out in several writes; Nagle would hold
+  // back all but the first until the client acknowledges it.
+  error_code ec;
+  socket_.set_option (tcp::no_delay{ true }, ec);
 }
 
 void
 session::start ()
 {
   auto self = shared_from_this ();
+
+  // The processor keeps this for as long as the client is subscribed,
+  // which close ends; the session must not be kept alive by it.
+  std::weak_ptr<session> weak = self;
+  client_.push = [weak] (std::shared_ptr<const std::string> bytes)
+    {
+      auto self = weak.lock ();
+      if (self == nullptr)
+	return;
+      auto task = [self, bytes] () { self->push_message (bytes); };
+      asio::post (self->strand_, task);
+    };
+
   auto start_cb = [self] ()
     {
       BOOST_ASSERT (self->strand_.running_in_this_thread ());
@@ -69,6 +91,13 @@ session::refresh_idle_timeout ()
   if (state_ == closed)
     return;
 
+  if (subscriber_)
+    {
+      ++idle_timer_gen_;
+      idle_timer_.cancel ();
+      return;
+    }
+
   if (idle_timeout_ != milliseconds::zero ())
     {
       ++idle_timer_gen_;
@@ -121,51 +150,219 @@ session::process ()
 	  results_.clear ();
 	  results_.push_back (resp::simple_error{ parser_.pop_error () });
 	  state_ = close_after_send;
+	  replying_ = true;
 	  return start_send ();
 	}
       return start_recv ();
     }
 
-  auto requests = std::make_shared<std::vector<resp::data>> ();
-  requests->reserve (parser_.available_data ());
+  auto b = std::make_shared<batch> ();
+  b->requests.reserve (parser_.available_data ());
   while (parser_.has_data ())
-    requests->push_back (parser_.pop_data ());
+    b->requests.push_back (parser_.pop_data ());
 
-  auto parse_error = std::make_shared<optional<std::string>> ();
   if (parser_.has_error ())
-    *parse_error = parser_.pop_error ();
+    b->parse_error = parser_.pop_error ();
+
+  replying_ = true;
+  auto self = shared_from_this ();
+  auto task = [self, b] (processor *pro) { self->run_batch (b, pro); };
+  manager_.post (task);
+}
+
+void
+session::run_batch (std::shared_ptr<batch> b, processor *pro)
+{
+  b->responses.reserve (b->requests.size ()
+			+ (b->parse_error.has_value () ? 1 : 0));
+  while (b->next < b->requests.size ())
+    {
+      auto response
+	  = pro->execute (std::move (b->requests[b->next]), &client_);
+      auto req = pro->take_block_request ();
+      if (req.has_value ())
+	return block (std::move (b), pro, std::move (req.value ()));
+      auto sync = pro->take_sync_request ();
+      if (sync.has_value ())
+	{
+	  // Whatever the replica sent after PSYNC is dropped.
+	  become_replica (b, pro, sync.value ());
+	  break;
+	}
+      auto m = pro->take_migration ();
+      if (m.has_value ())
+	return migrate (std::move (b), std::move (m.value ()));
+      if (pro->take_script_pause ())
+	return run_script (std::move (b));
+
+      for (auto &r : pro->take_leading_replies ())
+	b->responses.push_back (std::move (r));
+
+      b->responses.push_back (std::move (response));
+      b->next++;
+      b->blocked = false;
+      b->deadline = boost::none;
+    }
 
+  bool should_close = false;
+  if (b->parse_error.has_value () && !b->replica)
+    {
+      b->responses.push_back (
+	  resp::simple_error{ std::move (b->parse_error.value ()) });
+      should_close = true;
+    }
+
+  b->subscriber = !client_.channels.empty () || !client_.patterns.empty ();
   auto self = shared_from_this ();
-  auto task = [self, requests, parse_error] (processor *pro)
+  auto send_task = [self, b, should_close] ()
     {
-      auto responses = std::make_shared<std::vector<resp::data>> ();
-      responses->reserve (requests->size ()
-			  + (parse_error->has_value () ? 1 : 0));
-      for (auto &i : *requests)
-	responses->push_back (pro->execute (std::move (i)));
+      BOOST_ASSERT (self->strand_.running_in_this_thread ());
+      if (self->state_ == closed)
+	return;
 
-      bool should_close = false;
-      if (parse_error->has_value ())
+      self->block_timer_.cancel ();
+      self->results_.swap (b->responses);
+      self->subscriber_ = b->subscriber;
+      if (should_close)
+	self->state_ = close_after_send;
+      if (b->replica)
 	{
-	  responses->push_back (
-	      resp::simple_error{ std::move (parse_error->value ()) });
-	  should_close = true;
+	  self->state_ = stream_after_send;
+	  if (self->results_.empty ())
+	    return self->start_stream ();
 	}
+      self->start_send ();
+    };
+  auto reply = [self, send_task] () { asio::post (self->strand_, send_task); };
+  manager_.after_flush (reply);
+  manager_.run_save_slices ();
+}
+
+void
+session::block (std::shared_ptr<batch> b, processor *pro,
+		processor::block_request req)
+{
+  auto now = steady_clock::now ();
+  if (!b->blocked)
+    {
+      b->blocked = true;
+      if (req.timeout != milliseconds::zero ())
+	b->deadline = now + req.timeout;
+    }
 
-      auto send_task = [self, responses, should_close] ()
+  milliseconds remaining = milliseconds::zero ();
+  if (b->deadline.has_value ())
+    {
+      if (now >= b->deadline.value ())
 	{
-	  BOOST_ASSERT (self->strand_.running_in_this_thread ());
-	  if (self->state_ == closed)
+	  // Woken up too late: the request times out right away.
+	  b->responses.push_back (resp::array{ boost::none });
+	  b->next++;
+	  b->blocked = false;
+	  b->deadline = boost::none;
+	  return run_batch (std::move (b), pro);
+	}
+      remaining = duration_cast<milliseconds> (b->deadline.value () - now);
+      if (remaining == milliseconds::zero ())
+	remaining = milliseconds{ 1 };
+    }
+
+  b->requests[b->next] = std::move (req.request);
+
+  auto self = shared_from_this ();
+  auto wake = [self, b] ()
+    {
+      auto task = [self, b] (processor *pro)
+	{
+	  self->waiter_ = 0;
+	  self->run_batch (b, pro);
+	};
+      self->manager_.post (task);
+    };
+  waiter_ = pro->add_waiter (req.keys, wake);
+
+  auto waiter = waiter_;
+  auto timer_task = [self, b, waiter, remaining] ()
+    { self->start_block_timer (b, waiter, remaining); };
+  asio::post (strand_, timer_task);
+}
+
+void
+session::migrate (std::shared_ptr<batch> b, processor::migration m)
+{
+  auto self = shared_from_this ();
+  auto shared = std::make_shared<processor::migration> (std::move (m));
+  auto done = [self, b, shared] (result<void, std::string> res)
+    {
+      auto task = [self, b, shared, res] (processor *pro)
+	{
+	  b->responses.push_back (pro->finish_migration (*shared, res));
+	  b->next++;
+	  self->run_batch (b, pro);
+	};
+      self->manager_.post (task);
+    };
+  auto start_task = [self, shared, done] ()
+    {
+      auto link = std::make_shared<migrate_link> (
+	  self->strand_, shared->host, shared->port,
+	  std::move (shared->commands), shared->keys.size (), shared->timeout,
+	  done);
+      link->start ();
+    };
+  asio::post (strand_, start_task);
+}
+
+void
+session::run_script (std::shared_ptr<batch> b)
+{
+  auto self = shared_from_this ();
+  auto done = [self, b] (processor *pro, resp::data reply)
+    {
+      b->responses.push_back (std::move (reply));
+      b->next++;
+      self->run_batch (b, pro);
+    };
+  manager_.run_script_slices (done);
+}
+
+void
+session::start_block_timer (std::shared_ptr<batch> b, std::uint64_t waiter,
+			    milliseconds timeout)
+{
+  BOOST_ASSERT (strand_.running_in_this_thread ());
+  if (state_ == closed)
+    return;
+
+  // A blocked client is not idle.
+  ++idle_timer_gen_;
+  idle_timer_.cancel ();
+
+  if (timeout == milliseconds::zero ())
+    return;
+
+  auto self = shared_from_this ();
+  auto wait_cb = [self, b, waiter] (const error_code &ec)
+    {
+      if (ec)
+	return;
+
+      auto task = [self, b, waiter] (processor *pro)
+	{
+	  if (self->waiter_ != waiter || !pro->remove_waiter (waiter))
 	    return;
 
-	  self->results_.swap (*responses);
-	  if (should_close)
-	    self->state_ = close_after_send;
-	  self->start_send ();
+	  self->waiter_ = 0;
+	  b->responses.push_back (resp::array{ boost::none });
+	  b->next++;
+	  b->blocked = false;
+	  b->deadline = boost::none;
+	  self->run_batch (b, pro);
 	};
-      asio::post (self->strand_, send_task);
+      self->manager_.post (task);
     };
-  manager_.post (task);
+  block_timer_.expires_after (timeout);
+  block_timer_.async_wait (asio::bind_executor (strand_, wait_cb));
 }
 
 void
@@ -174,6 +371,11 @@ session::start_send ()
   BOOST_ASSERT (strand_.running_in_this_thread ());
   if (state_ == closed)
     return;
+  if (!pushes_in_flight_.empty ())
+    {
+      reply_waiting_ = true;
+      return;
+    }
 
   send_buffers_.clear ();
   send_buffers_.reserve (results_.size ());
@@ -193,13 +395,164 @@ session::start_send ()
 	return self->close ();
       if (self->state_ == close_after_send)
 	return self->close ();
+      if (self->state_ == stream_after_send)
+	return self->start_stream ();
 
+      self->replying_ = false;
+      self->send_pushes ();
       self->refresh_idle_timeout ();
       self->start_recv ();
     };
   asio::async_write (socket_, bufs, asio::bind_executor (strand_, write_cb));
 }
 
+void
+session::become_replica (std::shared_ptr<batch> b, processor *pro,
+			 const processor::sync_request &req)
+{
+  b->replica = true;
+
+  auto self = shared_from_this ();
+  auto feed = [self] (std::shared_ptr<const std::string> bytes)
+    {
+      auto task = [self, bytes] () { self->push (bytes); };
+      asio::post (self->strand_, task);
+    };
+  auto stream = [self] (processor::replica_source source)
+    {
+      auto task = [self, source] () { self->push_source (source); };
+      asio::post (self->strand_, task);
+    };
+  replica_ = pro->add_replica (req, feed, stream);
+}
+
+void
+session::start_stream ()
+{
+  BOOST_ASSERT (strand_.running_in_this_thread ());
+  if (state_ == closed)
+    return;
+
+  // A replica may stay silent for as long as there are no writes.
+  state_ = streaming;
+  ++idle_timer_gen_;
+  idle_timer_.cancel ();
+  discard_recv ();
+  send_pushes ();
+}
+
+void
+session::discard_recv ()
+{
+  auto self = shared_from_this ();
+  auto receive_cb = [self] (const error_code &ec, std::size_t)
+    {
+      if (ec)
+	return self->close ();
+      self->discard_recv ();
+    };
+  socket_.async_receive (asio::buffer (recv_buffer_),
+			 asio::bind_executor (strand_, receive_cb));
+}
+
+void
+session::push (std::shared_ptr<const std::string> bytes)
+{
+  BOOST_ASSERT (strand_.running_in_this_thread ());
+  if (state_ == closed)
+    return;
+  if (bytes == nullptr)
+    return close ();
+
+  pushed_bytes_ += bytes->size ();
+  pushes_.push_back (pending_push{ std::move (bytes), nullptr });
+  send_pushes ();
+}
+
+void
+session::push_message (std::shared_ptr<const std::string> bytes)
+{
+  BOOST_ASSERT (strand_.running_in_this_thread ());
+  if (state_ == closed)
+    return;
+
+  // A subscriber that reads its messages slower than they are published
+  // is disconnected, rather than having the server hold them all.
+  auto limit = manager_.get_config ().client_output_buffer_limit_pubsub;
+  if (limit != 0 && pushed_bytes_ + bytes->size () > limit)
+    return close ();
+  push (std::move (bytes));
+}
+
+void
+session::push_source (processor::replica_source source)
+{
+  BOOST_ASSERT (strand_.running_in_this_thread ());
+  if (state_ == closed)
+    return;
+
+  pushes_.push_back (pending_push{ nullptr, std::move (source) });
+  send_pushes ();
+}
+
+void
+session::send_pushes ()
+{
+  BOOST_ASSERT (strand_.running_in_this_thread ());
+  if (!pushes_in_flight_.empty () || pushes_.empty ())
+    return;
+  // The pushes of a subscriber go out between the replies, which keeps
+  // the confirmation of a subscription before the messages that follow.
+  if (state_ != streaming && (state_ != normal || replying_))
+    return;
+
+  // Everything pushed meanwhile goes out in a single write, up to a
+  // source: one piece is pulled from it, and the next once that has been
+  // written, so that only a piece at a time is held.
+  std::vector<asio::const_buffer> bufs;
+  bufs.reserve (pushes_.size ());
+  while (!pushes_.empty ())
+    {
+      auto &front = pushes_.front ();
+      if (front.source)
+	{
+	  auto piece = front.source ();
+	  if (piece == nullptr)
+	    {
+	      pushes_.pop_front ();
+	      continue;
+	    }
+	  pushed_bytes_ += piece->size ();
+	  bufs.push_back (asio::buffer (*piece));
+	  pushes_in_flight_.push_back (std::move (piece));
+	  break;
+	}
+      bufs.push_back (asio::buffer (*front.bytes));
+      pushes_in_flight_.push_back (std::move (front.bytes));
+      pushes_.pop_front ();
+    }
+  if (bufs.empty ())
+    return;
+
+  auto self = shared_from_this ();
+  auto write_cb = [self] (const error_code &ec, std::size_t)
+    {
+      BOOST_ASSERT (self->strand_.running_in_this_thread ());
+      for (const auto &i : self->pushes_in_flight_)
+	self->pushed_bytes_ -= i->size ();
+      self->pushes_in_flight_.clear ();
+      if (ec)
+	return self->close ();
+      if (self->reply_waiting_)
+	{
+	  self->reply_waiting_ = false;
+	  return self->start_send ();
+	}
+      self->send_pushes ();
+    };
+  asio::async_write (socket_, bufs, asio::bind_executor (strand_, write_cb));
+}
+
 void
 session::close ()
 {
@@ -210,10 +563,23 @@ session::close ()
       if (self->state_ != closed)
 	{
 	  self->idle_timer_.cancel ();
+	  self->block_timer_.cancel ();
 	  error_code ec;
 	  auto r = self->socket_.close (ec);
 	  (void) r;
 	  self->state_ = closed;
+
+	  auto unblock = [self] (processor *pro)
+	    {
+	      if (self->waiter_ != 0)
+		pro->remove_waiter (self->waiter_);
+	      self->waiter_ = 0;
+	      if (self->replica_ != 0)
+		pro->remove_replica (self->replica_);
+	      self->replica_ = 0;
+	      pro->remove_client (self->client_);
+	    };
+	  self->manager_.post (unblock);
 	}
     };
   asio::dispatch (strand_, task);
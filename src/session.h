@@ -21,34 +21,102 @@ public:
   void start ();
 
 private:
+  // A pipelined batch of requests executed on the manager strand.
+  struct batch
+  {
+    std::vector<resp::data> requests;
+    std::vector<resp::data> responses;
+    optional<std::string> parse_error;
+    std::size_t next = 0;
+    // Deadline of the request at next once it has blocked.
+    bool blocked = false;
+    optional<steady_clock::time_point> deadline;
+    // Set once PSYNC has turned the connection into a replica.
+    bool replica = false;
+    // Whether the client is subscribed to anything after the batch.
+    bool subscriber = false;
+  };
+
   void refresh_idle_timeout ();
   void start_recv ();
   void process ();
+  void run_batch (std::shared_ptr<batch> b, processor *pro);
+  void block (std::shared_ptr<batch> b, processor *pro,
+	      processor::block_request req);
+  void start_block_timer (std::shared_ptr<batch> b, std::uint64_t waiter,
+			  milliseconds timeout);
+  // Runs a MIGRATE against its target; the batch resumes with its reply.
+  void migrate (std::shared_ptr<batch> b, processor::migration m);
+  // Runs a paused script to its end; the batch resumes with its reply.
+  void run_script (std::shared_ptr<batch> b);
   void start_send ();
   void close ();
 
+  // Once the client is a replica, the replication stream is pushed to it,
+  // and whatever it sends is discarded. The messages of a subscribed
+  // client are pushed to it between the replies.
+  void become_replica (std::shared_ptr<batch> b, processor *pro,
+		       const processor::sync_request &req);
+  void start_stream ();
+  void discard_recv ();
+  void push (std::shared_ptr<const std::string> bytes);
+  void push_message (std::shared_ptr<const std::string> bytes);
+  void push_source (processor::replica_source source);
+  void send_pushes ();
+
 private:
   enum
   {
     normal,
     closed,
     close_after_send,
+    // A replica: the replication stream follows the replies.
+    stream_after_send,
+    streaming,
   };
 
   int state_;
+  // From the receipt of a batch until its replies are written, during
+  // which pushes wait, and whether the replies wait for pushes being
+  // written.
+  bool replying_;
+  bool reply_waiting_;
+  // A subscribed client is never idle: it waits for messages.
+  bool subscriber_;
   tcp::socket socket_;
   asio::strand<asio::any_io_executor> strand_;
 
   milliseconds idle_timeout_;
   std::uint64_t idle_timer_gen_;
   asio::steady_timer idle_timer_;
+  asio::steady_timer block_timer_;
 
   std::vector<resp::data> results_;
   std::array<char, 4096> recv_buffer_;
   std::vector<std::string> send_buffers_;
 
+  // The bytes pushed to a replica or a subscriber, or the sources their
+  // pieces are pulled from once the ones before are written, and the bytes
+  // being written.
+  struct pending_push
+  {
+    std::shared_ptr<const std::string> bytes;
+    processor::replica_source source;
+  };
+  std::deque<pending_push> pushes_;
+  std::vector<std::shared_ptr<const std::string>> pushes_in_flight_;
+  // The bytes pushed, queued or being written.
+  std::size_t pushed_bytes_;
+
   manager &manager_;
   resp::parser parser_;
+
+  // The waiter the client is blocked on, or 0, the replica the client is,
+  // or 0, and the state its commands carry over. Only accessed on the
+  // manager strand.
+  std::uint64_t waiter_;
+  std::uint64_t replica_;
+  processor::client_state client_;
 }; // class session
 
 } // namespace mini_redis
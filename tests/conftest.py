@@ -115,6 +115,33 @@ def server() -> Iterator[Dict[str, object]]:
     _stop_process(process)
 
 
+@pytest.fixture
+def spawn_server(
+    tmp_path: Path,
+) -> Iterator[Callable[..., Dict[str, object]]]:
+    """Starts extra servers with the given options, in a scratch directory."""
+    server_bin = _server_bin()
+    processes: list[subprocess.Popen[str]] = []
+
+    def _spawn(*args: str) -> Dict[str, object]:
+        port = _pick_free_port()
+        process = subprocess.Popen(
+            [str(server_bin), "--port", str(port), *args],
+            cwd=str(tmp_path),
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+            text=True,
+        )
+        processes.append(process)
+        _wait_server_ready(process, port)
+        return {"host": HOST, "port": port, "process": process, "dir": tmp_path}
+
+    yield _spawn
+
+    for process in processes:
+        _stop_process(process)
+
+
 @pytest.fixture(scope="session")
 def server_addr(server: Dict[str, object]) -> tuple[str, int]:
     host = str(server["host"])
@@ -145,7 +172,7 @@ def redis_client(server_addr: tuple[str, int]) -> Iterator[redis.Redis]:
         socket_connect_timeout=1.0,
         socket_timeout=1.0,
     )
-    for cmd in ("PING", "SET", "LSET", "SAVE", "LOAD"):
+    for cmd in ("PING", "SET", "LSET", "SAVE", "LOAD", "ZADD"):
         client.set_response_callback(cmd, _raw_response)
 
     try:
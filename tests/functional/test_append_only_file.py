@@ -0,0 +1,293 @@
+from __future__ import annotations
+
+import threading
+import time
+
+import pytest
+import redis
+
+
+def _client(info) -> redis.Redis:
+    return redis.Redis(
+        host=str(info["host"]),
+        port=int(info["port"]),
+        decode_responses=True,
+        socket_connect_timeout=1.0,
+        socket_timeout=5.0,
+    )
+
+
+def _stop(info) -> None:
+    process = info["process"]
+    process.terminate()
+    process.wait(timeout=5.0)
+
+
+def test_aof_replays_writes_after_restart(spawn_server) -> None:
+    info = spawn_server("--appendonly", "yes")
+    client = _client(info)
+    client.set("str", "hello")
+    client.incrby("counter", 41)
+    client.incr("counter")
+    client.rpush("list", "a", "b", "c")
+    client.lpop("list")
+    client.execute_command("ZADD", "zset", "1.5", "m1", "2", "m2")
+    client.pfadd("hll", "x", "y", "z")
+    client.setbit("bits", 7, 1)
+    stream_id = client.xadd("stream", {"f": "v"})
+    client.set("gone", "1")
+    client.delete("gone")
+    client.close()
+    _stop(info)
+
+    info = spawn_server("--appendonly", "yes")
+    client = _client(info)
+    assert client.get("str") == "hello"
+    assert client.get("counter") == "42"
+    assert client.lrange("list", 0, -1) == ["b", "c"]
+    assert client.zscore("zset", "m1") == 1.5
+    assert client.pfcount("hll") == 3
+    assert client.getbit("bits", 7) == 1
+    assert client.xrange("stream") == [(stream_id, {"f": "v"})]
+    assert client.get("gone") is None
+    assert client.info("persistence")["aof_enabled"] == 1
+    client.close()
+
+
+def test_aof_logs_relative_expirations_as_absolute(spawn_server) -> None:
+    info = spawn_server("--appendonly", "yes")
+    client = _client(info)
+    client.set("ex", "v", ex=100)
+    client.setex("setex", 100, "v")
+    client.set("expire", "v")
+    client.expire("expire", 100)
+    client.set("short", "v", px=300)
+    time.sleep(1.1)
+    client.close()
+    _stop(info)
+
+    info = spawn_server("--appendonly", "yes")
+    client = _client(info)
+    for key in ("ex", "setex", "expire"):
+        assert 0 < client.ttl(key) <= 99
+    assert client.get("short") is None
+    client.close()
+
+
+def test_aof_logs_deletion_of_expired_keys(spawn_server) -> None:
+    info = spawn_server("--appendonly", "yes")
+    client = _client(info)
+    client.set("key", "5", px=100)
+    time.sleep(0.2)
+    assert client.incr("key") == 1
+    client.close()
+    _stop(info)
+
+    info = spawn_server("--appendonly", "yes")
+    client = _client(info)
+    assert client.get("key") == "1"
+    assert client.ttl("key") == -1
+    client.close()
+
+
+def test_aof_drops_truncated_last_command(spawn_server) -> None:
+    info = spawn_server("--appendonly", "yes", "--appendfsync", "always")
+    client = _client(info)
+    client.set("key", "value")
+    client.close()
+    _stop(info)
+
+    path = info["dir"] / "appendonly.aof"
+    size = path.stat().st_size
+    with path.open("ab") as f:
+        f.write(b"*3\r\n$3\r\nSET\r\n$5\r\nother\r\n$2\r\nv")
+
+    info = spawn_server("--appendonly", "yes")
+    client = _client(info)
+    assert client.get("key") == "value"
+    assert client.get("other") is None
+    assert path.stat().st_size == size
+    client.set("after", "1")
+    client.close()
+    _stop(info)
+
+    info = spawn_server("--appendonly", "yes")
+    client = _client(info)
+    assert client.get("after") == "1"
+    client.close()
+
+
+def test_aof_refuses_to_start_on_corrupted_file(spawn_server, tmp_path) -> None:
+    (tmp_path / "appendonly.aof").write_bytes(b"garbage\r\n")
+    with pytest.raises(RuntimeError, match="append-only file"):
+        spawn_server("--appendonly", "yes")
+
+
+def test_aof_custom_file_name(spawn_server, tmp_path) -> None:
+    info = spawn_server(
+        "--appendonly", "yes", "--appendfilename", "custom.aof",
+        "--appendfsync", "no",
+    )
+    client = _client(info)
+    client.set("key", "value")
+    client.close()
+    _stop(info)
+    assert (tmp_path / "custom.aof").stat().st_size > 0
+    assert not (tmp_path / "appendonly.aof").exists()
+
+
+def test_aof_always_keeps_acknowledged_writes_on_crash(spawn_server) -> None:
+    args = ("--appendonly", "yes", "--appendfsync", "always")
+    info = spawn_server(*args)
+    acked = {"counter": 0, "keys": 0}
+    failed = threading.Event()
+
+    def _write() -> None:
+        client = _client(info)
+        n = 0
+        try:
+            while True:
+                pipe = client.pipeline(transaction=False)
+                for i in range(n, n + 50):
+                    pipe.incr("counter")
+                    pipe.set(f"key:{i}", i)
+                results = pipe.execute()
+                n += 50
+                acked["counter"] = int(results[-2])
+                acked["keys"] = n
+        except (redis.ConnectionError, redis.TimeoutError):
+            failed.set()
+        finally:
+            client.close()
+
+    writers = [threading.Thread(target=_write)]
+    writers[0].start()
+    time.sleep(0.5)
+    assert not failed.is_set()
+    info["process"].kill()
+    info["process"].wait(timeout=5.0)
+    writers[0].join(timeout=5.0)
+    assert failed.is_set()
+    assert acked["keys"] > 0
+
+    info = spawn_server(*args)
+    client = _client(info)
+    assert int(client.get("counter")) >= acked["counter"]
+    keys = [f"key:{i}" for i in range(acked["keys"])]
+    for start in range(0, len(keys), 1000):
+        chunk = keys[start:start + 1000]
+        values = client.mget(chunk)
+        assert values == [k.split(":")[1] for k in chunk]
+    client.close()
+
+
+def _wait_for_rewrite(client: redis.Redis) -> None:
+    deadline = time.monotonic() + 10.0
+    while time.monotonic() < deadline:
+        info = client.info("persistence")
+        if info["aof_rewrite_in_progress"] == 0:
+            assert info["aof_last_bgrewrite_status"] == "ok"
+            return
+        time.sleep(0.05)
+    raise AssertionError("BGREWRITEAOF did not finish in time")
+
+
+def test_bgrewriteaof_compacts_the_file(spawn_server, tmp_path) -> None:
+    info = spawn_server("--appendonly", "yes")
+    client = _client(info)
+    pipe = client.pipeline(transaction=False)
+    for _ in range(2000):
+        pipe.incr("counter")
+    pipe.execute()
+    client.xadd("stream", {"f": "v"}, id="5-1")
+    client.set("ttl", "v", ex=100)
+    path = tmp_path / "appendonly.aof"
+    before = path.stat().st_size
+
+    assert client.bgrewriteaof() is True
+    # Writes made while the child runs end up in the new file as well.
+    client.incr("counter")
+    client.set("during", "1")
+    _wait_for_rewrite(client)
+    client.set("after", "1")
+    client.close()
+    _stop(info)
+
+    assert path.stat().st_size < before / 10
+    assert not (tmp_path / "appendonly.aof.tmp").exists()
+
+    info = spawn_server("--appendonly", "yes")
+    client = _client(info)
+    assert client.get("counter") == "2001"
+    assert client.xrange("stream") == [("5-1", {"f": "v"})]
+    assert 0 < client.ttl("ttl") <= 100
+    assert client.get("during") == "1"
+    assert client.get("after") == "1"
+    client.close()
+
+
+def test_bgrewriteaof_keeps_keys_expiring_after_the_rewrite(spawn_server) -> None:
+    info = spawn_server("--appendonly", "yes")
+    client = _client(info)
+    client.set("key", "5", px=500)
+    client.bgrewriteaof()
+    _wait_for_rewrite(client)
+    # The key is still alive here, so the log relies on its base value.
+    client.append("key", "x")
+    client.bitop("OR", "copy", "key")
+    time.sleep(0.6)
+    client.close()
+    _stop(info)
+
+    info = spawn_server("--appendonly", "yes")
+    client = _client(info)
+    assert client.get("key") is None
+    assert client.get("copy") == "5x"
+    client.close()
+
+
+def test_bgrewriteaof_twice_in_a_row(spawn_server) -> None:
+    info = spawn_server("--appendonly", "yes")
+    client = _client(info)
+    client.set("key", "value")
+    client.bgrewriteaof()
+    _wait_for_rewrite(client)
+    client.set("key", "second")
+    client.bgrewriteaof()
+    _wait_for_rewrite(client)
+    client.close()
+    _stop(info)
+
+    info = spawn_server("--appendonly", "yes")
+    client = _client(info)
+    assert client.get("key") == "second"
+    client.close()
+
+
+def test_load_rewrites_the_log_rather_than_logging_itself(spawn_server, tmp_path) -> None:
+    info = spawn_server("--appendonly", "yes")
+    client = _client(info)
+    client.set("a", 1)
+    assert client.save() is True
+    client.incr("a")
+    assert client.execute_command("LOAD") == "OK"
+    assert client.get("a") == "1"
+    client.incr("a")
+
+    # The log is rewritten from the loaded dataset, and LOAD is not in it:
+    # replaying it would load the file as it is at restart.
+    path = tmp_path / "appendonly.aof"
+    deadline = time.monotonic() + 10.0
+    while path.read_bytes().count(b"INCR") > 1:
+        assert time.monotonic() < deadline, "the log was not rewritten after LOAD"
+        time.sleep(0.05)
+    _wait_for_rewrite(client)
+    assert b"LOAD" not in path.read_bytes()
+    assert client.save() is True
+    client.close()
+    _stop(info)
+
+    info = spawn_server("--appendonly", "yes")
+    client = _client(info)
+    assert client.get("a") == "2"
+    client.close()
@@ -0,0 +1,151 @@
+from __future__ import annotations
+
+import pytest
+from redis.exceptions import ResponseError
+
+from _helpers import assert_error_contains
+
+
+def test_setbit_getbit_and_bitcount(redis_client, make_key) -> None:
+    key = make_key("bits")
+    missing = make_key("missing")
+
+    assert redis_client.execute_command("SETBIT", key, 7, 1) == 0
+    assert redis_client.execute_command("SETBIT", key, 7, 1) == 1
+    assert redis_client.execute_command("GETBIT", key, 7) == 1
+    assert redis_client.execute_command("GETBIT", key, 100) == 0
+    assert redis_client.execute_command("GETBIT", missing, 0) == 0
+    assert redis_client.execute_command("GET", key) == "\x01"
+
+    redis_client.execute_command("SET", key, "foobar")
+    assert redis_client.execute_command("BITCOUNT", key) == 26
+    assert redis_client.execute_command("BITCOUNT", key, 0, 0) == 4
+    assert redis_client.execute_command("BITCOUNT", key, 1, 1) == 6
+    assert redis_client.execute_command("BITCOUNT", key, 1, 1, "BYTE") == 6
+    assert redis_client.execute_command("BITCOUNT", key, 5, 30, "BIT") == 17
+    assert redis_client.execute_command("BITCOUNT", missing) == 0
+
+
+def test_bitcount_matches_python_on_long_strings(redis_client, make_key) -> None:
+    key = make_key("long")
+    data = bytes((i * 37 + 11) & 0xFF for i in range(10007))
+    redis_client.execute_command("SET", key, data)
+
+    expected = sum(bin(b).count("1") for b in data)
+    assert redis_client.execute_command("BITCOUNT", key) == expected
+    assert redis_client.execute_command("BITCOUNT", key, 3, -5) == sum(
+        bin(b).count("1") for b in data[3:-4]
+    )
+
+
+def test_bitpos(redis_client, make_key) -> None:
+    key = make_key("pos")
+    missing = make_key("missing")
+
+    redis_client.execute_command("SET", key, b"\xff\xf0\x00")
+    assert redis_client.execute_command("BITPOS", key, 0) == 12
+    assert redis_client.execute_command("BITPOS", key, 1, 2) == -1
+    assert redis_client.execute_command("BITPOS", key, 1, 7, 15, "BIT") == 7
+
+    redis_client.execute_command("SET", key, b"\xff\xff")
+    assert redis_client.execute_command("BITPOS", key, 0) == 16
+    assert redis_client.execute_command("BITPOS", key, 0, 0, -1) == -1
+
+    assert redis_client.execute_command("BITPOS", missing, 1) == -1
+    assert redis_client.execute_command("BITPOS", missing, 0) == 0
+
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("BITPOS", key, 2)
+    assert_error_contains(exc_info.value, "bit argument")
+
+
+def test_bitop(redis_client, make_key) -> None:
+    a = make_key("a")
+    b = make_key("b")
+    dest = make_key("dest")
+    missing = make_key("missing")
+
+    redis_client.execute_command("SET", a, b"\x0f\xff\x01")
+    redis_client.execute_command("SET", b, b"\xf0\x0f")
+
+    assert redis_client.execute_command("BITOP", "AND", dest, a, b) == 3
+    assert redis_client.execute_command("GET", dest) == "\x00\x0f\x00"
+    assert redis_client.execute_command("BITOP", "OR", dest, a, b) == 3
+    assert redis_client.execute_command("BITCOUNT", dest) == 17
+    assert redis_client.execute_command("BITOP", "XOR", dest, a, b) == 3
+    assert redis_client.execute_command("BITCOUNT", dest) == 13
+    assert redis_client.execute_command("BITOP", "NOT", dest, b) == 2
+    assert redis_client.execute_command("BITCOUNT", dest) == 8
+
+    assert redis_client.execute_command("BITOP", "AND", dest, missing) == 0
+    assert redis_client.execute_command("GET", dest) is None
+
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("BITOP", "NOT", dest, a, b)
+    assert_error_contains(exc_info.value, "single source")
+
+
+def test_bitop_on_large_strings(redis_client, make_key) -> None:
+    a = make_key("large-a")
+    b = make_key("large-b")
+    dest = make_key("large-dest")
+
+    da = bytes((i * 7) & 0xFF for i in range(200000))
+    db = bytes((i * 13 + 5) & 0xFF for i in range(150000))
+    redis_client.execute_command("SET", a, da)
+    redis_client.execute_command("SET", b, db)
+
+    assert redis_client.execute_command("BITOP", "XOR", dest, a, b) == len(da)
+    expected = bytes(x ^ y for x, y in zip(da, db)) + da[len(db) :]
+    count = sum(bin(x).count("1") for x in expected)
+    assert redis_client.execute_command("BITCOUNT", dest) == count
+
+
+def test_bitfield(redis_client, make_key) -> None:
+    key = make_key("field")
+
+    assert redis_client.execute_command(
+        "BITFIELD", key, "SET", "i8", 0, 100, "GET", "i8", 0
+    ) == [0, 100]
+    assert redis_client.execute_command("BITFIELD", key, "INCRBY", "i8", 0, 100) == [
+        -56
+    ]
+    assert redis_client.execute_command(
+        "BITFIELD", key, "OVERFLOW", "SAT", "INCRBY", "i8", 0, -200
+    ) == [-128]
+    assert redis_client.execute_command(
+        "BITFIELD", key, "OVERFLOW", "FAIL", "INCRBY", "i8", 0, -1
+    ) == [None]
+
+    assert redis_client.execute_command(
+        "BITFIELD", key, "SET", "u4", "#2", 15, "GET", "u4", "#2", "GET", "u16", 0
+    ) == [0, 15, 0x80F0]
+    assert redis_client.execute_command(
+        "BITFIELD", key, "OVERFLOW", "SAT", "INCRBY", "u4", 8, 5
+    ) == [15]
+    assert redis_client.execute_command("BITFIELD_RO", key, "GET", "u4", 8) == [15]
+
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("BITFIELD_RO", key, "SET", "u4", 8, 1)
+    assert_error_contains(exc_info.value, "only supports the get")
+
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("BITFIELD", key, "GET", "u64", 0)
+    assert_error_contains(exc_info.value, "invalid bitfield type")
+
+
+def test_bitmap_wrong_type(redis_client, make_key) -> None:
+    key = make_key("wrong-type")
+    redis_client.execute_command("RPUSH", key, "a")
+
+    for command, args in (
+        ("SETBIT", (key, 0, 1)),
+        ("GETBIT", (key, 0)),
+        ("BITCOUNT", (key,)),
+        ("BITPOS", (key, 1)),
+        ("BITOP", ("AND", make_key("dest"), key)),
+        ("BITFIELD", (key, "GET", "u8", 0)),
+    ):
+        with pytest.raises(ResponseError) as exc_info:
+            redis_client.execute_command(command, *args)
+        assert_error_contains(exc_info.value, "wrongtype")
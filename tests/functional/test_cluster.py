@@ -0,0 +1,195 @@
+from __future__ import annotations
+
+import pytest
+import redis
+from redis.exceptions import ResponseError
+
+from _helpers import assert_error_contains
+
+
+def _client(info, decode: bool = True) -> redis.Redis:
+    return redis.Redis(
+        host=str(info["host"]),
+        port=int(info["port"]),
+        decode_responses=decode,
+        socket_connect_timeout=1.0,
+        socket_timeout=5.0,
+        single_connection_client=True,
+    )
+
+
+def _spawn_node(spawn_server, tmp_path, name: str):
+    data_dir = tmp_path / name
+    data_dir.mkdir()
+    info = spawn_server("--dir", str(data_dir), "--cluster-enabled", "yes")
+    return info, _client(info)
+
+
+def _meet(a: redis.Redis, a_info, b: redis.Redis, b_info) -> tuple[str, str]:
+    a_id = a.execute_command("CLUSTER", "MYID")
+    b_id = b.execute_command("CLUSTER", "MYID")
+    assert a.execute_command("CLUSTER", "MEET", b_info["host"], b_info["port"], b_id) == "OK"
+    assert b.execute_command("CLUSTER", "MEET", a_info["host"], a_info["port"], a_id) == "OK"
+    return a_id, b_id
+
+
+def _redirect(call, *args) -> str:
+    with pytest.raises(ResponseError) as exc_info:
+        call(*args)
+    return str(exc_info.value)
+
+
+def _assign(node: redis.Redis, first: int, last: int, node_id: str) -> None:
+    """Tells node that node_id owns the slots, as there is no cluster bus."""
+    pipe = node.pipeline(transaction=False)
+    for slot in range(first, last + 1):
+        pipe.execute_command("CLUSTER", "SETSLOT", slot, "NODE", node_id)
+    assert all(reply == "OK" for reply in pipe.execute())
+
+
+def test_keyslot_follows_hash_tags(spawn_server, tmp_path) -> None:
+    _, node = _spawn_node(spawn_server, tmp_path, "node")
+
+    assert node.execute_command("CLUSTER", "KEYSLOT", "123456789") == 12739
+    assert node.execute_command("CLUSTER", "KEYSLOT", "foo") == 12182
+    assert node.execute_command("CLUSTER", "KEYSLOT", "{user1000}.following") == node.execute_command(
+        "CLUSTER", "KEYSLOT", "{user1000}.followers"
+    )
+    # An empty tag does not count: the whole key is hashed.
+    assert node.execute_command("CLUSTER", "KEYSLOT", "foo{}{bar}") != node.execute_command(
+        "CLUSTER", "KEYSLOT", "bar"
+    )
+
+
+def test_cluster_commands_need_cluster_mode(redis_client) -> None:
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("CLUSTER", "MYID")
+    assert_error_contains(exc_info.value, "cluster support disabled")
+
+
+def test_keys_are_redirected_to_the_owner_of_their_slot(spawn_server, tmp_path) -> None:
+    a_info, a = _spawn_node(spawn_server, tmp_path, "a")
+    b_info, b = _spawn_node(spawn_server, tmp_path, "b")
+
+    with pytest.raises(ResponseError) as exc_info:
+        a.execute_command("SET", "foo", "bar")
+    assert_error_contains(exc_info.value, "CLUSTERDOWN")
+
+    a_id, b_id = _meet(a, a_info, b, b_info)
+    assert a.execute_command("CLUSTER", "ADDSLOTSRANGE", 0, 8191) == "OK"
+    assert b.execute_command("CLUSTER", "ADDSLOTSRANGE", 8192, 16383) == "OK"
+    _assign(a, 8192, 16383, b_id)
+    _assign(b, 0, 8191, a_id)
+
+    with pytest.raises(ResponseError) as exc_info:
+        a.execute_command("CLUSTER", "ADDSLOTS", 100)
+    assert_error_contains(exc_info.value, "already busy")
+
+    # "foo" hashes to 12182, owned by b.
+    assert b.execute_command("SET", "foo", "bar") is True
+    assert _redirect(a.execute_command, "GET", "foo") == f"MOVED 12182 {b_info['host']}:{b_info['port']}"
+
+    with pytest.raises(ResponseError) as exc_info:
+        b.execute_command("MSET", "foo", "1", "bar", "2")
+    assert_error_contains(exc_info.value, "CROSSSLOT")
+    assert b.execute_command("MSET", "{foo}a", "1", "{foo}b", "2") is True
+    assert b.execute_command("MGET", "{foo}a", "{foo}b") == ["1", "2"]
+
+    info = a.execute_command("CLUSTER", "INFO")
+    assert "cluster_state:ok" in info
+    assert "cluster_known_nodes:2" in info
+
+    slots = sorted(a.execute_command("CLUSTER", "SLOTS"))
+    assert slots == [
+        [0, 8191, [a_info["host"], a_info["port"], a_id]],
+        [8192, 16383, [b_info["host"], b_info["port"], b_id]],
+    ]
+    shards = a.execute_command("CLUSTER", "SHARDS")
+    assert len(shards) == 2
+
+    assert a.execute_command("CLUSTER", "COUNTKEYSINSLOT", 12182) == 0
+    assert b.execute_command("CLUSTER", "COUNTKEYSINSLOT", 12182) == 3
+    assert sorted(b.execute_command("CLUSTER", "GETKEYSINSLOT", 12182, 10)) == ["foo", "{foo}a", "{foo}b"]
+    assert len(b.execute_command("CLUSTER", "GETKEYSINSLOT", 12182, 2)) == 2
+
+
+def test_slot_migrates_live_with_ask_redirections(spawn_server, tmp_path) -> None:
+    a_info, a = _spawn_node(spawn_server, tmp_path, "a")
+    b_info, b = _spawn_node(spawn_server, tmp_path, "b")
+    a_id, b_id = _meet(a, a_info, b, b_info)
+    assert a.execute_command("CLUSTER", "ADDSLOTSRANGE", 0, 16383) == "OK"
+    _assign(b, 0, 16383, a_id)
+
+    slot = a.execute_command("CLUSTER", "KEYSLOT", "{t}")
+    a.execute_command("SET", "{t}one", "1")
+    a.execute_command("SET", "{t}two", "2", "EX", 100)
+    a.execute_command("RPUSH", "{t}list", "x", "y")
+
+    assert b.execute_command("CLUSTER", "SETSLOT", slot, "IMPORTING", a_id) == "OK"
+    assert a.execute_command("CLUSTER", "SETSLOT", slot, "MIGRATING", b_id) == "OK"
+
+    assert sorted(a.execute_command("CLUSTER", "GETKEYSINSLOT", slot, 10)) == ["{t}list", "{t}one", "{t}two"]
+    assert a.execute_command("MIGRATE", b_info["host"], b_info["port"], "{t}one", 0, 5000) == "OK"
+
+    # Gone from a: asked to b, where only ASKING lets the command in.
+    assert _redirect(a.execute_command, "GET", "{t}one") == f"ASK {slot} {b_info['host']}:{b_info['port']}"
+    assert _redirect(b.execute_command, "GET", "{t}one").startswith("MOVED")
+    assert b.execute_command("ASKING") is True
+    assert b.execute_command("GET", "{t}one") == "1"
+
+    # Still on a, or split over both nodes.
+    assert a.execute_command("GET", "{t}two") == "2"
+    assert _redirect(a.execute_command, "MGET", "{t}one", "{t}two").startswith("TRYAGAIN")
+
+    assert (
+        a.execute_command("MIGRATE", b_info["host"], b_info["port"], "", 0, 5000, "KEYS", "{t}two", "{t}list")
+        == "OK"
+    )
+    assert a.execute_command("CLUSTER", "COUNTKEYSINSLOT", slot) == 0
+    assert a.execute_command("MIGRATE", b_info["host"], b_info["port"], "{t}one", 0, 5000) == "NOKEY"
+
+    for node in (a, b):
+        assert node.execute_command("CLUSTER", "SETSLOT", slot, "NODE", b_id) == "OK"
+    assert _redirect(a.execute_command, "LRANGE", "{t}list", 0, -1) == f"MOVED {slot} {b_info['host']}:{b_info['port']}"
+    assert b.execute_command("LRANGE", "{t}list", 0, -1) == ["x", "y"]
+    assert 0 < b.execute_command("TTL", "{t}two") <= 100
+    assert b.execute_command("CLUSTER", "COUNTKEYSINSLOT", slot) == 3
+
+
+def test_migrate_reports_target_errors(spawn_server, tmp_path) -> None:
+    a_info, a = _spawn_node(spawn_server, tmp_path, "a")
+    b_info = spawn_server("--dir", str(tmp_path))
+    b = _client(b_info)
+    a.execute_command("CLUSTER", "ADDSLOTSRANGE", 0, 16383)
+
+    a.execute_command("SET", "key", "mine")
+    b.execute_command("SET", "key", "theirs")
+    with pytest.raises(ResponseError) as exc_info:
+        a.execute_command("MIGRATE", b_info["host"], b_info["port"], "key", 0, 5000)
+    assert_error_contains(exc_info.value, "BUSYKEY")
+    assert a.execute_command("GET", "key") == "mine"
+
+    assert a.execute_command("MIGRATE", b_info["host"], b_info["port"], "key", 0, 5000, "COPY", "REPLACE") == "OK"
+    assert a.execute_command("GET", "key") == "mine"
+    assert b.execute_command("GET", "key") == "mine"
+
+
+def test_dump_restore_round_trip(spawn_server, tmp_path) -> None:
+    node = _client(spawn_server("--dir", str(tmp_path)), decode=False)
+    node.execute_command("ZADD", "z", 1, "a", 2, "b")
+    payload = node.execute_command("DUMP", "z")
+    assert node.execute_command("DUMP", "missing") is None
+
+    with pytest.raises(ResponseError) as exc_info:
+        node.execute_command("RESTORE", "z", 0, payload)
+    assert_error_contains(exc_info.value, "BUSYKEY")
+    assert node.execute_command("RESTORE", "copy", 0, payload) == b"OK"
+    assert node.execute_command("ZRANGE", "copy", 0, -1, "WITHSCORES") == [b"a", b"1", b"b", b"2"]
+
+    assert node.execute_command("RESTORE", "copy", 5000, payload, "REPLACE") == b"OK"
+    assert 0 < node.execute_command("PTTL", "copy") <= 5000
+
+    corrupt = payload[:-1] + bytes([payload[-1] ^ 0xFF])
+    with pytest.raises(ResponseError) as exc_info:
+        node.execute_command("RESTORE", "other", 0, corrupt)
+    assert_error_contains(exc_info.value, "checksum")
@@ -27,6 +27,27 @@ def test_del_requires_at_least_one_key(redis_client) -> None:
     assert_error_contains(exc_info.value, "wrong number of arguments")
 
 
+def test_delex_removes_key_only_when_condition_holds(redis_client, make_key) -> None:
+    lock = make_key("lock")
+    assert redis_client.execute_command("SET", lock, "token-1", "NX", "PX", 5000) == "OK"
+    assert redis_client.execute_command("DELEX", lock, "IFEQ", "token-2") == 0
+    assert redis_client.execute_command("DELEX", lock, "IFNE", "token-1") == 0
+    assert redis_client.execute_command("GET", lock) == "token-1"
+    assert redis_client.execute_command("DELEX", lock, "ifeq", "token-1") == 1
+    assert redis_client.execute_command("GET", lock) is None
+    assert redis_client.execute_command("DELEX", lock, "IFEQ", "token-1") == 0
+
+    assert redis_client.execute_command("SET", lock, "v") == "OK"
+    assert redis_client.execute_command("DELEX", lock) == 1
+
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("DELEX", lock, "IFEQ")
+    assert_error_contains(exc_info.value, "wrong number of arguments")
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("DELEX", lock, "IF", "v")
+    assert_error_contains(exc_info.value, "syntax error")
+
+
 def test_expire_and_ttl_main_flow(redis_client, make_key) -> None:
     key = make_key("expire")
     assert redis_client.execute_command("SET", key, "v") == "OK"
@@ -0,0 +1,89 @@
+from __future__ import annotations
+
+import pytest
+from redis.exceptions import ResponseError
+
+from _helpers import assert_error_contains, assert_in_range
+
+
+def _pfadd_range(redis_client, key: str, prefix: str, start: int, stop: int) -> None:
+    for i in range(start, stop, 1000):
+        elements = [f"{prefix}{j}" for j in range(i, min(stop, i + 1000))]
+        redis_client.execute_command("PFADD", key, *elements)
+
+
+def test_pfadd_and_pfcount_main_flow(redis_client, make_key) -> None:
+    key = make_key("pfadd")
+    missing = make_key("missing")
+
+    assert redis_client.execute_command("PFADD", key, "a", "b", "c") == 1
+    assert redis_client.execute_command("PFADD", key, "a", "b") == 0
+    assert redis_client.execute_command("PFCOUNT", key) == 3
+    assert redis_client.execute_command("PFCOUNT", missing) == 0
+
+
+def test_pfadd_without_elements_creates_key(redis_client, make_key) -> None:
+    key = make_key("pfadd-empty")
+
+    assert redis_client.execute_command("PFADD", key) == 1
+    assert redis_client.execute_command("PFADD", key) == 0
+    assert redis_client.execute_command("PFCOUNT", key) == 0
+
+
+def test_pfcount_error_is_small_for_dense_encoding(redis_client, make_key) -> None:
+    key = make_key("dense")
+    n = 50000
+    _pfadd_range(redis_client, key, "e", 0, n)
+
+    count = int(redis_client.execute_command("PFCOUNT", key))
+    assert_in_range(count, int(n * 0.97), int(n * 1.03))
+
+
+def test_pfcount_and_pfmerge_union(redis_client, make_key) -> None:
+    k1 = make_key("u1")
+    k2 = make_key("u2")
+    k3 = make_key("u3")
+    dest = make_key("dest")
+
+    _pfadd_range(redis_client, k1, "e", 0, 20000)
+    _pfadd_range(redis_client, k2, "e", 10000, 30000)
+    assert redis_client.execute_command("PFADD", k3, "x", "y") == 1
+
+    union = int(redis_client.execute_command("PFCOUNT", k1, k2, k3))
+    assert_in_range(union, int(30002 * 0.97), int(30002 * 1.03))
+
+    assert redis_client.execute_command("PFMERGE", dest, k1, k2, k3)
+    assert int(redis_client.execute_command("PFCOUNT", dest)) == union
+
+
+def test_hyperloglog_wrong_type(redis_client, make_key) -> None:
+    key = make_key("wrong-type")
+    other = make_key("other")
+    assert redis_client.execute_command("SET", key, "v") == "OK"
+
+    for command, args in (
+        ("PFADD", (key, "a")),
+        ("PFCOUNT", (key,)),
+        ("PFCOUNT", (other, key)),
+        ("PFMERGE", (other, key)),
+    ):
+        with pytest.raises(ResponseError) as exc_info:
+            redis_client.execute_command(command, *args)
+        assert_error_contains(exc_info.value, "wrongtype")
+
+
+def test_hyperloglog_survives_save_and_load(redis_client, make_key, tmp_path) -> None:
+    sparse = make_key("persist-sparse")
+    dense = make_key("persist-dense")
+    snapshot = tmp_path / "hll.mrdb"
+
+    redis_client.execute_command("PFADD", sparse, "a", "b", "c")
+    _pfadd_range(redis_client, dense, "e", 0, 5000)
+    expected = int(redis_client.execute_command("PFCOUNT", dense))
+
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot)) == "OK"
+    redis_client.execute_command("DEL", sparse, dense)
+    assert redis_client.execute_command("LOAD", "FROM", str(snapshot)) == "OK"
+
+    assert redis_client.execute_command("PFCOUNT", sparse) == 3
+    assert int(redis_client.execute_command("PFCOUNT", dense)) == expected
@@ -0,0 +1,93 @@
+from __future__ import annotations
+
+import time
+
+import redis
+
+
+def _client(info) -> redis.Redis:
+    return redis.Redis(
+        host=str(info["host"]),
+        port=int(info["port"]),
+        decode_responses=True,
+        socket_connect_timeout=1.0,
+        socket_timeout=5.0,
+    )
+
+
+def _next_message(pubsub, timeout: float = 5.0):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        message = pubsub.get_message(timeout=0.1)
+        if message is not None:
+            return message
+    raise AssertionError("no message before timeout")
+
+
+def _events(pubsub, count: int) -> list[tuple[str, str]]:
+    return [(m["channel"], m["data"]) for m in (_next_message(pubsub) for _ in range(count))]
+
+
+def test_writes_publish_keyspace_and_keyevent_messages(spawn_server, tmp_path) -> None:
+    client = _client(spawn_server("--dir", str(tmp_path), "--notify-keyspace-events", "KEA"))
+    pubsub = client.pubsub()
+    try:
+        pubsub.psubscribe("__key*__:*")
+        assert _next_message(pubsub)["type"] == "psubscribe"
+
+        client.execute_command("SET", "foo", "bar")
+        assert _events(pubsub, 2) == [("__keyspace@0__:foo", "set"), ("__keyevent@0__:set", "foo")]
+
+        client.execute_command("EXPIRE", "foo", 100)
+        assert _events(pubsub, 2) == [("__keyspace@0__:foo", "expire"), ("__keyevent@0__:expire", "foo")]
+
+        client.execute_command("RPUSH", "list", "a")
+        client.execute_command("LPOP", "list")
+        assert _events(pubsub, 6) == [
+            ("__keyspace@0__:list", "rpush"),
+            ("__keyevent@0__:rpush", "list"),
+            ("__keyspace@0__:list", "lpop"),
+            ("__keyevent@0__:lpop", "list"),
+            ("__keyspace@0__:list", "del"),
+            ("__keyevent@0__:del", "list"),
+        ]
+
+        # Writes that change nothing stay silent.
+        assert client.execute_command("DEL", "missing", "foo") == 1
+        assert _events(pubsub, 2) == [("__keyspace@0__:foo", "del"), ("__keyevent@0__:del", "foo")]
+    finally:
+        pubsub.close()
+
+
+def test_expired_keys_are_reported(spawn_server, tmp_path) -> None:
+    client = _client(spawn_server("--dir", str(tmp_path), "--notify-keyspace-events", "Ex"))
+    pubsub = client.pubsub()
+    try:
+        pubsub.subscribe("__keyevent@0__:expired")
+        assert _next_message(pubsub)["type"] == "subscribe"
+
+        # Only the expired class is enabled.
+        client.execute_command("SET", "short", "v", "PX", 10)
+        time.sleep(0.05)
+        assert client.execute_command("GET", "short") is None
+        assert _next_message(pubsub) == {
+            "type": "message",
+            "pattern": None,
+            "channel": "__keyevent@0__:expired",
+            "data": "short",
+        }
+    finally:
+        pubsub.close()
+
+
+def test_no_events_by_default(redis_client, make_key) -> None:
+    key = make_key("quiet")
+    pubsub = redis_client.pubsub()
+    try:
+        pubsub.psubscribe("__key*__:*")
+        assert _next_message(pubsub)["type"] == "psubscribe"
+        redis_client.execute_command("SET", key, "v")
+        redis_client.execute_command("DEL", key)
+        assert pubsub.get_message(timeout=0.2) is None
+    finally:
+        pubsub.close()
@@ -0,0 +1,172 @@
+from __future__ import annotations
+
+import socket
+import time
+
+import pytest
+import redis
+from redis.exceptions import ResponseError
+
+from _helpers import assert_error_contains
+
+
+def _next_message(pubsub, timeout: float = 5.0):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        message = pubsub.get_message(timeout=0.1)
+        if message is not None:
+            return message
+    raise AssertionError("no message before timeout")
+
+
+def _encode(*args: str) -> bytes:
+    out = f"*{len(args)}\r\n"
+    for arg in args:
+        out += f"${len(arg)}\r\n{arg}\r\n"
+    return out.encode()
+
+
+def _exchange(server_addr, request: bytes, expected: bytes) -> None:
+    with socket.create_connection(server_addr, timeout=5) as sock:
+        sock.sendall(request)
+        data = b""
+        while len(data) < len(expected):
+            chunk = sock.recv(4096)
+            assert chunk
+            data += chunk
+        assert data == expected
+
+
+def test_subscribers_receive_published_messages(redis_client, make_key) -> None:
+    channel = make_key("news")
+    other = make_key("other")
+    subscribers = [redis_client.pubsub() for _ in range(3)]
+    try:
+        for pubsub in subscribers:
+            pubsub.subscribe(channel, other)
+            assert _next_message(pubsub) == {"type": "subscribe", "pattern": None, "channel": channel, "data": 1}
+            assert _next_message(pubsub)["data"] == 2
+
+        assert redis_client.execute_command("PUBLISH", channel, "hello") == 3
+        assert redis_client.execute_command("PUBLISH", make_key("nobody"), "hello") == 0
+        for pubsub in subscribers:
+            assert _next_message(pubsub) == {"type": "message", "pattern": None, "channel": channel, "data": "hello"}
+
+        subscribers[0].unsubscribe(channel)
+        assert _next_message(subscribers[0]) == {
+            "type": "unsubscribe",
+            "pattern": None,
+            "channel": channel,
+            "data": 1,
+        }
+        assert redis_client.execute_command("PUBLISH", channel, "again") == 2
+        assert redis_client.execute_command("PUBSUB", "NUMSUB", channel, other) == [channel, 2, other, 3]
+    finally:
+        for pubsub in subscribers:
+            pubsub.close()
+
+
+def test_pattern_subscribers_receive_matching_messages(redis_client, make_key) -> None:
+    prefix = make_key("events")
+    pubsub = redis_client.pubsub()
+    try:
+        pubsub.psubscribe(f"{prefix}.*", f"{prefix}.[ab]?")
+        assert _next_message(pubsub)["type"] == "psubscribe"
+        assert _next_message(pubsub)["data"] == 2
+
+        assert redis_client.execute_command("PUBLISH", f"{prefix}.a1", "x") == 2
+        received = {_next_message(pubsub)["pattern"] for _ in range(2)}
+        assert received == {f"{prefix}.*", f"{prefix}.[ab]?"}
+
+        assert redis_client.execute_command("PUBLISH", f"{prefix}.c1", "y") == 1
+        assert _next_message(pubsub) == {
+            "type": "pmessage",
+            "pattern": f"{prefix}.*",
+            "channel": f"{prefix}.c1",
+            "data": "y",
+        }
+        assert redis_client.execute_command("PUBLISH", f"{prefix}x", "z") == 0
+        assert redis_client.execute_command("PUBSUB", "NUMPAT") >= 2
+    finally:
+        pubsub.close()
+
+
+def test_pubsub_channels_lists_channels_with_subscribers(redis_client, make_key) -> None:
+    first = make_key("first")
+    second = make_key("second")
+    pubsub = redis_client.pubsub()
+    try:
+        pubsub.subscribe(first, second)
+        _next_message(pubsub)
+        _next_message(pubsub)
+        channels = redis_client.execute_command("PUBSUB", "CHANNELS")
+        assert first in channels and second in channels
+        assert redis_client.execute_command("PUBSUB", "CHANNELS", first) == [first]
+    finally:
+        pubsub.close()
+
+    # Closing the connection drops its subscriptions.
+    deadline = time.monotonic() + 5
+    while redis_client.execute_command("PUBSUB", "NUMSUB", first)[1] != 0:
+        assert time.monotonic() < deadline
+        time.sleep(0.05)
+
+
+def test_subscribed_client_only_manages_subscriptions(server_addr, make_key) -> None:
+    channel = make_key("chan")
+    _exchange(
+        server_addr,
+        _encode("SUBSCRIBE", channel) + _encode("GET", "foo") + _encode("PING") + _encode("UNSUBSCRIBE") + _encode("PING"),
+        (
+            f"*3\r\n$9\r\nsubscribe\r\n${len(channel)}\r\n{channel}\r\n:1\r\n"
+            "-ERR Can't execute 'get': only (P)SUBSCRIBE / (P)UNSUBSCRIBE / PING are allowed in this context\r\n"
+            "*2\r\n$4\r\npong\r\n$0\r\n\r\n"
+            f"*3\r\n$11\r\nunsubscribe\r\n${len(channel)}\r\n{channel}\r\n:0\r\n"
+            "+PONG\r\n"
+        ).encode(),
+    )
+
+
+def test_subscriber_that_never_reads_is_disconnected(spawn_server) -> None:
+    info = spawn_server("--client-output-buffer-limit-pubsub", str(1024 * 1024))
+    publisher = redis.Redis(host=str(info["host"]), port=int(info["port"]), socket_timeout=5.0)
+    with socket.socket() as subscriber:
+        subscriber.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+        subscriber.settimeout(5)
+        subscriber.connect((str(info["host"]), int(info["port"])))
+        subscriber.sendall(_encode("SUBSCRIBE", "news"))
+        confirmation = b"*3\r\n$9\r\nsubscribe\r\n$4\r\nnews\r\n:1\r\n"
+        data = b""
+        while len(data) < len(confirmation):
+            chunk = subscriber.recv(4096)
+            assert chunk
+            data += chunk
+        assert data == confirmation
+
+        # The subscriber stops reading: once the messages waiting for it
+        # pass the limit, it is dropped, and the server stays responsive.
+        message = "x" * 65536
+        for sent in range(2000):
+            if publisher.publish("news", message) == 0:
+                break
+        else:
+            raise AssertionError("the subscriber was never disconnected")
+        assert sent > 0
+        assert publisher.ping() is True
+        # What was written before can still be read, then the connection
+        # ends.
+        try:
+            while subscriber.recv(65536):
+                pass
+        except ConnectionResetError:
+            pass
+
+
+def test_unsubscribe_without_subscriptions(server_addr) -> None:
+    _exchange(server_addr, _encode("UNSUBSCRIBE"), b"*3\r\n$11\r\nunsubscribe\r\n$-1\r\n:0\r\n")
+
+
+def test_publish_requires_channel_and_message(redis_client) -> None:
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("PUBLISH", "channel")
+    assert_error_contains(exc_info.value, "wrong number of arguments")
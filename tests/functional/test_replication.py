@@ -0,0 +1,346 @@
+from __future__ import annotations
+
+import queue
+import socket
+import threading
+import time
+
+import pytest
+import redis
+from redis.exceptions import ResponseError
+
+
+def _client(info) -> redis.Redis:
+    return redis.Redis(
+        host=str(info["host"]),
+        port=int(info["port"]),
+        decode_responses=True,
+        socket_connect_timeout=1.0,
+        socket_timeout=5.0,
+    )
+
+
+def _spawn(spawn_server, tmp_path, name: str, *args: str):
+    data_dir = tmp_path / name
+    data_dir.mkdir()
+    return spawn_server("--dir", str(data_dir), *args)
+
+
+def _wait_for(predicate, timeout: float = 10.0):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        value = predicate()
+        if value:
+            return value
+        time.sleep(0.05)
+    raise AssertionError("condition not met before timeout")
+
+
+def _wait_link_up(replica: redis.Redis) -> None:
+    _wait_for(lambda: replica.info("replication").get("master_link_status") == "up")
+
+
+def _wait_caught_up(primary: redis.Redis, replica: redis.Redis) -> None:
+    offset = primary.info("replication")["master_repl_offset"]
+    _wait_for(lambda: replica.info("replication")["master_repl_offset"] >= offset)
+
+
+class _Proxy:
+    """Forwards connections to a server, delay seconds late; drop() cuts
+    the live ones."""
+
+    def __init__(self, port: int, delay: float = 0.0) -> None:
+        self.target = port
+        self.delay = delay
+        self.listener = socket.create_server(("127.0.0.1", 0))
+        self.port = self.listener.getsockname()[1]
+        self.sockets: list[socket.socket] = []
+        self.lock = threading.Lock()
+        threading.Thread(target=self._accept, daemon=True).start()
+
+    def _accept(self) -> None:
+        while True:
+            try:
+                client, _ = self.listener.accept()
+            except OSError:
+                return
+            upstream = socket.create_connection(("127.0.0.1", self.target))
+            with self.lock:
+                self.sockets += [client, upstream]
+            threading.Thread(target=self._pipe, args=(client, upstream), daemon=True).start()
+            threading.Thread(target=self._pipe, args=(upstream, client), daemon=True).start()
+
+    def _pipe(self, src: socket.socket, dst: socket.socket) -> None:
+        send = dst.sendall
+        if self.delay > 0:
+            pending: queue.Queue = queue.Queue()
+            threading.Thread(target=self._send_late, args=(pending, dst), daemon=True).start()
+            send = lambda data: pending.put((time.monotonic() + self.delay, data))
+        try:
+            while data := src.recv(65536):
+                send(data)
+        except OSError:
+            pass
+        for sock in (src, dst):
+            try:
+                sock.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+
+    def _send_late(self, pending: queue.Queue, dst: socket.socket) -> None:
+        while True:
+            due, data = pending.get()
+            time.sleep(max(0.0, due - time.monotonic()))
+            try:
+                dst.sendall(data)
+            except OSError:
+                return
+
+    def drop(self) -> None:
+        with self.lock:
+            for sock in self.sockets:
+                try:
+                    sock.shutdown(socket.SHUT_RDWR)
+                except OSError:
+                    pass
+            self.sockets = []
+
+    def close(self) -> None:
+        self.listener.close()
+        self.drop()
+
+
+@pytest.fixture
+def proxy_factory():
+    proxies: list[_Proxy] = []
+
+    def _make(port: int, delay: float = 0.0) -> _Proxy:
+        proxy = _Proxy(port, delay)
+        proxies.append(proxy)
+        return proxy
+
+    yield _make
+    for proxy in proxies:
+        proxy.close()
+
+
+@pytest.mark.parametrize("bgsave", ["fork", "sliced"])
+def test_replica_loads_snapshot_then_follows_stream(spawn_server, tmp_path, bgsave) -> None:
+    primary_info = _spawn(spawn_server, tmp_path, "primary", "--bgsave", bgsave)
+    replica_info = _spawn(spawn_server, tmp_path, "replica")
+    primary = _client(primary_info)
+    replica = _client(replica_info)
+
+    primary.mset({f"key-{i}": str(i) for i in range(1000)})
+    primary.rpush("list", "a", "b")
+    primary.set("ttl", "v", ex=100)
+    replica.set("stale", "gone after the sync")
+
+    assert replica.execute_command("REPLICAOF", "127.0.0.1", str(primary_info["port"])) == "OK"
+    _wait_link_up(replica)
+    info = replica.info("replication")
+    assert info["role"] == "slave"
+    assert info["master_replid"] == primary.info("replication")["master_replid"]
+
+    assert replica.mget([f"key-{i}" for i in range(1000)]) == [str(i) for i in range(1000)]
+    assert replica.get("stale") is None
+    assert 0 < replica.ttl("ttl") <= 100
+
+    primary.set("key-0", "changed")
+    primary.lpush("list", "z")
+    primary.delete("key-1")
+    primary.expire("key-2", 500)
+    primary.incrby("counter", 5)
+    _wait_caught_up(primary, replica)
+    assert replica.get("key-0") == "changed"
+    assert replica.lrange("list", 0, -1) == ["z", "a", "b"]
+    assert replica.get("key-1") is None
+    assert 0 < replica.ttl("key-2") <= 500
+    assert replica.get("counter") == "5"
+
+    with pytest.raises(ResponseError, match="read only replica"):
+        replica.set("key-0", "local")
+    assert primary.info("replication")["connected_slaves"] == 1
+
+
+def test_full_sync_sends_snapshot_larger_than_a_piece(spawn_server, tmp_path) -> None:
+    primary_info = _spawn(spawn_server, tmp_path, "primary")
+    replica_infos = [_spawn(spawn_server, tmp_path, f"replica-{i}") for i in range(2)]
+    primary = _client(primary_info)
+    replicas = [_client(info) for info in replica_infos]
+
+    # Several MiB, which the replicas are sent a piece at a time, followed
+    # by the writes made meanwhile.
+    value = "v" * 2000
+    primary.mset({f"key-{i}": value for i in range(3000)})
+    for replica in replicas:
+        replica.execute_command("REPLICAOF", "127.0.0.1", str(primary_info["port"]))
+    primary.set("during", "sync")
+    for replica in replicas:
+        _wait_link_up(replica)
+        _wait_caught_up(primary, replica)
+        assert replica.mget([f"key-{i}" for i in range(3000)]) == [value] * 3000
+        assert replica.get("during") == "sync"
+
+
+def test_diskless_sync_streams_one_pass_to_replicas(spawn_server, tmp_path) -> None:
+    primary_info = _spawn(
+        spawn_server, tmp_path, "primary", "--repl-diskless-sync", "yes", "--repl-diskless-sync-delay", "1000"
+    )
+    replica_infos = [_spawn(spawn_server, tmp_path, f"replica-{i}") for i in range(2)]
+    primary = _client(primary_info)
+    replicas = [_client(info) for info in replica_infos]
+
+    # Big enough for the snapshot to span several chunks.
+    value = "v" * 1000
+    primary.mset({f"key-{i}": value for i in range(3000)})
+    primary.set("ttl", "v", ex=100)
+    primary.xadd("stream", {"f": "1"})
+
+    for replica in replicas:
+        replica.execute_command("REPLICAOF", "127.0.0.1", str(primary_info["port"]))
+    for replica in replicas:
+        _wait_link_up(replica)
+        assert replica.mget([f"key-{i}" for i in range(3000)]) == [value] * 3000
+        assert 0 < replica.ttl("ttl") <= 100
+        assert len(replica.xrange("stream")) == 1
+
+    primary.set("key-0", "changed")
+    for replica in replicas:
+        _wait_caught_up(primary, replica)
+        assert replica.get("key-0") == "changed"
+
+    process = primary_info["process"]
+    process.terminate()
+    out, _ = process.communicate(timeout=10)
+    assert "Streaming a snapshot to 2 replicas" in out
+    assert not (tmp_path / "primary" / "dump.mrdb").exists()
+
+
+def test_replica_resumes_from_backlog_after_short_disconnect(spawn_server, tmp_path, proxy_factory) -> None:
+    primary_info = _spawn(spawn_server, tmp_path, "primary")
+    replica_info = _spawn(spawn_server, tmp_path, "replica")
+    primary = _client(primary_info)
+    replica = _client(replica_info)
+    proxy = proxy_factory(int(primary_info["port"]))
+
+    primary.set("before", "1")
+    replica.execute_command("REPLICAOF", "127.0.0.1", str(proxy.port))
+    _wait_link_up(replica)
+    primary.set("online", "2")
+    _wait_caught_up(primary, replica)
+
+    proxy.drop()
+    _wait_for(lambda: replica.info("replication")["master_link_status"] == "down")
+    primary.set("offline", "3")
+    primary.rpush("list", "x")
+
+    _wait_link_up(replica)
+    _wait_caught_up(primary, replica)
+    assert replica.mget(["before", "online", "offline"]) == ["1", "2", "3"]
+    assert replica.lrange("list", 0, -1) == ["x"]
+    info = primary.info("replication")
+    assert info["sync_full"] == 1
+    assert info["sync_partial_ok"] == 1
+
+
+def test_replica_loads_snapshot_again_when_backlog_overflows(spawn_server, tmp_path, proxy_factory) -> None:
+    primary_info = _spawn(spawn_server, tmp_path, "primary", "--repl-backlog-size", "1024")
+    replica_info = _spawn(spawn_server, tmp_path, "replica")
+    primary = _client(primary_info)
+    replica = _client(replica_info)
+    proxy = proxy_factory(int(primary_info["port"]))
+
+    replica.execute_command("REPLICAOF", "127.0.0.1", str(proxy.port))
+    _wait_link_up(replica)
+
+    proxy.drop()
+    _wait_for(lambda: replica.info("replication")["master_link_status"] == "down")
+    for i in range(50):
+        primary.set(f"key-{i}", "x" * 100)
+
+    _wait_link_up(replica)
+    _wait_caught_up(primary, replica)
+    assert replica.mget([f"key-{i}" for i in range(50)]) == ["x" * 100] * 50
+    info = primary.info("replication")
+    assert info["sync_full"] == 2
+    assert info["sync_partial_err"] == 1
+
+
+def test_lagging_replica_leaves_expiration_to_its_primary(spawn_server, tmp_path, proxy_factory) -> None:
+    primary_info = _spawn(spawn_server, tmp_path, "primary")
+    replica_info = _spawn(spawn_server, tmp_path, "replica")
+    primary = _client(primary_info)
+    replica = _client(replica_info)
+    proxy = proxy_factory(int(primary_info["port"]), delay=1.0)
+    replica.execute_command("REPLICAOF", "127.0.0.1", str(proxy.port))
+    _wait_link_up(replica)
+
+    # The replica gets these a second late, past the expiration times they
+    # carry, but they ran on the primary before the keys expired.
+    primary.set("counter", 1, px=500)
+    primary.incr("counter")
+    primary.getex("counter", persist=True)
+    primary.set("key", "value", px=500)
+    sent = primary.info("replication")["master_repl_offset"]
+    time.sleep(0.3)
+    assert primary.getex("key", persist=True) == "value"
+
+    # Before the PERSIST arrives, reading the key on the replica finds it
+    # expired, but leaves its removal to the primary.
+    _wait_for(lambda: replica.info("replication")["master_repl_offset"] >= sent)
+    assert replica.get("counter") == "2"
+    assert replica.get("key") is None
+    _wait_caught_up(primary, replica)
+    assert replica.get("key") == "value"
+    assert replica.ttl("key") == -1
+
+
+def test_replicaof_no_one_promotes_replica(spawn_server, tmp_path) -> None:
+    primary_info = _spawn(spawn_server, tmp_path, "primary")
+    replica_info = _spawn(spawn_server, tmp_path, "replica")
+    primary = _client(primary_info)
+    replica = _client(replica_info)
+
+    primary.set("key", "value")
+    replica.execute_command("REPLICAOF", "127.0.0.1", str(primary_info["port"]))
+    _wait_link_up(replica)
+    _wait_caught_up(primary, replica)
+
+    assert replica.execute_command("REPLICAOF", "NO", "ONE") == "OK"
+    assert replica.info("replication")["role"] == "master"
+    assert replica.set("key", "local")
+    primary.set("key", "primary")
+    time.sleep(0.3)
+    assert replica.get("key") == "local"
+
+
+def test_replicaof_rejects_bad_port(spawn_server, tmp_path) -> None:
+    replica = _client(_spawn(spawn_server, tmp_path, "replica"))
+    with pytest.raises(ResponseError, match="Invalid master port"):
+        replica.execute_command("REPLICAOF", "127.0.0.1", "70000")
+    assert replica.info("replication")["role"] == "master"
+
+
+def test_replica_applies_transactions_whole(spawn_server, tmp_path) -> None:
+    primary_info = _spawn(spawn_server, tmp_path, "primary")
+    replica_info = _spawn(spawn_server, tmp_path, "replica")
+    primary = _client(primary_info)
+    replica = _client(replica_info)
+    replica.execute_command("REPLICAOF", "127.0.0.1", str(primary_info["port"]))
+    _wait_link_up(replica)
+
+    pipe = primary.pipeline(transaction=True)
+    pipe.incrby("balance", 100)
+    pipe.rpush("log", "credit")
+    pipe.execute()
+    _wait_caught_up(primary, replica)
+    assert replica.get("balance") == "100"
+    assert replica.lrange("log", 0, -1) == ["credit"]
+
+    # Writes sent to the replica are refused when queued.
+    pipe = replica.pipeline(transaction=True)
+    pipe.incr("balance")
+    with pytest.raises(ResponseError, match="read only replica"):
+        pipe.execute()
+    assert replica.get("balance") == "100"
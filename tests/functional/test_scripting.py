@@ -0,0 +1,400 @@
+from __future__ import annotations
+
+import hashlib
+import threading
+import time
+
+import pytest
+import redis
+from redis.exceptions import NoScriptError, ResponseError
+
+from _helpers import assert_error_contains
+
+
+def _client(info) -> redis.Redis:
+    return redis.Redis(
+        host=str(info["host"]),
+        port=int(info["port"]),
+        decode_responses=True,
+        socket_connect_timeout=1.0,
+        socket_timeout=5.0,
+    )
+
+
+def test_eval_converts_values_as_redis_does(redis_client) -> None:
+    assert redis_client.eval("return 1 + 2 * 3", 0) == 7
+    assert redis_client.eval("return 3.99", 0) == 3
+    assert redis_client.eval("return 'text'", 0) == "text"
+    assert redis_client.eval("return true", 0) == 1
+    assert redis_client.eval("return false", 0) is None
+    assert redis_client.eval("return nil", 0) is None
+    # Arrays stop at the first nil.
+    assert redis_client.eval("return {1, 'two', {3}, nil, 5}", 0) == [1, "two", [3]]
+    assert redis_client.eval("return {ok='fine'}", 0) == "fine"
+    assert redis_client.eval("return redis.status_reply('fine')", 0) == "fine"
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.eval("return {err='MYERR custom'}", 0)
+    assert_error_contains(exc_info.value, "MYERR custom")
+
+
+def test_eval_passes_keys_and_arguments(redis_client) -> None:
+    script = "return {#KEYS, #ARGV, KEYS[1], KEYS[2], ARGV[1]}"
+    assert redis_client.eval(script, 2, "a", "b", "c") == [2, 1, "a", "b", "c"]
+    for numkeys, message in (("x", "not an integer"), (-1, "negative"), (3, "greater than")):
+        with pytest.raises(ResponseError) as exc_info:
+            redis_client.execute_command("EVAL", "return 1", numkeys, "a")
+        assert_error_contains(exc_info.value, message)
+
+
+def test_language_features(redis_client) -> None:
+    script = """
+    local function fib(n)
+      if n < 2 then return n end
+      return fib(n - 1) + fib(n - 2)
+    end
+    local t = {}
+    for i = 1, 5 do table.insert(t, i * i) end
+    local sum = 0
+    for _, v in ipairs(t) do sum = sum + v end
+    local count = 0
+    for k, v in pairs({a = 1, b = 2}) do count = count + v end
+    local words = {}
+    local i = 10
+    repeat i = i - 3 until i < 0
+    while #words < 2 do words[#words + 1] = string.upper('w' .. #words) end
+    return {fib(20), sum, count, i, table.concat(words, ','),
+            string.format('%05.1f|%s|%d', 3.14159, 'x', 42),
+            string.sub('scripting', 2, -3), tostring(10 / 4)}
+    """
+    assert redis_client.eval(script, 0) == [6765, 55, 3, -2, "W0,W1", "003.1|x|42", "cripti", "2.5"]
+
+
+def test_closures_share_the_locals_they_use(redis_client) -> None:
+    script = """
+    local function counter()
+      local n = 0
+      return function() n = n + 1; return n end
+    end
+    local a, b = counter(), counter()
+    a(); a()
+    local fs = {}
+    for i = 1, 3 do fs[i] = function() return i end end
+    for _, v in ipairs({'x', 'y'}) do
+      fs[#fs + 1] = function() return v end
+    end
+    local shared = 1
+    local function get() return shared end
+    local function set(v) shared = v end
+    set(5)
+    local function outer(x)
+      return function() return function() x = x * 2; return x end end
+    end
+    return {a(), b(), fs[1]() + fs[2]() + fs[3](), fs[4]() .. fs[5](),
+            get(), shared, outer(21)()()}
+    """
+    assert redis_client.eval(script, 0) == [3, 1, 6, "xy", 5, 5, 42]
+
+
+def test_varargs(redis_client) -> None:
+    script = """
+    local function pack(...) return {n = select('#', ...), ...} end
+    local function tail(_, ...) return ... end
+    local t = pack(1, nil, 3)
+    return {t.n, #{tail(1, 2, 3)}, select(2, tail(0, 'a', 'b')), #{...}}
+    """
+    assert redis_client.eval(script, 0) == [3, 2, "b", 0]
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.eval("local function f() return ... end", 0)
+    assert_error_contains(exc_info.value, "outside a vararg function")
+
+
+def test_pcall_and_error(redis_client) -> None:
+    script = """
+    local ok1, v = pcall(function(x) return x * 2 end, 21)
+    local ok2, e = pcall(function() local t = nil; return t.x end)
+    local ok3, t = pcall(error, {code = 7})
+    local ok4, r = pcall(redis.call, 'NOSUCHCOMMAND')
+    local _, nested = pcall(function()
+      local ok = pcall(error, 'inner')
+      error('outer ' .. tostring(ok))
+    end)
+    return {tostring(ok1), v, tostring(ok2), e, tostring(ok3), t.code,
+            tostring(ok4), r.err, nested}
+    """
+    result = redis_client.eval(script, 0)
+    assert result[:5] == ["true", 42, "false", "user_script:3: attempt to index a nil value", "false"]
+    assert result[5:7] == [7, "false"]
+    assert "unknown command" in result[7]
+    assert result[8] == "user_script:8: outer false"
+
+
+def test_string_patterns(redis_client) -> None:
+    script = """
+    local words = {}
+    for w in ('one two  three'):gmatch('%a+') do words[#words + 1] = w end
+    local pairs_found = {}
+    for k, v in string.gmatch('a=1, b=2', '(%w+)=(%w+)') do
+      pairs_found[#pairs_found + 1] = k .. v
+    end
+    return {
+      {string.find('key:123', '(%a+):(%d+)')},
+      {string.find('a.b', '.', 1, true)},
+      string.match('2024-01-05', '^(%d+)-%d+'),
+      ('  trim  '):match('^%s*(.-)%s*$'),
+      {string.match('abc', '()b()')},
+      table.concat(words, ','),
+      table.concat(pairs_found, ','),
+      {string.gsub('hello world', '(%w+)', '<%1>')},
+      {string.gsub('abc', '%w', '%0%0', 2)},
+      (string.gsub('$name is $age', '%$(%w+)', {name = 'bob', age = 3})),
+      (string.gsub('a b c', '%a', function(c) return c:upper() end)),
+      (string.gsub('a b c', '%a', string.upper)),
+      (string.gsub('abc', '', '-')),
+      (string.gsub('f(a(b)c)d', '%b()', 'X')),
+      (string.gsub('THE (quick) fox', '%f[%a]%a+', 'w')),
+      (string.gsub('keep', 'e', function() return nil end)),
+    }
+    """
+    assert redis_client.eval(script, 0) == [
+        [1, 7, "key", "123"],
+        [2, 2],
+        "2024",
+        "trim",
+        [2, 3],
+        "one,two,three",
+        "a1,b2",
+        ["<hello> <world>", 2],
+        ["aabbc", 2],
+        "bob is 3",
+        "A B C",
+        "A B C",
+        "-a-b-c-",
+        "fXd",
+        "w (w) w",
+        "keep",
+    ]
+    for source, message in (
+        ("return string.find('a', '[a')", "missing ']'"),
+        ("return string.match('a', '%')", "ends with '%'"),
+        ("return string.gsub('a', '(a)', '%2')", "invalid capture index"),
+        ("return string.gsub('a', 'a', function() return {} end)", "invalid replacement value"),
+        ("return string.rep('a', 300):match(string.rep('a?', 300))", "pattern too complex"),
+    ):
+        with pytest.raises(ResponseError) as exc_info:
+            redis_client.eval(source, 0)
+        assert_error_contains(exc_info.value, message)
+
+
+def test_redis_call_and_pcall(redis_client, make_key) -> None:
+    key = make_key("counter")
+    text = make_key("text")
+    script = """
+    redis.call('SET', KEYS[1], ARGV[1])
+    local n = redis.call('INCRBY', KEYS[1], 5)
+    return {n, redis.call('GET', KEYS[1]), redis.call('GET', KEYS[2])}
+    """
+    assert redis_client.eval(script, 2, key, text, 10) == [15, "15", None]
+    assert redis_client.get(key) == "15"
+
+    redis_client.set(text, "abc")
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.eval("return redis.call('INCR', KEYS[1])", 1, text)
+    assert_error_contains(exc_info.value, "not an integer")
+    script = "local r = redis.pcall('INCR', KEYS[1]); return type(r) .. ':' .. r.err"
+    assert "not an integer" in redis_client.eval(script, 1, text)
+
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.eval("return redis.call('NOSUCHCOMMAND')", 0)
+    assert_error_contains(exc_info.value, "unknown command")
+    for command in ("EVAL", "MULTI", "SUBSCRIBE"):
+        with pytest.raises(ResponseError) as exc_info:
+            redis_client.eval(f"return redis.call('{command}', 'x', '0')", 0)
+        assert_error_contains(exc_info.value, "not allowed from script")
+
+
+def test_script_errors(redis_client) -> None:
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.eval("return (", 0)
+    assert_error_contains(exc_info.value, "user_script:1:")
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.eval("x = 1", 0)
+    assert_error_contains(exc_info.value, "global variable 'x'")
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.eval("local t = nil\nreturn t.x", 0)
+    assert_error_contains(exc_info.value, "user_script:2:")
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.eval("error('stopped here')", 0)
+    assert_error_contains(exc_info.value, "stopped here")
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.eval("return redis.error_reply('MYERR raised')", 0)
+    assert_error_contains(exc_info.value, "MYERR raised")
+
+
+def test_evalsha_and_script_cache(redis_client) -> None:
+    body = "return ARGV[1] .. '!'"
+    sha = hashlib.sha1(body.encode()).hexdigest()
+    missing = hashlib.sha1(b"return 0").hexdigest()
+    assert redis_client.script_load(body) == sha
+    assert redis_client.evalsha(sha.upper(), 0, "hi") == "hi!"
+    assert redis_client.script_exists(sha, missing) == [True, False]
+    assert redis_client.eval("return redis.sha1hex('')", 0) == hashlib.sha1(b"").hexdigest()
+
+    # EVAL caches the scripts it runs too.
+    redis_client.eval("return 0", 0)
+    assert redis_client.script_exists(missing) == [True]
+
+    assert redis_client.script_flush() is True
+    assert redis_client.script_exists(sha) == [False]
+    with pytest.raises(NoScriptError):
+        redis_client.evalsha(sha, 0, "hi")
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.script_load("return (")
+    assert_error_contains(exc_info.value, "user_script:1:")
+
+
+def test_script_writes_are_logged_as_a_transaction(spawn_server) -> None:
+    info = spawn_server("--appendonly", "yes")
+    client = _client(info)
+    script = """
+    redis.call('RPUSH', KEYS[1], 'a', 'b')
+    redis.call('LPOP', KEYS[1])
+    return redis.call('LLEN', KEYS[1])
+    """
+    assert client.eval(script, 1, "list") == 1
+    assert client.eval("return redis.call('GET', 'missing')", 0) is None
+    client.close()
+    process = info["process"]
+    process.terminate()
+    process.wait(timeout=5.0)
+
+    # The effects are logged rather than the script, between MULTI and EXEC.
+    log = (info["dir"] / "appendonly.aof").read_bytes()
+    assert b"EVAL" not in log
+    assert log.index(b"MULTI") < log.index(b"RPUSH") < log.index(b"LPOP") < log.index(b"EXEC")
+    assert log.count(b"MULTI") == 1
+
+    client = _client(spawn_server("--appendonly", "yes"))
+    assert client.lrange("list", 0, -1) == ["b"]
+    client.close()
+
+
+def _eval_in_thread(client, *args) -> tuple[threading.Thread, dict]:
+    outcome: dict = {}
+
+    def run() -> None:
+        try:
+            outcome["reply"] = client.eval(*args)
+        except redis.RedisError as exc:
+            outcome["error"] = str(exc)
+
+    thread = threading.Thread(target=run)
+    thread.start()
+    return thread, outcome
+
+
+def _wait_busy(client) -> None:
+    deadline = time.monotonic() + 5.0
+    while True:
+        try:
+            client.get("probe")
+        except ResponseError as exc:
+            assert_error_contains(exc, "BUSY")
+            return
+        assert time.monotonic() < deadline
+        time.sleep(0.01)
+
+
+def test_script_past_busy_threshold_can_be_killed(spawn_server) -> None:
+    info = spawn_server("--busy-reply-threshold", "100")
+    other = _client(info)
+    thread, outcome = _eval_in_thread(_client(info), "while true do end", 0)
+
+    # Past the threshold, the other clients are refused until it is killed.
+    _wait_busy(other)
+    with pytest.raises(ResponseError) as exc_info:
+        other.set("key", "value")
+    assert_error_contains(exc_info.value, "BUSY")
+    assert other.script_kill() is True
+    thread.join(timeout=5.0)
+    assert "Script killed by user with SCRIPT KILL" in outcome["error"]
+
+    assert other.ping() is True
+    with pytest.raises(ResponseError) as exc_info:
+        other.script_kill()
+    assert_error_contains(exc_info.value, "NOTBUSY")
+
+
+def test_script_that_has_written_cannot_be_killed(spawn_server) -> None:
+    info = spawn_server("--busy-reply-threshold", "100")
+    other = _client(info)
+    script = "redis.call('SET', KEYS[1], 'partial') while true do end"
+    thread, outcome = _eval_in_thread(_client(info), script, 1, "key")
+
+    _wait_busy(other)
+    with pytest.raises(ResponseError) as exc_info:
+        other.script_kill()
+    assert_error_contains(exc_info.value, "UNKILLABLE")
+
+    # Only stopping the server ends it.
+    process = info["process"]
+    process.kill()
+    process.wait(timeout=5.0)
+    thread.join(timeout=5.0)
+    assert "reply" not in outcome
+
+
+def test_paused_scripts_complete_in_order(spawn_server) -> None:
+    info = spawn_server("--busy-reply-threshold", "1", "--appendonly", "yes")
+    client = _client(info)
+    script = """
+    redis.call('INCR', KEYS[1])
+    local n = 0
+    for i = 1, tonumber(ARGV[1]) do n = n + 1 end
+    redis.call('INCR', KEYS[1])
+    return n
+    """
+    assert client.eval(script, 1, "counter", 200000) == 200000
+    assert client.get("counter") == "2"
+
+    # A paused script in a transaction: the commands after it run once it
+    # ends, and the transaction is logged whole.
+    pipe = client.pipeline(transaction=True)
+    pipe.eval(script, 1, "counter", 200000)
+    pipe.incr("counter")
+    pipe.eval(script, 1, "counter", 200000)
+    assert pipe.execute() == [200000, 5, 200000]
+    client.close()
+    process = info["process"]
+    process.terminate()
+    process.wait(timeout=5.0)
+
+    log = (info["dir"] / "appendonly.aof").read_bytes()
+    assert log.count(b"MULTI") == log.count(b"EXEC") == 2
+    client = _client(spawn_server("--appendonly", "yes"))
+    assert client.get("counter") == "7"
+    client.close()
+
+
+def test_clients_woken_by_a_paused_script_are_served_after_it(spawn_server) -> None:
+    info = spawn_server("--busy-reply-threshold", "1")
+    waiter = _client(info)
+    read: dict = {}
+
+    def block() -> None:
+        read["reply"] = waiter.xread({"stream": "$"}, block=5000)
+
+    thread = threading.Thread(target=block)
+    thread.start()
+    time.sleep(0.1)
+
+    # The script wakes the reader before it pauses; the reader gets the
+    # entry once the script ends, not BUSY.
+    script = """
+    redis.call('XADD', KEYS[1], '1-0', 'field', 'value')
+    local n = 0
+    for i = 1, 200000 do n = n + 1 end
+    return n
+    """
+    assert _client(info).eval(script, 1, "stream") == 200000
+    thread.join(timeout=5.0)
+    assert read["reply"] == [["stream", [("1-0", {"field": "value"})]]]
@@ -1,8 +1,10 @@
 from __future__ import annotations
 
+import time
 from pathlib import Path
 
 import pytest
+import redis
 from redis.exceptions import ResponseError
 
 from _helpers import assert_error_contains
@@ -77,6 +79,8 @@ def test_load_reports_missing_file(redis_client, tmp_path) -> None:
     [
         ("SAVE", ("TO",)),
         ("SAVE", ("TO", "path", "extra")),
+        ("SAVE", ("COMPRESS",)),
+        ("SAVE", ("COMPRESS", "zstd")),
         ("LOAD", ("FROM",)),
         ("LOAD", ("FROM", "path", "extra")),
     ],
@@ -85,3 +89,499 @@ def test_save_and_load_validate_argument_count(redis_client, command: str, args:
     with pytest.raises(ResponseError) as exc_info:
         redis_client.execute_command(command, *args)
     assert_error_contains(exc_info.value, "syntax error")
+
+
+def _wait_for_bgsave(redis_client) -> dict:
+    for _ in range(200):
+        info = redis_client.info("persistence")
+        if info["rdb_bgsave_in_progress"] == 0:
+            return info
+        time.sleep(0.05)
+    raise AssertionError("background save did not finish")
+
+
+def test_bgsave_and_load_roundtrip(redis_client, make_key, tmp_path) -> None:
+    key = make_key("bgsave")
+    snapshot = tmp_path / "bgsave.mrdb"
+
+    assert redis_client.execute_command("SET", key, "before") == "OK"
+    before = int(redis_client.lastsave().timestamp())
+    assert redis_client.execute_command("BGSAVE", "TO", str(snapshot)) is True
+
+    info = _wait_for_bgsave(redis_client)
+    assert info["rdb_last_bgsave_status"] == "ok"
+    assert info["rdb_last_save_time"] >= before
+    assert int(redis_client.lastsave().timestamp()) == info["rdb_last_save_time"]
+    assert snapshot.exists()
+
+    assert redis_client.execute_command("SET", key, "after") == "OK"
+    assert redis_client.execute_command("LOAD", "FROM", str(snapshot)) == "OK"
+    assert redis_client.execute_command("GET", key) == "before"
+
+
+def test_bgsave_reports_failure_in_info(redis_client, tmp_path) -> None:
+    snapshot = tmp_path / "missing-dir" / "bgsave.mrdb"
+
+    assert redis_client.execute_command("BGSAVE", "TO", str(snapshot)) is True
+    info = _wait_for_bgsave(redis_client)
+    assert info["rdb_last_bgsave_status"] == "err"
+    assert not snapshot.exists()
+
+
+@pytest.mark.parametrize("args", [("TO",), ("FROM", "path"), ("TO", "path", "extra")])
+def test_bgsave_rejects_invalid_arguments(redis_client, args: tuple[str, ...]) -> None:
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("BGSAVE", *args)
+    assert_error_contains(exc_info.value, "syntax error")
+
+
+def test_save_and_load_roundtrip_all_types(redis_client, make_key, tmp_path) -> None:
+    snapshot = tmp_path / "types.mrdb"
+    keys = {name: make_key(name) for name in ("str", "int", "list", "zset", "hll", "stream", "ttl")}
+
+    redis_client.execute_command("SET", keys["str"], "x" * 300)
+    redis_client.execute_command("SET", keys["int"], "-1234567890123")
+    redis_client.execute_command("INCRBY", keys["int"], 1)
+    redis_client.execute_command("RPUSH", keys["list"], "a", "", "c")
+    redis_client.execute_command("ZADD", keys["zset"], "1.5", "a", "-inf", "b", "1e300", "c")
+    redis_client.execute_command("PFADD", keys["hll"], "a", "b", "c")
+    redis_client.execute_command("XADD", keys["stream"], "1-1", "f", "v")
+    redis_client.execute_command("SET", keys["ttl"], "v", "EX", "100")
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot)) == "OK"
+    assert snapshot.read_bytes()[:5] == b"MRDB\x04"
+
+    for key in keys.values():
+        redis_client.execute_command("DEL", key)
+    assert redis_client.execute_command("LOAD", "FROM", str(snapshot)) == "OK"
+
+    assert redis_client.execute_command("GET", keys["str"]) == "x" * 300
+    assert redis_client.execute_command("INCR", keys["int"]) == -1234567890121
+    assert redis_client.execute_command("LRANGE", keys["list"], 0, -1) == ["a", "", "c"]
+    assert redis_client.execute_command("ZRANGE", keys["zset"], 0, -1, "WITHSCORES") == [
+        "b",
+        "-inf",
+        "a",
+        "1.5",
+        "c",
+        "1e+300",
+    ]
+    assert redis_client.execute_command("PFCOUNT", keys["hll"]) == 3
+    assert redis_client.execute_command("XLEN", keys["stream"]) == 1
+    assert 0 < redis_client.execute_command("TTL", keys["ttl"]) <= 100
+
+
+def test_load_reads_version_1_snapshots(redis_client, make_key, tmp_path) -> None:
+    key = make_key("v1")
+    counter = make_key("v1-counter")
+    snapshot = tmp_path / "v1.mrdb"
+
+    def bulk(value: str) -> bytes:
+        return b"$%d\r\n%s\r\n" % (len(value), value.encode())
+
+    body = b"*2\r\n"
+    body += b"*5\r\n" + bulk(key) + b":0\r\n" + bulk("legacy") + b":0\r\n:0\r\n"
+    body += b"*5\r\n" + bulk(counter) + b":1\r\n:41\r\n:0\r\n:0\r\n"
+    snapshot.write_bytes(b"MRDB\x01" + body)
+
+    assert redis_client.execute_command("LOAD", "FROM", str(snapshot)) == "OK"
+    assert redis_client.execute_command("GET", key) == "legacy"
+    assert redis_client.execute_command("INCR", counter) == 42
+
+
+def test_save_and_load_roundtrip_many_blocks(redis_client, make_key, tmp_path) -> None:
+    snapshot = tmp_path / "blocks.mrdb"
+    big = [make_key(f"big-{i}") for i in range(4)]
+    small = [make_key(f"small-{i}") for i in range(2000)]
+
+    for i, key in enumerate(big):
+        redis_client.execute_command("SET", key, str(i) * 600_000)
+    redis_client.execute_command("MSET", *[x for i, key in enumerate(small) for x in (key, i)])
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot)) == "OK"
+
+    redis_client.execute_command("DEL", *big, *small)
+    assert redis_client.execute_command("LOAD", "FROM", str(snapshot)) == "OK"
+
+    for i, key in enumerate(big):
+        assert redis_client.execute_command("GET", key) == str(i) * 600_000
+    assert redis_client.execute_command("MGET", *small) == [str(i) for i in range(len(small))]
+
+
+def test_load_reads_version_2_snapshots(redis_client, make_key, tmp_path) -> None:
+    key = make_key("v2")
+    expired = make_key("v2-expired")
+    snapshot = tmp_path / "v2.mrdb"
+
+    def string(value: str) -> bytes:
+        return bytes([len(value)]) + value.encode()
+
+    body = b"\x02"
+    body += b"\x00" + string(key) + string("packed")
+    body += b"\x80\x01" + string(expired) + string("gone")
+    snapshot.write_bytes(b"MRDB\x02" + body)
+
+    assert redis_client.execute_command("LOAD", "FROM", str(snapshot)) == "OK"
+    assert redis_client.execute_command("GET", key) == "packed"
+    assert redis_client.execute_command("GET", expired) is None
+
+
+def test_load_rejects_truncated_snapshot(redis_client, make_key, tmp_path) -> None:
+    key = make_key("truncated")
+    snapshot = tmp_path / "truncated.mrdb"
+
+    redis_client.execute_command("SET", key, "value")
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot)) == "OK"
+    snapshot.write_bytes(snapshot.read_bytes()[:-2])
+
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("LOAD", "FROM", str(snapshot))
+    assert_error_contains(exc_info.value, "load failed")
+    assert redis_client.execute_command("GET", key) == "value"
+
+
+def test_load_rejects_corrupted_block(redis_client, make_key, tmp_path) -> None:
+    key = make_key("corrupted")
+    snapshot = tmp_path / "corrupted.mrdb"
+
+    redis_client.execute_command("SET", key, "value")
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot)) == "OK"
+    raw = bytearray(snapshot.read_bytes())
+    raw[5] = 0x7F
+    snapshot.write_bytes(bytes(raw))
+
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("LOAD", "FROM", str(snapshot))
+    assert_error_contains(exc_info.value, "unknown value type")
+    assert redis_client.execute_command("GET", key) == "value"
+
+
+def test_save_with_compression_roundtrip(redis_client, make_key, tmp_path) -> None:
+    plain = tmp_path / "plain.mrdb"
+    packed = tmp_path / "packed.mrdb"
+    keys = [make_key(f"json-{i}") for i in range(5000)]
+    values = [f'{{"id": {i}, "name": "user{i}", "tags": ["a", "b"], "active": true}}' for i in range(len(keys))]
+    redis_client.execute_command("MSET", *[x for pair in zip(keys, values) for x in pair])
+
+    assert redis_client.execute_command("SAVE", "TO", str(plain)) == "OK"
+    assert redis_client.execute_command("SAVE", "TO", str(packed), "COMPRESS", "lz") == "OK"
+    assert packed.stat().st_size < plain.stat().st_size // 2
+
+    redis_client.execute_command("DEL", *keys)
+    assert redis_client.execute_command("LOAD", "FROM", str(packed)) == "OK"
+    assert redis_client.execute_command("MGET", *keys) == values
+
+
+def test_bgsave_with_compression(redis_client, make_key, tmp_path) -> None:
+    key = make_key("bgsave-lz")
+    snapshot = tmp_path / "bgsave-lz.mrdb"
+
+    redis_client.execute_command("SET", key, "abc" * 1000)
+    assert redis_client.execute_command("BGSAVE", "COMPRESS", "LZ", "TO", str(snapshot)) is True
+    assert _wait_for_bgsave(redis_client)["rdb_last_bgsave_status"] == "ok"
+
+    redis_client.execute_command("DEL", key)
+    assert redis_client.execute_command("LOAD", "FROM", str(snapshot)) == "OK"
+    assert redis_client.execute_command("GET", key) == "abc" * 1000
+
+
+def test_load_reads_version_3_snapshots(redis_client, make_key, tmp_path) -> None:
+    key = make_key("v3")
+    snapshot = tmp_path / "v3.mrdb"
+
+    block = b"\x00" + bytes([len(key)]) + key.encode() + b"\x07indexed"
+    index = bytes([1, 5, len(block), 1])
+    index_offset = 5 + len(block)
+    snapshot.write_bytes(b"MRDB\x03" + block + index + index_offset.to_bytes(8, "little"))
+
+    assert redis_client.execute_command("LOAD", "FROM", str(snapshot)) == "OK"
+    assert redis_client.execute_command("GET", key) == "indexed"
+
+
+def test_incremental_save_and_load_roundtrip(redis_client, make_key, tmp_path) -> None:
+    kept, changed, deleted, added = (make_key(f"delta-{name}") for name in ("kept", "changed", "deleted", "added"))
+    snapshot = tmp_path / "delta.mrdb"
+    delta = tmp_path / "delta.mrdb.delta"
+
+    redis_client.execute_command("MSET", kept, "1", changed, "1", deleted, "1")
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot)) == "OK"
+    assert not delta.exists()
+
+    redis_client.execute_command("APPEND", changed, "2")
+    redis_client.execute_command("DEL", deleted)
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot), "INCREMENTAL") == "OK"
+    first_segment = delta.stat().st_size
+
+    redis_client.execute_command("SET", added, "3", "EX", "100")
+    redis_client.execute_command("APPEND", changed, "3")
+    assert redis_client.execute_command("SAVE", "INCREMENTAL", "TO", str(snapshot)) == "OK"
+    assert delta.stat().st_size > first_segment
+
+    redis_client.execute_command("SET", kept, "lost")
+    redis_client.execute_command("SET", deleted, "lost")
+    assert redis_client.execute_command("LOAD", "FROM", str(snapshot)) == "OK"
+    assert redis_client.execute_command("MGET", kept, changed, deleted, added) == ["1", "123", None, "3"]
+    assert 0 < redis_client.execute_command("TTL", added) <= 100
+
+
+def test_incremental_save_writes_only_changed_keys(redis_client, make_key, tmp_path) -> None:
+    snapshot = tmp_path / "cold.mrdb"
+    delta = tmp_path / "cold.mrdb.delta"
+    keys = [make_key(f"cold-{i}") for i in range(5000)]
+    redis_client.execute_command("MSET", *[x for key in keys for x in (key, "v" * 100)])
+
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot)) == "OK"
+    redis_client.execute_command("SET", keys[0], "hot")
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot), "INCREMENTAL") == "OK"
+    assert delta.stat().st_size < snapshot.stat().st_size // 100
+
+    # Nothing changed since: no segment is added.
+    size = delta.stat().st_size
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot), "INCREMENTAL") == "OK"
+    assert delta.stat().st_size == size
+
+
+def test_incremental_save_without_base_saves_everything(redis_client, make_key, tmp_path) -> None:
+    key = make_key("delta-fallback")
+    snapshot = tmp_path / "fallback.mrdb"
+
+    redis_client.execute_command("SET", key, "value")
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot), "INCREMENTAL") == "OK"
+    assert snapshot.exists()
+    assert not (tmp_path / "fallback.mrdb.delta").exists()
+
+    redis_client.execute_command("DEL", key)
+    assert redis_client.execute_command("LOAD", "FROM", str(snapshot)) == "OK"
+    assert redis_client.execute_command("GET", key) == "value"
+
+
+def test_full_save_discards_deltas(redis_client, make_key, tmp_path) -> None:
+    key = make_key("delta-full")
+    snapshot = tmp_path / "full.mrdb"
+    delta = tmp_path / "full.mrdb.delta"
+
+    redis_client.execute_command("SET", key, "1")
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot)) == "OK"
+    redis_client.execute_command("SET", key, "2")
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot), "INCREMENTAL") == "OK"
+    assert delta.exists()
+
+    redis_client.execute_command("SET", key, "3")
+    assert redis_client.execute_command("BGSAVE", "TO", str(snapshot)) is True
+    assert not delta.exists()
+    assert _wait_for_bgsave(redis_client)["rdb_last_bgsave_status"] == "ok"
+
+    redis_client.execute_command("SET", key, "4")
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot), "INCREMENTAL") == "OK"
+    assert redis_client.execute_command("LOAD", "FROM", str(snapshot)) == "OK"
+    assert redis_client.execute_command("GET", key) == "4"
+
+
+def test_load_ignores_cut_short_delta_segment(redis_client, make_key, tmp_path) -> None:
+    key = make_key("delta-torn")
+    snapshot = tmp_path / "torn.mrdb"
+    delta = tmp_path / "torn.mrdb.delta"
+
+    redis_client.execute_command("SET", key, "1")
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot)) == "OK"
+    redis_client.execute_command("SET", key, "2")
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot), "INCREMENTAL") == "OK"
+
+    with delta.open("ab") as f:
+        f.write((1000).to_bytes(8, "little") + b"MRDD\x04partial")
+    assert redis_client.execute_command("LOAD", "FROM", str(snapshot)) == "OK"
+    assert redis_client.execute_command("GET", key) == "2"
+
+    # The next segment replaces the partial one.
+    redis_client.execute_command("SET", key, "3")
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot), "INCREMENTAL") == "OK"
+    assert redis_client.execute_command("LOAD", "FROM", str(snapshot)) == "OK"
+    assert redis_client.execute_command("GET", key) == "3"
+
+
+def test_compact_merges_deltas_into_snapshot(redis_client, make_key, tmp_path) -> None:
+    keys = [make_key(f"compact-{i}") for i in range(100)]
+    snapshot = tmp_path / "compact.mrdb"
+    delta = tmp_path / "compact.mrdb.delta"
+
+    redis_client.execute_command("MSET", *[x for key in keys for x in (key, "base")])
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot)) == "OK"
+    for i in range(3):
+        redis_client.execute_command("SET", keys[i], f"delta-{i}")
+        redis_client.execute_command("DEL", keys[50 + i])
+        assert redis_client.execute_command("SAVE", "TO", str(snapshot), "INCREMENTAL") == "OK"
+
+    assert redis_client.execute_command("COMPACT", "TO", str(snapshot), "COMPRESS", "lz") == "OK"
+    assert not delta.exists()
+
+    redis_client.execute_command("SET", keys[10], "after")
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot), "INCREMENTAL") == "OK"
+    redis_client.execute_command("DEL", *keys)
+    assert redis_client.execute_command("LOAD", "FROM", str(snapshot)) == "OK"
+
+    expected = ["base"] * len(keys)
+    expected[:3] = ["delta-0", "delta-1", "delta-2"]
+    expected[50:53] = [None] * 3
+    expected[10] = "after"
+    assert redis_client.execute_command("MGET", *keys) == expected
+
+
+def _sliced_client(spawn_server) -> redis.Redis:
+    info = spawn_server("--bgsave", "sliced", "--bgsave-slice", "50")
+    return redis.Redis(host=str(info["host"]), port=int(info["port"]), decode_responses=True, socket_timeout=5.0)
+
+
+def test_sliced_bgsave_saves_dataset_as_of_start(spawn_server, tmp_path) -> None:
+    client = _sliced_client(spawn_server)
+    snapshot = tmp_path / "sliced.mrdb"
+    keys = [f"key-{i}" for i in range(20000)]
+    for i in range(0, len(keys), 1000):
+        client.mset({key: f"value-{key}" for key in keys[i : i + 1000]})
+    client.rpush("list", "a", "b")
+    client.set("ttl", "v", ex=100)
+
+    # The writes are executed in the same batch, before any slice runs.
+    pipe = client.pipeline(transaction=False)
+    pipe.execute_command("BGSAVE", "TO", str(snapshot))
+    pipe.set(keys[0], "changed")
+    pipe.delete(keys[1])
+    pipe.set("new", "value")
+    pipe.rpush("list", "c")
+    pipe.expire("ttl", 5000)
+    pipe.info("persistence")
+    replies = pipe.execute()
+    assert replies[-1]["rdb_bgsave_in_progress"] == 1
+    assert _wait_for_bgsave(client)["rdb_last_bgsave_status"] == "ok"
+
+    assert client.mget(keys[:3]) == ["changed", None, f"value-{keys[2]}"]
+    assert client.lrange("list", 0, -1) == ["a", "b", "c"]
+    assert client.ttl("ttl") > 100
+    assert client.mget(keys[3:]) == [f"value-{key}" for key in keys[3:]]
+
+    assert client.execute_command("LOAD", "FROM", str(snapshot)) == "OK"
+    assert client.mget(keys) == [f"value-{key}" for key in keys]
+    assert client.get("new") is None
+    assert client.lrange("list", 0, -1) == ["a", "b"]
+    assert client.get("ttl") == "v"
+    assert 0 < client.ttl("ttl") <= 100
+
+
+def test_load_completes_sliced_bgsave_first(spawn_server, tmp_path) -> None:
+    client = _sliced_client(spawn_server)
+    snapshot = tmp_path / "sliced-load.mrdb"
+    client.mset({f"key-{i}": "before" for i in range(5000)})
+
+    pipe = client.pipeline(transaction=False)
+    pipe.execute_command("BGSAVE", "TO", str(snapshot))
+    pipe.set("key-0", "after")
+    pipe.execute_command("LOAD", "FROM", str(snapshot))
+    pipe.get("key-0")
+    assert pipe.execute()[-1] == "before"
+    assert client.info("persistence")["rdb_bgsave_in_progress"] == 0
+
+
+def test_multi_key_commands_during_sliced_bgsave(spawn_server, tmp_path) -> None:
+    client = _sliced_client(spawn_server)
+    keys = [f"key-{i}" for i in range(20000)]
+    for i in range(0, len(keys), 1000):
+        client.mset({key: f"value-{key}" for key in keys[i : i + 1000]})
+    hlls = [f"hll-{i}" for i in range(3000)]
+    bitmaps = [f"bits-{i}" for i in range(3000)]
+    pipe = client.pipeline(transaction=False)
+    for i, (hll, bits) in enumerate(zip(hlls, bitmaps)):
+        pipe.pfadd(hll, f"e{i % 100}")
+        pipe.setbit(bits, i % 64, 1)
+    pipe.execute()
+
+    # In one transaction, so that no slice runs in between: the keys are
+    # all frozen when the commands look them up, and the new keys are sized
+    # so that moving them back grows the table midway through each command.
+    pipe = client.pipeline(transaction=True)
+    pipe.execute_command("BGSAVE", "TO", str(tmp_path / "multi.mrdb"))
+    new = 0
+    for count, command in ((27000, "PFMERGE"), (26000, "BITOP"), (41000, "MGET")):
+        for i in range(new, new + count, 1000):
+            pipe.mset({f"new-{j}": "v" for j in range(i, i + 1000)})
+        new += count
+        if command == "PFMERGE":
+            pipe.pfmerge("merged", *hlls)
+        elif command == "BITOP":
+            pipe.bitop("OR", "ored", *bitmaps)
+        else:
+            pipe.mget(keys)
+    replies = pipe.execute()
+    assert replies[-1] == [f"value-{key}" for key in keys]
+    assert _wait_for_bgsave(client)["rdb_last_bgsave_status"] == "ok"
+
+    assert client.pfcount("merged") == 100
+    assert client.bitcount("ored") == 64
+    assert client.mget("new-0", f"new-{new - 1}", keys[-1]) == ["v", "v", f"value-{keys[-1]}"]
+
+
+def _client_for(info) -> redis.Redis:
+    return redis.Redis(host=str(info["host"]), port=int(info["port"]), decode_responses=True, socket_timeout=5.0)
+
+
+def _terminate(info) -> str:
+    process = info["process"]
+    process.terminate()
+    out, _ = process.communicate(timeout=10)
+    assert process.returncode == 0
+    return out
+
+
+def test_startup_loads_dbfilename_from_dir(spawn_server, tmp_path) -> None:
+    data_dir = tmp_path / "data"
+    data_dir.mkdir()
+    options = ("--dir", str(data_dir), "--dbfilename", "startup.mrdb")
+
+    first = spawn_server(*options)
+    client = _client_for(first)
+    client.mset({f"key-{i}": str(i) for i in range(100)})
+    client.set("ttl", "v", ex=100)
+    assert client.save()
+    _terminate(first)
+    assert (data_dir / "startup.mrdb").is_file()
+
+    second = spawn_server(*options)
+    client = _client_for(second)
+    assert client.mget([f"key-{i}" for i in range(100)]) == [str(i) for i in range(100)]
+    assert 0 < client.ttl("ttl") <= 100
+    out = _terminate(second)
+    assert "Loaded startup.mrdb in" in out
+    assert "101 keys" in out
+
+
+def test_shutdown_saves_only_with_save_points(spawn_server, tmp_path) -> None:
+    plain = spawn_server("--dbfilename", "plain.mrdb")
+    _client_for(plain).set("key", "value")
+    _terminate(plain)
+    assert not (tmp_path / "plain.mrdb").exists()
+
+    saving = spawn_server("--dbfilename", "saved.mrdb", "--save", "3600 1000")
+    _client_for(saving).set("key", "value")
+    out = _terminate(saving)
+    assert "Saved saved.mrdb on shutdown" in out
+
+    restarted = spawn_server("--dbfilename", "saved.mrdb")
+    assert _client_for(restarted).get("key") == "value"
+
+
+def test_save_point_starts_bgsave(spawn_server, tmp_path) -> None:
+    info = spawn_server("--dbfilename", "auto.mrdb", "--save", "3600 1000 1 3")
+    client = _client_for(info)
+    client.set("a", "1")
+    client.set("b", "2")
+    assert client.info("persistence")["rdb_changes_since_last_save"] == 2
+    time.sleep(1.3)
+    assert not (tmp_path / "auto.mrdb").exists()
+
+    # Failed writes are not counted.
+    with pytest.raises(ResponseError):
+        client.incr("a", 1.5)
+    client.set("c", "3")
+    deadline = time.monotonic() + 5
+    while not (tmp_path / "auto.mrdb").exists() and time.monotonic() < deadline:
+        time.sleep(0.05)
+    assert _wait_for_bgsave(client)["rdb_last_bgsave_status"] == "ok"
+    assert client.info("persistence")["rdb_changes_since_last_save"] == 0
+    assert (tmp_path / "auto.mrdb").is_file()
+
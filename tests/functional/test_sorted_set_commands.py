@@ -0,0 +1,149 @@
+from __future__ import annotations
+
+import pytest
+from redis.exceptions import ResponseError
+
+from _helpers import assert_error_contains
+
+
+def _seed_zset(redis_client, key: str, pairs: list[tuple[float, str]]) -> None:
+    redis_client.execute_command("DEL", key)
+    args: list[object] = []
+    for score, member in pairs:
+        args.extend((score, member))
+    redis_client.execute_command("ZADD", key, *args)
+
+
+def test_zadd_zscore_and_zcard_main_flow(redis_client, make_key) -> None:
+    key = make_key("zadd")
+
+    assert redis_client.execute_command("ZADD", key, 1, "a", 2, "b") == 2
+    assert redis_client.execute_command("ZADD", key, 3, "a", 4, "c") == 1
+    assert redis_client.execute_command("ZCARD", key) == 3
+    assert redis_client.execute_command("ZSCORE", key, "a") == 3.0
+    assert redis_client.execute_command("ZSCORE", key, "missing") is None
+    assert redis_client.execute_command("ZRANGE", key, 0, -1) == ["b", "a", "c"]
+
+
+def test_zadd_flags(redis_client, make_key) -> None:
+    key = make_key("zadd-flags")
+    _seed_zset(redis_client, key, [(5, "a")])
+
+    assert redis_client.execute_command("ZADD", key, "NX", 1, "a", 1, "b") == 1
+    assert redis_client.execute_command("ZADD", key, "XX", 1, "c") == 0
+    assert redis_client.execute_command("ZADD", key, "XX", "CH", 6, "a") == 1
+    assert redis_client.execute_command("ZADD", key, "GT", "CH", 2, "a") == 0
+    assert redis_client.execute_command("ZADD", key, "LT", "CH", 2, "a") == 1
+    assert redis_client.execute_command("ZSCORE", key, "a") == 2.0
+    assert redis_client.execute_command("ZSCORE", key, "c") is None
+
+    assert redis_client.execute_command("ZADD", key, "INCR", 1.5, "a") == "3.5"
+    assert redis_client.execute_command("ZADD", key, "NX", "INCR", 1, "a") is None
+
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("ZADD", key, "NX", "XX", 1, "a")
+    assert_error_contains(exc_info.value, "not compatible")
+
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("ZADD", key, "INCR", 1, "a", 2, "b")
+    assert_error_contains(exc_info.value, "single increment-element pair")
+
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("ZADD", key, "x", "a")
+    assert_error_contains(exc_info.value, "not a valid float")
+
+
+def test_zincrby_and_rank(redis_client, make_key) -> None:
+    key = make_key("zincrby")
+    _seed_zset(redis_client, key, [(1, "a"), (2, "b"), (3, "c")])
+
+    assert redis_client.execute_command("ZINCRBY", key, 5, "a") == 6.0
+    assert redis_client.execute_command("ZINCRBY", key, 1, "new") == 1.0
+    assert redis_client.execute_command("ZRANK", key, "a") == 3
+    assert redis_client.execute_command("ZREVRANK", key, "a") == 0
+    assert redis_client.execute_command("ZRANK", key, "b", "WITHSCORE") == [1, "2"]
+    assert redis_client.execute_command("ZRANK", key, "missing") is None
+
+
+def test_zrange_by_rank_score_and_lex(redis_client, make_key) -> None:
+    key = make_key("zrange")
+    _seed_zset(redis_client, key, [(1, "a"), (2, "b"), (3, "c"), (4, "d")])
+
+    assert redis_client.execute_command("ZRANGE", key, 1, 2) == ["b", "c"]
+    assert redis_client.execute_command("ZRANGE", key, 0, 1, "REV") == ["d", "c"]
+    assert redis_client.execute_command("ZRANGE", key, 0, 0, "WITHSCORES") == ["a", "1"]
+    assert redis_client.execute_command("ZRANGE", key, "(1", 3, "BYSCORE") == ["b", "c"]
+    assert redis_client.execute_command("ZRANGE", key, "+inf", "-inf", "BYSCORE", "REV", "LIMIT", 1, 2) == ["c", "b"]
+    assert redis_client.execute_command("ZRANGE", key, "-inf", "+inf", "BYSCORE", "LIMIT", 3, 5) == ["d"]
+
+    lex = make_key("zrange-lex")
+    _seed_zset(redis_client, lex, [(0, "a"), (0, "b"), (0, "c"), (0, "d")])
+    assert redis_client.execute_command("ZRANGE", lex, "[b", "(d", "BYLEX") == ["b", "c"]
+    assert redis_client.execute_command("ZRANGE", lex, "+", "-", "BYLEX", "REV", "LIMIT", 0, 2) == ["d", "c"]
+
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("ZRANGE", key, 0, 1, "LIMIT", 0, 1)
+    assert_error_contains(exc_info.value, "limit is only supported")
+
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("ZRANGE", key, "x", 1, "BYSCORE")
+    assert_error_contains(exc_info.value, "min or max is not a float")
+
+
+def test_zrem_zremrangebyscore_and_pop(redis_client, make_key) -> None:
+    key = make_key("zrem")
+    _seed_zset(redis_client, key, [(1, "a"), (2, "b"), (3, "c"), (4, "d"), (5, "e")])
+
+    assert redis_client.execute_command("ZREM", key, "a", "missing") == 1
+    assert redis_client.execute_command("ZREMRANGEBYSCORE", key, "(2", 3) == 1
+    assert redis_client.execute_command("ZPOPMIN", key) == ["b", "2"]
+    assert redis_client.execute_command("ZPOPMAX", key, 5) == ["e", "5", "d", "4"]
+    assert redis_client.execute_command("ZCARD", key) == 0
+
+
+def test_large_zset_keeps_order_and_ranks(redis_client, make_key) -> None:
+    key = make_key("large")
+    n = 1000
+    args: list[object] = []
+    for i in range(n):
+        args.extend((i * 2, f"m{i:05d}"))
+    assert redis_client.execute_command("ZADD", key, *args) == n
+
+    assert redis_client.execute_command("ZCARD", key) == n
+    assert redis_client.execute_command("ZRANK", key, "m00500") == 500
+    assert redis_client.execute_command("ZRANGE", key, 998, -1) == ["m00998", "m00999"]
+    assert redis_client.execute_command("ZRANGE", key, "(10", 14, "BYSCORE") == ["m00006", "m00007"]
+
+    assert redis_client.execute_command("ZADD", key, -1, "m00999") == 0
+    assert redis_client.execute_command("ZRANK", key, "m00999") == 0
+    assert redis_client.execute_command("ZREMRANGEBYSCORE", key, 0, 99) == 50
+    assert redis_client.execute_command("ZCARD", key) == n - 50
+
+
+def test_zset_wrong_type(redis_client, make_key) -> None:
+    key = make_key("wrong-type")
+    assert redis_client.execute_command("SET", key, "v") == "OK"
+
+    for command, args in (
+        ("ZADD", (1, "a")),
+        ("ZSCORE", ("a",)),
+        ("ZRANGE", (0, -1)),
+        ("ZPOPMIN", ()),
+    ):
+        with pytest.raises(ResponseError) as exc_info:
+            redis_client.execute_command(command, key, *args)
+        assert_error_contains(exc_info.value, "wrongtype")
+
+
+def test_zset_survives_save_and_load(redis_client, make_key, tmp_path) -> None:
+    key = make_key("persist")
+    snapshot = tmp_path / "zset.mrdb"
+    _seed_zset(redis_client, key, [(1.5, "a"), (-2, "b"), (float("inf"), "c")])
+
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot)) == "OK"
+    redis_client.execute_command("DEL", key)
+    assert redis_client.execute_command("LOAD", "FROM", str(snapshot)) == "OK"
+
+    assert redis_client.execute_command("ZRANGE", key, 0, -1, "WITHSCORES") == [
+        "b", "-2", "a", "1.5", "c", "inf",
+    ]
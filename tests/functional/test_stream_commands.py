@@ -0,0 +1,190 @@
+from __future__ import annotations
+
+import time
+
+import pytest
+from redis.exceptions import ResponseError
+
+from _helpers import assert_error_contains, encode_resp_command, send_and_read
+
+
+def _ids(entries) -> list[str]:
+    return [entry_id for entry_id, _ in entries]
+
+
+def test_xadd_xlen_and_xrange(redis_client, make_key) -> None:
+    key = make_key("stream")
+
+    assert redis_client.execute_command("XADD", key, "1-1", "a", "1") == "1-1"
+    assert redis_client.execute_command("XADD", key, "1-*", "a", "2") == "1-2"
+    assert redis_client.execute_command("XADD", key, "5", "b", "3", "c", "4") == "5-0"
+    auto_id = redis_client.execute_command("XADD", key, "*", "a", "5")
+    assert int(auto_id.split("-")[0]) > 5
+    assert redis_client.execute_command("XLEN", key) == 4
+
+    entries = redis_client.execute_command("XRANGE", key, "-", "+")
+    assert entries[:3] == [
+        ("1-1", {"a": "1"}),
+        ("1-2", {"a": "2"}),
+        ("5-0", {"b": "3", "c": "4"}),
+    ]
+    assert _ids(redis_client.execute_command("XRANGE", key, "1", "1")) == [
+        "1-1",
+        "1-2",
+    ]
+    assert _ids(redis_client.execute_command("XRANGE", key, "(1-1", "5")) == [
+        "1-2",
+        "5-0",
+    ]
+    assert _ids(redis_client.execute_command("XRANGE", key, "-", "+", "COUNT", 2)) == [
+        "1-1",
+        "1-2",
+    ]
+    assert _ids(
+        redis_client.execute_command("XREVRANGE", key, "+", "-", "COUNT", 2)
+    ) == [auto_id, "5-0"]
+
+
+def test_xadd_rejects_small_ids(redis_client, make_key) -> None:
+    key = make_key("ids")
+    redis_client.execute_command("XADD", key, "5-5", "f", "v")
+
+    for entry_id, message in (
+        ("5-5", "equal or smaller"),
+        ("4-9", "equal or smaller"),
+        ("0-0", "greater than 0-0"),
+        ("abc", "invalid stream id"),
+    ):
+        with pytest.raises(ResponseError) as exc_info:
+            redis_client.execute_command("XADD", key, entry_id, "f", "v")
+        assert_error_contains(exc_info.value, message)
+
+    missing = make_key("missing")
+    assert redis_client.execute_command("XADD", missing, "NOMKSTREAM", "*", "f", "v") is None
+    assert redis_client.execute_command("XLEN", missing) == 0
+
+
+def test_stream_spans_many_blocks(redis_client, make_key) -> None:
+    key = make_key("large")
+    n = 1000
+    pipe = redis_client.pipeline(transaction=False)
+    for i in range(1, n + 1):
+        pipe.execute_command("XADD", key, f"{i}-0", "name", f"n{i}", "value", i)
+    pipe.execute()
+
+    assert redis_client.execute_command("XLEN", key) == n
+    entries = redis_client.execute_command("XRANGE", key, "250", "(260-0")
+    assert _ids(entries) == [f"{i}-0" for i in range(250, 260)]
+    assert entries[0][1] == {"name": "n250", "value": "250"}
+
+    rev = redis_client.execute_command("XREVRANGE", key, "+", "-", "COUNT", 3)
+    assert _ids(rev) == ["1000-0", "999-0", "998-0"]
+
+
+def test_xdel_and_xtrim(redis_client, make_key) -> None:
+    key = make_key("trim")
+    for i in range(1, 301):
+        redis_client.execute_command("XADD", key, f"{i}-0", "f", i)
+
+    assert redis_client.execute_command("XDEL", key, "2-0", "3-0", "999-0") == 2
+    assert redis_client.execute_command("XDEL", key, "2-0") == 0
+    assert redis_client.execute_command("XLEN", key) == 298
+
+    assert redis_client.execute_command("XTRIM", key, "MINID", "11") == 8
+    assert _ids(redis_client.execute_command("XRANGE", key, "-", "+", "COUNT", 1)) == [
+        "11-0"
+    ]
+
+    assert redis_client.execute_command("XTRIM", key, "MAXLEN", 250) == 40
+    assert redis_client.execute_command("XLEN", key) == 250
+
+    # Approximate trimming only releases whole blocks, so it may keep more.
+    removed = redis_client.execute_command("XTRIM", key, "MAXLEN", "~", 10)
+    assert 0 <= removed <= 240
+    assert redis_client.execute_command("XLEN", key) == 250 - removed
+
+    redis_client.execute_command("XADD", key, "MAXLEN", 5, "*", "f", "last")
+    assert redis_client.execute_command("XLEN", key) == 5
+
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("XTRIM", key, "MAXLEN", 5, "LIMIT", 1)
+    assert_error_contains(exc_info.value, "without the special ~")
+
+
+def test_xread(redis_client, make_key) -> None:
+    s1 = make_key("s1")
+    s2 = make_key("s2")
+    redis_client.execute_command("XADD", s1, "1-0", "a", "1")
+    redis_client.execute_command("XADD", s1, "2-0", "a", "2")
+    redis_client.execute_command("XADD", s2, "3-0", "b", "1")
+
+    result = redis_client.execute_command("XREAD", "STREAMS", s1, s2, "1-0", "0")
+    assert result == [
+        [s1, [("2-0", {"a": "2"})]],
+        [s2, [("3-0", {"b": "1"})]],
+    ]
+    result = redis_client.execute_command("XREAD", "COUNT", 1, "STREAMS", s1, "0")
+    assert result == [[s1, [("1-0", {"a": "1"})]]]
+
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("XREAD", "STREAMS", s1, s2, "0")
+    assert_error_contains(exc_info.value, "unbalanced")
+
+
+def test_xread_block_times_out(raw_socket, make_key) -> None:
+    key = make_key("block-timeout")
+    start = time.monotonic()
+    response = send_and_read(
+        raw_socket,
+        encode_resp_command("XREAD", "BLOCK", "100", "STREAMS", key, "$")
+        + encode_resp_command("PING"),
+        quiet_sec=0.3,
+    )
+    assert response == b"*-1\r\n+PONG\r\n"
+    assert time.monotonic() - start >= 0.1
+
+
+def test_xread_block_is_woken_up_by_xadd(raw_socket, redis_client, make_key) -> None:
+    key = make_key("block-wake")
+    redis_client.execute_command("XADD", key, "1-0", "old", "x")
+
+    raw_socket.sendall(
+        encode_resp_command("XREAD", "BLOCK", "0", "STREAMS", key, "$")
+    )
+    time.sleep(0.1)
+    redis_client.execute_command("XADD", key, "2-0", "new", "y")
+
+    response = send_and_read(raw_socket, b"", quiet_sec=0.2)
+    assert b"2-0" in response
+    assert b"new" in response
+    assert b"old" not in response
+
+
+def test_stream_wrong_type_and_persistence(redis_client, make_key, tmp_path) -> None:
+    key = make_key("persist")
+    other = make_key("other")
+    snapshot = tmp_path / "stream.mrdb"
+
+    redis_client.execute_command("SET", other, "v")
+    for command, args in (
+        ("XADD", (other, "*", "f", "v")),
+        ("XLEN", (other,)),
+        ("XRANGE", (other, "-", "+")),
+        ("XREAD", ("STREAMS", other, "0")),
+    ):
+        with pytest.raises(ResponseError) as exc_info:
+            redis_client.execute_command(command, *args)
+        assert_error_contains(exc_info.value, "wrongtype")
+
+    for i in range(1, 151):
+        redis_client.execute_command("XADD", key, f"{i}-1", "f", i)
+    redis_client.execute_command("XDEL", key, "7-1")
+    expected = redis_client.execute_command("XRANGE", key, "-", "+")
+
+    assert redis_client.execute_command("SAVE", "TO", str(snapshot)) == "OK"
+    redis_client.execute_command("DEL", key)
+    assert redis_client.execute_command("LOAD", "FROM", str(snapshot)) == "OK"
+
+    assert redis_client.execute_command("XRANGE", key, "-", "+") == expected
+    with pytest.raises(ResponseError):
+        redis_client.execute_command("XADD", key, "150-1", "f", "v")
@@ -29,6 +29,30 @@ def test_set_nx_and_xx_main_paths(redis_client, make_key) -> None:
     assert redis_client.execute_command("GET", key) == "third"
 
 
+def test_set_ifeq_and_ifne_compare_the_current_value(redis_client, make_key) -> None:
+    key = make_key("cas")
+    assert redis_client.execute_command("SET", key, "a", "IFEQ", "a") is None
+    assert redis_client.execute_command("SET", key, "a", "IFNE", "b") == "OK"
+    assert redis_client.execute_command("SET", key, "b", "IFEQ", "x") is None
+    assert redis_client.execute_command("SET", key, "b", "IFEQ", "a", "GET") == "a"
+    assert redis_client.execute_command("SET", key, "c", "IFNE", "b") is None
+    assert redis_client.execute_command("SET", key, "c", "IFNE", "B", "PX", 5000) == "OK"
+    assert 0 < redis_client.execute_command("PTTL", key) <= 5000
+
+    # Integers compare by their string form.
+    assert redis_client.execute_command("SET", key, "10") == "OK"
+    assert redis_client.execute_command("INCR", key) == 11
+    assert redis_client.execute_command("SET", key, "x", "IFEQ", "11") == "OK"
+
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("SET", key, "v", "NX", "IFEQ", "x")
+    assert_error_contains(exc_info.value, "syntax error")
+    redis_client.execute_command("RPUSH", make_key("list"), "x")
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("SET", make_key("list"), "v", "IFEQ", "x")
+    assert_error_contains(exc_info.value, "WRONGTYPE")
+
+
 def test_set_keepttl_preserves_existing_ttl(redis_client, make_key) -> None:
     key = make_key("keepttl")
     assert redis_client.execute_command("SET", key, "v1", "PX", 2000) == "OK"
@@ -158,6 +182,184 @@ def test_decr_overflow_is_reported(redis_client, make_key) -> None:
     assert_error_contains(exc_info.value, "would overflow")
 
 
+def test_incr_family_respects_bounds(redis_client, make_key) -> None:
+    stock = make_key("stock")
+    assert redis_client.execute_command("SET", stock, 2) == "OK"
+    assert redis_client.execute_command("DECRBY", stock, 2, "MIN", 0) == 0
+    assert redis_client.execute_command("DECR", stock, "MIN", 0) is None
+    assert redis_client.execute_command("GET", stock) == "0"
+
+    counter = make_key("counter")
+    assert redis_client.execute_command("INCRBY", counter, 5, "max", 5) == 5
+    assert redis_client.execute_command("INCR", counter, "MIN", 0, "MAX", 5) is None
+    assert redis_client.execute_command("INCRBY", counter, -10, "MIN", -5) == -5
+    fresh = make_key("fresh")
+    assert redis_client.execute_command("INCRBY", fresh, 3, "MAX", 2) is None
+    assert redis_client.execute_command("GET", fresh) is None
+
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("INCRBY", counter, 1, "MAX")
+    assert_error_contains(exc_info.value, "syntax error")
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("INCRBY", counter, 1, "MAX", "ten")
+    assert_error_contains(exc_info.value, "not an integer")
+
+
+def test_mget_mset_and_msetnx(redis_client, make_key) -> None:
+    k1 = make_key("m1")
+    k2 = make_key("m2")
+    k3 = make_key("m3")
+    other = make_key("list")
+
+    assert redis_client.execute_command("MSET", k1, "a", k2, "b", k1, "c")
+    assert redis_client.execute_command("INCR", k3) == 1
+    redis_client.execute_command("RPUSH", other, "x")
+    assert redis_client.execute_command("MGET", k1, k2, k3, other, make_key("none")) == [
+        "c",
+        "b",
+        "1",
+        None,
+        None,
+    ]
+
+    assert redis_client.execute_command("MSETNX", k1, "x", make_key("new"), "y") == 0
+    assert redis_client.execute_command("GET", k1) == "c"
+    assert redis_client.execute_command("MSETNX", make_key("n1"), "1", make_key("n2"), "2") == 1
+
+
+def test_mset_mixing_new_and_existing_keys_while_growing(redis_client, make_key) -> None:
+    # The new keys make the table grow several times during one MSET, while
+    # existing keys come after them.
+    existing = [make_key(f"old{i}") for i in range(50)]
+    redis_client.execute_command("MSET", *[part for key in existing for part in (key, "old")])
+    fresh = [make_key(f"grow{i}") for i in range(5000)]
+    args = []
+    for i, key in enumerate(fresh):
+        args += [key, f"new{i}", existing[i % len(existing)], f"set{i}"]
+    assert redis_client.execute_command("MSET", *args)
+    assert redis_client.execute_command("MGET", *existing) == [f"set{4950 + i}" for i in range(50)]
+    assert redis_client.execute_command("MGET", fresh[0], fresh[-1]) == ["new0", "new4999"]
+
+def test_mset_clears_ttl(redis_client, make_key) -> None:
+    key = make_key("mset-ttl")
+    assert redis_client.execute_command("SET", key, "v", "EX", 100) == "OK"
+    assert redis_client.execute_command("MSET", key, "w")
+    assert redis_client.execute_command("TTL", key) == -1
+
+
+def test_mget_skips_expired_keys(redis_client, make_key) -> None:
+    key = make_key("mget-expired")
+    assert redis_client.execute_command("SET", key, "v", "PX", 50) == "OK"
+    time.sleep(0.1)
+    assert redis_client.execute_command("MGET", key, key) == [None, None]
+
+
+def test_getset_getdel_and_getex(redis_client, make_key) -> None:
+    key = make_key("get-family")
+
+    assert redis_client.execute_command("GETSET", key, "a") is None
+    assert redis_client.execute_command("GETSET", key, "b") == "a"
+    assert redis_client.execute_command("GETEX", key, "EX", 100) == "b"
+    assert 0 < redis_client.execute_command("TTL", key) <= 100
+    assert redis_client.execute_command("GETEX", key, "PERSIST") == "b"
+    assert redis_client.execute_command("TTL", key) == -1
+    assert redis_client.execute_command("GETDEL", key) == "b"
+    assert redis_client.execute_command("GET", key) is None
+    assert redis_client.execute_command("GETDEL", key) is None
+
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("GETEX", key, "EX", 0)
+    assert_error_contains(exc_info.value, "invalid expire time")
+
+
+def test_setnx_setex_and_psetex(redis_client, make_key) -> None:
+    key = make_key("setnx")
+    assert redis_client.execute_command("SETNX", key, "a") == 1
+    assert redis_client.execute_command("SETNX", key, "b") == 0
+    assert redis_client.execute_command("GET", key) == "a"
+
+    assert redis_client.execute_command("SETEX", key, 100, "c")
+    assert 0 < redis_client.execute_command("TTL", key) <= 100
+    assert redis_client.execute_command("PSETEX", key, 100000, "d")
+    assert 0 < redis_client.execute_command("PTTL", key) <= 100000
+    assert redis_client.execute_command("GET", key) == "d"
+
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("SETEX", key, -1, "e")
+    assert_error_contains(exc_info.value, "invalid expire time in 'setex'")
+
+
+def test_strlen_append_getrange_and_setrange(redis_client, make_key) -> None:
+    key = make_key("range")
+
+    assert redis_client.execute_command("STRLEN", key) == 0
+    assert redis_client.execute_command("APPEND", key, "Hello") == 5
+    assert redis_client.execute_command("APPEND", key, " World") == 11
+    assert redis_client.execute_command("STRLEN", key) == 11
+
+    assert redis_client.execute_command("GETRANGE", key, 0, 4) == "Hello"
+    assert redis_client.execute_command("GETRANGE", key, -5, -1) == "World"
+    assert redis_client.execute_command("GETRANGE", key, 5, 2) == ""
+    assert redis_client.execute_command("GETRANGE", key, 0, 100) == "Hello World"
+
+    assert redis_client.execute_command("SETRANGE", key, 6, "Redis") == 11
+    assert redis_client.execute_command("GET", key) == "Hello Redis"
+    assert redis_client.execute_command("SETRANGE", key, 13, "!") == 14
+    assert redis_client.execute_command("GET", key) == "Hello Redis\x00\x00!"
+
+    missing = make_key("missing")
+    assert redis_client.execute_command("SETRANGE", missing, 5, "") == 0
+    assert redis_client.execute_command("GET", missing) is None
+
+    number = make_key("number")
+    assert redis_client.execute_command("INCRBY", number, 12) == 12
+    assert redis_client.execute_command("STRLEN", number) == 2
+    assert redis_client.execute_command("APPEND", number, "3") == 3
+    assert redis_client.execute_command("INCR", number) == 124
+
+
+
+def test_throttle_limits_bursts(redis_client, make_key) -> None:
+    key = make_key("throttle")
+    # 10 per minute, one every 6 seconds, with a burst of 4 on top.
+    replies = [redis_client.execute_command("THROTTLE", key, 4, 10, 60) for _ in range(6)]
+    assert replies[:5] == [[0, 5, left, -1, 6 * (5 - left)] for left in (4, 3, 2, 1, 0)]
+    assert replies[5] == [1, 5, 0, 6, 30]
+    # A single compact timestamp, which expires once the limit is full again.
+    assert int(redis_client.get(key)) > 0
+    assert 29000 < redis_client.pttl(key) <= 30000
+
+    # A quantity of 0 checks without taking, and one over the limit never fits.
+    assert redis_client.execute_command("THROTTLE", key, 4, 10, 60, 0) == [0, 5, 0, -1, 30]
+    other = make_key("throttle-big")
+    assert redis_client.execute_command("THROTTLE", other, 4, 10, 60, 6) == [1, 5, 5, -1, 0]
+    assert redis_client.get(other) is None
+
+
+def test_throttle_lets_requests_through_again(redis_client, make_key) -> None:
+    key = make_key("throttle")
+    # One every 100 ms, with no burst.
+    assert redis_client.execute_command("THROTTLE", key, 0, 10, 1)[0] == 0
+    assert redis_client.execute_command("THROTTLE", key, 0, 10, 1)[:2] == [1, 1]
+    time.sleep(0.15)
+    assert redis_client.execute_command("THROTTLE", key, 0, 10, 1)[0] == 0
+
+    for args, message in (
+        ((-1, 10, 1), "must be positive"),
+        ((1, 0, 1), "must be positive"),
+        ((1, 10, 1, -1), "must be positive"),
+        (("x", 10, 1), "not an integer"),
+    ):
+        with pytest.raises(ResponseError) as exc_info:
+            redis_client.execute_command("THROTTLE", key, *args)
+        assert_error_contains(exc_info.value, message)
+    text = make_key("text")
+    redis_client.set(text, "abc")
+    with pytest.raises(ResponseError) as exc_info:
+        redis_client.execute_command("THROTTLE", text, 1, 1, 1)
+    assert_error_contains(exc_info.value, "not an integer")
+
+
 @pytest.mark.parametrize(
     ("command", "args"),
     [
@@ -166,6 +368,17 @@ def test_decr_overflow_is_reported(redis_client, make_key) -> None:
         ("INCRBY", ("k",)),
         ("DECR", tuple()),
         ("DECRBY", ("k",)),
+        ("MGET", tuple()),
+        ("MSET", ("k",)),
+        ("MSETNX", ("k", "v", "k2")),
+        ("GETSET", ("k",)),
+        ("GETDEL", tuple()),
+        ("SETEX", ("k", "1")),
+        ("STRLEN", tuple()),
+        ("APPEND", ("k",)),
+        ("GETRANGE", ("k", "0")),
+        ("SETRANGE", ("k", "0")),
+        ("THROTTLE", ("k", "1", "1")),
     ],
 )
 def test_string_commands_validate_argument_count(
@@ -0,0 +1,249 @@
+from __future__ import annotations
+
+import time
+
+import pytest
+import redis
+from redis.exceptions import ExecAbortError, ResponseError, WatchError
+
+from _helpers import assert_error_contains
+
+
+def _connection(server_addr) -> redis.Redis:
+    """A client on one connection, as a transaction needs, that keeps the
+    replies of SET as they are, to see them queued."""
+    host, port = server_addr
+    client = redis.Redis(
+        host=host,
+        port=port,
+        decode_responses=True,
+        socket_connect_timeout=1.0,
+        socket_timeout=5.0,
+        single_connection_client=True,
+    )
+    client.set_response_callback("SET", lambda response, **options: response)
+    return client
+
+
+def _stop(info) -> None:
+    process = info["process"]
+    process.terminate()
+    process.wait(timeout=5.0)
+
+
+def test_exec_runs_queued_commands(redis_client, make_key) -> None:
+    counter = make_key("counter")
+    name = make_key("name")
+    pipe = redis_client.pipeline(transaction=True)
+    pipe.incr(counter)
+    pipe.incrby(counter, 10)
+    pipe.set(name, "x")
+    pipe.get(name)
+    assert pipe.execute() == [1, 11, "OK", "x"]
+
+
+def test_commands_wait_for_exec(server_addr, redis_client, make_key) -> None:
+    key = make_key("key")
+    client = _connection(server_addr)
+    try:
+        assert client.execute_command("MULTI") == "OK"
+        assert client.execute_command("SET", key, "mine") == "QUEUED"
+        assert client.execute_command("GET", key) == "QUEUED"
+
+        # Other clients do not see the queued commands, and theirs run first.
+        assert redis_client.get(key) is None
+        redis_client.set(key, "theirs")
+        assert client.execute_command("GET", key) == "QUEUED"
+        assert client.execute_command("EXEC") == ["OK", "mine", "mine"]
+        assert redis_client.get(key) == "mine"
+
+        assert client.execute_command("MULTI") == "OK"
+        assert client.execute_command("SET", key, "dropped") == "QUEUED"
+        assert client.execute_command("DISCARD") == "OK"
+        assert redis_client.get(key) == "mine"
+    finally:
+        client.close()
+
+
+def test_errors_found_when_queuing_abort_exec(server_addr, redis_client, make_key) -> None:
+    key = make_key("key")
+    client = _connection(server_addr)
+    try:
+        client.execute_command("MULTI")
+        client.execute_command("SET", key, "v")
+        with pytest.raises(ResponseError) as exc_info:
+            client.execute_command("NOSUCHCOMMAND")
+        assert_error_contains(exc_info.value, "unknown command")
+        with pytest.raises(ResponseError) as exc_info:
+            client.execute_command("SUBSCRIBE", "channel")
+        assert_error_contains(exc_info.value, "not allowed inside a transaction")
+        with pytest.raises(ExecAbortError):
+            client.execute_command("EXEC")
+        assert redis_client.get(key) is None
+    finally:
+        client.close()
+
+
+def test_wrong_argument_count_when_queuing_aborts_exec(
+    server_addr, redis_client, make_key
+) -> None:
+    key = make_key("key")
+    client = _connection(server_addr)
+    try:
+        client.execute_command("MULTI")
+        client.execute_command("SET", key, "v")
+        for command in (("SET", key), ("GET", key, "extra"), ("ZADD", key, "1")):
+            with pytest.raises(ResponseError) as exc_info:
+                client.execute_command(*command)
+            assert_error_contains(exc_info.value, "wrong number of arguments")
+        with pytest.raises(ExecAbortError):
+            client.execute_command("EXEC")
+        assert redis_client.get(key) is None
+    finally:
+        client.close()
+
+
+def test_errors_when_running_do_not_abort_exec(server_addr, make_key) -> None:
+    text = make_key("text")
+    other = make_key("other")
+    client = _connection(server_addr)
+    try:
+        client.execute_command("MULTI")
+        client.execute_command("SET", text, "abc")
+        client.execute_command("INCR", text)
+        client.execute_command("SET", other, "v")
+        replies = client.execute_command("EXEC")
+        assert replies[0] == "OK" and replies[2] == "OK"
+        assert isinstance(replies[1], ResponseError)
+        assert client.get(other) == "v"
+    finally:
+        client.close()
+
+
+def test_transaction_commands_misused(server_addr) -> None:
+    client = _connection(server_addr)
+    try:
+        for command, message in (("EXEC", "EXEC without MULTI"), ("DISCARD", "DISCARD without MULTI")):
+            with pytest.raises(ResponseError) as exc_info:
+                client.execute_command(command)
+            assert_error_contains(exc_info.value, message)
+        client.execute_command("MULTI")
+        with pytest.raises(ResponseError) as exc_info:
+            client.execute_command("MULTI")
+        assert_error_contains(exc_info.value, "can not be nested")
+        assert client.execute_command("EXEC") == []
+    finally:
+        client.close()
+
+
+def test_transactions_are_replayed_from_the_aof(spawn_server) -> None:
+    info = spawn_server("--appendonly", "yes")
+    client = _connection((info["host"], info["port"]))
+    pipe = client.pipeline(transaction=True)
+    pipe.rpush("list", "a", "b")
+    pipe.get("missing")
+    pipe.lpop("list")
+    assert pipe.execute() == [2, None, "a"]
+    client.close()
+    _stop(info)
+
+    # The writes are logged as a whole, between MULTI and EXEC.
+    log = (info["dir"] / "appendonly.aof").read_bytes()
+    assert log.index(b"MULTI") < log.index(b"RPUSH") < log.index(b"LPOP") < log.index(b"EXEC")
+
+    info = spawn_server("--appendonly", "yes")
+    client = _connection((info["host"], info["port"]))
+    assert client.lrange("list", 0, -1) == ["b"]
+    client.close()
+
+
+def test_exec_fails_when_a_watched_key_changes(server_addr, redis_client, make_key) -> None:
+    balance = make_key("balance")
+    redis_client.set(balance, 100)
+    client = _connection(server_addr)
+    try:
+        # Untouched: the transaction runs.
+        assert client.execute_command("WATCH", balance) is True
+        assert int(client.get(balance)) == 100
+        client.execute_command("MULTI")
+        client.execute_command("DECRBY", balance, 30)
+        assert client.execute_command("EXEC") == [70]
+
+        # EXEC drops the watches, and a write from another client fails
+        # the next transaction.
+        for change in (lambda: redis_client.incr(balance), lambda: redis_client.delete(balance)):
+            client.execute_command("WATCH", balance)
+            change()
+            client.execute_command("MULTI")
+            client.execute_command("SET", balance, 0)
+            assert client.execute_command("EXEC") is None
+            assert redis_client.get(balance) != "0"
+
+        # UNWATCH forgets the keys.
+        client.execute_command("WATCH", balance)
+        redis_client.set(balance, 1)
+        assert client.execute_command("UNWATCH") is True
+        client.execute_command("MULTI")
+        client.execute_command("INCR", balance)
+        assert client.execute_command("EXEC") == [2]
+    finally:
+        client.close()
+
+
+def test_watched_key_expiring_fails_exec(server_addr, redis_client, make_key) -> None:
+    key = make_key("lease")
+    gone = make_key("gone")
+    redis_client.set(key, "v", px=100)
+    redis_client.set(gone, "v", px=10)
+    time.sleep(0.05)
+    client = _connection(server_addr)
+    try:
+        # A key already expired when watched stays unchanged.
+        client.execute_command("WATCH", gone)
+        client.execute_command("MULTI")
+        client.execute_command("GET", gone)
+        assert client.execute_command("EXEC") == [None]
+
+        client.execute_command("WATCH", key)
+        time.sleep(0.1)
+        client.execute_command("MULTI")
+        client.execute_command("SET", key, "renewed")
+        assert client.execute_command("EXEC") is None
+        assert redis_client.get(key) is None
+    finally:
+        client.close()
+
+
+def test_watch_guards_optimistic_updates(redis_client, make_key) -> None:
+    counter = make_key("counter")
+    redis_client.set(counter, 0)
+
+    def increment(pipe) -> None:
+        value = int(pipe.get(counter))
+        pipe.multi()
+        pipe.set(counter, value + 1)
+
+    with redis_client.pipeline() as pipe:
+        pipe.watch(counter)
+        pipe.get(counter)
+        redis_client.incr(counter)
+        pipe.multi()
+        pipe.incr(counter)
+        with pytest.raises(WatchError):
+            pipe.execute()
+
+    for _ in range(5):
+        redis_client.transaction(increment, counter)
+    assert redis_client.get(counter) == "6"
+
+
+def test_watch_inside_multi_is_refused(server_addr, make_key) -> None:
+    client = _connection(server_addr)
+    try:
+        client.execute_command("MULTI")
+        with pytest.raises(ResponseError) as exc_info:
+            client.execute_command("WATCH", make_key("key"))
+        assert_error_contains(exc_info.value, "WATCH inside MULTI is not allowed")
+        assert client.execute_command("EXEC") == []
+    finally:
+        client.close()